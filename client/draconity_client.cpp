@@ -0,0 +1,473 @@
+#include <string.h>
+#include <algorithm>
+#include "draconity_client.h"
+
+// Frames beyond this much are written straight away rather than batched.
+#define FLUSH_SIZE (256 * 1024)
+
+#define streq(a, b) (strcmp(a, b) == 0)
+
+static std::string_view iter_utf8(const bson_iter_t *iter) {
+    uint32_t length = 0;
+    const char *str = bson_iter_utf8(iter, &length);
+    return std::string_view(str, length);
+}
+
+static std::string_view doc_utf8(const bson_t *doc, const char *key) {
+    bson_iter_t iter;
+    if (bson_iter_init_find(&iter, doc, key) && BSON_ITER_HOLDS_UTF8(&iter)) {
+        return iter_utf8(&iter);
+    }
+    return std::string_view();
+}
+
+template <typename Strings>
+static void append_strings(bson_t *doc, const char *key, const Strings &strings) {
+    bson_t array;
+    char keystr[16];
+    const char *index;
+    uint32_t i = 0;
+    BSON_APPEND_ARRAY_BEGIN(doc, key, &array);
+    for (auto &str : strings) {
+        bson_uint32_to_string(i++, &index, keystr, sizeof(keystr));
+        bson_append_utf8(&array, index, -1, str.data(), str.size());
+    }
+    bson_append_array_end(doc, &array);
+}
+
+// Stands in for the reply to an update there was no need to send.
+static void reply_unchanged(ReplyFn &on_reply) {
+    if (on_reply) {
+        bson_t *reply = BCON_NEW("status", BCON_UTF8("unchanged"), "success", BCON_BOOL(true));
+        on_reply(reply);
+        bson_destroy(reply);
+    }
+}
+
+ClientReply::ClientReply(const bson_t *reply) {
+    if (reply) {
+        const uint8_t *data = bson_get_data(reply);
+        this->data.assign(data, data + reply->len);
+    }
+}
+
+bool ClientReply::doc(bson_t *doc) const {
+    return !this->data.empty() && bson_init_static(doc, this->data.data(), this->data.size());
+}
+
+DraconityClient::DraconityClient(std::shared_ptr<uvw::Loop> loop) {
+    this->loop = loop;
+    this->flush_handle = loop->resource<uvw::PrepareHandle>();
+    this->flush_handle->on<uvw::PrepareEvent>([this](const uvw::PrepareEvent &, uvw::PrepareHandle &handle) {
+        handle.stop();
+        this->flush_scheduled = false;
+        this->flush();
+    });
+    this->async_invoke_handle = loop->resource<uvw::AsyncHandle>();
+    this->async_invoke_handle->on<uvw::AsyncEvent>([this](const uvw::AsyncEvent &, uvw::AsyncHandle &) {
+        this->drain_invoke_queue();
+    });
+}
+
+DraconityClient::~DraconityClient() {
+    this->close();
+}
+
+template <typename T>
+void DraconityClient::attach(std::shared_ptr<T> stream, const std::string &secret, bool pauses, ReplyFn on_ready) {
+    this->write_stream = [stream](std::unique_ptr<char[]> data, unsigned int length) {
+        stream->write(std::move(data), length);
+    };
+    this->close_stream = [stream] {
+        stream->close();
+    };
+    stream->template once<uvw::ConnectEvent>([this](const uvw::ConnectEvent &, T &stream) {
+        this->connected = true;
+        stream.read();
+        this->flush();
+    });
+    stream->template on<uvw::DataEvent>([this](const uvw::DataEvent &event, T &) {
+        this->on_data((const uint8_t *)event.data.get(), event.length);
+    });
+    stream->template once<uvw::EndEvent>([this](const uvw::EndEvent &, T &) {
+        this->lose(NULL);
+    });
+    stream->template once<uvw::ErrorEvent>([this](const uvw::ErrorEvent &event, T &) {
+        this->lose(event.what());
+    });
+
+    // The server reads nothing else until it has authed us, so the auth goes
+    // ahead of anything already queued.
+    bson_t *auth = BCON_NEW("cmd", BCON_UTF8("auth"),
+                            "secret", BCON_UTF8(secret.c_str()),
+                            "pause", BCON_BOOL(pauses));
+    if (!this->resume_token.empty()) {
+        BSON_APPEND_UTF8(auth, "resume", this->resume_token.c_str());
+    }
+    auto on_auth = [this, on_ready](const bson_t *reply) {
+        bson_iter_t iter;
+        if (reply && bson_iter_init_find(&iter, reply, "resume_token") && BSON_ITER_HOLDS_UTF8(&iter)) {
+            this->resume_token = bson_iter_utf8(&iter, NULL);
+        }
+        if (on_ready) {
+            on_ready(reply);
+        }
+    };
+    std::vector<uint8_t> frame;
+    append_frame(frame, this->track(auth, on_auth), bson_get_data(auth), auth->len);
+    bson_destroy(auth);
+    this->out.insert(this->out.begin(), frame.begin(), frame.end());
+}
+
+void DraconityClient::connect_tcp(const std::string &host, unsigned int port, const std::string &secret,
+                                  bool pauses, ReplyFn on_ready) {
+    auto tcp = this->loop->resource<uvw::TCPHandle>();
+    // Requests are already batched per loop iteration.
+    tcp->noDelay(true);
+    this->attach(tcp, secret, pauses, on_ready);
+    tcp->connect(host, port);
+}
+
+void DraconityClient::connect_pipe(const std::string &path, const std::string &secret,
+                                   bool pauses, ReplyFn on_ready) {
+    auto pipe = this->loop->resource<uvw::PipeHandle>();
+    this->attach(pipe, secret, pauses, on_ready);
+    pipe->connect(path);
+}
+
+void DraconityClient::close() {
+    if (this->is_closed) return;
+    this->is_closed = true;
+    this->connected = false;
+    if (this->close_stream) {
+        this->close_stream();
+    }
+    this->flush_handle->close();
+    this->lock.lock();
+    this->invoke_closed = true;
+    this->lock.unlock();
+    this->async_invoke_handle->close();
+    this->out.clear();
+    this->decoder.clear();
+    this->abandon();
+    // Anything request_async queued gets an empty reply.
+    this->drain_invoke_queue();
+    this->grammars.clear();
+    this->synced_words = nullptr;
+    this->words_in_flight = 0;
+}
+
+void DraconityClient::lose(const char *error) {
+    if (this->is_closed) return;
+    this->close();
+    if (this->on_lost) {
+        this->on_lost(error);
+    }
+}
+
+void DraconityClient::abandon() {
+    auto abandoned = std::move(this->pending);
+    this->pending.clear();
+    auto now = std::chrono::steady_clock::now();
+    for (auto &pair : abandoned) {
+        Pending &request = pair.second;
+        if (this->on_complete) {
+            this->on_complete(request.cmd, now - request.start, NULL);
+        }
+        if (request.on_reply) {
+            request.on_reply(NULL);
+        }
+    }
+}
+
+bool DraconityClient::invoke(std::function<void()> fn) {
+    // The loop isn't safe to touch from other threads, so queue `fn` and wake
+    // the loop to run it, as UvServer::invoke does.
+    this->lock.lock();
+    bool open = !this->invoke_closed;
+    if (open) {
+        this->invoke_queue.push_back(fn);
+    }
+    this->lock.unlock();
+    if (open) {
+        this->async_invoke_handle->send();
+    }
+    return open;
+}
+
+void DraconityClient::drain_invoke_queue() {
+    this->lock.lock();
+    auto functions = std::move(this->invoke_queue);
+    this->invoke_queue.clear();
+    this->lock.unlock();
+    for (auto &function : functions) {
+        function();
+    }
+}
+
+uint32_t DraconityClient::track(const bson_t *msg, ReplyFn on_reply) {
+    uint32_t tid = this->next_tid++;
+    if (this->next_tid == NO_REPLY_TID) {
+        this->next_tid = PUBLISH_TID + 1;
+    }
+    Pending &request = this->pending[tid];
+    request.cmd = doc_utf8(msg, "cmd");
+    request.start = std::chrono::steady_clock::now();
+    request.on_reply = std::move(on_reply);
+    return tid;
+}
+
+uint32_t DraconityClient::request(bson_t *msg, ReplyFn on_reply) {
+    if (this->is_closed) {
+        bson_destroy(msg);
+        if (on_reply) on_reply(NULL);
+        return 0;
+    }
+    uint32_t tid = this->track(msg, std::move(on_reply));
+    this->queue_frame(tid, msg);
+    bson_destroy(msg);
+    return tid;
+}
+
+std::future<ClientReply> DraconityClient::request_async(bson_t *msg) {
+    auto promise = std::make_shared<std::promise<ClientReply>>();
+    auto future = promise->get_future();
+    bool queued = this->invoke([this, msg, promise] {
+        this->request(msg, [promise](const bson_t *reply) {
+            promise->set_value(ClientReply(reply));
+        });
+    });
+    if (!queued) {
+        bson_destroy(msg);
+        promise->set_value(ClientReply());
+    }
+    return future;
+}
+
+void DraconityClient::queue_frame(uint32_t tid, const bson_t *msg) {
+    append_frame(this->out, tid, bson_get_data(msg), msg->len);
+    if (!this->connected) {
+        // Goes out once we're connected.
+        return;
+    }
+    if (this->out.size() >= FLUSH_SIZE) {
+        this->flush();
+    } else if (!this->flush_scheduled) {
+        this->flush_scheduled = true;
+        this->flush_handle->start();
+    }
+}
+
+void DraconityClient::flush() {
+    if (!this->connected || this->out.empty()) return;
+    size_t length = this->out.size();
+    auto data = std::make_unique<char[]>(length);
+    memcpy(data.get(), this->out.data(), length);
+    this->out.clear();
+    this->write_stream(std::move(data), length);
+}
+
+void DraconityClient::on_data(const uint8_t *data, size_t length) {
+    bool ok = this->decoder.feed(data, length, [this](uint32_t tid, const uint8_t *msg, uint32_t msg_len) {
+        bson_t doc;
+        if (bson_init_static(&doc, msg, msg_len)) {
+            this->dispatch(tid, &doc);
+        }
+        // A callback may have closed the connection.
+        return !this->is_closed;
+    });
+    if (!ok) {
+        this->lose("message too long");
+    }
+}
+
+void DraconityClient::dispatch(uint32_t tid, const bson_t *doc) {
+    if (tid == PUBLISH_TID) {
+        this->dispatch_publish(doc);
+        return;
+    }
+    auto it = this->pending.find(tid);
+    if (it == this->pending.end()) {
+        if (this->on_unexpected) {
+            this->on_unexpected(tid);
+        }
+        return;
+    }
+    Pending request = std::move(it->second);
+    this->pending.erase(it);
+    if (this->on_complete) {
+        this->on_complete(request.cmd, std::chrono::steady_clock::now() - request.start, doc);
+    }
+    if (request.on_reply) {
+        request.on_reply(doc);
+    }
+}
+
+/* Phrases are decoded in a second pass, as the server appends the topic last
+   and skipping keys to find it is cheap. */
+void DraconityClient::dispatch_publish(const bson_t *doc) {
+    std::string_view topic = doc_utf8(doc, "topic");
+    bson_iter_t iter, child, word;
+    if (topic == "phrase" && this->on_phrase && bson_iter_init(&iter, doc)) {
+        PhraseView &phrase = this->phrase;
+        phrase.cmd = phrase.grammar = std::string_view();
+        phrase.phrase.clear();
+        phrase.words.clear();
+        phrase.prefix = 0;
+        phrase.utterance = 0;
+        phrase.mimic = false;
+        phrase.wav = NULL;
+        phrase.wav_len = 0;
+        phrase.doc = doc;
+        while (bson_iter_next(&iter)) {
+            const char *key = bson_iter_key(&iter);
+            if (streq(key, "cmd") && BSON_ITER_HOLDS_UTF8(&iter)) {
+                phrase.cmd = iter_utf8(&iter);
+            } else if (streq(key, "grammar") && BSON_ITER_HOLDS_UTF8(&iter)) {
+                phrase.grammar = iter_utf8(&iter);
+            } else if (streq(key, "phrase") && bson_iter_recurse(&iter, &child)) {
+                while (bson_iter_next(&child)) {
+                    if (BSON_ITER_HOLDS_UTF8(&child)) {
+                        phrase.phrase.push_back(iter_utf8(&child));
+                    }
+                }
+            } else if (streq(key, "words") && bson_iter_recurse(&iter, &child)) {
+                while (bson_iter_next(&child)) {
+                    if (!bson_iter_recurse(&child, &word)) continue;
+                    PhraseWordView view = {};
+                    while (bson_iter_next(&word)) {
+                        const char *field = bson_iter_key(&word);
+                        if (streq(field, "word") && BSON_ITER_HOLDS_UTF8(&word)) {
+                            view.word = iter_utf8(&word);
+                        } else if (streq(field, "id") && BSON_ITER_HOLDS_INT32(&word)) {
+                            view.id = bson_iter_int32(&word);
+                        } else if (streq(field, "rule") && BSON_ITER_HOLDS_INT32(&word)) {
+                            view.rule = bson_iter_int32(&word);
+                        } else if (streq(field, "start") && BSON_ITER_HOLDS_INT64(&word)) {
+                            view.start = bson_iter_int64(&word);
+                        } else if (streq(field, "end") && BSON_ITER_HOLDS_INT64(&word)) {
+                            view.end = bson_iter_int64(&word);
+                        }
+                    }
+                    phrase.words.push_back(view);
+                }
+            } else if (streq(key, "prefix") && BSON_ITER_HOLDS_INT32(&iter)) {
+                phrase.prefix = bson_iter_int32(&iter);
+            } else if (streq(key, "utterance") && BSON_ITER_HOLDS_INT64(&iter)) {
+                phrase.utterance = bson_iter_int64(&iter);
+            } else if (streq(key, "mimic") && BSON_ITER_HOLDS_BOOL(&iter)) {
+                phrase.mimic = bson_iter_bool(&iter);
+            } else if (streq(key, "wav") && BSON_ITER_HOLDS_BINARY(&iter)) {
+                bson_iter_binary(&iter, NULL, &phrase.wav_len, &phrase.wav);
+            }
+        }
+        this->on_phrase(phrase);
+        if (this->is_closed) return;
+    }
+    if (this->on_publish) {
+        this->on_publish(topic, doc);
+    }
+}
+
+void DraconityClient::set_grammar(const std::string &name, const ClientGrammar &grammar, ReplyFn on_reply) {
+    GrammarMirror &mirror = this->grammars[name];
+    // The synced state is only the server's while nothing else is in flight.
+    const ClientGrammar *base = (mirror.in_flight == 0) ? mirror.synced.get() : NULL;
+    if (base && *base == grammar) {
+        reply_unchanged(on_reply);
+        return;
+    }
+    // A new blob reloads the grammar, which drops its lists.
+    bool full = !base || base->blob != grammar.blob;
+
+    bson_t *msg = bson_new();
+    BSON_APPEND_UTF8(msg, "cmd", "g.set");
+    BSON_APPEND_UTF8(msg, "name", name.c_str());
+    if (full) {
+        BSON_APPEND_BINARY(msg, "data", BSON_SUBTYPE_BINARY, grammar.blob.data(), grammar.blob.size());
+    }
+    if (full || base->active_rules != grammar.active_rules) {
+        append_strings(msg, "active_rules", grammar.active_rules);
+    }
+    bson_t lists;
+    BSON_APPEND_DOCUMENT_BEGIN(msg, "lists", &lists);
+    for (auto &pair : grammar.lists) {
+        if (!full) {
+            auto it = base->lists.find(pair.first);
+            if (it != base->lists.end() && it->second == pair.second) continue;
+        }
+        append_strings(&lists, pair.first.c_str(), pair.second);
+    }
+    bson_append_document_end(msg, &lists);
+
+    auto state = std::make_shared<const ClientGrammar>(grammar);
+    mirror.in_flight++;
+    this->request(msg, [this, name, state, on_reply](const bson_t *reply) {
+        GrammarMirror &mirror = this->grammars[name];
+        mirror.in_flight--;
+        std::string_view status = reply ? doc_utf8(reply, "status") : "";
+        if (status == "success") {
+            mirror.synced = state;
+        } else if (status != "skipped") {
+            // The server dropped the grammar, or we can't tell what it has.
+            mirror.synced = nullptr;
+        }
+        if (!mirror.in_flight && !mirror.synced) {
+            this->grammars.erase(name);
+        }
+        if (on_reply) on_reply(reply);
+    });
+}
+
+void DraconityClient::unload_grammar(const std::string &name, ReplyFn on_reply) {
+    this->grammars[name].in_flight++;
+    bson_t *msg = BCON_NEW("cmd", BCON_UTF8("g.unload"), "name", BCON_UTF8(name.c_str()));
+    this->request(msg, [this, name, on_reply](const bson_t *reply) {
+        GrammarMirror &mirror = this->grammars[name];
+        mirror.in_flight--;
+        mirror.synced = nullptr;
+        if (!mirror.in_flight) {
+            this->grammars.erase(name);
+        }
+        if (on_reply) on_reply(reply);
+    });
+}
+
+void DraconityClient::set_words(const std::set<std::string> &words, ReplyFn on_reply) {
+    const std::set<std::string> *base = (this->words_in_flight == 0) ? this->synced_words.get() : NULL;
+    if (base && *base == words) {
+        reply_unchanged(on_reply);
+        return;
+    }
+    bson_t *msg = bson_new();
+    BSON_APPEND_UTF8(msg, "cmd", "w.set");
+    std::vector<std::string_view> added, removed;
+    if (base) {
+        std::set_difference(words.begin(), words.end(), base->begin(), base->end(), std::back_inserter(added));
+        std::set_difference(base->begin(), base->end(), words.begin(), words.end(), std::back_inserter(removed));
+    }
+    if (base && added.size() + removed.size() < words.size()) {
+        append_strings(msg, "add", added);
+        append_strings(msg, "remove", removed);
+    } else {
+        append_strings(msg, "words", words);
+    }
+
+    auto state = std::make_shared<const std::set<std::string>>(words);
+    this->words_in_flight++;
+    this->request(msg, [this, state, on_reply](const bson_t *reply) {
+        this->words_in_flight--;
+        std::string_view status = reply ? doc_utf8(reply, "status") : "";
+        if (status == "success") {
+            this->synced_words = state;
+        } else if (status != "skipped") {
+            // Words that failed to add are dropped from the server's set.
+            this->synced_words = nullptr;
+        }
+        if (on_reply) on_reply(reply);
+    });
+}
+
+void DraconityClient::unpause(uint64_t token, ReplyFn on_reply) {
+    this->request(BCON_NEW("cmd", BCON_UTF8("unpause"), "token", BCON_INT64(token)), on_reply);
+}
@@ -0,0 +1,198 @@
+#pragma once
+#include <stdint.h>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <bson.h>
+#include <uvw.hpp>
+
+#include "transport/framing.h"
+
+/* A client for draconity's socket protocol, on a uvw loop.
+
+   Requests are pipelined: each is framed into an output buffer straight away,
+   without waiting for earlier replies, and the buffer goes out in one write
+   just before the loop next polls. Every request gets exactly one reply
+   callback, including g.set, w.set and mimic, which the server answers once
+   the update has synced or the mimic finished rather than when it reads them.
+   Requests still waiting when the connection closes get a NULL reply.
+
+   set_grammar and set_words keep a mirror of what the server has synced for
+   this connection and send only what changed since: a g.set leaves out an
+   unchanged blob, rules and lists, and a w.set sends the words added and
+   removed. They fall back to the full state whenever the mirror can't be
+   trusted, that is while an earlier update is still in flight, after an error
+   and on a new connection. The mirror assumes no other client sets the same
+   grammars.
+
+   Replies, publishes and phrases are handed out as views into the receive
+   buffer, only valid for the length of the callback. Everything but
+   request_async must be called on the loop's thread.
+
+ */
+
+// A reply, or NULL if the connection closed before it came.
+typedef std::function<void(const bson_t *reply)> ReplyFn;
+
+/* A copy of a reply, for requests completed through a future. */
+class ClientReply {
+public:
+    ClientReply() {}
+    explicit ClientReply(const bson_t *reply);
+
+    // False if the connection closed before the reply came.
+    bool received() const { return !this->data.empty(); }
+    // Points `doc` at the reply. Returns false if there isn't one.
+    bool doc(bson_t *doc) const;
+private:
+    std::vector<uint8_t> data;
+};
+
+/* A grammar as the client wants the server to have it. */
+struct ClientGrammar {
+    std::vector<uint8_t> blob;
+    std::vector<std::string> active_rules;
+    std::unordered_map<std::string, std::vector<std::string>> lists;
+
+    bool operator==(const ClientGrammar &other) const {
+        return this->blob == other.blob && this->active_rules == other.active_rules && this->lists == other.lists;
+    }
+};
+
+struct PhraseWordView {
+    std::string_view word;
+    int32_t id;
+    int32_t rule;
+    int64_t start, end;  // ns, on the server's monotonic clock
+};
+
+/* A p.begin, p.hypothesis or p.end, decoded in place. */
+struct PhraseView {
+    std::string_view cmd;
+    std::string_view grammar;
+    std::vector<std::string_view> phrase;
+    std::vector<PhraseWordView> words;
+    // Leading words unchanged since the last hypothesis, with hypothesis_suffix.
+    int32_t prefix;
+    uint64_t utterance;  // 0 if the result wasn't kept
+    bool mimic;
+    const uint8_t *wav;  // With the send_wav client option, else NULL
+    uint32_t wav_len;
+    // The whole message, for anything else.
+    const bson_t *doc;
+};
+
+class DraconityClient {
+public:
+    DraconityClient(std::shared_ptr<uvw::Loop> loop);
+    ~DraconityClient();
+
+    /* Connects and authenticates. Requests made before the connection is up
+       are queued behind the auth. on_ready gets the auth reply, which has
+       "success" false if the secret was wrong, and "resumed" true if
+       resume_token named a session the server kept. `pauses` says whether the
+       engine should wait for this client to unpause. */
+    void connect_tcp(const std::string &host, unsigned int port, const std::string &secret,
+                     bool pauses, ReplyFn on_ready = nullptr);
+    void connect_pipe(const std::string &path, const std::string &secret,
+                      bool pauses, ReplyFn on_ready = nullptr);
+    // Closes the connection, abandoning any requests still waiting.
+    void close();
+
+    // Sends `msg` and destroys it. Returns the request's tid.
+    uint32_t request(bson_t *msg, ReplyFn on_reply = nullptr);
+    // request() from any thread, while the loop runs on another.
+    std::future<ClientReply> request_async(bson_t *msg);
+
+    void set_grammar(const std::string &name, const ClientGrammar &grammar, ReplyFn on_reply = nullptr);
+    void unload_grammar(const std::string &name, ReplyFn on_reply = nullptr);
+    void set_words(const std::set<std::string> &words, ReplyFn on_reply = nullptr);
+    void unpause(uint64_t token, ReplyFn on_reply = nullptr);
+
+    size_t pending_count() const {
+        return this->pending.size();
+    }
+
+    bool closed() const {
+        return this->is_closed;
+    }
+
+public:
+    // Sent with the auth to take back the grammars and words of an earlier
+    // connection the server is still keeping, and replaced by the token from
+    // the auth reply. Give it to the next client to resume this one.
+    std::string resume_token;
+    // Every publish, by topic.
+    std::function<void(std::string_view topic, const bson_t *msg)> on_publish;
+    // Phrase publishes, decoded. Also passed to on_publish.
+    std::function<void(const PhraseView &phrase)> on_phrase;
+    // Every reply as it completes, with the request's cmd and round trip
+    // time, before its own callback. `reply` is NULL for abandoned requests.
+    std::function<void(const std::string &cmd, std::chrono::nanoseconds rtt, const bson_t *reply)> on_complete;
+    // A reply to no request this client is waiting on.
+    std::function<void(uint32_t tid)> on_unexpected;
+    // The server or an error closed the connection; close() doesn't call it.
+    // `error` is NULL when the server hung up.
+    std::function<void(const char *error)> on_lost;
+
+private:
+    struct Pending {
+        std::string cmd;
+        std::chrono::steady_clock::time_point start;
+        ReplyFn on_reply;
+    };
+
+    /* What the server has synced for one grammar, as far as we know. */
+    struct GrammarMirror {
+        std::shared_ptr<const ClientGrammar> synced;
+        unsigned int in_flight = 0;
+    };
+
+    template <typename T>
+    void attach(std::shared_ptr<T> stream, const std::string &secret, bool pauses, ReplyFn on_ready);
+    bool invoke(std::function<void()> fn);
+    void drain_invoke_queue();
+    uint32_t track(const bson_t *msg, ReplyFn on_reply);
+    void queue_frame(uint32_t tid, const bson_t *msg);
+    void flush();
+    void on_data(const uint8_t *data, size_t length);
+    void dispatch(uint32_t tid, const bson_t *doc);
+    void dispatch_publish(const bson_t *doc);
+    void lose(const char *error);
+    void abandon();
+
+    std::shared_ptr<uvw::Loop> loop;
+    std::function<void(std::unique_ptr<char[]>, unsigned int)> write_stream;
+    std::function<void()> close_stream;
+    bool connected = false;
+    bool is_closed = false;
+
+    FrameDecoder decoder;
+    // Frames waiting for the next flush.
+    std::vector<uint8_t> out;
+    std::shared_ptr<uvw::PrepareHandle> flush_handle;
+    bool flush_scheduled = false;
+
+    std::unordered_map<uint32_t, Pending> pending;
+    uint32_t next_tid = 1;
+
+    std::unordered_map<std::string, GrammarMirror> grammars;
+    std::shared_ptr<const std::set<std::string>> synced_words;
+    unsigned int words_in_flight = 0;
+
+    // Reused for every phrase, so decoding doesn't allocate once warm.
+    PhraseView phrase;
+
+    std::shared_ptr<uvw::AsyncHandle> async_invoke_handle;
+    std::list<std::function<void()>> invoke_queue;
+    bool invoke_closed = false;
+    std::mutex lock; // protects access to `invoke_queue` and `invoke_closed`
+};
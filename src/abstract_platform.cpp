@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include "abstract_platform.h"
 
@@ -8,13 +9,33 @@ std::string Platform::expanduser(std::string path) {
     return path;
 }
 
-#ifdef __APPLE__
+int Platform::loadSymbols(std::string moduleName, std::list<SymbolLoad> &loads) {
+    std::list<CodeHook> hooks;
+    return Platform::resolve(moduleName, loads, hooks);
+}
+
+int Platform::applyHooks(std::string moduleName, std::list<CodeHook> &hooks) {
+    std::list<SymbolLoad> loads;
+    return Platform::resolve(moduleName, loads, hooks);
+}
+
+static void report_unresolved(std::list<SymbolLoad> &loads, std::list<CodeHook> &hooks) {
+    for (auto &symbol_load : loads) {
+        if (!symbol_load.loaded) {
+            printf("[!] Failed to load symbol %s\n", symbol_load.name.c_str());
+        }
+    }
+    for (auto &hook : hooks) {
+        if (!hook.active) {
+            printf("[!] Failed to hook %s\n", hook.name.c_str());
+        }
+    }
+}
+
+#ifndef _WIN32
 
 #include <unistd.h>
 #include <sys/mman.h>
-extern "C" {
-#include "CoreSymbolication.h"
-}
 #include <sys/types.h>
 #include <pwd.h>
 
@@ -47,71 +68,222 @@ void Platform::protectRX(void *addr, size_t size) {
     mprotect(prot_addr, prot_size, PROT_READ|PROT_EXEC);
 }
 
-static int walk_image(std::string image, std::function<void(std::string, void *, size_t)> cb) {
+std::string Platform::homedir() {
+    char *home = getenv("HOME");
+    if (home) {
+        return home;
+    } else {
+        struct passwd pw, *pwp;
+        char buf[1024];
+        if (getpwuid_r(getuid(), &pw, buf, sizeof(buf), &pwp) == 0) {
+            return std::string(pwp->pw_dir);
+        }
+        return "";
+    }
+}
+
+#endif
+
+#ifdef __APPLE__
+
+#include <fstream>
+#include <unordered_map>
+#include <vector>
+#include <mach-o/loader.h>
+#include <sys/stat.h>
+extern "C" {
+#include "CoreSymbolication.h"
+}
+
+// Offset of a symbol from the image base, or -1 if the image doesn't have it.
+typedef std::unordered_map<std::string, int64_t> SymbolOffsets;
+
+/* Identifies the build of an image, so cached offsets are only reused against
+   the exact binary they came from: its LC_UUID, or failing that its path, size
+   and mtime. */
+static std::string image_key(CSSymbolOwnerRef owner) {
+    const uint8_t *base = (const uint8_t *)CSSymbolOwnerGetBaseAddress(owner);
+    const struct mach_header *header = (const struct mach_header *)base;
+    const uint8_t *cmd = NULL;
+    if (header->magic == MH_MAGIC_64) {
+        cmd = base + sizeof(struct mach_header_64);
+    } else if (header->magic == MH_MAGIC) {
+        cmd = base + sizeof(struct mach_header);
+    }
+    for (uint32_t i = 0; cmd && i < header->ncmds; i++) {
+        const struct load_command *lc = (const struct load_command *)cmd;
+        if (lc->cmd == LC_UUID) {
+            const uint8_t *uuid = ((const struct uuid_command *)lc)->uuid;
+            char hex[33];
+            for (int j = 0; j < 16; j++) {
+                snprintf(hex + j * 2, 3, "%02x", uuid[j]);
+            }
+            return std::string("uuid ") + hex;
+        }
+        cmd += lc->cmdsize;
+    }
+    const char *path = CSSymbolOwnerGetPath(owner);
+    struct stat st;
+    if (path && stat(path, &st) == 0) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), " %lld %lld", (long long)st.st_size, (long long)st.st_mtime);
+        return std::string("file ") + path + buf;
+    }
+    return "";
+}
+
+/* The cache is a text file: the image key on the first line, then one
+   "<hex offset> <name>" line per symbol, with "- <name>" for symbols the
+   image doesn't have. */
+static bool read_symbol_cache(const std::string &path, const std::string &key, SymbolOffsets &offsets) {
+    std::ifstream in(path);
+    std::string line;
+    if (!std::getline(in, line) || line != key) {
+        return false;
+    }
+    while (std::getline(in, line)) {
+        size_t space = line.find(' ');
+        if (space == std::string::npos) continue;
+        int64_t offset = (line[0] == '-') ? -1 : strtoll(line.c_str(), NULL, 16);
+        offsets[line.substr(space + 1)] = offset;
+    }
+    return true;
+}
+
+static void write_symbol_cache(const std::string &path, const std::string &key, const SymbolOffsets &offsets) {
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp);
+        if (!out) return;
+        out << key << "\n";
+        for (auto &pair : offsets) {
+            if (pair.second < 0) {
+                out << "- " << pair.first << "\n";
+            } else {
+                out << std::hex << pair.second << std::dec << " " << pair.first << "\n";
+            }
+        }
+        if (!out) return;
+    }
+    rename(tmp.c_str(), path.c_str());
+}
+
+struct WantedSymbol {
+    std::vector<SymbolLoad *> loads;
+    std::vector<CodeHook *> hooks;
+    void *addr;
+    bool known;
+};
+
+/* Walking every symbol in server.so is by far the slowest part of startup, so
+   we only do it when the cache doesn't already cover every name we want, and
+   then only once for both the loads and the hooks. */
+int Platform::resolve(std::string moduleName, std::list<SymbolLoad> &loads, std::list<CodeHook> &hooks) {
+    std::unordered_map<std::string, WantedSymbol> wanted;
+    for (auto &symbol_load : loads) {
+        wanted[symbol_load.name].loads.push_back(&symbol_load);
+    }
+    for (auto &hook : hooks) {
+        wanted[hook.name].hooks.push_back(&hook);
+    }
+
     CSSymbolicatorRef csym = CSSymbolicatorCreateWithTask(mach_task_self());
-    CSSymbolOwnerRef owner = CSSymbolicatorGetSymbolOwnerWithNameAtTime(csym, image.c_str(), kCSNow);
+    CSSymbolOwnerRef owner = CSSymbolicatorGetSymbolOwnerWithNameAtTime(csym, moduleName.c_str(), kCSNow);
     if (CSIsNull(owner)) {
-        printf("  [!] IMAGE NOT FOUND: %s\n", image.c_str());
+        printf("  [!] IMAGE NOT FOUND: %s\n", moduleName.c_str());
         CSRelease(csym);
         return 1;
     }
-    CSSymbolOwnerForeachSymbol(owner, ^int (CSSymbolRef sym) {
-        const char *name = CSSymbolGetName(sym);
-        if (name) {
-            CSRange range = CSSymbolGetRange(sym);
-            cb(name, (void *)range.addr, range.size);
-            return 0;
-        }
-        return 1;
-    });
-    CSRelease(csym);
-    return 0;
-}
+    uintptr_t base = CSSymbolOwnerGetBaseAddress(owner);
+    std::string key = image_key(owner);
+    std::string cache_path = Platform::expanduser("~/.talon/.sys/draconity-" + moduleName + ".symbols");
+    SymbolOffsets offsets;
+    if (key.size() > 0) {
+        read_symbol_cache(cache_path, key, offsets);
+    }
 
-int Platform::loadSymbols(std::string moduleName, std::list<SymbolLoad> &loads) {
-    walk_image(moduleName, [&loads](std::string name, void *addr, size_t size) {
-        for (auto &symbol_load : loads) {
-            if (name == symbol_load.name) {
-                symbol_load.setAddr(addr);
+    size_t missing = 0;
+    for (auto &pair : wanted) {
+        WantedSymbol &symbol = pair.second;
+        auto it = offsets.find(pair.first);
+        symbol.known = (it != offsets.end());
+        symbol.addr = (symbol.known && it->second >= 0) ? (void *)(base + it->second) : NULL;
+        if (!symbol.known) missing++;
+    }
+    if (missing > 0) {
+        // Blocks capture C++ objects by const copy, so go through a pointer.
+        auto *wanted_ptr = &wanted;
+        CSSymbolOwnerForeachSymbol(owner, ^int (CSSymbolRef sym) {
+            const char *name = CSSymbolGetName(sym);
+            if (name) {
+                auto it = wanted_ptr->find(name);
+                // First definition wins, so a duplicate can't be hooked twice.
+                if (it != wanted_ptr->end() && !it->second.known) {
+                    it->second.addr = (void *)CSSymbolGetRange(sym).addr;
+                    it->second.known = true;
+                }
+                return 0;
             }
+            return 1;
+        });
+        for (auto &pair : wanted) {
+            offsets[pair.first] = pair.second.addr ? (int64_t)((uintptr_t)pair.second.addr - base) : -1;
         }
-    });
-    for (auto &symbol_load : loads) {
-        if (!symbol_load.loaded) {
-            printf("[!] Failed to load symbol %s\n", symbol_load.name.c_str());
+        if (key.size() > 0) {
+            write_symbol_cache(cache_path, key, offsets);
         }
     }
-    return 0;
-};
+    CSRelease(csym);
 
-int Platform::applyHooks(std::string moduleName, std::list<CodeHook> &hooks) {
-    walk_image(moduleName, [&hooks](std::string name, void *addr, size_t size) {
-        for (auto &hook : hooks) {
-            if (name == hook.name) {
-                hook.setup(addr);
-            }
+    // Loads before hooks, so a symbol that is both still points at the
+    // function's entry rather than our trampoline.
+    for (auto &pair : wanted) {
+        if (!pair.second.addr) continue;
+        for (auto symbol_load : pair.second.loads) {
+            symbol_load->setAddr(pair.second.addr);
         }
-    });
-    for (auto &hook : hooks) {
-        if (!hook.active) {
-            printf("[!] Failed to hook %s\n", hook.name.c_str());
+    }
+    HookTransaction transaction;
+    for (auto &pair : wanted) {
+        if (!pair.second.addr) continue;
+        for (auto hook : pair.second.hooks) {
+            transaction.add(hook, pair.second.addr);
         }
     }
+    transaction.commit();
+    report_unresolved(loads, hooks);
     return 0;
-};
+}
 
-std::string Platform::homedir() {
-    char *home = getenv("HOME");
-    if (home) {
-        return home;
-    } else {
-        struct passwd pw, *pwp;
-        char buf[1024];
-        if (getpwuid_r(getuid(), &pw, buf, sizeof(buf), &pwp) == 0) {
-            return std::string(pwp->pw_dir);
+#elif defined(__linux__)
+
+#include <dlfcn.h>
+
+// dlsym already searches the dynamic symbol table by name, so like Windows
+// there's nothing to index or cache here.
+int Platform::resolve(std::string moduleName, std::list<SymbolLoad> &loads, std::list<CodeHook> &hooks) {
+    void *module = dlopen(moduleName.c_str(), RTLD_NOW | RTLD_NOLOAD);
+    if (!module) {
+        printf("[!] Failed to open module %s\n", moduleName.c_str());
+        return 1;
+    }
+    for (auto &symbol_load : loads) {
+        void *addr = dlsym(module, symbol_load.name.c_str());
+        if (addr) {
+            symbol_load.setAddr(addr);
         }
-        return "";
     }
+    HookTransaction transaction;
+    for (auto &hook : hooks) {
+        void *addr = dlsym(module, hook.name.c_str());
+        if (addr) {
+            transaction.add(&hook, addr);
+        }
+    }
+    transaction.commit();
+    dlclose(module);
+    report_unresolved(loads, hooks);
+    return 0;
 }
 
 #else // windows
@@ -142,7 +314,9 @@ void Platform::protectRX(void *addr, size_t size) {
     VirtualProtect(addr, size, PAGE_EXECUTE_READ, &oldProtect);
 }
 
-int Platform::loadSymbols(std::string moduleName, std::list<SymbolLoad> &loads) {
+// GetProcAddress already searches the export table by name, so there's
+// nothing to index or cache here.
+int Platform::resolve(std::string moduleName, std::list<SymbolLoad> &loads, std::list<CodeHook> &hooks) {
     HMODULE module = GetModuleHandleA(moduleName.c_str());
     if (!module) {
         printf("[!] Failed to open module %s\n", moduleName.c_str());
@@ -154,31 +328,15 @@ int Platform::loadSymbols(std::string moduleName, std::list<SymbolLoad> &loads)
             symbol_load.setAddr(reinterpret_cast<void *>(addr));
         }
     }
-    for (auto &symbol_load : loads) {
-        if (!symbol_load.loaded) {
-            printf("[!] Failed to load symbol %s\n", symbol_load.name.c_str());
-        }
-    }
-    return 0;
-};
-
-int Platform::applyHooks(std::string moduleName, std::list<CodeHook> &hooks) {
-    HMODULE module = GetModuleHandleA(moduleName.c_str());
-    if (!module) {
-        printf("[!] Failed to open module %s\n", moduleName.c_str());
-        return 1;
-    }
+    HookTransaction transaction;
     for (auto &hook : hooks) {
         FARPROC addr = GetProcAddress(module, hook.name.c_str());
         if (addr != 0) {
-            hook.setup(reinterpret_cast<void *>(addr));
-        }
-    }
-    for (auto &hook : hooks) {
-        if (!hook.active) {
-            printf("[!] Failed to hook %s\n", hook.name.c_str());
+            transaction.add(&hook, reinterpret_cast<void *>(addr));
         }
     }
+    transaction.commit();
+    report_unresolved(loads, hooks);
     return 0;
 };
 
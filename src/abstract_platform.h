@@ -14,6 +14,9 @@ public:
     static void protectRX(void *addr, size_t size);
     static int loadSymbols(std::string module, std::list<SymbolLoad> &loads);
     static int applyHooks(std::string module, std::list<CodeHook> &hooks);
+    // Loads the symbols then applies the hooks, finding both in a single pass
+    // over the module.
+    static int resolve(std::string module, std::list<SymbolLoad> &loads, std::list<CodeHook> &hooks);
     static std::string homedir();
     static std::string expanduser(std::string path);
 };
@@ -0,0 +1,172 @@
+#include "api_profile.h"
+#include "draconity.h"
+#include "log.h"
+
+void ApiProfiler::configure(std::shared_ptr<cpptoml::table> config) {
+    if (config) {
+        this->wanted = config->get_as<bool>("api_profile").value_or(false);
+    }
+}
+
+ApiStats *ApiProfiler::stats(const char *name) {
+    this->lock.lock();
+    this->apis.emplace_back();
+    ApiStats *stats = &this->apis.back();
+    this->lock.unlock();
+    stats->name = name;
+    stats->latency = draconity->metrics.histogram(std::string("draconity_api_") + name + "_seconds",
+                                                  std::string("Time spent in Dragon's ") + name);
+    stats->calls = 0;
+    stats->errors = 0;
+    stats->bytes = 0;
+    stats->max_bytes = 0;
+    return stats;
+}
+
+void ApiProfiler::record_grammar(ApiStats *stats, drg_grammar *grammar, int64_t ns, uint64_t bytes) {
+    this->lock.lock();
+    ApiGrammarCost &cost = stats->grammars[grammar];
+    cost.calls++;
+    cost.total_ns += ns;
+    cost.bytes += bytes;
+    this->lock.unlock();
+}
+
+void ApiProfiler::install() {
+    if (!this->wanted || this->installed) return;
+#define w(name) api_wrap<&_##name>(this, #name)
+    w(DSXEngine_New);
+    w(DSXEngine_Create);
+
+    w(DSXEngine_AddWord);
+    w(DSXEngine_AddTemporaryWord);
+    w(DSXEngine_DeleteWord);
+    w(DSXEngine_ValidateWord);
+    w(DSXEngine_EnumWords);
+
+    w(DSXWordEnum_GetCount);
+    w(DSXWordEnum_Next);
+    w(DSXWordEnum_End);
+
+    w(DSXEngine_LoadGrammar);
+    w(DSXEngine_GetCurrentSpeaker);
+    w(DSXEngine_GetLanguageID);
+    w(DSXEngine_SetMicState);
+    w(DSXEngine_GetMicState);
+    w(DSXEngine_Mimic);
+    w(DSXEngine_RegisterAttribChangedCallback);
+    w(DSXEngine_RegisterMimicDoneCallback);
+    w(DSXEngine_RegisterPausedCallback);
+
+    w(DSXEngine_SetStringValue);
+    w(DSXEngine_GetValue);
+    w(DSXEngine_GetParam);
+    w(DSXEngine_DestroyParam);
+
+    w(DSXEngine_SetBeginPhraseCallback);
+    w(DSXEngine_SetEndPhraseCallback);
+
+    w(DSXEngine_Pause);
+    w(DSXEngine_Resume);
+    w(DSXEngine_ResumeRecognition);
+
+    w(DSXFileSystem_PreferenceSetValue);
+    w(DSXFileSystem_PreferenceGetValue);
+    w(DSXFileSystem_SetUsersDirectory);
+    w(DSXFileSystem_SetVocabsLocation);
+    w(DSXFileSystem_SetResultsDirectory);
+
+    w(DSXGrammar_Activate);
+    w(DSXGrammar_Deactivate);
+    w(DSXGrammar_Destroy);
+    w(DSXGrammar_GetList);
+    w(DSXGrammar_RegisterBeginPhraseCallback);
+    w(DSXGrammar_RegisterEndPhraseCallback);
+    w(DSXGrammar_RegisterPhraseHypothesisCallback);
+    w(DSXGrammar_SetApplicationName);
+    w(DSXGrammar_SetList);
+    w(DSXGrammar_GetApplicationName);
+    w(DSXGrammar_SetPriority);
+    w(DSXGrammar_SetSpecialGrammar);
+    w(DSXGrammar_Unregister);
+
+    w(DSXResult_GetWAV);
+    w(DSXResult_BestPathWord);
+    w(DSXResult_GetWordNode);
+    w(DSXResult_Destroy);
+
+    w(SDApi_SetShowCalls);
+    w(SDApi_SetShowCallsWithFileSpecArgs);
+    w(SDApi_SetShowCallPointerArguments);
+    w(SDApi_SetShowCallMemDeltas);
+    w(SDApi_SetShowAllocation);
+    w(SDApi_SetShowAllocationHistogram);
+
+    w(SDRule_New);
+    w(SDRule_Delete);
+#undef w
+    this->installed = true;
+    draconity_log(LEVEL_INFO, "api", "profiling %d Dragon API calls", (int)this->apis.size());
+}
+
+void ApiProfiler::append(bson_t *doc) {
+    std::unordered_map<drg_grammar *, std::string> names;
+    for (auto &pair : draconity->grammars) {
+        if (pair.second->handle) {
+            names[pair.second->handle] = pair.first;
+        }
+    }
+
+    bson_t apis, child, grammars, cost;
+    BSON_APPEND_BOOL(doc, "enabled", this->installed);
+    BSON_APPEND_DOCUMENT_BEGIN(doc, "apis", &apis);
+    this->lock.lock();
+    for (auto &stats : this->apis) {
+        uint64_t calls = stats.calls.load(std::memory_order_relaxed);
+        if (calls == 0) continue;
+        BSON_APPEND_DOCUMENT_BEGIN(&apis, stats.name, &child);
+        BSON_APPEND_INT64(&child, "calls", calls);
+        BSON_APPEND_INT64(&child, "errors", stats.errors.load(std::memory_order_relaxed));
+        BSON_APPEND_INT64(&child, "total_ns", stats.latency->sum());
+        BSON_APPEND_INT64(&child, "p50", stats.latency->quantile(0.5));
+        BSON_APPEND_INT64(&child, "p90", stats.latency->quantile(0.9));
+        BSON_APPEND_INT64(&child, "p99", stats.latency->quantile(0.99));
+        BSON_APPEND_INT64(&child, "max", stats.latency->quantile(1));
+        BSON_APPEND_INT64(&child, "bytes", stats.bytes.load(std::memory_order_relaxed));
+        BSON_APPEND_INT64(&child, "max_bytes", stats.max_bytes.load(std::memory_order_relaxed));
+        if (stats.grammars.size() > 0) {
+            // Handles of unloaded grammars are folded into the NULL entry here,
+            // so the table doesn't grow with every reload.
+            ApiGrammarCost unloaded = {0, 0, 0};
+            std::unordered_map<std::string, ApiGrammarCost> by_name;
+            for (auto it = stats.grammars.begin(); it != stats.grammars.end();) {
+                auto name = names.find(it->first);
+                ApiGrammarCost &total = (name == names.end()) ? unloaded : by_name[name->second];
+                total.calls += it->second.calls;
+                total.total_ns += it->second.total_ns;
+                total.bytes += it->second.bytes;
+                if (name == names.end()) {
+                    it = stats.grammars.erase(it);
+                } else {
+                    it++;
+                }
+            }
+            if (unloaded.calls > 0) {
+                stats.grammars[NULL] = unloaded;
+                by_name["(unloaded)"] = unloaded;
+            }
+            BSON_APPEND_DOCUMENT_BEGIN(&child, "grammars", &grammars);
+            for (auto &pair : by_name) {
+                BSON_APPEND_DOCUMENT_BEGIN(&grammars, pair.first.c_str(), &cost);
+                BSON_APPEND_INT64(&cost, "calls", pair.second.calls);
+                BSON_APPEND_INT64(&cost, "total_ns", pair.second.total_ns);
+                BSON_APPEND_INT64(&cost, "bytes", pair.second.bytes);
+                bson_append_document_end(&grammars, &cost);
+            }
+            bson_append_document_end(&child, &grammars);
+        }
+        bson_append_document_end(&apis, &child);
+    }
+    this->lock.unlock();
+    bson_append_document_end(doc, &apis);
+}
@@ -0,0 +1,138 @@
+#pragma once
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string.h>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <bson.h>
+#include "cpptoml.h"
+#include "dr_time.h"
+#include "metrics.h"
+#include "trace.h"
+#include "types.h"
+
+struct ApiGrammarCost {
+    uint64_t calls;
+    int64_t total_ns;
+    uint64_t bytes;
+};
+
+struct ApiStats {
+    // A literal, so it can go straight into the trace.
+    const char *name;
+    Histogram *latency;
+    std::atomic<uint64_t> calls;
+    std::atomic<uint64_t> errors;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> max_bytes;
+    // Calls that took a grammar, by Dragon's handle. Guarded by the profiler's
+    // lock.
+    std::unordered_map<drg_grammar *, ApiGrammarCost> grammars;
+};
+
+/* Opt-in timing of every call we make into Dragon.
+
+   With api_profile set, each function pointer in api.h is swapped for a shim
+   that calls the original and records its latency, the size of its blob and
+   string arguments, and the grammar it was called on. The latencies also show
+   up in the metrics and the flight recorder. `api.stats` reports it all, with
+   grammar handles mapped back to names.
+
+ */
+class ApiProfiler {
+public:
+    void configure(std::shared_ptr<cpptoml::table> config);
+    // Wraps the loaded symbols, if profiling is enabled. Call once they're all
+    // resolved.
+    void install();
+    bool enabled() { return this->installed; }
+
+    ApiStats *stats(const char *name);
+    void record_grammar(ApiStats *stats, drg_grammar *grammar, int64_t ns, uint64_t bytes);
+    // Must be called on the Uv thread.
+    void append(bson_t *doc);
+private:
+    bool wanted = false;
+    bool installed = false;
+    std::mutex lock;
+    std::list<ApiStats> apis;
+};
+
+static inline uint64_t api_arg_bytes(const dsx_dataptr *data) { return data ? data->size : 0; }
+static inline uint64_t api_arg_bytes(dsx_dataptr *data) { return data ? data->size : 0; }
+static inline uint64_t api_arg_bytes(const char *s) { return s ? strlen(s) : 0; }
+// Anything else - including non-const char *, which are usually out buffers.
+template <typename T> static inline uint64_t api_arg_bytes(T) { return 0; }
+
+static inline drg_grammar *api_arg_grammar(drg_grammar *grammar) { return grammar; }
+// LoadGrammar's out parameter; only read after the call.
+static inline drg_grammar *api_arg_grammar(drg_grammar **grammar) { return grammar ? *grammar : NULL; }
+template <typename T> static inline drg_grammar *api_arg_grammar(T) { return NULL; }
+
+template <typename... Args>
+static void api_record(ApiProfiler *profiler, ApiStats *stats, int64_t start, bool error, Args... args) {
+    int64_t ns = dr_monotonic_time() - start;
+    // Measured after the call, so blobs Dragon fills in (GetWAV, GetList) count.
+    uint64_t bytes = (api_arg_bytes(args) + ... + 0);
+    drg_grammar *grammar = NULL;
+    ((grammar = grammar ? grammar : api_arg_grammar(args)), ...);
+
+    stats->latency->record(ns);
+    stats->calls.fetch_add(1, std::memory_order_relaxed);
+    if (error) {
+        stats->errors.fetch_add(1, std::memory_order_relaxed);
+    }
+    stats->bytes.fetch_add(bytes, std::memory_order_relaxed);
+    uint64_t max = stats->max_bytes.load(std::memory_order_relaxed);
+    while (bytes > max && !stats->max_bytes.compare_exchange_weak(max, bytes, std::memory_order_relaxed)) {}
+    if (grammar) {
+        profiler->record_grammar(stats, grammar, ns, bytes);
+    }
+    trace_complete(stats->name, start, bytes);
+}
+
+template <auto Ptr, typename F> struct ApiShim;
+
+/* One instantiation per api.h entry, keyed by the address of its pointer. */
+template <auto Ptr, typename R, typename... Args>
+struct ApiShim<Ptr, R (*)(Args...)> {
+    static R (*orig)(Args...);
+    static ApiProfiler *profiler;
+    static ApiStats *stats;
+
+    static R call(Args... args) {
+        int64_t start = dr_monotonic_time();
+        if constexpr (std::is_void<R>::value) {
+            orig(args...);
+            api_record(profiler, stats, start, false, args...);
+        } else {
+            R ret = orig(args...);
+            bool error = false;
+            if constexpr (std::is_integral<R>::value) {
+                error = (ret != 0);
+            }
+            api_record(profiler, stats, start, error, args...);
+            return ret;
+        }
+    }
+};
+
+template <auto Ptr, typename R, typename... Args>
+R (*ApiShim<Ptr, R (*)(Args...)>::orig)(Args...) = NULL;
+template <auto Ptr, typename R, typename... Args>
+ApiProfiler *ApiShim<Ptr, R (*)(Args...)>::profiler = NULL;
+template <auto Ptr, typename R, typename... Args>
+ApiStats *ApiShim<Ptr, R (*)(Args...)>::stats = NULL;
+
+template <auto Ptr>
+static void api_wrap(ApiProfiler *profiler, const char *name) {
+    typedef ApiShim<Ptr, typename std::remove_pointer<decltype(Ptr)>::type> Shim;
+    if (!*Ptr || Shim::orig) return;
+    Shim::orig = *Ptr;
+    Shim::profiler = profiler;
+    Shim::stats = profiler->stats(name);
+    *Ptr = Shim::call;
+}
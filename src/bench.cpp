@@ -0,0 +1,321 @@
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include "abstract_platform.h"
+#include "bench.h"
+#include "draconity.h"
+#include "dr_time.h"
+#include "log.h"
+#include "server.h"
+#include "transport/server.h"
+
+MimicBench::MimicBench() {
+    this->active = false;
+    this->client_id = 0;
+    this->tid = 0;
+    this->next = 0;
+    this->ends = 0;
+    this->publishes = 0;
+    this->mimic_finished = false;
+}
+
+/* Corpora are named in a [bench.corpora] table:
+
+       [bench]
+       report_path = "~/.talon/draconity.bench.json"
+       [bench.corpora]
+       commands = "~/.talon/bench/commands.txt"
+
+ */
+void MimicBench::configure(std::shared_ptr<cpptoml::table> config) {
+    auto bench = config ? config->get_table("bench") : nullptr;
+    if (!bench) {
+        return;
+    }
+    std::string report_path = bench->get_as<std::string>("report_path").value_or("");
+    this->report_path = report_path != "" ? Platform::expanduser(report_path) : "";
+    auto corpora = bench->get_table("corpora");
+    if (corpora) {
+        for (auto &pair : *corpora) {
+            if (auto path = pair.second->as<std::string>()) {
+                this->corpora[pair.first] = Platform::expanduser(path->get());
+            }
+        }
+    }
+}
+
+/* Corpus files hold one phrase per line, with words separated by whitespace.
+   Blank lines and lines starting with '#' are skipped. */
+static bool read_corpus(const std::string &path, std::vector<std::vector<std::string>> &corpus) {
+    std::ifstream file(path);
+    if (!file) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream stream(line);
+        std::vector<std::string> words;
+        std::string word;
+        while (stream >> word) {
+            words.push_back(word);
+        }
+        if (words.empty() || words[0][0] == '#') {
+            continue;
+        }
+        corpus.push_back(std::move(words));
+    }
+    return true;
+}
+
+std::string MimicBench::start(uint64_t client_id, uint32_t tid, const std::string &name,
+                              std::function<void()> on_finish) {
+    if (this->active) {
+        return "benchmark already running";
+    }
+    auto it = this->corpora.find(name);
+    if (it == this->corpora.end()) {
+        return "unknown corpus " + name;
+    }
+    std::vector<std::vector<std::string>> corpus;
+    if (!read_corpus(it->second, corpus)) {
+        return "could not read corpus " + name;
+    }
+    if (corpus.empty()) {
+        return "corpus is empty";
+    }
+    this->client_id = client_id;
+    this->tid = tid;
+    this->on_finish = on_finish;
+    this->corpus = std::move(corpus);
+    this->next = 0;
+    this->samples.clear();
+    this->samples.reserve(this->corpus.size());
+    this->start_time = dr_monotonic_time();
+    this->active = true;
+    this->submit_next();
+    return "";
+}
+
+void MimicBench::cancel(uint64_t client_id) {
+    if (this->active && this->client_id == client_id) {
+        // Nobody is left to report to - let the mimic in flight finish and
+        // drop the rest.
+        this->corpus.resize(this->next);
+        this->tid = 0;
+    }
+}
+
+void MimicBench::submit_next() {
+    while (this->next < this->corpus.size()) {
+        std::vector<std::string> &words = this->corpus[this->next++];
+        std::vector<uint8_t> phrase;
+        for (auto &word : words) {
+            phrase.insert(phrase.end(), word.begin(), word.end());
+            phrase.push_back(0);
+        }
+        this->lock.lock();
+        this->current = {words.size(), "", dr_monotonic_time(), 0, 0, 0, 0, false, false};
+        this->ends = 0;
+        this->publishes = 0;
+        this->mimic_finished = false;
+        this->lock.unlock();
+
+        MimicRequest request = {0, 0, 0, 0, NULL, 0, true};
+        std::string errmsg = draconity->submit_mimic(request, phrase, words.size());
+        if (errmsg.size() == 0) {
+            return;
+        }
+        this->current.failed = true;
+        this->samples.push_back(this->current);
+    }
+    this->finish();
+}
+
+void MimicBench::phrase_begin() {
+    if (!this->active) return;
+    int64_t now = dr_monotonic_time();
+    this->lock.lock();
+    if (this->current.begin == 0) {
+        this->current.begin = now;
+    }
+    this->lock.unlock();
+}
+
+void MimicBench::phrase_end() {
+    if (!this->active) return;
+    int64_t now = dr_monotonic_time();
+    this->lock.lock();
+    if (this->current.end == 0) {
+        this->current.end = now;
+    }
+    this->ends++;
+    this->lock.unlock();
+}
+
+/* Called once a p.end's write to the client's socket has completed, or the
+   p.end was dropped, so `write` is when it actually reached the socket. */
+void MimicBench::published(const std::string &grammar, bool ours, std::vector<std::string> words) {
+    if (!this->active) return;
+    int64_t now = dr_monotonic_time();
+    this->lock.lock();
+    if (ours) {
+        this->current.grammar = grammar;
+        this->current.write = now;
+        this->current.matched = (this->next > 0 && words == this->corpus[this->next - 1]);
+    }
+    this->publishes++;
+    this->lock.unlock();
+    this->try_advance();
+}
+
+void MimicBench::mimic_done() {
+    this->lock.lock();
+    this->current.done = dr_monotonic_time();
+    this->mimic_finished = true;
+    this->lock.unlock();
+    this->try_advance();
+}
+
+void MimicBench::try_advance() {
+    this->lock.lock();
+    bool complete = this->mimic_finished && this->publishes >= this->ends;
+    if (complete) {
+        this->samples.push_back(this->current);
+        this->mimic_finished = false;
+    }
+    this->lock.unlock();
+    if (complete) {
+        this->submit_next();
+    }
+}
+
+void MimicBench::finish() {
+    this->active = false;
+    this->end_time = dr_monotonic_time();
+    if (this->on_finish) {
+        auto on_finish = std::move(this->on_finish);
+        this->on_finish = nullptr;
+        on_finish();
+        return;
+    }
+    bson_t *report = this->report();
+    if (this->report_path.size() > 0) {
+        size_t length = 0;
+        char *json = bson_as_json(report, &length);
+        std::ofstream file(this->report_path);
+        file.write(json, length);
+        file << "\n";
+        bson_free(json);
+        if (!file) {
+            draconity_log(LEVEL_ERROR, "bench", "could not write benchmark report to %s", this->report_path.c_str());
+        }
+    }
+    if (this->tid != 0) {
+        BSON_APPEND_BOOL(report, "done", true);
+        draconity_send("bench.mimic", report, this->tid, this->client_id);
+    } else {
+        bson_destroy(report);
+    }
+    this->corpus.clear();
+}
+
+/* Latency from submission to each stage, for one group of samples. */
+struct BenchGroup {
+    std::vector<int64_t> begin, end, write;
+    size_t count = 0;
+    size_t failed = 0;
+    size_t matched = 0;
+
+    void add(const BenchSample &sample) {
+        this->count++;
+        if (sample.failed) {
+            this->failed++;
+            return;
+        }
+        if (sample.matched) this->matched++;
+        if (sample.begin) this->begin.push_back(sample.begin - sample.submit);
+        if (sample.end) this->end.push_back(sample.end - sample.submit);
+        if (sample.write) this->write.push_back(sample.write - sample.submit);
+    }
+};
+
+static int64_t percentile(std::vector<int64_t> &values, int percent) {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[(values.size() - 1) * percent / 100];
+}
+
+BenchSummary MimicBench::summary() {
+    BenchGroup all;
+    for (auto &sample : this->samples) {
+        all.add(sample);
+    }
+    double seconds = (this->end_time - this->start_time) / 1e9;
+    return {all.count, all.failed, all.matched, seconds > 0 ? all.count / seconds : 0,
+            percentile(all.end, 50), percentile(all.end, 90),
+            percentile(all.write, 50), percentile(all.write, 90)};
+}
+
+static void append_percentiles(bson_t *doc, const char *name, std::vector<int64_t> &values) {
+    bson_t child;
+    BSON_APPEND_DOCUMENT_BEGIN(doc, name, &child);
+    BSON_APPEND_INT64(&child, "count", values.size());
+    if (!values.empty()) {
+        std::sort(values.begin(), values.end());
+        size_t last = values.size() - 1;
+        BSON_APPEND_INT64(&child, "p50", values[last * 50 / 100]);
+        BSON_APPEND_INT64(&child, "p90", values[last * 90 / 100]);
+        BSON_APPEND_INT64(&child, "p99", values[last * 99 / 100]);
+        BSON_APPEND_INT64(&child, "max", values[last]);
+    }
+    bson_append_document_end(doc, &child);
+}
+
+static void append_group(bson_t *doc, const char *name, BenchGroup &group) {
+    bson_t child;
+    BSON_APPEND_DOCUMENT_BEGIN(doc, name, &child);
+    BSON_APPEND_INT64(&child, "count", group.count);
+    BSON_APPEND_INT64(&child, "failed", group.failed);
+    BSON_APPEND_INT64(&child, "matched", group.matched);
+    append_percentiles(&child, "begin", group.begin);
+    append_percentiles(&child, "end", group.end);
+    append_percentiles(&child, "write", group.write);
+    bson_append_document_end(doc, &child);
+}
+
+/* Latencies are in ns from the mimic being submitted. */
+bson_t *MimicBench::report() {
+    int64_t duration = this->end_time - this->start_time;
+    BenchGroup all;
+    std::map<std::string, BenchGroup> grammars;
+    std::map<size_t, BenchGroup> lengths;
+    for (auto &sample : this->samples) {
+        all.add(sample);
+        grammars[sample.grammar.size() ? sample.grammar : "(none)"].add(sample);
+        lengths[sample.words].add(sample);
+    }
+
+    bson_t *doc = BCON_NEW("success", BCON_BOOL(true),
+                           "count", BCON_INT64(all.count),
+                           "failed", BCON_INT64(all.failed),
+                           "duration", BCON_INT64(duration));
+    double seconds = duration / 1e9;
+    BSON_APPEND_DOUBLE(doc, "throughput", seconds > 0 ? all.count / seconds : 0);
+    append_group(doc, "all", all);
+
+    bson_t child;
+    BSON_APPEND_DOCUMENT_BEGIN(doc, "grammars", &child);
+    for (auto &pair : grammars) {
+        append_group(&child, pair.first.c_str(), pair.second);
+    }
+    bson_append_document_end(doc, &child);
+
+    BSON_APPEND_DOCUMENT_BEGIN(doc, "lengths", &child);
+    for (auto &pair : lengths) {
+        append_group(&child, std::to_string(pair.first).c_str(), pair.second);
+    }
+    bson_append_document_end(doc, &child);
+    return doc;
+}
@@ -0,0 +1,101 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <bson.h>
+#include "cpptoml.h"
+
+/* Timestamps for one corpus phrase, all on the dr_monotonic_time() clock.
+   Any stage that never happened is left at 0. */
+struct BenchSample {
+    size_t words;
+    std::string grammar;  // Grammar that recognised the phrase, if any
+    int64_t submit;       // Handed to _DSXEngine_Mimic
+    int64_t begin;        // First phrase_begin
+    int64_t end;          // First phrase_end
+    int64_t write;        // Our p.end written to the client's socket
+    int64_t done;         // Mimic done callback
+    bool failed;
+    bool matched;         // Recognised as exactly the corpus phrase
+};
+
+/* The headline numbers from a finished run. Latencies are ns from submission. */
+struct BenchSummary {
+    size_t count;
+    size_t failed;
+    size_t matched;
+    double throughput;  // Phrases per second
+    int64_t end_p50;
+    int64_t end_p90;
+    int64_t write_p50;
+    int64_t write_p90;
+};
+
+/* Replays a corpus of phrases through _DSXEngine_Mimic against whatever
+   grammars are loaded, and reports recognition latency.
+
+   Phrases are mimicked one at a time so each sample only sees its own
+   callbacks. `phrase_begin` and `phrase_end` are called from Dragon's threads;
+   everything else must run on the Uv thread.
+
+   Clients pick a corpus by name; the files themselves, and where reports are
+   written, only come from draconity.toml.
+
+ */
+class MimicBench {
+public:
+    MimicBench();
+    void configure(std::shared_ptr<cpptoml::table> config);
+
+    // Returns an error message, or "" once the run has started. When the run
+    // finishes the report is sent to the client on `tid`, or if `on_finish` is
+    // set, that's called instead and can read `summary`.
+    std::string start(uint64_t client_id, uint32_t tid, const std::string &corpus,
+                      std::function<void()> on_finish = nullptr);
+    BenchSummary summary();
+    void cancel(uint64_t client_id);
+    bool running() { return this->active.load(); }
+
+    void phrase_begin();
+    void phrase_end();
+    // Must be run on the Uv thread.
+    void published(const std::string &grammar, bool ours, std::vector<std::string> words);
+    void mimic_done();
+private:
+    MimicBench(const MimicBench &);
+    MimicBench& operator=(const MimicBench &);
+
+    void submit_next();
+    void try_advance();
+    void finish();
+    bson_t *report();
+
+    // Corpus name -> file, and where to also write reports ("" = don't).
+    std::map<std::string, std::string> corpora;
+    std::string report_path;
+
+    std::atomic<bool> active;
+    uint64_t client_id;
+    uint32_t tid;
+    std::function<void()> on_finish;
+    int64_t start_time;
+    int64_t end_time;
+
+    std::vector<std::vector<std::string>> corpus;
+    size_t next;
+    std::vector<BenchSample> samples;
+
+    // Locks the current sample's begin/end and `ends`, which Dragon's threads
+    // write.
+    std::mutex lock;
+    BenchSample current;
+    // phrase_end callbacks and matching publishes for the current phrase. Dragon
+    // ends the phrase once per grammar, so the sample is complete once every end
+    // has been published and the mimic is done.
+    int ends;
+    int publishes;
+    bool mimic_finished;
+};
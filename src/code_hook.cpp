@@ -1,5 +1,7 @@
 #include <Zydis/Zydis.h>
+#include <algorithm>
 #include <string>
+#include <vector>
 
 #include "abstract_platform.h"
 #include "code_hook.h"
@@ -38,26 +40,118 @@ static void dis_mem(uint8_t *addr, size_t size) {
     }
 }
 
-int CodeHook::setup(void *addr) {
-    this->addr = addr;
+/* Trampolines are a few dozen bytes each, so they're packed into shared pages
+   rather than getting a page apiece. The current chunk stays writable until
+   seal(), after which it's never made writable again - another thread could be
+   running one of its trampolines - so a later transaction starts a new one. */
+class TrampolineArena {
+public:
+    uint8_t *alloc(size_t size) {
+        size = (size + 15) & ~15;
+        if (!this->writable || this->used + size > this->chunk_size) {
+            this->seal();
+            size_t page_mask = Platform::pageSize() - 1;
+            this->chunk_size = (size + page_mask) & ~page_mask;
+            this->chunk = (uint8_t *)Platform::mmap(this->chunk_size);
+            if (!this->chunk) return NULL;
+            this->used = 0;
+            this->writable = true;
+        }
+        uint8_t *ptr = this->chunk + this->used;
+        this->used += size;
+        return ptr;
+    }
 
-    size_t page_mask = Platform::pageSize() - 1;
+    void seal() {
+        if (this->chunk && this->writable) {
+            Platform::protectRX(this->chunk, this->chunk_size);
+            this->writable = false;
+        }
+    }
+private:
+    uint8_t *chunk = NULL;
+    size_t chunk_size = 0;
+    size_t used = 0;
+    bool writable = false;
+};
+
+static TrampolineArena arena;
+
+int CodeHook::prepare(void *addr) {
+    this->addr = addr;
 
     int paddedSize = dis_code_size((uint8_t*)addr, jmpSize());
-    size_t trampolineSize = (paddedSize + jmpSize() + page_mask) & ~page_mask;
-    uint8_t *trampoline = (uint8_t *)Platform::mmap(trampolineSize);
+    uint8_t *trampoline = arena.alloc(paddedSize + jmpSize());
+    if (!trampoline) {
+        return 1;
+    }
 
     memcpy(reinterpret_cast<void *>(trampoline), reinterpret_cast<void *>(addr), paddedSize);
     jmpPatch(trampoline + paddedSize, (uint8_t*)addr + paddedSize);
-    Platform::protectRX(trampoline, trampolineSize);
 
     jmpPatch(patchData, reinterpret_cast<uint8_t*>(target));
     memcpy(origData, addr, jmpSize());
-    apply();
-
     *(this->original) = trampoline;
+    return 0;
+}
+
+// The target must already be writable.
+void CodeHook::commit() {
+    memcpy(this->addr, this->patchData, this->jmpSize());
     this->active = true;
-    printf("[+] hooked %s (%p -> %p), orig at %p\n", this->name.c_str(), addr, target, trampoline);
+    printf("[+] hooked %s (%p -> %p), orig at %p\n", this->name.c_str(), this->addr, this->target, *this->original);
+}
+
+int CodeHook::setup(void *addr) {
+    HookTransaction transaction;
+    transaction.add(this, addr);
+    return transaction.commit();
+}
+
+void HookTransaction::add(CodeHook *hook, void *addr) {
+    if (hook->prepare(addr) == 0) {
+        this->hooks.push_back(hook);
+    } else {
+        printf("[!] no trampoline space for %s\n", hook->name.c_str());
+    }
+}
+
+int HookTransaction::commit() {
+    // Trampolines have to be executable before any target jumps into them.
+    arena.seal();
+    if (this->hooks.empty()) {
+        return 0;
+    }
+
+    // Every page a patch touches, merged into contiguous runs.
+    uintptr_t page_mask = Platform::pageSize() - 1;
+    std::vector<std::pair<uintptr_t, uintptr_t>> runs;
+    for (auto hook : this->hooks) {
+        uintptr_t start = (uintptr_t)hook->addr & ~page_mask;
+        uintptr_t end = ((uintptr_t)hook->addr + hook->jmpSize() + page_mask) & ~page_mask;
+        runs.push_back({start, end});
+    }
+    std::sort(runs.begin(), runs.end());
+    size_t merged = 0;
+    for (size_t i = 1; i < runs.size(); i++) {
+        if (runs[i].first <= runs[merged].second) {
+            runs[merged].second = std::max(runs[merged].second, runs[i].second);
+        } else {
+            runs[++merged] = runs[i];
+        }
+    }
+    runs.resize(merged + 1);
+
+    for (auto &run : runs) {
+        Platform::protectRW((void *)run.first, run.second - run.first);
+    }
+    for (auto hook : this->hooks) {
+        hook->commit();
+    }
+    for (auto &run : runs) {
+        Platform::protectRX((void *)run.first, run.second - run.first);
+    }
+    this->hooks.clear();
     return 0;
 }
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 class CodeHook {
 public:
@@ -24,9 +25,21 @@ public:
         free(origData);
         free(patchData);
     }
+    // Hooks addr straight away; use a HookTransaction to install several.
     int setup(void *addr);
+    // Hooks a function that is only ever called through `slot`, by pointing
+    // the slot at our target instead of patching any code.
+    void redirect(void **slot) {
+        *this->original = *slot;
+        *slot = this->target;
+        this->active = true;
+    }
 private:
+    friend class HookTransaction;
     CodeHook& operator=(const CodeHook &obj);
+    // Builds the trampoline and patch without touching the target.
+    int prepare(void *addr);
+    void commit();
     bool apply() {
         return this->write(this->addr, this->patchData, this->jmpSize());
     }
@@ -48,6 +61,17 @@ private:
     uint8_t *patchData, *origData;
 };
 
+/* Installs a set of hooks together. Trampolines are packed into shared pages
+   from an arena, and each target page is made writable once for every patch on
+   it rather than once per hook. */
+class HookTransaction {
+public:
+    void add(CodeHook *hook, void *addr);
+    int commit();
+private:
+    std::vector<CodeHook *> hooks;
+};
+
 template <typename F>
 CodeHook makeCodeHook(std::string name, F target, F *original) {
     return CodeHook(name, reinterpret_cast<void *>(target), reinterpret_cast<void **>(original));
@@ -1,13 +1,18 @@
+#include <random>
 #include <sstream>
 #include <string>
+#include <signal.h>
 #include <stdio.h>
 #include <bson.h>
 #include <uvw.hpp>
 
 #include "draconity.h"
 #include "abstract_platform.h"
+#include "dr_time.h"
+#include "log.h"
 #include "phrase.h"
 #include "server.h"
+#include "trace.h"
 #include "transport/server.h"
 
 
@@ -28,24 +33,33 @@ Draconity::Draconity() {
     ready = false;
     dragon_enabled = false;
     engine = NULL;
+    profile_switch.pending = false;
+    mimic_token = 0;
+    mimics_in_flight = 0;
+    pause_token = 0;
     pause_timeout = 10000;
+    pause_timeout_min = 100;
+    pause_start = 0;
+    memset(pause_histogram, 0, sizeof(pause_histogram));
+    idle_sync_delay = 0;
+    idle_sync_scheduled = false;
+    resume_grace = 0;
+    resume_deactivate = false;
+    in_phrase = false;
+    last_phrase_end = 0;
     engine_name = "dragon";
 
 #ifdef _WIN32
     auto config_path = Platform::expanduser("~/talon/draconity.toml");
+    std::string trace_path = "~/talon/draconity.trace.json";
 #else
     auto config_path = Platform::expanduser("~/.talon/draconity.toml");
+    std::string trace_path = "~/.talon/draconity.trace.json";
 #endif
+    bool trace_enabled = true, trace_crash = false;
     config = cpptoml::parse_file(config_path);
+    log_init(config);
     if (config) {
-        auto logfile = *config->get_as<std::string>("logfile");
-        if (logfile != "") {
-            logfile = Platform::expanduser(logfile);
-            freopen(logfile.c_str(), "a", stdout);
-            freopen(logfile.c_str(), "a", stderr);
-            setvbuf(stdout, NULL, _IONBF, 0);
-            setvbuf(stderr, NULL, _IONBF, 0);
-        }
         // dump the config, commented out by default because it contains the secret
         if (false) {
             std::cout << "================================" << std::endl;
@@ -56,92 +70,191 @@ Draconity::Draconity() {
         this->timeout            = config->get_as<int>     ("timeout"           ).value_or(80);
         this->timeout_incomplete = config->get_as<int>     ("timeout_incomplete").value_or(500);
         this->prevent_wake       = config->get_as<bool>    ("prevent_wake"      ).value_or(false);
+        this->idle_sync_delay    = config->get_as<int>     ("idle_sync_delay"   ).value_or(0);
+        this->pause_timeout      = config->get_as<int>     ("pause_timeout"     ).value_or(10000);
+        this->pause_timeout_min  = config->get_as<int>     ("pause_timeout_min" ).value_or(100);
+        this->resume_grace       = config->get_as<int>     ("resume_grace"      ).value_or(0);
+        this->resume_deactivate  = config->get_as<bool>    ("resume_deactivate" ).value_or(false);
+        this->results.configure(config->get_as<int>("result_retention"      ).value_or(32),
+                                config->get_as<int>("result_retention_bytes").value_or(32 * 1024 * 1024));
+        auto quota = config->get_table("quota");
+        if (quota) {
+            this->quota.grammars     = quota->get_as<int64_t>("grammars"    ).value_or(0);
+            this->quota.blob_bytes   = quota->get_as<int64_t>("blob_bytes"  ).value_or(0);
+            this->quota.list_entries = quota->get_as<int64_t>("list_entries").value_or(0);
+            this->quota.active_rules = quota->get_as<int64_t>("active_rules").value_or(0);
+            this->quota.words        = quota->get_as<int64_t>("words"       ).value_or(0);
+            this->quota.queued_bytes = quota->get_as<int64_t>("queued_bytes").value_or(0);
+        }
+        trace_enabled = config->get_as<bool>("trace").value_or(true);
+        trace_path = config->get_as<std::string>("trace_path").value_or(trace_path);
+        trace_crash = config->get_as<bool>("trace_crash").value_or(false);
+    }
+    this->params.configure(config, this->timeout, this->timeout_incomplete);
+    this->api_profiler.configure(config);
+    this->bench.configure(config);
+    trace_init(trace_enabled, trace_path != "" ? Platform::expanduser(trace_path) : "");
+    if (trace_crash) {
+        trace_install_hooks();
     }
-    printf("[+] draconity: loaded config from %s\n", config_path.c_str());
+    draconity_log(LEVEL_INFO, "config", "loaded config from %s", config_path.c_str());
 }
 
-// Must be called from the Uv thread
-void Draconity::init_pause_timer() {
+/* Create the Uv handles Draconity owns. Must be called from the Uv thread. */
+void Draconity::init_handles() {
     this->pause_timer = server->loop->resource<uvw::TimerHandle>();
     this->pause_timer->on<uvw::TimerEvent>([this](const auto &, auto &handle) {
-        this->do_unpause();
+        this->expire_pause_clients();
+    });
+    this->idle_sync_timer = server->loop->resource<uvw::TimerHandle>();
+    this->idle_sync_timer->on<uvw::TimerEvent>([this](const auto &, auto &handle) {
+        this->idle_sync_scheduled = false;
+        this->try_idle_sync();
+    });
+    this->session_timer = server->loop->resource<uvw::TimerHandle>();
+    this->session_timer->on<uvw::TimerEvent>([this](const auto &, auto &handle) {
+        this->expire_sessions();
+    });
+    this->hypotheses.init_timer(server->loop);
+    this->phrase_queue.init(phrase_record_publish);
+#ifndef _WIN32
+    this->trace_signal = server->loop->resource<uvw::SignalHandle>();
+    this->trace_signal->on<uvw::SignalEvent>([](const auto &, auto &handle) {
+        int64_t count = trace_dump();
+        draconity_log(LEVEL_INFO, "trace", "dumped %lld trace events", (long long)count);
+    });
+    this->trace_signal->start(SIGUSR2);
+#endif
+
+    // Sampled when the metrics are read, which is always on the Uv thread.
+    this->metrics.gauge("draconity_clients", "Connected clients", [] {
+        return (int64_t)server->clients.size();
+    });
+    this->metrics.gauge("draconity_grammars", "Grammars loaded into Dragon", [this] {
+        return (int64_t)this->grammars.size();
+    });
+    this->metrics.gauge("draconity_suspended_sessions", "Disconnected clients whose state is kept for them to resume", [this] {
+        return (int64_t)this->suspended_sessions.size();
+    });
+    this->metrics.gauge("draconity_phrase_queue_depth", "p.end records waiting for the Uv thread", [this] {
+        return (int64_t)this->phrase_queue.depth();
+    });
+    this->metrics.gauge("draconity_mimics_in_flight", "Mimics submitted to Dragon and not yet done", [this] {
+        return (int64_t)this->mimics_in_flight.load();
+    });
+    this->metrics.gauge("draconity_retained_results", "Recognition results kept for r.* queries", [this] {
+        return (int64_t)this->results.count();
+    });
+    this->metrics.gauge("draconity_retained_result_bytes", "Audio bytes held by retained results", [this] {
+        return (int64_t)this->results.bytes();
     });
 }
 
+/* Turns Dragon's own rules on or off as one batch.
+
+   Only the rules whose state differs are touched, and the Dragon calls are
+   made without dragon_lock so Dragon's threads can keep going through our
+   hooks meanwhile. Since dragon_enabled flips before the batch, a rule
+   activated mid-batch is handled by its hook; one deactivated mid-batch that
+   we've just activated is deactivated again afterwards.
+
+ */
 std::string Draconity::set_dragon_enabled(bool enabled) {
+    TraceScope trace("set_dragon_enabled", enabled);
     std::stringstream errstream;
     std::string errmsg;
+    std::vector<ForeignRule> batch;
     this->dragon_lock.lock();
-    if (enabled != this->dragon_enabled) {
-        for (ForeignRule *fg : this->dragon_rules) {
-            int rc;
-            if (enabled) {
-                if ((rc = fg->activate())) {
-                    errstream << "error activating grammar: " << rc;
-                    errmsg = errstream.str();
-                    break;
-                }
-            } else {
-                if ((rc = fg->deactivate())) {
-                    errstream << "error deactivating grammar: " << rc;
-                    errmsg = errstream.str();
-                    break;
-                }
-            }
+    if (enabled == this->dragon_enabled) {
+        this->dragon_lock.unlock();
+        return "";
+    }
+    this->dragon_enabled = enabled;
+    for (auto &pair : this->dragon_rules) {
+        if (pair.second.applied != enabled) {
+            batch.push_back(pair.second);
         }
-        this->dragon_enabled = enabled;
     }
     this->dragon_lock.unlock();
-    return "";
-}
 
-std::shared_ptr<Grammar> Draconity::get_grammar(uintptr_t key) {
-    for (auto &grammar_pair : this->grammars) {
-        // Grammar keys correspond to the grammar's position in memory,
-        // underneath the shared_ptr.
-        if (key == (uintptr_t)grammar_pair.second.get()) {
-            return grammar_pair.second;
+    std::vector<bool> done(batch.size());
+    for (size_t i = 0; i < batch.size(); i++) {
+        int rc = enabled ? batch[i].activate() : batch[i].deactivate();
+        done[i] = (rc == 0);
+        if (rc && errmsg.size() == 0) {
+            errstream << "error " << (enabled ? "activating" : "deactivating") << " grammar: " << rc;
+            errmsg = errstream.str();
         }
     }
-    // Grammar couldn't be found.
-    return NULL;
+
+    std::vector<ForeignRule> stale;
+    this->dragon_lock.lock();
+    for (size_t i = 0; i < batch.size(); i++) {
+        if (!done[i]) continue;
+        auto it = this->dragon_rules.find(batch[i].key());
+        if (it != this->dragon_rules.end()) {
+            it->second.applied = enabled;
+        } else if (enabled) {
+            stale.push_back(batch[i]);
+        }
+    }
+    this->dragon_lock.unlock();
+    for (auto &rule : stale) {
+        rule.deactivate();
+    }
+    if (errmsg.size() > 0) {
+        draconity_log(LEVEL_WARN, "dragon", "%s", errmsg.c_str());
+    }
+    return errmsg;
+}
+
+std::shared_ptr<Grammar> Draconity::get_grammar(uintptr_t key) {
+    // Returns NULL if the grammar has since been unloaded.
+    return this->grammar_registry.lookup(key);
 }
 
 int unload_grammar(std::shared_ptr<Grammar> &grammar) {
+    TraceScope trace("unload_grammar");
     int rc;
     // Unregister callbacks before unloading.
     if ((rc =_DSXGrammar_Unregister(grammar->handle, grammar->endkey))) {
-        printf("[!] error unregistering grammar: %d\n", rc);
+        draconity_log(LEVEL_ERROR, "grammar", "error unregistering grammar: %d", rc);
         return rc;
     } else if ((rc = _DSXGrammar_Unregister(grammar->handle, grammar->hypokey))) {
-        printf("[!] error removing hypothesis cb: %d\n", rc);
+        draconity_log(LEVEL_ERROR, "grammar", "error removing hypothesis cb: %d", rc);
         return rc;
     } else if ((rc = _DSXGrammar_Unregister(grammar->handle, grammar->beginkey))) {
-        printf("[!] error removing begin cb: %d\n", rc);
+        draconity_log(LEVEL_ERROR, "grammar", "error removing begin cb: %d", rc);
         return rc;
     } else if ((rc = _DSXGrammar_Destroy(grammar->handle))) {
-        printf("[!] error destroying grammar: %d\n", rc);
+        draconity_log(LEVEL_ERROR, "grammar", "error destroying grammar: %d", rc);
         return rc;
     }
     grammar->state.active_rules.clear();
     grammar->state.lists.clear();
-    grammar->state.blob = {};
+    grammar->state.blob = SharedBlob();
     grammar->state.unload = true;
     grammar->enabled = false;
     return 0;
 
 }
 
-int load_grammar(std::shared_ptr<Grammar> &grammar, std::vector<uint8_t> &blob) {
+int load_grammar(std::shared_ptr<Grammar> &grammar, const SharedBlob &blob) {
     int rc;
-    void *grammar_key = (void *)grammar.get();
-    dsx_dataptr blob_dp = {.data = blob.data(),
+    if (!grammar->key) {
+        grammar->record_error("grammar", "too many grammars loaded", -1, grammar->name);
+        return -1;
+    }
+    void *grammar_key = (void *)grammar->key;
+    // Dragon doesn't write to the blob, it's only non-const in the signature.
+    dsx_dataptr blob_dp = {.data = (void *)blob.data(),
                            .size = (uint32_t)blob.size()};
+    TraceScope trace("load_grammar", blob.size());
     if ((rc = _DSXEngine_LoadGrammar(_engine, 1 /* cfg */, &blob_dp, &grammar->handle))) {
         grammar->record_error("grammar", "error loading grammar", rc, grammar->name);
         return rc;
     }
-    grammar->state.blob = std::move(blob);
+    grammar->state.blob = blob;
 
     // Now register callbacks
     if ((rc = _DSXGrammar_RegisterEndPhraseCallback(grammar->handle, phrase_end, grammar_key, &grammar->endkey))) {
@@ -160,83 +273,125 @@ int load_grammar(std::shared_ptr<Grammar> &grammar, std::vector<uint8_t> &blob)
     return 0;
 }
 
-void activate_rule(std::shared_ptr<Grammar> &grammar, std::string &rule) {
-    int rc = _DSXGrammar_Activate(grammar->handle, 0, false, rule.c_str());
+void activate_rule(std::shared_ptr<Grammar> &grammar, StrId rule) {
+    TraceScope trace("activate_rule");
+    const std::string &name = interned_str(rule);
+    int rc = _DSXGrammar_Activate(grammar->handle, 0, false, name.c_str());
     if (rc) {
-        grammar->record_error("rule", "error activating rule", rc, rule);
+        grammar->record_error("rule", "error activating rule", rc, name);
         return;
     }
     grammar->state.active_rules.insert(rule);
 }
 
-void deactivate_rule(std::shared_ptr<Grammar> &grammar, std::string &rule) {
-    int rc = _DSXGrammar_Deactivate(grammar->handle, 0, rule.c_str());
+void deactivate_rule(std::shared_ptr<Grammar> &grammar, StrId rule) {
+    TraceScope trace("deactivate_rule");
+    const std::string &name = interned_str(rule);
+    int rc = _DSXGrammar_Deactivate(grammar->handle, 0, name.c_str());
     if (rc) {
-        grammar->record_error("rule", "error deactivating rule", rc, rule);
+        grammar->record_error("rule", "error deactivating rule", rc, name);
         return;
     }
     grammar->state.active_rules.erase(rule);
 }
 
-void sync_rules(std::shared_ptr<Grammar> &grammar, GrammarState &shadow_state) {
-    std::set<std::string> rules_to_enable = {};
-    std::set<std::string> rules_to_disable = {};
+void sync_rules(std::shared_ptr<Grammar> &grammar, const InternedSet &shadow_rules) {
+    std::vector<StrId> rules_to_enable;
+    std::vector<StrId> rules_to_disable;
 
-    std::set<std::string> &shadow_rules = shadow_state.active_rules;
-    std::set<std::string> &live_rules = grammar->state.active_rules;
-    // Get rules to enable
+    // Both sides are sorted id arrays, so this is a merge over integers.
+    const InternedSet &live_rules = grammar->state.active_rules;
     std::set_difference(shadow_rules.begin(), shadow_rules.end(),
                         live_rules.begin(), live_rules.end(),
-                        std::inserter(rules_to_enable, rules_to_enable.end()));
-    // Get rules to disable
+                        std::back_inserter(rules_to_enable));
     std::set_difference(live_rules.begin(), live_rules.end(),
                         shadow_rules.begin(), shadow_rules.end(),
-                        std::inserter(rules_to_disable, rules_to_disable.end()));
+                        std::back_inserter(rules_to_disable));
 
-    for (auto rule : rules_to_enable) {
+    for (StrId rule : rules_to_enable) {
         activate_rule(grammar, rule);
     }
-    for (auto rule : rules_to_disable) {
+    for (StrId rule : rules_to_disable) {
         deactivate_rule(grammar, rule);
     }
 }
 
-void set_list(std::shared_ptr<Grammar> &grammar, const std::string &name, std::set<std::string> &list) {
-    // List has to be passed as a dsx_dataptr - we need to construct one.
+/* Packs a list into the dsx_id array Dragon takes. The caller frees `data`. */
+dsx_dataptr list_dataptr(const InternedSet &list) {
     dsx_dataptr dataptr = {.data = NULL, .size = 0};
 
     // Establish the dataptr's size first.
-    for (auto &word : list) {
-        int length = strlen(word.c_str());
-        dataptr.size += sizeof(dsx_id) + align4(length);
+    for (StrId id : list) {
+        dataptr.size += sizeof(dsx_id) + align4(interned_str(id).size());
     }
 
     // Now we have the size, allocate memory and populate it.
     dataptr.data = calloc(1, dataptr.size);
     uint8_t *pos = (uint8_t *)dataptr.data;
-    for (auto word : list) {
+    for (StrId id : list) {
         dsx_id *ent = (dsx_id *)pos;
-        const char *word_cstr = word.c_str();
-        uint32_t length = strlen(word_cstr);
-        ent->size = sizeof(dsx_id) + align4(length);
-        memcpy(ent->name, word_cstr, length);
+        const std::string &word = interned_str(id);
+        ent->size = sizeof(dsx_id) + align4(word.size());
+        memcpy(ent->name, word.data(), word.size());
         pos += ent->size;
     }
+    return dataptr;
+}
+
+void set_list(std::shared_ptr<Grammar> &grammar, const std::string &name, const InternedSet &list) {
+    // List has to be passed as a dsx_dataptr - we need to construct one.
+    dsx_dataptr dataptr = list_dataptr(list);
 
     // Now we can pass the list to Dragon.
+    TraceScope trace("set_list", list.size());
     int rc = _DSXGrammar_SetList(grammar->handle, name.c_str(), &dataptr);
+    // Dragon copies the list.
+    free(dataptr.data);
     if (rc) {
         grammar->record_error("list", "error setting list", rc, name);
         return;
     }
     // Only set our grammar's list when Dragon's list was set successfully.
-    grammar->state.lists[name] = std::move(list);
+    grammar->state.lists[name] = list;
 }
 
-void sync_grammar(std::shared_ptr<Grammar> &grammar, GrammarState &shadow_state) {
+static bool has_rule_named(const InternedSet &rules, const std::string &name) {
+    for (StrId rule : rules) {
+        if (interned_str(rule) == name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Move the errors for rules only the profile wants out of grammar->errors and
+   into `profile_errors`. A profile may name rules this grammar's blob doesn't
+   define, which is no fault of the client that set it. */
+static void split_profile_errors(std::shared_ptr<Grammar> &grammar, const InternedSet &client_rules,
+                                 const InternedSet &old_client_rules,
+                                 std::list<std::unordered_map<std::string, std::string>> &profile_errors) {
+    for (auto it = grammar->errors.begin(); it != grammar->errors.end();) {
+        auto &error = *it;
+        if (error["type"] == "rule" && !has_rule_named(client_rules, error["name"]) &&
+                !has_rule_named(old_client_rules, error["name"])) {
+            auto next = std::next(it);
+            profile_errors.splice(profile_errors.end(), grammar->errors, it);
+            it = next;
+        } else {
+            it++;
+        }
+    }
+}
+
+void sync_grammar(std::shared_ptr<Grammar> &grammar, GrammarState &shadow_state,
+                  const InternedSet &profile_rules, bool active,
+                  std::list<std::unordered_map<std::string, std::string>> &profile_errors) {
     // This is where we'll accumulate errors to send to the client if things go
     // wrong - start with clean slate.
     grammar->errors.clear();
+    // The grammar is charged to whichever client set it last.
+    grammar->state.client_id = shadow_state.client_id;
+    grammar->state.tid = shadow_state.tid;
 
     if (grammar->state.blob != shadow_state.blob) {
         if (grammar->enabled) {
@@ -249,8 +404,19 @@ void sync_grammar(std::shared_ptr<Grammar> &grammar, GrammarState &shadow_state)
         }
     }
 
-    if (grammar->state.active_rules != shadow_state.active_rules) {
-        sync_rules(grammar, shadow_state);
+    // The active profile's rules for this grammar are layered on top of the
+    // rules requested by the client. A deactivated grammar keeps its rules
+    // for later, but has none active.
+    InternedSet old_base_rules = std::move(grammar->base_rules);
+    grammar->base_rules = shadow_state.active_rules;
+    InternedSet active_rules;
+    if (active) {
+        active_rules = shadow_state.active_rules;
+        active_rules.merge(profile_rules);
+    }
+    if (grammar->state.active_rules != active_rules) {
+        sync_rules(grammar, active_rules);
+        split_profile_errors(grammar, shadow_state.active_rules, old_base_rules, profile_errors);
     }
     for (auto &list_pair : shadow_state.lists) {
         auto it = grammar->state.lists.find(list_pair.first);
@@ -259,8 +425,6 @@ void sync_grammar(std::shared_ptr<Grammar> &grammar, GrammarState &shadow_state)
         }
     }
     // TODO: Sync exclusivity
-    grammar->state.client_id = shadow_state.client_id;
-    grammar->state.tid = shadow_state.tid;
 }
 
 /* Append a list of grammar loading errors to a bson response */
@@ -330,11 +494,24 @@ void Draconity::clear_client_state(uint64_t client_id) {
     this->shadow_lock.unlock();
 }
 
+/* Deleter for live grammars. Their interned strings may only be released on
+   the Uv thread, but a phrase callback on one of Dragon's threads can hold the
+   last reference once the grammar has been removed. */
+static void release_grammar(Grammar *grammar) {
+    if (!server || server->on_loop_thread()) {
+        delete grammar;
+    } else {
+        server->invoke([grammar] { delete grammar; });
+    }
+}
+
 /* Unload & erase a live grammar. */
 void Draconity::remove_grammar(std::string name, std::shared_ptr<Grammar> &grammar) {
     if (grammar->enabled) {
         unload_grammar(grammar);
     }
+    // Callbacks already in flight will see the grammar as gone.
+    this->grammar_registry.remove(grammar->key);
     this->grammars.erase(name);
 }
 
@@ -358,13 +535,27 @@ void Draconity::sync_grammars() {
 
             if (grammar_it == this->grammars.end()) {
                 // We need to have a Grammar object to synchronize on.
-                grammar = std::make_shared<Grammar>(name);
+                grammar = std::shared_ptr<Grammar>(new Grammar(name), release_grammar);
+                grammar->key = this->grammar_registry.add(grammar);
                 this->grammars[name] = grammar;
             } else {
                 grammar = grammar_it->second;
             }
 
-            sync_grammar(grammar, shadow_state);
+            std::list<std::unordered_map<std::string, std::string>> profile_errors;
+            sync_grammar(grammar, shadow_state, this->profile_rules(name),
+                         !this->deactivated(shadow_state.client_id), profile_errors);
+            // The grammar now has the pending profile's rules, if any.
+            this->profile_switch.changed_grammars.erase(name);
+            // Profile rules that failed don't fail the g.set. They go back to
+            // whoever is switching profiles, or to the log.
+            if (this->profile_switch.pending) {
+                this->profile_switch.errors.splice(this->profile_switch.errors.end(), profile_errors);
+            }
+            for (auto &error : profile_errors) {
+                draconity_log(LEVEL_WARN, "profile", "grammar %s: %s %s", name.c_str(),
+                              error["msg"].c_str(), error["name"].c_str());
+            }
 
             if (grammar->errors.empty()) {
                 operation_status = "success";
@@ -383,6 +574,159 @@ void Draconity::sync_grammars() {
     }
     // Only un-synced grammars should be in the shadow state.
     this->shadow_grammars.clear();
+    this->grammar_registry.reclaim();
+}
+
+/* Send the result of a profile.use operation to the client.
+
+   `status` can be one of { "success", "error", "skipped" }.
+
+ */
+void send_profile_response(const uint64_t client_id, const uint32_t tid,
+                           const std::string &profile_name,
+                           std::string status,
+                           std::list<std::unordered_map<std::string, std::string>> &errors) {
+    bson_t *response = BCON_NEW(
+        "name", BCON_UTF8(profile_name.c_str()),
+        "status", BCON_UTF8(status.c_str()),
+        "success", BCON_BOOL(status == "success")
+    );
+    bson_append_errors(response, errors);
+    draconity_send("profile.use", response, tid, client_id);
+}
+
+/* Rules the profile in effect (or about to take effect) adds to a grammar. */
+const InternedSet &Draconity::profile_rules(const std::string &grammar_name) {
+    static const InternedSet no_rules;
+    const ActivationProfile &profile = this->profile_switch.pending ? this->profile_switch.rules
+                                                                    : this->active_profile;
+    auto it = profile.find(grammar_name);
+    if (it == profile.end()) {
+        return no_rules;
+    }
+    return it->second;
+}
+
+/* Apply a pending profile switch.
+
+   Only the grammars the switch actually changes are touched, and `sync_rules`
+   only makes Dragon calls for rules whose state differs.
+
+ */
+void Draconity::sync_profile() {
+    ProfileSwitch &pending = this->profile_switch;
+    if (!pending.pending) {
+        return;
+    }
+    // Starting with any errors g.set syncs hit applying this profile's rules.
+    std::list<std::unordered_map<std::string, std::string>> errors = std::move(pending.errors);
+    for (auto &name : pending.changed_grammars) {
+        auto grammar_it = this->grammars.find(name);
+        if (grammar_it == this->grammars.end() || !grammar_it->second->enabled) {
+            // Grammars that aren't loaded pick up the profile on their next
+            // g.set.
+            continue;
+        }
+        auto &grammar = grammar_it->second;
+        InternedSet active_rules;
+        if (!this->deactivated(grammar->state.client_id)) {
+            active_rules = grammar->base_rules;
+            active_rules.merge(this->profile_rules(name));
+        }
+        sync_rules(grammar, active_rules);
+        // Unlike g.set, a rule that fails to activate doesn't unload the
+        // grammar - the error is just reported back.
+        errors.splice(errors.end(), grammar->errors);
+    }
+    this->active_profile = std::move(pending.rules);
+    this->active_profile_name = pending.name;
+    send_profile_response(pending.client_id, pending.tid, pending.name,
+                          errors.empty() ? "success" : "error", errors);
+    pending = {};
+}
+
+/* Reapply the rules of grammars whose client was suspended or resumed. Only
+   done with resume_deactivate. */
+void Draconity::sync_activation() {
+    for (auto &name : this->activation_changed) {
+        auto grammar_it = this->grammars.find(name);
+        if (grammar_it == this->grammars.end() || !grammar_it->second->enabled) {
+            continue;
+        }
+        auto &grammar = grammar_it->second;
+        InternedSet active_rules;
+        if (!this->deactivated(grammar->state.client_id)) {
+            active_rules = grammar->base_rules;
+            active_rules.merge(this->profile_rules(name));
+        }
+        if (grammar->state.active_rules != active_rules) {
+            sync_rules(grammar, active_rules);
+        }
+        // Nobody is waiting on a reply, so errors can only be logged.
+        if (!grammar->errors.empty()) {
+            draconity_log(LEVEL_WARN, "session", "%zu errors changing the rules of grammar %s",
+                          grammar->errors.size(), name.c_str());
+            grammar->errors.clear();
+        }
+    }
+    this->activation_changed.clear();
+}
+
+void Draconity::set_profile(std::string name, ActivationProfile &profile) {
+    this->shadow_lock.lock();
+    this->profiles[name] = std::move(profile);
+    this->shadow_lock.unlock();
+}
+
+/* Names of grammars whose rules differ between two profiles. */
+static void profile_diff(const ActivationProfile &from, const ActivationProfile &to,
+                         std::set<std::string> &changed) {
+    for (auto &pair : from) {
+        auto to_it = to.find(pair.first);
+        if (to_it == to.end() || to_it->second != pair.second) {
+            changed.insert(pair.first);
+        }
+    }
+    for (auto &pair : to) {
+        if (from.find(pair.first) == from.end()) {
+            changed.insert(pair.first);
+        }
+    }
+}
+
+/* Queue a switch to a named profile. Returns an error message on failure.
+
+   The diff against the current profile is worked out here, so the sync only
+   visits grammars that change.
+
+ */
+std::string Draconity::use_profile(uint64_t client_id, uint32_t tid, std::string name) {
+    this->shadow_lock.lock();
+    auto profile_it = this->profiles.find(name);
+    if (profile_it == this->profiles.end()) {
+        this->shadow_lock.unlock();
+        return "unknown profile";
+    }
+    ProfileSwitch &pending = this->profile_switch;
+    const ActivationProfile &from = pending.pending ? pending.rules : this->active_profile;
+    std::set<std::string> changed;
+    profile_diff(from, profile_it->second, changed);
+    if (pending.pending) {
+        // The earlier switch never reached Dragon, so its changes still need
+        // applying.
+        std::list<std::unordered_map<std::string, std::string>> no_errors = {};
+        send_profile_response(pending.client_id, pending.tid, pending.name, "skipped", no_errors);
+        changed.insert(pending.changed_grammars.begin(), pending.changed_grammars.end());
+    }
+    pending.name = name;
+    pending.rules = profile_it->second;
+    pending.errors.clear();
+    pending.changed_grammars = std::move(changed);
+    pending.client_id = client_id;
+    pending.tid = tid;
+    pending.pending = true;
+    this->shadow_lock.unlock();
+    return "";
 }
 
 /* Add an error to the "w.set" error list. */
@@ -413,6 +757,7 @@ int add_word(std::string word, std::set<std::string> &loaded_words,
             return rc;
         }
     }
+    TraceScope trace("add_word");
     rc = _DSXEngine_AddTemporaryWord(_engine, word_cstr, 1);
     if (rc) {
         errstream << "error adding word. Return code: " << rc;
@@ -426,6 +771,7 @@ int add_word(std::string word, std::set<std::string> &loaded_words,
 
 int remove_word(std::string word, std::set<std::string> &loaded_words,
                 std::list<std::unordered_map<std::string, std::string>> &errors) {
+    TraceScope trace("remove_word");
     int rc = _DSXEngine_DeleteWord(_engine, 1, word.c_str());
     if (rc) {
         std::stringstream errstream;
@@ -451,11 +797,11 @@ void Draconity::set_words(std::set<std::string> &new_words, std::list<std::unord
                         new_words.begin(), new_words.end(),
                         std::inserter(words_to_remove, words_to_remove.end()));
     for (auto word : words_to_add) {
-        printf("[+] Adding word: %s\n", word.c_str());
+        draconity_log(LEVEL_DEBUG, "words", "adding word: %s", word.c_str());
         add_word(word, this->loaded_words, errors);
     }
     for (auto word : words_to_remove) {
-        printf("[+] Removing word: %s\n", word.c_str());
+        draconity_log(LEVEL_DEBUG, "words", "removing word: %s", word.c_str());
         remove_word(word, this->loaded_words, errors);
     }
 }
@@ -522,9 +868,15 @@ void Draconity::sync_words() {
 
 /* Push the shadow state into Dragon - make it live. */
 void Draconity::sync_state() {
+    static Histogram *sync_time = this->metrics.histogram("draconity_sync_seconds", "Time spent syncing state into Dragon");
     this->shadow_lock.lock();
+    TraceScope trace("sync_state");
+    int64_t start = dr_monotonic_time();
     this->sync_words();
     this->sync_grammars();
+    this->sync_profile();
+    this->sync_activation();
+    sync_time->record(dr_monotonic_time() - start);
     this->shadow_lock.unlock();
 }
 
@@ -558,52 +910,742 @@ void Draconity::set_shadow_words(uint64_t client_id, uint32_t tid, std::set<std:
     this->shadow_lock.unlock();
 }
 
+/* A pending update is what a new g.set builds on, so omitted lists carry over
+   from it. Without one the live grammar's lists stay set anyway, so only its
+   blob and the client's own rules are needed. */
+bool Draconity::current_grammar_state(const std::string &name, GrammarState &state) {
+    bool found = false;
+    this->shadow_lock.lock();
+    auto shadow_it = this->shadow_grammars.find(name);
+    if (shadow_it != this->shadow_grammars.end()) {
+        if (!shadow_it->second.unload) {
+            state.blob = shadow_it->second.blob;
+            state.active_rules = shadow_it->second.active_rules;
+            state.lists = shadow_it->second.lists;
+            found = true;
+        }
+    } else {
+        auto grammar_it = this->grammars.find(name);
+        if (grammar_it != this->grammars.end() && grammar_it->second->enabled) {
+            state.blob = grammar_it->second->state.blob;
+            state.active_rules = grammar_it->second->base_rules;
+            found = true;
+        }
+    }
+    this->shadow_lock.unlock();
+    return found;
+}
+
+std::set<std::string> Draconity::client_words(uint64_t client_id) {
+    std::set<std::string> words;
+    this->shadow_lock.lock();
+    auto it = this->shadow_words.find(client_id);
+    if (it != this->shadow_words.end()) {
+        words = it->second.words;
+    }
+    this->shadow_lock.unlock();
+    return words;
+}
+
+static void add_grammar_usage(ClientUsage &usage, const GrammarState &state) {
+    usage.grammars++;
+    usage.blob_bytes += state.blob.size();
+    usage.active_rules += state.active_rules.size();
+    for (auto &pair : state.lists) {
+        usage.list_entries += pair.second.size();
+    }
+}
+
+/* Grammars are counted as they will be once pending updates are synced, so a
+   g.set replacing a big grammar with a small one isn't held to the sum. */
+std::unordered_map<uint64_t, ClientUsage> Draconity::client_usage(const std::string &skip) {
+    std::unordered_map<uint64_t, ClientUsage> usage;
+    this->shadow_lock.lock();
+    for (auto &pair : this->grammars) {
+        if (pair.first == skip || this->shadow_grammars.count(pair.first)) continue;
+        add_grammar_usage(usage[pair.second->state.client_id], pair.second->state);
+    }
+    for (auto &pair : this->shadow_grammars) {
+        if (pair.first == skip || pair.second.unload) continue;
+        add_grammar_usage(usage[pair.second.client_id], pair.second);
+    }
+    for (auto &pair : this->shadow_words) {
+        usage[pair.first].words = pair.second.words.size();
+    }
+    this->shadow_lock.unlock();
+    return usage;
+}
+
+static std::string quota_error(const char *what, uint64_t value, uint64_t limit) {
+    std::stringstream errstream;
+    errstream << "quota exceeded: " << what << " " << value << " > " << limit;
+    return errstream.str();
+}
+
+std::string Draconity::check_grammar_quota(uint64_t client_id, const std::string &name, const GrammarState &state) {
+    ClientQuota &q = this->quota;
+    if (!q.grammars && !q.blob_bytes && !q.list_entries && !q.active_rules) {
+        return "";
+    }
+    ClientUsage usage = this->client_usage(name)[client_id];
+    add_grammar_usage(usage, state);
+    if (q.grammars && usage.grammars > q.grammars) {
+        return quota_error("grammars", usage.grammars, q.grammars);
+    } else if (q.blob_bytes && usage.blob_bytes > q.blob_bytes) {
+        return quota_error("blob_bytes", usage.blob_bytes, q.blob_bytes);
+    } else if (q.list_entries && usage.list_entries > q.list_entries) {
+        return quota_error("list_entries", usage.list_entries, q.list_entries);
+    } else if (q.active_rules && usage.active_rules > q.active_rules) {
+        return quota_error("active_rules", usage.active_rules, q.active_rules);
+    }
+    return "";
+}
+
+std::string Draconity::check_words_quota(uint64_t client_id, const std::set<std::string> &words) {
+    if (this->quota.words && words.size() > this->quota.words) {
+        return quota_error("words", words.size(), this->quota.words);
+    }
+    return "";
+}
+
+void Draconity::note_phrase_begin() {
+    this->in_phrase = true;
+}
+
+void Draconity::note_phrase_end() {
+    this->in_phrase = false;
+    this->last_phrase_end = dr_monotonic_time();
+}
+
+bool Draconity::has_pending_state() {
+    if (!this->shadow_grammars.empty() || this->profile_switch.pending || !this->activation_changed.empty()) {
+        return true;
+    }
+    for (auto &state_pair : this->shadow_words) {
+        if (!state_pair.second.synced) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Whether Dragon looks quiet enough to touch grammars without a pause. */
+bool Draconity::engine_idle() {
+    const char *micstate = this->micstate;
+    if (micstate && (!strcmp(micstate, "off") || !strcmp(micstate, "disabled"))) {
+        return true;
+    }
+    if (this->in_phrase) {
+        return false;
+    }
+    int64_t quiet_ns = dr_monotonic_time() - this->last_phrase_end;
+    return quiet_ns >= (int64_t)this->idle_sync_delay * 1000000;
+}
+
+/* Arrange for pending state to be synced once the engine goes quiet.
+
+   Must be run on the Uv thread.
+
+ */
+void Draconity::schedule_idle_sync() {
+    if (this->idle_sync_delay <= 0 || this->idle_sync_scheduled || !this->idle_sync_timer) {
+        return;
+    }
+    this->idle_sync_scheduled = true;
+    this->idle_sync_timer->start(uvw::TimerHandle::Time{(uint64_t)this->idle_sync_delay},
+                                 uvw::TimerHandle::Time{0});
+}
+
+// Must be run on the Uv thread
+void Draconity::try_idle_sync() {
+    if (this->pause_token != 0) {
+        // The pause will sync everything anyway.
+        return;
+    }
+    this->shadow_lock.lock();
+    bool pending = this->has_pending_state();
+    this->shadow_lock.unlock();
+    if (!pending) {
+        return;
+    }
+    if (this->engine_idle()) {
+        this->sync_state();
+    } else {
+        // Still talking - check again later.
+        this->schedule_idle_sync();
+    }
+}
+
 // Must be run on the Uv thread
 void Draconity::do_unpause() {
     if (this->pause_token > 0 ) {
         this->pause_clients.clear();
         this->pause_timer->stop();
-        _DSXEngine_Resume(_engine, this->pause_token);
+        {
+            TraceScope trace("resume", this->pause_token);
+            _DSXEngine_Resume(_engine, this->pause_token);
+        }
+        trace_complete("paused", this->pause_start, this->pause_token);
+
+        PauseRecord &record = this->current_pause;
+        record.duration = dr_monotonic_time() - this->pause_start;
+        static Histogram *pause_time = this->metrics.histogram("draconity_pause_seconds", "Time Dragon spent paused");
+        pause_time->record(record.duration);
+        int64_t duration_ms = record.duration / 1000000;
+        int bucket = 0;
+        while (duration_ms > 0 && bucket < PAUSE_HISTOGRAM_BUCKETS - 1) {
+            duration_ms >>= 1;
+            bucket++;
+        }
+        this->pause_histogram[bucket]++;
+        if (record.has_waited_on) {
+            this->pause_stats[record.waited_on].waited_on++;
+        }
+        this->pause_history.push_back(std::move(record));
+        if (this->pause_history.size() > PAUSE_HISTORY_SIZE) {
+            this->pause_history.pop_front();
+        }
         this->pause_token = 0;
     }
 }
 
+/* Deadline (monotonic ns) for a client to unpause a pause that began at `start`.
+
+   Clients get a few times their usual unpause latency, so a client that's
+   normally quick but has hung doesn't hold Dragon for the full timeout.
+
+ */
+int64_t Draconity::pause_deadline(uint64_t client_id, int64_t start) {
+    int64_t max_ns = (int64_t)this->pause_timeout * 1000000;
+    int64_t min_ns = (int64_t)this->pause_timeout_min * 1000000;
+    auto stats_it = this->pause_stats.find(client_id);
+    // Until we've seen a few pauses we have nothing to go on.
+    if (stats_it == this->pause_stats.end() || stats_it->second.pauses < 4) {
+        return start + max_ns;
+    }
+    int64_t allowed = stats_it->second.latency * 4;
+    return start + std::min(max_ns, std::max(min_ns, allowed));
+}
+
+/* Stop waiting on a client for the current pause, unpausing if it was the last.
+
+   `responded` is false when the client disconnected instead of unpausing.
+
+ */
+void Draconity::release_pause_client(uint64_t client_id, bool responded) {
+    auto it = this->pause_clients.find(client_id);
+    if (it == this->pause_clients.end()) {
+        return;
+    }
+    this->pause_clients.erase(it);
+    if (responded) {
+        PauseClientStats &stats = this->pause_stats[client_id];
+        int64_t latency = dr_monotonic_time() - this->pause_start;
+        // Exponential moving average, weighting the latest pause by 1/8.
+        stats.latency = (stats.pauses == 0) ? latency : stats.latency + (latency - stats.latency) / 8;
+        stats.pauses++;
+    }
+    if (this->pause_clients.empty()) {
+        if (responded) {
+            this->current_pause.has_waited_on = true;
+            this->current_pause.waited_on = client_id;
+        }
+        this->do_unpause();
+    }
+}
+
 // Must be run on the Uv thread
 void Draconity::client_unpause(uint64_t client_id, uint64_t token) {
     if (this->pause_token == token) {
-        this->pause_clients.erase(client_id);
-        if (this->pause_clients.size() == 0) {
-            this->do_unpause();
+        this->release_pause_client(client_id, true);
+    }
+}
+
+// Must be run on the Uv thread
+void Draconity::arm_pause_timer() {
+    int64_t next = INT64_MAX;
+    for (auto &pair : this->pause_clients) {
+        next = std::min(next, pair.second);
+    }
+    int64_t wait_ms = (next - dr_monotonic_time() + 999999) / 1000000;
+    this->pause_timer->start(uvw::TimerHandle::Time{(uint64_t)std::max(wait_ms, (int64_t)0)},
+                             uvw::TimerHandle::Time{0});
+}
+
+/* Give up on every client that has passed its deadline. */
+void Draconity::expire_pause_clients() {
+    if (this->pause_token == 0) {
+        return;
+    }
+    int64_t now = dr_monotonic_time();
+    for (auto it = this->pause_clients.begin(); it != this->pause_clients.end();) {
+        if (it->second <= now) {
+            PauseClientStats &stats = this->pause_stats[it->first];
+            // Count the miss as a slow unpause so the deadline grows to fit a
+            // client that's just slow.
+            int64_t latency = now - this->pause_start;
+            stats.latency = (stats.pauses == 0) ? latency : stats.latency + (latency - stats.latency) / 8;
+            stats.pauses++;
+            stats.timeouts++;
+            this->current_pause.timed_out.push_back(it->first);
+            static Counter *timeouts = this->metrics.counter("draconity_pause_timeouts_total", "Clients that missed their unpause deadline");
+            timeouts->inc();
+            trace_instant("pause_timeout", it->first);
+            draconity_log(LEVEL_WARN, "pause", "client %llu missed its unpause deadline", (unsigned long long)it->first);
+            it = this->pause_clients.erase(it);
+        } else {
+            it++;
         }
     }
+    if (this->pause_clients.empty()) {
+        this->do_unpause();
+    } else {
+        this->arm_pause_timer();
+    }
 }
 
 void Draconity::handle_pause(uint64_t token) {
+    static Counter *pauses = this->metrics.counter("draconity_pauses_total", "Pauses requested by Dragon");
+    pauses->inc();
+    trace_instant("pause", token);
     // We run the entire pause process on the Uv thread to avoid contention.
     server->invoke([this, token] {
         this->pause_token = token;
+        this->pause_start = dr_monotonic_time();
+        this->current_pause = {};
+        this->current_pause.token = token;
         this->sync_state();
-        if (server->clients.empty()) {
+        // Only wait on clients that take part in pauses.
+        for (auto &client : server->clients) {
+            if (client->authed && client->pauses) {
+                this->pause_clients[client->id] = this->pause_deadline(client->id, this->pause_start);
+            }
+        }
+        if (this->pause_clients.empty()) {
             // There are no clients to wait for so we unpause immediately.
             this->do_unpause();
         } else {
-            for (auto &client : server->clients) {
-                this->pause_clients.insert(client->id);
-            }
             draconity_publish("paused", BCON_NEW("token", BCON_INT64(token)));
-            this->pause_timer->start(uvw::TimerHandle::Time{draconity->pause_timeout},
-                                     uvw::TimerHandle::Time{0});
+            this->arm_pause_timer();
+        }
+    });
+}
+
+/* Append pause timing statistics to a bson document. */
+void Draconity::append_pause_stats(bson_t *doc) {
+    bson_t array, child, timed_out;
+    char keystr[16], subkeystr[16];
+    const char *key, *subkey;
+
+    BSON_APPEND_ARRAY_BEGIN(doc, "histogram", &array);
+    for (int i = 0; i < PAUSE_HISTOGRAM_BUCKETS; i++) {
+        bson_uint32_to_string(i, &key, keystr, sizeof(keystr));
+        BSON_APPEND_DOCUMENT_BEGIN(&array, key, &child);
+        // Upper bound of the bucket in ms - the last bucket is unbounded.
+        BSON_APPEND_INT64(&child, "lt_ms", (i == PAUSE_HISTOGRAM_BUCKETS - 1) ? -1 : (int64_t)1 << i);
+        BSON_APPEND_INT64(&child, "count", this->pause_histogram[i]);
+        bson_append_document_end(&array, &child);
+    }
+    bson_append_array_end(doc, &array);
+
+    BSON_APPEND_ARRAY_BEGIN(doc, "clients", &array);
+    int i = 0;
+    for (auto &pair : this->pause_stats) {
+        bson_uint32_to_string(i++, &key, keystr, sizeof(keystr));
+        BSON_APPEND_DOCUMENT_BEGIN(&array, key, &child);
+        BSON_APPEND_INT64(&child, "client", pair.first);
+        BSON_APPEND_INT64(&child, "latency", pair.second.latency);
+        BSON_APPEND_INT64(&child, "deadline", this->pause_deadline(pair.first, 0));
+        BSON_APPEND_INT64(&child, "pauses", pair.second.pauses);
+        BSON_APPEND_INT64(&child, "timeouts", pair.second.timeouts);
+        BSON_APPEND_INT64(&child, "waited_on", pair.second.waited_on);
+        bson_append_document_end(&array, &child);
+    }
+    bson_append_array_end(doc, &array);
+
+    BSON_APPEND_ARRAY_BEGIN(doc, "recent", &array);
+    i = 0;
+    for (auto &record : this->pause_history) {
+        bson_uint32_to_string(i++, &key, keystr, sizeof(keystr));
+        BSON_APPEND_DOCUMENT_BEGIN(&array, key, &child);
+        BSON_APPEND_INT64(&child, "token", record.token);
+        BSON_APPEND_INT64(&child, "duration", record.duration);
+        if (record.has_waited_on) {
+            BSON_APPEND_INT64(&child, "waited_on", record.waited_on);
+        }
+        BSON_APPEND_ARRAY_BEGIN(&child, "timed_out", &timed_out);
+        int j = 0;
+        for (uint64_t client_id : record.timed_out) {
+            bson_uint32_to_string(j++, &subkey, subkeystr, sizeof(subkeystr));
+            BSON_APPEND_INT64(&timed_out, subkey, client_id);
+        }
+        bson_append_array_end(&child, &timed_out);
+        bson_append_document_end(&array, &child);
+    }
+    bson_append_array_end(doc, &array);
+}
+
+/* Submit a mimic to Dragon. Returns an error message on failure.
+
+   Must be run on the Uv thread.
+
+ */
+std::string Draconity::submit_mimic(MimicRequest request, std::vector<uint8_t> &phrase, unsigned int count) {
+    // Queue the request first - Dragon can finish the mimic before
+    // _DSXEngine_Mimic returns.
+    request.phrase = phrase;
+    this->mimic_lock.lock();
+    request.token = ++this->mimic_token;
+    request.start = dr_monotonic_time();
+    uint64_t token = request.token;
+    this->mimic_queue.push_back(std::move(request));
+    this->mimics_in_flight++;
+    this->mimic_lock.unlock();
+
+    dsx_dataptr dp = {.data = phrase.data(), .size = (uint32_t)phrase.size()};
+    TraceScope trace("mimic", token);
+    int rc = _DSXEngine_Mimic(_engine, 0, count, &dp, 0, 2);
+    if (rc) {
+        this->mimic_lock.lock();
+        for (auto it = this->mimic_queue.begin(); it != this->mimic_queue.end(); it++) {
+            if (it->token == token) {
+                this->mimic_queue.erase(it);
+                this->mimics_in_flight--;
+                break;
+            }
+        }
+        this->mimic_lock.unlock();
+        std::stringstream errstream;
+        errstream << "error during mimic: " << rc;
+        return errstream.str();
+    }
+    return "";
+}
+
+/* Whether a recognised phrase is the one the oldest mimic in flight asked
+   for. Dragon runs mimics in order, so no other mimic can be ending; a real
+   utterance that ends meanwhile won't have its words.
+
+   Called from Dragon's threads.
+
+ */
+bool Draconity::matches_mimic(const CapturedWord *words, uint32_t count) {
+    if (count == 0 || this->mimics_in_flight.load() == 0) {
+        return false;
+    }
+    bool matched = false;
+    this->mimic_lock.lock();
+    if (!this->mimic_queue.empty()) {
+        const std::vector<uint8_t> &phrase = this->mimic_queue.front().phrase;
+        size_t pos = 0;
+        uint32_t i = 0;
+        for (; i < count; i++) {
+            size_t len = strlen(words[i].word) + 1;
+            if (pos + len > phrase.size() || memcmp(phrase.data() + pos, words[i].word, len) != 0) {
+                break;
+            }
+            pos += len;
         }
+        matched = (i == count && pos == phrase.size());
+    }
+    this->mimic_lock.unlock();
+    return matched;
+}
+
+/* Match a mimic done callback to the mimic it completes. */
+void Draconity::mimic_done() {
+    trace_instant("mimic_done");
+    this->mimic_lock.lock();
+    if (this->mimic_queue.empty()) {
+        // Someone other than us mimicked.
+        this->mimic_lock.unlock();
+        return;
+    }
+    MimicRequest request = std::move(this->mimic_queue.front());
+    this->mimic_queue.pop_front();
+    this->mimics_in_flight--;
+    this->mimic_lock.unlock();
+
+    int64_t duration = dr_monotonic_time() - request.start;
+    if (request.bench) {
+        server->invoke([this]() {
+            this->bench.mimic_done();
+        });
+        return;
+    }
+    if (!request.batch) {
+        draconity_send("mimic",
+                       BCON_NEW("success", BCON_BOOL(true),
+                                "token", BCON_INT64(request.token),
+                                "duration", BCON_INT64(duration)),
+                       request.tid,
+                       request.client_id);
+        return;
+    }
+    // Batches are only touched on the Uv thread.
+    server->invoke([this, request, duration]() mutable {
+        this->mimic_batch_done(request, duration);
     });
 }
 
+// Must be run on the Uv thread
+void Draconity::start_mimic_batch(std::shared_ptr<MimicBatch> batch) {
+    batch->start = dr_monotonic_time();
+    this->mimic_batches.push_back(batch);
+    this->pump_mimic_batch(batch);
+}
+
+// Must be run on the Uv thread
+void Draconity::mimic_batch_done(MimicRequest &request, int64_t duration) {
+    std::shared_ptr<MimicBatch> batch = request.batch;
+    batch->in_flight--;
+    batch->completed++;
+    draconity_send("mimic.batch",
+                   BCON_NEW("index", BCON_INT64(request.index),
+                            "token", BCON_INT64(request.token),
+                            "success", BCON_BOOL(true),
+                            "duration", BCON_INT64(duration)),
+                   batch->tid,
+                   batch->client_id);
+    this->pump_mimic_batch(batch);
+}
+
+/* Keep up to `window` of a batch's mimics in Dragon, and report once the
+   batch is finished.
+
+   Must be run on the Uv thread.
+
+ */
+void Draconity::pump_mimic_batch(std::shared_ptr<MimicBatch> batch) {
+    while (!batch->cancelled && batch->in_flight < batch->window && batch->next < batch->phrases.size()) {
+        size_t index = batch->next++;
+        MimicRequest request = {0, batch->client_id, batch->tid, 0, batch, index, false};
+        std::string errmsg = this->submit_mimic(request, batch->phrases[index], batch->word_counts[index]);
+        batch->phrases[index] = {};
+        if (errmsg.size() > 0) {
+            batch->completed++;
+            batch->failed++;
+            draconity_send("mimic.batch",
+                           BCON_NEW("index", BCON_INT64(index),
+                                    "success", BCON_BOOL(false),
+                                    "error", BCON_UTF8(errmsg.c_str())),
+                           batch->tid,
+                           batch->client_id);
+            continue;
+        }
+        batch->in_flight++;
+    }
+    if (batch->in_flight == 0 && (batch->cancelled || batch->next == batch->phrases.size())) {
+        draconity_send("mimic.batch",
+                       BCON_NEW("done", BCON_BOOL(true),
+                                "success", BCON_BOOL(batch->failed == 0 && !batch->cancelled),
+                                "count", BCON_INT64(batch->completed),
+                                "failed", BCON_INT64(batch->failed),
+                                "duration", BCON_INT64(dr_monotonic_time() - batch->start)),
+                       batch->tid,
+                       batch->client_id);
+        this->mimic_batches.remove(batch);
+    }
+}
+
+ClientOptions Draconity::client_options(uint64_t client_id) {
+    ClientOptions options;
+    this->client_opts_lock.lock();
+    auto it = this->client_opts.find(client_id);
+    if (it != this->client_opts.end()) {
+        options = it->second;
+    }
+    this->client_opts_lock.unlock();
+    return options;
+}
+
+void Draconity::set_client_options(uint64_t client_id, ClientOptions &options) {
+    this->client_opts_lock.lock();
+    this->client_opts[client_id] = options;
+    this->client_opts_lock.unlock();
+}
+
 // Must be run on uv thread.
 void Draconity::handle_disconnect(uint64_t client_id) {
-    // Unload everything related to a client when it disconnects.
-    this->clear_client_state(client_id);
+    // Unload everything related to a client when it disconnects, unless it
+    // may yet come back for it.
+    if (!this->suspend_session(client_id)) {
+        this->clear_client_state(client_id);
+    }
     // We might be waiting on the client to unpause.
     if (this->pause_token > 0) {
         this->sync_state();
-        this->client_unpause(client_id, this->pause_token);
+        this->release_pause_client(client_id, false);
+    } else {
+        this->schedule_idle_sync();
+    }
+    this->pause_stats.erase(client_id);
+    this->bench.cancel(client_id);
+    // Let in-flight mimics finish, but don't submit any more.
+    for (auto &batch : this->mimic_batches) {
+        if (batch->client_id == client_id) {
+            batch->cancelled = true;
+        }
+    }
+    this->client_opts_lock.lock();
+    this->client_opts.erase(client_id);
+    this->client_opts_lock.unlock();
+}
+
+static std::string new_resume_token() {
+    static std::random_device random;
+    char token[33];
+    snprintf(token, sizeof(token), "%08x%08x%08x%08x", random(), random(), random(), random());
+    return token;
+}
+
+// Must be run on uv thread.
+uint64_t Draconity::open_session(uint64_t client_id, const std::string &resume_token, bson_t *reply) {
+    if (this->resume_grace <= 0) {
+        return client_id;
+    }
+    bool resumed = false;
+    auto session_it = this->suspended_sessions.find(resume_token);
+    if (!resume_token.empty() && session_it != this->suspended_sessions.end()) {
+        // Everything the old connection set is keyed by its client id, so the
+        // new connection takes it over just by using that id.
+        SuspendedSession session = session_it->second;
+        this->suspended_sessions.erase(session_it);
+        client_id = session.client_id;
+        this->set_client_options(client_id, session.options);
+        this->shadow_lock.lock();
+        this->suspended_clients.erase(client_id);
+        this->mark_activation_changed(client_id);
+        this->shadow_lock.unlock();
+        if (this->pause_token != 0) {
+            this->sync_state();
+        } else {
+            this->schedule_idle_sync();
+        }
+        resumed = true;
+        draconity_log(LEVEL_INFO, "session", "client %llu resumed its session",
+                      (unsigned long long)client_id);
+    }
+    std::string token = new_resume_token();
+    this->session_tokens[client_id] = token;
+    BSON_APPEND_UTF8(reply, "resume_token", token.c_str());
+    BSON_APPEND_BOOL(reply, "resumed", resumed);
+    return client_id;
+}
+
+/* Keep a disconnected client's grammars and words for resume_grace ms instead
+   of unloading them. Returns false if the client can't resume. */
+bool Draconity::suspend_session(uint64_t client_id) {
+    auto token_it = this->session_tokens.find(client_id);
+    if (token_it == this->session_tokens.end()) {
+        return false;
+    }
+    SuspendedSession session;
+    session.client_id = client_id;
+    session.deadline = dr_monotonic_time() + (int64_t)this->resume_grace * 1000000;
+    session.options = this->client_options(client_id);
+    this->suspended_sessions[token_it->second] = session;
+    this->session_tokens.erase(token_it);
+
+    this->shadow_lock.lock();
+    this->suspended_clients.insert(client_id);
+    this->mark_activation_changed(client_id);
+    this->shadow_lock.unlock();
+    this->drop_replies(client_id);
+    this->arm_session_timer();
+    return true;
+}
+
+/* Stop replying to a suspended client's outstanding requests. If it resumes,
+   the new connection numbers its tids afresh, so replies on the old ones would
+   answer requests it never sent. */
+void Draconity::drop_replies(uint64_t client_id) {
+    this->shadow_lock.lock();
+    for (auto &pair : this->shadow_grammars) {
+        if (pair.second.client_id == client_id) {
+            pair.second.tid = NO_REPLY_TID;
+        }
+    }
+    auto words_it = this->shadow_words.find(client_id);
+    if (words_it != this->shadow_words.end()) {
+        words_it->second.last_tid = NO_REPLY_TID;
+    }
+    if (this->profile_switch.pending && this->profile_switch.client_id == client_id) {
+        this->profile_switch.tid = NO_REPLY_TID;
+    }
+    this->shadow_lock.unlock();
+
+    this->mimic_lock.lock();
+    for (auto &request : this->mimic_queue) {
+        if (request.client_id == client_id) {
+            request.tid = NO_REPLY_TID;
+        }
+    }
+    this->mimic_lock.unlock();
+    // Batches were cancelled on disconnect, but still report their in-flight
+    // mimics.
+    for (auto &batch : this->mimic_batches) {
+        if (batch->client_id == client_id) {
+            batch->tid = NO_REPLY_TID;
+        }
+    }
+    this->tuner.detach(client_id);
+}
+
+// Must hold shadow_lock.
+void Draconity::mark_activation_changed(uint64_t client_id) {
+    if (!this->resume_deactivate) {
+        return;
+    }
+    for (auto &pair : this->grammars) {
+        if (pair.second->state.client_id == client_id) {
+            this->activation_changed.insert(pair.first);
+        }
+    }
+}
+
+// Must hold shadow_lock.
+bool Draconity::deactivated(uint64_t client_id) {
+    return this->resume_deactivate && this->suspended_clients.count(client_id) > 0;
+}
+
+void Draconity::arm_session_timer() {
+    int64_t next = INT64_MAX;
+    for (auto &pair : this->suspended_sessions) {
+        next = std::min(next, pair.second.deadline);
+    }
+    int64_t wait_ms = (next - dr_monotonic_time() + 999999) / 1000000;
+    this->session_timer->start(uvw::TimerHandle::Time{(uint64_t)std::max(wait_ms, (int64_t)0)},
+                               uvw::TimerHandle::Time{0});
+}
+
+/* Unload the state of every suspended client that has passed its deadline. */
+void Draconity::expire_sessions() {
+    int64_t now = dr_monotonic_time();
+    bool expired = false;
+    for (auto it = this->suspended_sessions.begin(); it != this->suspended_sessions.end();) {
+        if (it->second.deadline <= now) {
+            uint64_t client_id = it->second.client_id;
+            this->shadow_lock.lock();
+            this->suspended_clients.erase(client_id);
+            this->shadow_lock.unlock();
+            this->clear_client_state(client_id);
+            draconity_log(LEVEL_INFO, "session", "client %llu didn't resume, unloading its state",
+                          (unsigned long long)client_id);
+            it = this->suspended_sessions.erase(it);
+            expired = true;
+        } else {
+            it++;
+        }
+    }
+    if (expired) {
+        if (this->pause_token != 0) {
+            this->sync_state();
+        } else {
+            this->schedule_idle_sync();
+        }
+    }
+    if (!this->suspended_sessions.empty()) {
+        this->arm_session_timer();
     }
 }
@@ -1,41 +1,192 @@
 #ifndef draconity_H
 #define draconity_H
 
+#include <atomic>
 #include <condition_variable>
 #include <list>
 #include <map>
 #include <mutex>
 #include <unordered_set>
-#include <queue>
+#include <deque>
 #include <cstring>
+#include <vector>
+#include <bson.h>
 #include <uvw.hpp>
 
 #include "cpptoml.h"
 #include "types.h"
 #include "dragon/grammar.h"
+#include "dragon/grammar_registry.h"
 #include "dragon/foreign_rule.h"
+#include "bench.h"
+#include "api_profile.h"
+#include "engine_params.h"
+#include "hypothesis.h"
+#include "metrics.h"
+#include "phrase_queue.h"
+#include "result_store.h"
+#include "timeline.h"
 
 /* Holds a desired state for the vocabulary. */
 struct WordState {
     std::set<std::string> words;
-    int last_tid;
+    uint32_t last_tid;
     bool synced;
 };
 
+/* Per-connection preferences, set with the client.options command. */
+struct ClientOptions {
+    // Embed the utterance audio in every p.end, rather than leaving it to be
+    // fetched with r.wav.
+    bool send_wav = false;
+    // Minimum ms between p.hypothesis messages; 0 sends them as they come.
+    int hypothesis_interval = 0;
+    // Send only the words that changed since the last hypothesis, plus how
+    // many leading words were unchanged.
+    bool hypothesis_suffix = false;
+    // Attach the utterance's latency timeline to every p.end.
+    bool timeline = false;
+};
+
+/* What a client's grammars and words cost us, as counted for status.memory
+   and the [quota] limits. */
+struct ClientUsage {
+    uint64_t grammars = 0;
+    uint64_t blob_bytes = 0;
+    uint64_t list_entries = 0;
+    uint64_t active_rules = 0;
+    uint64_t words = 0;
+    // Replies and publishes written but not yet flushed to the socket.
+    uint64_t queued_bytes = 0;
+};
+
+/* Per-client limits from the [quota] table; 0 means unlimited. */
+struct ClientQuota {
+    uint64_t grammars = 0;
+    uint64_t blob_bytes = 0;
+    uint64_t list_entries = 0;
+    uint64_t active_rules = 0;
+    uint64_t words = 0;
+    // Publishes to a client with more than this queued are dropped, and a
+    // reply to one disconnects it.
+    uint64_t queued_bytes = 0;
+};
+
+struct MimicBatch;
+
+/* A mimic waiting for Dragon's mimic done callback. */
+struct MimicRequest {
+    uint64_t token;  // Echoed back to the client with the completion
+    uint64_t client_id;
+    uint32_t tid;
+    int64_t start;   // dr_monotonic_time() when the mimic was submitted
+    std::shared_ptr<MimicBatch> batch;  // NULL for a single mimic
+    size_t index;    // Position within the batch
+    bool bench;      // Submitted by the mimic benchmark
+    std::vector<uint8_t> phrase;  // The mimicked words, each NUL terminated
+};
+
+/* A mimic.batch request. Only touched on the Uv thread. */
+struct MimicBatch {
+    uint64_t client_id;
+    uint32_t tid;
+    // Encoded phrases, freed as they're submitted.
+    std::vector<std::vector<uint8_t>> phrases;
+    std::vector<unsigned int> word_counts;
+    size_t window;     // Most mimics to keep in Dragon at once
+    size_t next;       // Next phrase to submit
+    size_t in_flight;
+    size_t completed;
+    size_t failed;
+    bool cancelled;
+    int64_t start;
+};
+
+/* Rules to activate per grammar name, applied on top of each grammar's own
+   active rules. */
+typedef std::unordered_map<std::string, InternedSet> ActivationProfile;
+
+/* Holds a requested switch to a named activation profile. */
+struct ProfileSwitch {
+    std::string name;
+    ActivationProfile rules;
+    // Grammars whose rules differ from the profile currently in effect.
+    std::set<std::string> changed_grammars;
+    // Errors applying its rules during g.set syncs before it took effect.
+    std::list<std::unordered_map<std::string, std::string>> errors;
+    uint64_t client_id;
+    uint32_t tid;
+    bool pending;
+};
+
+/* How a client has behaved across pauses. Used to size its unpause deadline. */
+struct PauseClientStats {
+    int64_t latency;     // Moving average of the time taken to unpause, in ns
+    uint64_t pauses;     // Pauses the client took part in
+    uint64_t timeouts;   // Pauses the client missed its deadline for
+    uint64_t waited_on;  // Pauses the client was the last to release
+};
+
+/* Summary of a single completed pause. */
+struct PauseRecord {
+    uint64_t token;
+    int64_t duration;  // ns
+    // The client Dragon ended up waiting for, if any.
+    bool has_waited_on;
+    uint64_t waited_on;
+    std::vector<uint64_t> timed_out;
+};
+
+/* A disconnected client whose grammars and words are kept for resume_grace ms,
+   in case it reconnects with its resume token. */
+struct SuspendedSession {
+    uint64_t client_id;
+    int64_t deadline;       // dr_monotonic_time() when its state is cleared
+    ClientOptions options;  // Restored when it resumes
+};
+
+#define PAUSE_HISTOGRAM_BUCKETS 16
+#define PAUSE_HISTORY_SIZE 32
+
 class Draconity {
 public:
     static Draconity *shared();
 
     std::string set_dragon_enabled(bool enabled);
-    void init_pause_timer();
+    void init_handles();
     void sync_state();
     void clear_client_state(uint64_t client_id);
     void set_shadow_grammar(std::string name, GrammarState &shadow_grammar);
     void set_shadow_words(uint64_t client_id, uint32_t tid, std::set<std::string> &words);
+    // What a g.set for `name` would update, pending or live. False if neither.
+    bool current_grammar_state(const std::string &name, GrammarState &state);
+    // The words the client last asked for, synced or not.
+    std::set<std::string> client_words(uint64_t client_id);
+    // Usage of every client with grammars or words, ignoring grammar `skip`.
+    std::unordered_map<uint64_t, ClientUsage> client_usage(const std::string &skip = "");
+    // Returns an error message if the update would put the client over quota.
+    std::string check_grammar_quota(uint64_t client_id, const std::string &name, const GrammarState &state);
+    std::string check_words_quota(uint64_t client_id, const std::set<std::string> &words);
+    void set_profile(std::string name, ActivationProfile &profile);
+    std::string use_profile(uint64_t client_id, uint32_t tid, std::string name);
     std::shared_ptr<Grammar> get_grammar(uintptr_t key);
     void handle_pause(uint64_t token);
     void handle_disconnect(uint64_t client_id);
+    // Adds a resume token to an auth reply, and resumes the session named by
+    // `resume_token` if it's still kept. Returns the client id the connection
+    // should use from now on.
+    uint64_t open_session(uint64_t client_id, const std::string &resume_token, bson_t *reply);
     void client_unpause(uint64_t client_id, uint64_t token);
+    void append_pause_stats(bson_t *doc);
+    std::string submit_mimic(MimicRequest request, std::vector<uint8_t> &phrase, unsigned int count);
+    void start_mimic_batch(std::shared_ptr<MimicBatch> batch);
+    void mimic_done();
+    bool matches_mimic(const CapturedWord *words, uint32_t count);
+    ClientOptions client_options(uint64_t client_id);
+    void set_client_options(uint64_t client_id, ClientOptions &options);
+    void schedule_idle_sync();
+    void note_phrase_begin();
+    void note_phrase_end();
 private:
     Draconity();
     Draconity(const Draconity &);
@@ -47,45 +198,130 @@ private:
     void set_words(std::set<std::string> &new_words,
                    std::list<std::unordered_map<std::string, std::string>> &errors);
     void remove_grammar(std::string name, std::shared_ptr<Grammar> &grammar);
+    void sync_profile();
+    void sync_activation();
+    const InternedSet &profile_rules(const std::string &grammar_name);
+    bool suspend_session(uint64_t client_id);
+    void drop_replies(uint64_t client_id);
+    void mark_activation_changed(uint64_t client_id);
+    bool deactivated(uint64_t client_id);
+    void arm_session_timer();
+    void expire_sessions();
 
     void do_unpause();
+    void release_pause_client(uint64_t client_id, bool responded);
+    int64_t pause_deadline(uint64_t client_id, int64_t start);
+    void arm_pause_timer();
+    void expire_pause_clients();
+    void pump_mimic_batch(std::shared_ptr<MimicBatch> batch);
+    void mimic_batch_done(MimicRequest &request, int64_t duration);
+    bool has_pending_state();
+    bool engine_idle();
+    void try_idle_sync();
 public:
+    // Exported with the metrics command and the Prometheus listener.
+    MetricsRegistry metrics;
     std::unordered_map<std::string, std::shared_ptr<Grammar>> grammars;
+    // Resolves phrase callback keys - safe to read from Dragon's threads.
+    GrammarRegistry grammar_registry;
     std::unordered_map<std::string, GrammarState> shadow_grammars;
 
+    std::unordered_map<std::string, ActivationProfile> profiles;
+    std::string active_profile_name;
+    ActivationProfile active_profile;
+    ProfileSwitch profile_switch;
+
     std::set<std::string> loaded_words;
+    // Recent recognition results, queried with the r.* commands.
+    ResultStore results;
+    HypothesisPipeline hypotheses;
+    // Carries p.end data from Dragon's thread to the Uv thread.
+    PhraseQueue phrase_queue;
+    MimicBench bench;
+    EngineParams params;
+    ParamTuner tuner;
+    ApiProfiler api_profiler;
+    // Per-stage p.end latency, queried with timeline.stats.
+    TimelineStats timelines;
     std::unordered_map<uint64_t, WordState> shadow_words;
 
     const char *micstate;
     bool ready;
     uint64_t start_ts;
 
-    std::list<ForeignRule *> dragon_rules;
     // Locks the entire shadow state
     std::mutex shadow_lock;
-    // TODO: Remove
+    // Locks dragon_rules and dragon_enabled. Never held across a batch of Dragon
+    // calls, only the single call in a hook.
     std::mutex dragon_lock;
+    std::unordered_map<ForeignRuleKey, ForeignRule, ForeignRuleKeyHash> dragon_rules;
     bool dragon_enabled;
 
     std::string engine_name;
     std::shared_ptr<cpptoml::table> config;
+    // Locks client_opts, which is read from Dragon's threads.
+    std::mutex client_opts_lock;
+    std::unordered_map<uint64_t, ClientOptions> client_opts;
+    ClientQuota quota;
+    // Locks mimic_queue and mimic_token.
     std::mutex mimic_lock;
-    // Each pair holds a transaction's info - <client_id, tid>
-    std::queue<std::pair<uint64_t, uint32_t>> mimic_queue;
+    // Mimics in the order they were submitted. Dragon runs mimics one at a
+    // time and its done callback carries no id, so completions are matched
+    // against the front of this queue.
+    std::deque<MimicRequest> mimic_queue;
+    uint64_t mimic_token;
+    // Size of mimic_queue, readable without the lock.
+    std::atomic<int> mimics_in_flight;
+    std::list<std::shared_ptr<MimicBatch>> mimic_batches;
     drg_engine *engine;
 
     // loaded from the config
     int timeout;
     int timeout_incomplete;
     bool prevent_wake;
+    // Quiet time in ms after which pending state is synced without waiting for
+    // a pause. 0 disables idle syncing.
+    int idle_sync_delay;
+    // Ms a disconnected client's state is kept for it to resume; 0 unloads it
+    // straight away.
+    int resume_grace;
+    // Whether a disconnected client's grammars have their rules deactivated
+    // until it resumes.
+    bool resume_deactivate;
     // Token supplied to the pause callback. Also encodes whether Dragon is
     // paused - Dragon will never supply a token of 0, so we set this to 0 when
     // Dragon is unpaused.
     uint64_t pause_token;
 private:
-    uint64_t pause_timeout;  // Time in ms to wait before we force unpause.
-    std::set<uint64_t> pause_clients; // Clients that haven't unpaused yet.
+    uint64_t pause_timeout;      // Longest time in ms to wait for a client before we force unpause.
+    uint64_t pause_timeout_min;  // Shortest deadline in ms a client is given.
+    // Clients that haven't unpaused yet, mapped to their deadlines.
+    std::unordered_map<uint64_t, int64_t> pause_clients;
+    int64_t pause_start;
+    PauseRecord current_pause;
+    std::unordered_map<uint64_t, PauseClientStats> pause_stats;
+    std::list<PauseRecord> pause_history;
+    // Pause durations, bucketed by powers of two ms.
+    uint64_t pause_histogram[PAUSE_HISTOGRAM_BUCKETS];
     std::shared_ptr<uvw::TimerHandle> pause_timer;
+    std::shared_ptr<uvw::TimerHandle> idle_sync_timer;
+    // Resume tokens of connected clients, and disconnected clients' kept
+    // sessions by token. Uv thread only.
+    std::unordered_map<uint64_t, std::string> session_tokens;
+    std::unordered_map<std::string, SuspendedSession> suspended_sessions;
+    // Ids of the clients in suspended_sessions, read while syncing. Protected
+    // by shadow_lock.
+    std::unordered_set<uint64_t> suspended_clients;
+    // Grammars whose rules need reapplying since their client was suspended
+    // or resumed. Protected by shadow_lock.
+    std::set<std::string> activation_changed;
+    std::shared_ptr<uvw::TimerHandle> session_timer;
+    // Dumps the flight recorder on SIGUSR2.
+    std::shared_ptr<uvw::SignalHandle> trace_signal;
+    bool idle_sync_scheduled;
+    // Written from Dragon's phrase callbacks.
+    std::atomic<bool> in_phrase;
+    std::atomic<int64_t> last_phrase_end;  // dr_monotonic_time() of the last p.end
 };
 
 #define draconity (Draconity::shared())
@@ -97,4 +333,11 @@ private:
 int draconity_set_param(const char *key, const char *value);
 void draconity_set_default_params();
 
+// The primitives sync_state applies grammar state with. Uv thread only.
+int load_grammar(std::shared_ptr<Grammar> &grammar, const SharedBlob &blob);
+int unload_grammar(std::shared_ptr<Grammar> &grammar);
+void sync_rules(std::shared_ptr<Grammar> &grammar, const InternedSet &shadow_rules);
+dsx_dataptr list_dataptr(const InternedSet &list);
+void set_list(std::shared_ptr<Grammar> &grammar, const std::string &name, const InternedSet &list);
+
 #endif
@@ -1,10 +1,29 @@
 #pragma once
+#include <functional>
 #include <string>
 #include "types.h"
 
+/* Identifies an internal Dragon rule: rules are referenced by name, namespaced
+   to a particular grammar. A NULL rule name is stored as "". */
+struct ForeignRuleKey {
+    drg_grammar *grammar;
+    std::string rule;
+
+    bool operator==(const ForeignRuleKey &other) const {
+        return this->grammar == other.grammar && this->rule == other.rule;
+    }
+};
+
+struct ForeignRuleKeyHash {
+    size_t operator()(const ForeignRuleKey &key) const {
+        return std::hash<std::string>()(key.rule) ^ (std::hash<void *>()(key.grammar) * 31);
+    }
+};
+
 /* Class representing an internal Dragon rule.
 
-   Rules are referenced by name, namespaced to a particular grammar.
+   Dragon activates its own rules through our hooks; we remember them so the
+   "dragon" pseudo-grammar can turn them all on and off.
 
  */
 class ForeignRule {
@@ -16,12 +35,21 @@ class ForeignRule {
             if (rule) {
                 this->rule = rule;
             }
+            this->activations = 0;
+            this->applied = false;
         };
-        
-        bool matches(drg_grammar *other_grammar, const char *other_rule);
+
+        ForeignRuleKey key() const {
+            return ForeignRuleKey{this->grammar, this->rule};
+        }
         int activate();
         int deactivate();
-    
+
+        // How many times Dragon has activated the rule since it was last
+        // deactivated.
+        uint32_t activations;
+        // Whether we believe the rule is currently active in Dragon.
+        bool applied;
     private:
         drg_grammar *grammar;
         uint64_t unk1;
@@ -5,12 +5,13 @@
 #include <vector>
 #include <unordered_map>
 #include "types.h"
+#include "dragon/interned.h"
 
 struct GrammarState {
     public:
-    std::vector<uint8_t> blob;
-    std::set<std::string> active_rules;
-    std::unordered_map<std::string, std::set<std::string>> lists;
+    SharedBlob blob;
+    InternedSet active_rules;
+    std::unordered_map<std::string, InternedSet> lists;
     bool unload;
     uint64_t client_id;  // Client that set this state
     uint32_t tid;        // Transaction that set this state
@@ -35,7 +36,9 @@ class Grammar {
         std::list<std::unordered_map<std::string, std::string>> errors;
 
         GrammarState state;
-        std::set<std::string> exclusive_rules;
+        // Rules requested by the last g.set, before any profile is applied.
+        InternedSet base_rules;
+        InternedSet exclusive_rules;
 
         std::string error;
 
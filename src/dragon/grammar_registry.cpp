@@ -0,0 +1,146 @@
+#include "grammar_registry.h"
+
+// Keys have to fit in a 32-bit pointer: the low bits hold the slot index and
+// the rest hold the slot's generation. Generations start at 1, so a valid key
+// is never 0.
+#define KEY_INDEX_BITS 14
+#define KEY_INDEX_MASK ((1u << KEY_INDEX_BITS) - 1)
+#define KEY_GENERATION_MASK ((1u << (32 - KEY_INDEX_BITS)) - 1)
+
+static_assert(64 * 256 <= (1u << KEY_INDEX_BITS), "registry slots must fit in a key");
+
+static inline uintptr_t make_key(uint32_t index, uint32_t generation) {
+    return ((uintptr_t)generation << KEY_INDEX_BITS) | index;
+}
+
+GrammarRegistry::GrammarRegistry() {
+    for (auto &chunk : this->chunks) {
+        chunk.store(nullptr);
+    }
+    this->allocated_slots = 0;
+    this->epoch.store(0);
+    this->readers[0].store(0);
+    this->readers[1].store(0);
+}
+
+GrammarRegistry::~GrammarRegistry() {
+    for (auto &chunk : this->chunks) {
+        delete []chunk.load();
+    }
+}
+
+GrammarRegistry::Slot *GrammarRegistry::slot(uint32_t index) {
+    Slot *chunk = this->chunks[index >> chunk_bits].load(std::memory_order_acquire);
+    if (!chunk) {
+        return nullptr;
+    }
+    return &chunk[index & (chunk_size - 1)];
+}
+
+uintptr_t GrammarRegistry::add(std::shared_ptr<Grammar> grammar) {
+    if (this->free_slots.empty()) {
+        if (this->allocated_slots == chunk_size * chunk_count) {
+            return 0;
+        }
+        Slot *chunk = new Slot[chunk_size];
+        for (uint32_t i = 0; i < chunk_size; i++) {
+            chunk[i].generation.store(0);
+            chunk[i].next_generation = 1;
+            this->free_slots.push_back(this->allocated_slots + i);
+        }
+        this->chunks[this->allocated_slots >> chunk_bits].store(chunk, std::memory_order_release);
+        this->allocated_slots += chunk_size;
+    }
+    // Slots are reused in FIFO order so a stale key takes as long as possible
+    // to alias a new grammar.
+    uint32_t index = this->free_slots.front();
+    this->free_slots.pop_front();
+    Slot *slot = this->slot(index);
+    uint32_t generation = slot->next_generation;
+    slot->next_generation = (generation == KEY_GENERATION_MASK) ? 1 : generation + 1;
+    slot->grammar = std::move(grammar);
+    // Publishing the generation makes the slot visible to readers.
+    slot->generation.store(generation, std::memory_order_release);
+    return make_key(index, generation);
+}
+
+void GrammarRegistry::remove(uintptr_t key) {
+    uint32_t index = key & KEY_INDEX_MASK;
+    uint32_t generation = (key >> KEY_INDEX_BITS) & KEY_GENERATION_MASK;
+    Slot *slot = (index < this->allocated_slots) ? this->slot(index) : nullptr;
+    if (!slot || generation == 0 || slot->generation.load() != generation) {
+        return;
+    }
+    // New lookups fail from here on, but a reader that already matched the
+    // generation may still be copying the grammar out, so the slot can't be
+    // reused until its epoch has drained.
+    slot->generation.store(0);
+    this->retired.push_back({index, this->epoch.load()});
+}
+
+/* Free every retired slot that no reader can still be using.
+
+   Never waits on readers - anything still in use is left for the next call.
+
+ */
+void GrammarRegistry::reclaim() {
+    if (this->retired.empty()) {
+        return;
+    }
+    uint32_t current = this->epoch.load();
+    // The counter for the next epoch is shared with the previous one, so we can
+    // only advance once the previous epoch's readers have all left.
+    if (this->readers[(current + 1) & 1].load() != 0) {
+        return;
+    }
+    uint32_t safe_epoch = current - 1;
+    this->epoch.store(current + 1);
+    if (this->readers[current & 1].load() == 0) {
+        safe_epoch = current;
+    }
+    for (auto it = this->retired.begin(); it != this->retired.end();) {
+        if ((int32_t)(safe_epoch - it->epoch) >= 0) {
+            this->slot(it->index)->grammar.reset();
+            this->free_slots.push_back(it->index);
+            it = this->retired.erase(it);
+        } else {
+            it++;
+        }
+    }
+}
+
+uint32_t GrammarRegistry::read_lock() {
+    while (true) {
+        uint32_t epoch = this->epoch.load();
+        this->readers[epoch & 1].fetch_add(1);
+        // If the epoch moved while we registered, the writer may not have seen
+        // us - back out and try again.
+        if (this->epoch.load() == epoch) {
+            return epoch;
+        }
+        this->readers[epoch & 1].fetch_sub(1);
+    }
+}
+
+void GrammarRegistry::read_unlock(uint32_t epoch) {
+    this->readers[epoch & 1].fetch_sub(1);
+}
+
+std::shared_ptr<Grammar> GrammarRegistry::lookup(uintptr_t key) {
+    uint32_t index = key & KEY_INDEX_MASK;
+    uint32_t generation = (key >> KEY_INDEX_BITS) & KEY_GENERATION_MASK;
+    std::shared_ptr<Grammar> grammar;
+    if (generation == 0 || index >= chunk_size * chunk_count) {
+        return grammar;
+    }
+    Slot *slot = this->slot(index);
+    if (!slot) {
+        return grammar;
+    }
+    uint32_t epoch = this->read_lock();
+    if (slot->generation.load(std::memory_order_acquire) == generation) {
+        grammar = slot->grammar;
+    }
+    this->read_unlock(epoch);
+    return grammar;
+}
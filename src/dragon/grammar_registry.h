@@ -0,0 +1,61 @@
+#pragma once
+#include <atomic>
+#include <deque>
+#include <list>
+#include <memory>
+#include "grammar.h"
+
+/* Maps the keys handed to Dragon's phrase callbacks onto live grammars.
+
+   A key packs a slot index and that slot's generation, so lookup is a single
+   array index and a key for an unloaded grammar simply stops matching.
+
+   Lookups may run on any thread (Dragon's callback threads) and never block.
+   Everything else must be called from the Uv thread. Removed grammars are only
+   released by `reclaim` once no reader can still be looking at their slot.
+
+ */
+class GrammarRegistry {
+public:
+    GrammarRegistry();
+    ~GrammarRegistry();
+
+    // Returns the new key, or 0 if every slot is in use.
+    uintptr_t add(std::shared_ptr<Grammar> grammar);
+    void remove(uintptr_t key);
+    std::shared_ptr<Grammar> lookup(uintptr_t key);
+    void reclaim();
+
+private:
+    GrammarRegistry(const GrammarRegistry &);
+    GrammarRegistry& operator=(const GrammarRegistry &);
+
+    struct Slot {
+        // 0 while the slot is free or retired.
+        std::atomic<uint32_t> generation;
+        uint32_t next_generation;
+        std::shared_ptr<Grammar> grammar;
+    };
+    struct Retired {
+        uint32_t index;
+        uint32_t epoch;
+    };
+
+    Slot *slot(uint32_t index);
+    uint32_t read_lock();
+    void read_unlock(uint32_t epoch);
+
+    // Slots are allocated in chunks that are never moved or freed while the
+    // registry lives, so readers can index them without a lock.
+    static const uint32_t chunk_bits = 8;
+    static const uint32_t chunk_size = 1 << chunk_bits;
+    static const uint32_t chunk_count = 64;
+    std::atomic<Slot *> chunks[chunk_count];
+    uint32_t allocated_slots;
+
+    std::deque<uint32_t> free_slots;
+    std::list<Retired> retired;
+
+    std::atomic<uint32_t> epoch;
+    std::atomic<uint32_t> readers[2];
+};
@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <iterator>
+#include "interned.h"
+
+StringTable &interned() {
+    // Never destroyed, so static InternedSets can outlive it safely.
+    static StringTable *table = new StringTable();
+    return *table;
+}
+
+StrId StringTable::retain(const char *s, size_t len) {
+    auto it = this->index.find(std::string_view(s, len));
+    if (it != this->index.end()) {
+        this->entries[it->second].refs++;
+        return it->second;
+    }
+    StrId id;
+    if (!this->free_ids.empty()) {
+        id = this->free_ids.back();
+        this->free_ids.pop_back();
+    } else {
+        id = this->entries.size();
+        this->entries.emplace_back();
+    }
+    Entry &entry = this->entries[id];
+    entry.value.assign(s, len);
+    entry.refs = 1;
+    this->index.emplace(std::string_view(entry.value), id);
+    this->total_bytes += len;
+    return id;
+}
+
+void StringTable::release(StrId id) {
+    Entry &entry = this->entries[id];
+    if (--entry.refs > 0) {
+        return;
+    }
+    this->index.erase(std::string_view(entry.value));
+    this->total_bytes -= entry.value.size();
+    std::string().swap(entry.value);
+    this->free_ids.push_back(id);
+}
+
+InternedSet::InternedSet(const std::vector<std::string_view> &strings) {
+    StringTable &table = interned();
+    this->ids.reserve(strings.size());
+    for (auto &s : strings) {
+        this->ids.push_back(table.retain(s.data(), s.size()));
+    }
+    std::sort(this->ids.begin(), this->ids.end());
+    auto last = this->ids.begin();
+    for (auto it = this->ids.begin(); it != this->ids.end(); it++) {
+        if (last != this->ids.begin() && *(last - 1) == *it) {
+            // A duplicate's reference isn't kept.
+            table.release(*it);
+        } else {
+            *last++ = *it;
+        }
+    }
+    this->ids.erase(last, this->ids.end());
+}
+
+InternedSet::InternedSet(const InternedSet &other) : ids(other.ids) {
+    StringTable &table = interned();
+    for (StrId id : this->ids) {
+        table.retain(id);
+    }
+}
+
+InternedSet &InternedSet::operator=(const InternedSet &other) {
+    if (this != &other) {
+        StringTable &table = interned();
+        for (StrId id : other.ids) {
+            table.retain(id);
+        }
+        this->clear();
+        this->ids = other.ids;
+    }
+    return *this;
+}
+
+InternedSet &InternedSet::operator=(InternedSet &&other) {
+    if (this != &other) {
+        this->clear();
+        this->ids = std::move(other.ids);
+        other.ids.clear();
+    }
+    return *this;
+}
+
+void InternedSet::insert(StrId id) {
+    auto it = std::lower_bound(this->ids.begin(), this->ids.end(), id);
+    if (it == this->ids.end() || *it != id) {
+        interned().retain(id);
+        this->ids.insert(it, id);
+    }
+}
+
+void InternedSet::insert(const std::string &s) {
+    StrId id = interned().retain(s);
+    this->insert(id);
+    interned().release(id);
+}
+
+void InternedSet::erase(StrId id) {
+    auto it = std::lower_bound(this->ids.begin(), this->ids.end(), id);
+    if (it != this->ids.end() && *it == id) {
+        this->ids.erase(it);
+        interned().release(id);
+    }
+}
+
+void InternedSet::merge(const InternedSet &other) {
+    if (other.ids.empty()) {
+        return;
+    }
+    std::vector<StrId> merged;
+    merged.reserve(this->ids.size() + other.ids.size());
+    StringTable &table = interned();
+    auto a = this->ids.cbegin(), a_end = this->ids.cend();
+    auto b = other.ids.cbegin(), b_end = other.ids.cend();
+    while (a != a_end || b != b_end) {
+        if (b == b_end || (a != a_end && *a < *b)) {
+            merged.push_back(*a++);
+        } else if (a == a_end || *b < *a) {
+            table.retain(*b);
+            merged.push_back(*b++);
+        } else {
+            merged.push_back(*a++);
+            b++;
+        }
+    }
+    this->ids = std::move(merged);
+}
+
+void InternedSet::clear() {
+    StringTable &table = interned();
+    for (StrId id : this->ids) {
+        table.release(id);
+    }
+    this->ids.clear();
+}
+
+bool InternedSet::contains(StrId id) const {
+    return std::binary_search(this->ids.begin(), this->ids.end(), id);
+}
@@ -0,0 +1,106 @@
+#pragma once
+#include <deque>
+#include <memory>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+typedef uint32_t StrId;
+
+/* Interned strings for grammar state.
+
+   Each distinct rule name or list entry is stored once and named by a small
+   integer, so the shadow and live copies of a grammar share their strings and
+   comparing them is comparing integers. Strings are reference counted by the
+   InternedSets holding them and their ids reused once released.
+
+   Uv thread only, like the grammar state it backs. Dragon's callback threads
+   can end up holding the last reference to a Grammar, so Draconity's Grammars
+   are always destroyed on the Uv thread (see release_grammar).
+
+ */
+class StringTable {
+public:
+    // Returns the string's id with a new reference to it.
+    StrId retain(const char *s, size_t len);
+    StrId retain(const std::string &s) { return this->retain(s.data(), s.size()); }
+    void retain(StrId id) { this->entries[id].refs++; }
+    void release(StrId id);
+    const std::string &str(StrId id) const { return this->entries[id].value; }
+
+    size_t count() const { return this->index.size(); }
+    size_t bytes() const { return this->total_bytes; }
+private:
+    struct Entry {
+        std::string value;
+        uint32_t refs;
+    };
+    // A deque, so entries (and the views into them) never move.
+    std::deque<Entry> entries;
+    std::vector<StrId> free_ids;
+    std::unordered_map<std::string_view, StrId> index;
+    size_t total_bytes = 0;
+};
+
+StringTable &interned();
+
+static inline const std::string &interned_str(StrId id) {
+    return interned().str(id);
+}
+
+/* A set of interned strings, as a sorted array of ids. Holds a reference to
+   each string it contains. */
+class InternedSet {
+public:
+    typedef std::vector<StrId>::const_iterator const_iterator;
+
+    InternedSet() {}
+    // `strings` may be unsorted and contain duplicates.
+    explicit InternedSet(const std::vector<std::string_view> &strings);
+    InternedSet(const InternedSet &other);
+    InternedSet(InternedSet &&other) : ids(std::move(other.ids)) {}
+    ~InternedSet() { this->clear(); }
+    InternedSet &operator=(const InternedSet &other);
+    InternedSet &operator=(InternedSet &&other);
+
+    void insert(StrId id);
+    void insert(const std::string &s);
+    void erase(StrId id);
+    // Adds everything in `other`.
+    void merge(const InternedSet &other);
+    void clear();
+
+    bool contains(StrId id) const;
+    size_t size() const { return this->ids.size(); }
+    bool empty() const { return this->ids.empty(); }
+    const_iterator begin() const { return this->ids.begin(); }
+    const_iterator end() const { return this->ids.end(); }
+
+    bool operator==(const InternedSet &other) const { return this->ids == other.ids; }
+    bool operator!=(const InternedSet &other) const { return this->ids != other.ids; }
+private:
+    std::vector<StrId> ids;
+};
+
+/* An immutable grammar blob, shared between the shadow and live state rather
+   than copied. */
+class SharedBlob {
+public:
+    SharedBlob() {}
+    SharedBlob(const uint8_t *data, size_t len)
+        : buf(std::make_shared<const std::vector<uint8_t>>(data, data + len)) {}
+
+    const uint8_t *data() const { return this->buf ? this->buf->data() : NULL; }
+    size_t size() const { return this->buf ? this->buf->size() : 0; }
+
+    bool operator==(const SharedBlob &other) const {
+        return this->buf == other.buf ||
+            (this->size() == other.size() && (this->size() == 0 || memcmp(this->data(), other.data(), this->size()) == 0));
+    }
+    bool operator!=(const SharedBlob &other) const { return !(*this == other); }
+private:
+    std::shared_ptr<const std::vector<uint8_t>> buf;
+};
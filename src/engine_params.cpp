@@ -0,0 +1,309 @@
+#include "engine_params.h"
+#include "draconity.h"
+#include "log.h"
+#include "server.h"
+#include "transport/framing.h"
+
+EngineParams::EngineParams() {
+    this->defaults = {
+        {"DemonThreadPhraseFinishWait", "0"},
+        // {"TwoPassSkipSecondPass", "1"},
+        // {"ReturnPhonemes", "1"},
+        // {"ReturnNoise", "1"},
+        // {"ReturnPauseFillers", "1"},
+        // {"Pass2DefaultSpeed", "1"},
+        {"NumWordsAvailable", "10000"},
+        // {"MinPartialUpdateCFGTime", "1"},
+        // {"MinPartialUpdateTime", "1"},
+        // {"LiveMicMinStopFrames", "1"},
+        // {"SkipLettersVocInVocLookup", "1"},
+        {"UseParallelRecognizers", "1"},
+        // {"UsePitchTracking", "1"},
+        {"Pass1A_DurationThresh_ms", "50"},
+        // {"ComputeSpeed", "10"},
+        // {"DisableWatchdog", "1"},
+        // {"DoBWPlus", "1"},
+        {"ExtraDictationWords", "10000"},
+        {"MaxCFGWords", "20000"},
+        {"MaxPronGuessedWords", "20000"},
+        {"PhraseHypothesisCallbackThread", "1"},
+    };
+}
+
+/* Profiles are read from [params.<name>] tables, whose values can be strings,
+   integers or booleans:
+
+       [params.fast]
+       DwTimeOutComplete = 20
+       UseParallelRecognizers = true
+
+ */
+void EngineParams::configure(std::shared_ptr<cpptoml::table> config, int timeout, int timeout_incomplete) {
+    this->lock.lock();
+    this->defaults["DwTimeOutComplete"] = std::to_string(timeout);
+    this->defaults["DwTimeOutIncomplete"] = std::to_string(timeout_incomplete);
+    auto tables = config ? config->get_table("params") : nullptr;
+    if (tables) {
+        for (auto &pair : *tables) {
+            if (!pair.second->is_table()) continue;
+            ParamSet &profile = this->profiles[pair.first];
+            for (auto &param : *pair.second->as_table()) {
+                if (auto value = param.second->as<std::string>()) {
+                    profile[param.first] = value->get();
+                } else if (auto value = param.second->as<int64_t>()) {
+                    profile[param.first] = std::to_string(value->get());
+                } else if (auto value = param.second->as<bool>()) {
+                    profile[param.first] = value->get() ? "1" : "0";
+                }
+            }
+        }
+    }
+    this->active = config ? config->get_as<std::string>("param_profile").value_or("") : "";
+    if (this->active != "" && this->profiles.find(this->active) == this->profiles.end()) {
+        draconity_log(LEVEL_WARN, "params", "unknown param_profile %s", this->active.c_str());
+        this->active = "";
+    }
+    this->lock.unlock();
+}
+
+// Must be called with the lock held.
+ParamSet EngineParams::desired() {
+    ParamSet values = this->defaults;
+    auto it = this->profiles.find(this->active);
+    if (it != this->profiles.end()) {
+        for (auto &pair : it->second) {
+            values[pair.first] = pair.second;
+        }
+    }
+    for (auto &pair : this->overrides) {
+        values[pair.first] = pair.second;
+    }
+    return values;
+}
+
+/* The cached handle for a parameter, or NULL if Dragon has no such parameter.
+   Names come from clients and the config, so unknown ones aren't cached.
+
+   Must be called with the lock held.
+
+ */
+void *EngineParams::handle(const std::string &key) {
+    auto it = this->handles.find(key);
+    if (it != this->handles.end()) {
+        return it->second;
+    }
+    void *handle = _DSXEngine_GetParam(_engine, key.c_str());
+    if (handle) {
+        this->handles[key] = handle;
+    }
+    return handle;
+}
+
+// Must be called with the lock held.
+std::string EngineParams::set(const std::string &key, const std::string &value) {
+    if (!_engine) return "engine not ready";
+    void *handle = this->handle(key);
+    if (!handle) {
+        draconity_log(LEVEL_WARN, "params", "unknown parameter %s", key.c_str());
+        return "unknown parameter";
+    }
+    int rc = _DSXEngine_SetStringValue(_engine, handle, value.c_str());
+    if (rc) {
+        draconity_log(LEVEL_WARN, "params", "error setting %s = %s: %d", key.c_str(), value.c_str(), rc);
+        return "error setting parameter: " + std::to_string(rc);
+    }
+    this->applied[key] = value;
+    return "";
+}
+
+// Must be called with the lock held.
+void EngineParams::apply(const ParamSet &values) {
+    for (auto &pair : values) {
+        auto it = this->applied.find(pair.first);
+        if (it == this->applied.end() || it->second != pair.second) {
+            this->set(pair.first, pair.second);
+        }
+    }
+    // Parameters that only the old profile set have no baseline to go back to,
+    // so they keep their value until the next speaker change.
+}
+
+// Must be called with the lock held.
+void EngineParams::release_handles() {
+    if (_engine) {
+        for (auto &pair : this->handles) {
+            if (pair.second) {
+                _DSXEngine_DestroyParam(_engine, pair.second);
+            }
+        }
+    }
+    this->handles.clear();
+}
+
+std::string EngineParams::use(const std::string &name) {
+    this->lock.lock();
+    if (name != "default" && this->profiles.find(name) == this->profiles.end()) {
+        this->lock.unlock();
+        return "unknown param profile";
+    }
+    this->active = (name == "default") ? "" : name;
+    this->overrides.clear();
+    this->apply(this->desired());
+    this->lock.unlock();
+    return "";
+}
+
+std::string EngineParams::set_override(const std::string &key, const std::string &value) {
+    this->lock.lock();
+    std::string errmsg;
+    auto it = this->applied.find(key);
+    if (it == this->applied.end() || it->second != value) {
+        errmsg = this->set(key, value);
+    }
+    // Don't keep retrying a parameter Dragon doesn't have.
+    if (errmsg != "unknown parameter") {
+        this->overrides[key] = value;
+    }
+    this->lock.unlock();
+    return errmsg;
+}
+
+bool EngineParams::known(const std::string &key) {
+    this->lock.lock();
+    bool known = _engine && this->handle(key);
+    this->lock.unlock();
+    return known;
+}
+
+void EngineParams::reapply() {
+    this->lock.lock();
+    this->release_handles();
+    this->applied.clear();
+    this->overrides.clear();
+    this->apply(this->desired());
+    this->lock.unlock();
+}
+
+std::string EngineParams::active_name() {
+    this->lock.lock();
+    std::string name = this->active.size() ? this->active : "default";
+    this->lock.unlock();
+    return name;
+}
+
+void EngineParams::append(bson_t *doc) {
+    bson_t child, profile;
+    this->lock.lock();
+    BSON_APPEND_UTF8(doc, "profile", this->active.size() ? this->active.c_str() : "default");
+    BSON_APPEND_DOCUMENT_BEGIN(doc, "applied", &child);
+    for (auto &pair : this->applied) {
+        BSON_APPEND_UTF8(&child, pair.first.c_str(), pair.second.c_str());
+    }
+    bson_append_document_end(doc, &child);
+    BSON_APPEND_DOCUMENT_BEGIN(doc, "profiles", &child);
+    for (auto &pair : this->profiles) {
+        BSON_APPEND_DOCUMENT_BEGIN(&child, pair.first.c_str(), &profile);
+        for (auto &param : pair.second) {
+            BSON_APPEND_UTF8(&profile, param.first.c_str(), param.second.c_str());
+        }
+        bson_append_document_end(&child, &profile);
+    }
+    bson_append_document_end(doc, &child);
+    this->lock.unlock();
+}
+
+std::string ParamTuner::start(uint64_t client_id, uint32_t tid, const std::string &corpus,
+                              const std::string &param, const std::vector<std::string> &values) {
+    if (this->running || draconity->bench.running()) {
+        return "benchmark already running";
+    }
+    if (!draconity->params.known(param)) {
+        return "unknown parameter";
+    }
+    this->client_id = client_id;
+    this->tid = tid;
+    this->corpus = corpus;
+    this->param = param;
+    this->values = values;
+    this->next = 0;
+    this->results = bson_new();
+    this->result_count = 0;
+    this->best = "";
+    this->best_accuracy = -1;
+    this->best_latency = 0;
+    this->running = true;
+    this->run_next();
+    return "";
+}
+
+void ParamTuner::detach(uint64_t client_id) {
+    if (this->running && this->client_id == client_id) {
+        this->tid = NO_REPLY_TID;
+    }
+}
+
+void ParamTuner::run_next() {
+    while (this->next < this->values.size()) {
+        const std::string &value = this->values[this->next++];
+        std::string errmsg = draconity->params.set_override(this->param, value);
+        if (errmsg.empty()) {
+            errmsg = draconity->bench.start(this->client_id, 0, this->corpus, [this, value] {
+                BenchSummary summary = draconity->bench.summary();
+                size_t succeeded = summary.count - summary.failed;
+                double accuracy = summary.count ? (double)summary.matched / summary.count : 0;
+                char keystr[16];
+                const char *key;
+                bson_t child;
+                bson_uint32_to_string(this->result_count++, &key, keystr, sizeof(keystr));
+                BSON_APPEND_DOCUMENT_BEGIN(this->results, key, &child);
+                BSON_APPEND_UTF8(&child, "value", value.c_str());
+                BSON_APPEND_INT64(&child, "count", summary.count);
+                BSON_APPEND_INT64(&child, "failed", summary.failed);
+                BSON_APPEND_DOUBLE(&child, "accuracy", accuracy);
+                BSON_APPEND_DOUBLE(&child, "throughput", summary.throughput);
+                BSON_APPEND_INT64(&child, "end_p50", summary.end_p50);
+                BSON_APPEND_INT64(&child, "end_p90", summary.end_p90);
+                BSON_APPEND_INT64(&child, "write_p50", summary.write_p50);
+                BSON_APPEND_INT64(&child, "write_p90", summary.write_p90);
+                bson_append_document_end(this->results, &child);
+                if (succeeded > 0 && (accuracy > this->best_accuracy ||
+                        (accuracy == this->best_accuracy && summary.write_p50 < this->best_latency))) {
+                    this->best = value;
+                    this->best_accuracy = accuracy;
+                    this->best_latency = summary.write_p50;
+                }
+                // Progress, so a long sweep isn't silent.
+                draconity_send("params.tune",
+                               BCON_NEW("value", BCON_UTF8(value.c_str()),
+                                        "accuracy", BCON_DOUBLE(accuracy),
+                                        "write_p50", BCON_INT64(summary.write_p50)),
+                               this->tid, this->client_id);
+                this->run_next();
+            });
+        }
+        if (errmsg.size() == 0) {
+            return;
+        }
+        draconity_send("params.tune",
+                       BCON_NEW("value", BCON_UTF8(value.c_str()),
+                                "error", BCON_UTF8(errmsg.c_str())),
+                       this->tid, this->client_id);
+    }
+    this->finish();
+}
+
+void ParamTuner::finish() {
+    this->running = false;
+    // Back to the profile's own value.
+    draconity->params.use(draconity->params.active_name());
+    bson_t *doc = BCON_NEW("done", BCON_BOOL(true),
+                           "success", BCON_BOOL(this->result_count > 0),
+                           "param", BCON_UTF8(this->param.c_str()));
+    BSON_APPEND_ARRAY(doc, "results", this->results);
+    if (this->best.size() > 0) {
+        BSON_APPEND_UTF8(doc, "best", this->best.c_str());
+    }
+    bson_destroy(this->results);
+    this->results = NULL;
+    draconity_send("params.tune", doc, this->tid, this->client_id);
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <bson.h>
+#include "cpptoml.h"
+
+typedef std::map<std::string, std::string> ParamSet;
+
+/* Dragon engine parameters, applied as named profiles.
+
+   The defaults are our baseline; a profile from the [params.<name>] tables in
+   draconity.toml overrides some of them. Switching profiles only sets the
+   parameters whose value changes, through parameter handles cached for the
+   life of the speaker.
+
+   Dragon resets its parameters when the speaker changes, so `reapply` drops
+   the cache and sets everything again.
+
+ */
+class EngineParams {
+public:
+    EngineParams();
+    void configure(std::shared_ptr<cpptoml::table> config, int timeout, int timeout_incomplete);
+
+    // Returns an error message, or "" on success.
+    std::string use(const std::string &name);
+    // Sets one parameter on top of the active profile until the next `use` or
+    // `reapply`. Returns an error message, or "" on success.
+    std::string set_override(const std::string &key, const std::string &value);
+    // Whether Dragon has a parameter called `key`.
+    bool known(const std::string &key);
+    void reapply();
+    void append(bson_t *doc);
+    std::string active_name();
+private:
+    ParamSet desired();
+    void *handle(const std::string &key);
+    std::string set(const std::string &key, const std::string &value);
+    void apply(const ParamSet &values);
+    void release_handles();
+
+    std::mutex lock;
+    ParamSet defaults;
+    std::map<std::string, ParamSet> profiles;
+    std::string active;
+    ParamSet overrides;
+    // What Dragon currently has, as far as we know.
+    ParamSet applied;
+    std::map<std::string, void *> handles;
+};
+
+/* Sweeps one parameter across a list of values, running the mimic benchmark
+   for each, and reports the latency/accuracy trade-off.
+
+   Only used from the Uv thread.
+
+ */
+class ParamTuner {
+public:
+    ParamTuner() : running(false) {}
+    std::string start(uint64_t client_id, uint32_t tid, const std::string &corpus,
+                      const std::string &param, const std::vector<std::string> &values);
+    // Stops reporting to a client that has gone, leaving the sweep to finish.
+    void detach(uint64_t client_id);
+private:
+    void run_next();
+    void finish();
+
+    bool running;
+    uint64_t client_id;
+    uint32_t tid;
+    std::string corpus;
+    std::string param;
+    std::vector<std::string> values;
+    size_t next;
+    bson_t *results;
+    uint32_t result_count;
+    // Best value so far: most accurate, then lowest p50 latency.
+    std::string best;
+    double best_accuracy;
+    int64_t best_latency;
+};
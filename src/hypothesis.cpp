@@ -0,0 +1,155 @@
+#include <bson.h>
+#include "hypothesis.h"
+#include "draconity.h"
+#include "dr_time.h"
+#include "phrase.h"
+#include "server.h"
+#include "transport/server.h"
+
+HypothesisPipeline::HypothesisPipeline() {
+    this->flush_invoked = false;
+    this->timer_due = INT64_MAX;
+    this->next_epoch = 1;
+}
+
+// Must be called from the Uv thread
+void HypothesisPipeline::init_timer(std::shared_ptr<uvw::Loop> loop) {
+    this->timer = loop->resource<uvw::TimerHandle>();
+    this->timer->on<uvw::TimerEvent>([this](const auto &, auto &handle) {
+        this->flush();
+    });
+}
+
+void HypothesisPipeline::push(uintptr_t key, Hypothesis &&hypothesis) {
+    this->lock.lock();
+    auto it = this->states.find(key);
+    if (it == this->states.end()) {
+        it = this->states.emplace(key, State()).first;
+        it->second.epoch = this->next_epoch++;
+    }
+    State &state = it->second;
+    if (hypothesis.phrase == state.last_phrase) {
+        // Nothing new for the client.
+        this->lock.unlock();
+        return;
+    }
+    ClientOptions options = draconity->client_options(hypothesis.client_id);
+    int64_t due = state.last_sent + (int64_t)options.hypothesis_interval * 1000000;
+    state.last_phrase = hypothesis.phrase;
+    state.pending = std::move(hypothesis);
+    state.has_pending = true;
+    // Flush straight away if this one is already due or the timer won't fire
+    // in time for it; otherwise leave it to the timer. Either way it only
+    // waits on its own client's rate limit.
+    bool schedule = server && !this->flush_invoked &&
+        (due <= dr_monotonic_time() || due < this->timer_due);
+    if (schedule) {
+        this->flush_invoked = true;
+    }
+    this->lock.unlock();
+    if (schedule) {
+        server->invoke([this] {
+            this->flush();
+        });
+    }
+}
+
+void HypothesisPipeline::reset(uintptr_t key) {
+    this->lock.lock();
+    this->states.erase(key);
+    this->lock.unlock();
+}
+
+/* Encode a hypothesis, skipping the first `prefix` words. */
+static bson_t *hypothesis_to_bson(Hypothesis &hypothesis, size_t prefix, bool suffix_only) {
+    bson_t *obj = bson_new();
+    bson_t array;
+    char keystr[16];
+    const char *key;
+
+    BSON_APPEND_UTF8(obj, "cmd", "p.hypothesis");
+    BSON_APPEND_UTF8(obj, "grammar", hypothesis.grammar.c_str());
+    if (!suffix_only) {
+        prefix = 0;
+    } else {
+        BSON_APPEND_INT32(obj, "prefix", prefix);
+    }
+    BSON_APPEND_ARRAY_BEGIN(obj, "phrase", &array);
+    for (size_t i = prefix; i < hypothesis.phrase.size(); i++) {
+        bson_uint32_to_string(i - prefix, &key, keystr, sizeof(keystr));
+        BSON_APPEND_UTF8(&array, key, hypothesis.phrase[i].c_str());
+    }
+    bson_append_array_end(obj, &array);
+    // Word nodes normally line up with the phrase, but if they don't we can't
+    // tell which ones changed.
+    size_t word_prefix = (hypothesis.words.size() == hypothesis.phrase.size()) ? prefix : 0;
+    words_to_bson(obj, hypothesis.words, word_prefix);
+    return obj;
+}
+
+/* Send every pending hypothesis that its client's rate limit allows, and
+   arm the timer for the rest.
+
+   Must be run on the Uv thread.
+
+ */
+void HypothesisPipeline::flush() {
+    struct Outgoing {
+        uintptr_t key;
+        uint64_t epoch;
+        size_t prefix;
+        bool suffix_only;
+        Hypothesis hypothesis;
+    };
+    std::vector<Outgoing> outgoing;
+    int64_t now = dr_monotonic_time();
+    int64_t next_due = INT64_MAX;
+
+    this->lock.lock();
+    this->flush_invoked = false;
+    for (auto &pair : this->states) {
+        State &state = pair.second;
+        if (!state.has_pending) {
+            continue;
+        }
+        ClientOptions options = draconity->client_options(state.pending.client_id);
+        int64_t due = state.last_sent + (int64_t)options.hypothesis_interval * 1000000;
+        if (now < due) {
+            next_due = std::min(next_due, due);
+            continue;
+        }
+        std::vector<std::string> &phrase = state.pending.phrase;
+        size_t prefix = 0;
+        while (prefix < phrase.size() && prefix < state.sent_phrase.size() &&
+               phrase[prefix] == state.sent_phrase[prefix]) {
+            prefix++;
+        }
+        state.sent_phrase = phrase;
+        state.last_sent = now;
+        state.has_pending = false;
+        outgoing.push_back({pair.first, state.epoch, prefix, options.hypothesis_suffix,
+                            std::move(state.pending)});
+    }
+    this->timer_due = INT64_MAX;
+    if (next_due != INT64_MAX && this->timer) {
+        uint64_t wait_ms = (next_due - now + 999999) / 1000000;
+        this->timer->start(uvw::TimerHandle::Time{wait_ms}, uvw::TimerHandle::Time{0});
+        this->timer_due = next_due;
+    }
+    this->lock.unlock();
+
+    for (auto &item : outgoing) {
+        // Encode outside the lock so Dragon's threads aren't kept waiting.
+        bson_t *obj = hypothesis_to_bson(item.hypothesis, item.prefix, item.suffix_only);
+        this->lock.lock();
+        // Only send if the phrase hasn't ended since we picked this up. Sending
+        // under the lock keeps the message ordered ahead of any p.end.
+        auto it = this->states.find(item.key);
+        if (it != this->states.end() && it->second.epoch == item.epoch) {
+            draconity_send("phrase", obj, PUBLISH_TID, item.hypothesis.client_id);
+        } else {
+            bson_destroy(obj);
+        }
+        this->lock.unlock();
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <uvw.hpp>
+
+/* A recognised word and where it sits in the audio. */
+struct PhraseWord {
+    std::string word;
+    uint32_t id;
+    uint32_t rule;
+    int64_t start;  // ns, on the dr_monotonic_time() clock
+    int64_t end;
+};
+
+/* Everything a p.hypothesis message needs, captured on Dragon's thread so the
+   result can be destroyed straight away. */
+struct Hypothesis {
+    std::string grammar;
+    uint64_t client_id;
+    std::vector<std::string> phrase;
+    std::vector<PhraseWord> words;
+};
+
+/* Coalesces the hypotheses for each grammar before they reach its client.
+
+   A hypothesis whose phrase matches the last one is dropped, and a newer
+   hypothesis replaces one still waiting to be sent, so a client only ever gets
+   the current best guess. Clients can also cap the rate they receive
+   hypotheses at, and ask for only the words that changed.
+
+   `push` and `reset` are called from Dragon's threads; everything else must
+   run on the Uv thread.
+
+ */
+class HypothesisPipeline {
+public:
+    HypothesisPipeline();
+    void init_timer(std::shared_ptr<uvw::Loop> loop);
+
+    void push(uintptr_t key, Hypothesis &&hypothesis);
+    // Forget the grammar's pending and last-sent hypotheses - called when a
+    // phrase begins or ends, so nothing stale is sent after p.end.
+    void reset(uintptr_t key);
+private:
+    struct State {
+        bool has_pending = false;
+        Hypothesis pending;
+        std::vector<std::string> last_phrase;  // Last phrase sent or queued
+        std::vector<std::string> sent_phrase;  // Last phrase actually sent
+        int64_t last_sent = 0;
+        // Unique per state, so a send that was in flight across a `reset`
+        // can tell it's stale.
+        uint64_t epoch = 0;
+    };
+
+    void flush();
+
+    std::mutex lock;  // Protects everything below.
+    std::unordered_map<uintptr_t, State> states;
+    // A flush is queued on the Uv thread.
+    bool flush_invoked;
+    // When the timer will next flush, for hypotheses held back by a client's
+    // rate limit; INT64_MAX if it isn't armed.
+    int64_t timer_due;
+    uint64_t next_epoch;
+    std::shared_ptr<uvw::TimerHandle> timer;
+};
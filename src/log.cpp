@@ -0,0 +1,239 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <bson.h>
+#include "abstract_platform.h"
+#include "dr_time.h"
+#include "log.h"
+#include "server.h"
+
+#define LOG_CAPACITY 1024
+#define LOG_MESSAGE_SIZE 240
+#define LOG_FLUSH_INTERVAL_MS 20
+
+struct LogRecord {
+    // Vyukov-style sequence, less the slot's index so that the zeroed ring is
+    // already valid before static initialisers run: seq + index equals the
+    // enqueue position when the slot is free, and position + 1 once it holds
+    // a record.
+    std::atomic<size_t> seq;
+    int64_t ts;
+    LogLevel level;
+    const char *category;
+    char msg[LOG_MESSAGE_SIZE];
+};
+
+static LogRecord ring[LOG_CAPACITY];
+static std::atomic<size_t> enqueue_pos(0);
+static size_t dequeue_pos = 0;  // Owned by the writer thread
+static std::atomic<uint64_t> dropped(0);
+static std::atomic<int> min_level(LEVEL_INFO);
+
+static size_t load_seq(size_t pos) {
+    size_t index = pos & (LOG_CAPACITY - 1);
+    return ring[index].seq.load(std::memory_order_acquire) + index;
+}
+
+static void store_seq(size_t pos, size_t seq) {
+    size_t index = pos & (LOG_CAPACITY - 1);
+    ring[index].seq.store(seq - index, std::memory_order_release);
+}
+
+static const char *level_names[] = {"debug", "info", "warn", "error"};
+static const char *level_prefixes[] = {"[-]", "[+]", "[!]", "[!]"};
+
+void draconity_log(LogLevel level, const char *category, const char *fmt, ...) {
+    if (level < min_level.load(std::memory_order_relaxed)) {
+        return;
+    }
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    LogRecord *record;
+    while (true) {
+        record = &ring[pos & (LOG_CAPACITY - 1)];
+        size_t seq = load_seq(pos);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The writer has fallen a whole ring behind.
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    record->ts = dr_clock_time();
+    record->level = level;
+    record->category = category;
+    va_list va;
+    va_start(va, fmt);
+    int len = vsnprintf(record->msg, sizeof(record->msg), fmt, va);
+    va_end(va);
+    // Trailing newlines are the writer's job.
+    if (len >= (int)sizeof(record->msg)) len = sizeof(record->msg) - 1;
+    while (len > 0 && record->msg[len - 1] == '\n') {
+        record->msg[--len] = '\0';
+    }
+    store_seq(pos, pos + 1);
+}
+
+void draconity_logf(const char *fmt, ...) {
+    char msg[LOG_MESSAGE_SIZE];
+    va_list va;
+    va_start(va, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, va);
+    va_end(va);
+    draconity_log(LEVEL_INFO, "draconity", "%s", msg);
+}
+
+/* Per-category token bucket for the log topic. */
+struct LogLimit {
+    double tokens;
+    int64_t last;
+    uint64_t suppressed;
+};
+
+class LogWriter {
+public:
+    LogWriter(FILE *out, int rate) : out(out), rate(rate) {}
+
+    void run() {
+        while (true) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS));
+            this->drain();
+        }
+    }
+private:
+    void drain() {
+        bool wrote = false;
+        while (true) {
+            LogRecord &record = ring[dequeue_pos & (LOG_CAPACITY - 1)];
+            if (load_seq(dequeue_pos) != dequeue_pos + 1) {
+                break;
+            }
+            fprintf(this->out, "%s %s: %s\n", level_prefixes[record.level], record.category, record.msg);
+            if (this->allow(record.category)) {
+                bson_t obj = BSON_INITIALIZER;
+                BSON_APPEND_UTF8(&obj, "msg", record.msg);
+                BSON_APPEND_UTF8(&obj, "level", level_names[record.level]);
+                BSON_APPEND_UTF8(&obj, "category", record.category);
+                // Wall clock time the record was made. The publish adds its
+                // own monotonic "ts".
+                BSON_APPEND_INT64(&obj, "time", record.ts);
+                draconity_publish("log", &obj);
+            }
+            store_seq(dequeue_pos, dequeue_pos + LOG_CAPACITY);
+            dequeue_pos++;
+            wrote = true;
+        }
+        this->flush_suppressed();
+        uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+        if (lost) {
+            fprintf(this->out, "[!] log: dropped %llu records\n", (unsigned long long)lost);
+            wrote = true;
+        }
+        if (wrote) {
+            fflush(this->out);
+        }
+        // Anything still using printf directly.
+        fflush(stdout);
+        fflush(stderr);
+    }
+
+    bool allow(const char *category) {
+        if (this->rate <= 0) {
+            return true;
+        }
+        int64_t now = dr_monotonic_time();
+        auto it = this->limits.find(category);
+        if (it == this->limits.end()) {
+            it = this->limits.emplace(category, LogLimit{(double)this->rate, now, 0}).first;
+        }
+        LogLimit &limit = it->second;
+        this->refill(limit, now);
+        if (limit.tokens < 1) {
+            limit.suppressed++;
+            return false;
+        }
+        limit.tokens -= 1;
+        this->report_suppressed(category, limit);
+        return true;
+    }
+
+    void refill(LogLimit &limit, int64_t now) {
+        limit.tokens = std::min((double)this->rate, limit.tokens + (now - limit.last) * this->rate / 1e9);
+        limit.last = now;
+    }
+
+    // Report suppressed messages for categories that have gone quiet, which
+    // `allow` would otherwise only do on their next message.
+    void flush_suppressed() {
+        int64_t now = dr_monotonic_time();
+        for (auto &pair : this->limits) {
+            LogLimit &limit = pair.second;
+            if (!limit.suppressed) continue;
+            this->refill(limit, now);
+            if (limit.tokens >= 1) {
+                limit.tokens -= 1;
+                this->report_suppressed(pair.first, limit);
+            }
+        }
+    }
+
+    void report_suppressed(const char *category, LogLimit &limit) {
+        if (!limit.suppressed) {
+            return;
+        }
+        char msg[64];
+        snprintf(msg, sizeof(msg), "suppressed %llu messages", (unsigned long long)limit.suppressed);
+        bson_t obj = BSON_INITIALIZER;
+        BSON_APPEND_UTF8(&obj, "msg", msg);
+        BSON_APPEND_UTF8(&obj, "level", "warn");
+        BSON_APPEND_UTF8(&obj, "category", category);
+        draconity_publish("log", &obj);
+        limit.suppressed = 0;
+    }
+
+    FILE *out;
+    int rate;
+    // Keyed by pointer - categories are literals.
+    std::unordered_map<const char *, LogLimit> limits;
+};
+
+void log_init(std::shared_ptr<cpptoml::table> config) {
+    FILE *out = stdout;
+    int rate = 20;
+    if (config) {
+        std::string level = config->get_as<std::string>("log_level").value_or("info");
+        for (int i = LEVEL_DEBUG; i <= LEVEL_ERROR; i++) {
+            if (level == level_names[i]) {
+                min_level = i;
+            }
+        }
+        rate = config->get_as<int>("log_rate").value_or(rate);
+        auto logfile = config->get_as<std::string>("logfile").value_or("");
+        if (logfile != "") {
+            logfile = Platform::expanduser(logfile);
+            // Stray printf output goes to the same file, buffered; the writer
+            // flushes it with each batch.
+            freopen(logfile.c_str(), "a", stdout);
+            freopen(logfile.c_str(), "a", stderr);
+            FILE *file = fopen(logfile.c_str(), "a");
+            if (file) {
+                out = file;
+            }
+        }
+    }
+    std::thread writer([out, rate] {
+        LogWriter(out, rate).run();
+    });
+    writer.detach();
+}
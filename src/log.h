@@ -0,0 +1,28 @@
+#pragma once
+#include <memory>
+#include "cpptoml.h"
+
+enum LogLevel {
+    LEVEL_DEBUG,
+    LEVEL_INFO,
+    LEVEL_WARN,
+    LEVEL_ERROR,
+};
+
+/* Leveled logging that stays off the calling thread.
+
+   A record is formatted straight into a slot of a lock-free ring; a background
+   thread writes the ring out in batches to the log file (or stdout) and to the
+   `log` topic. Each category is rate-limited on its way to the sockets, so one
+   noisy path can't flood clients - the file still gets everything. When the
+   ring is full, records are dropped and counted rather than blocking.
+
+   Categories must be string literals - only the pointer is kept.
+
+ */
+
+// Reads log_level, log_rate and logfile from the config and starts the writer
+// thread. Records logged before this are kept until it runs.
+void log_init(std::shared_ptr<cpptoml::table> config);
+void draconity_log(LogLevel level, const char *category, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
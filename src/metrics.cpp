@@ -0,0 +1,225 @@
+#include <sstream>
+#include "metrics.h"
+
+static std::atomic<size_t> next_shard(0);
+
+// Threads take shards round-robin the first time they touch a counter.
+static size_t thread_shard() {
+    static thread_local size_t shard = next_shard.fetch_add(1) % METRIC_SHARDS;
+    return shard;
+}
+
+Counter::Counter() {
+    for (auto &shard : this->shards) {
+        shard.value.store(0);
+    }
+}
+
+void Counter::inc(uint64_t n) {
+    this->shards[thread_shard()].value.fetch_add(n, std::memory_order_relaxed);
+}
+
+uint64_t Counter::value() {
+    uint64_t total = 0;
+    for (auto &shard : this->shards) {
+        total += shard.value.load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+Gauge::Gauge() {
+    this->current.store(0);
+}
+
+Histogram::Histogram() {
+    for (auto &bucket : this->buckets) {
+        bucket.store(0);
+    }
+    this->total.store(0);
+    this->total_ns.store(0);
+}
+
+static int histogram_bucket(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (value >> (exponent - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+    return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+// Midpoint of a bucket's range.
+static uint64_t histogram_value(int bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    int exponent = bucket / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BITS - 1;
+    int sub = bucket % HISTOGRAM_SUB_BUCKETS;
+    uint64_t width = (uint64_t)1 << (exponent - HISTOGRAM_SUB_BITS);
+    return ((uint64_t)(HISTOGRAM_SUB_BUCKETS + sub) << (exponent - HISTOGRAM_SUB_BITS)) + width / 2;
+}
+
+void Histogram::record(int64_t ns) {
+    if (ns < 0) ns = 0;
+    this->buckets[histogram_bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    this->total.fetch_add(1, std::memory_order_relaxed);
+    this->total_ns.fetch_add(ns, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::count() {
+    return this->total.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::sum() {
+    return this->total_ns.load(std::memory_order_relaxed);
+}
+
+int64_t Histogram::quantile(double q) {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        counts[i] = this->buckets[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * (total - 1)) + 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return histogram_value(i);
+        }
+    }
+    return histogram_value(HISTOGRAM_BUCKETS - 1);
+}
+
+MetricsRegistry::Entry *MetricsRegistry::find(const std::string &name, Type type) {
+    for (auto &entry : this->entries) {
+        if (entry.name == name && entry.type == type) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+Counter *MetricsRegistry::counter(const std::string &name, const std::string &help) {
+    this->lock.lock();
+    Entry *entry = this->find(name, COUNTER);
+    if (!entry) {
+        this->entries.push_back({name, help, COUNTER});
+        entry = &this->entries.back();
+        entry->counter.reset(new Counter());
+    }
+    this->lock.unlock();
+    return entry->counter.get();
+}
+
+Gauge *MetricsRegistry::gauge(const std::string &name, const std::string &help) {
+    this->lock.lock();
+    Entry *entry = this->find(name, GAUGE);
+    if (!entry) {
+        this->entries.push_back({name, help, GAUGE});
+        entry = &this->entries.back();
+        entry->gauge.reset(new Gauge());
+    }
+    this->lock.unlock();
+    return entry->gauge.get();
+}
+
+void MetricsRegistry::gauge(const std::string &name, const std::string &help, std::function<int64_t()> fn) {
+    this->lock.lock();
+    Entry *entry = this->find(name, GAUGE_FN);
+    if (!entry) {
+        this->entries.push_back({name, help, GAUGE_FN});
+        entry = &this->entries.back();
+    }
+    entry->gauge_fn = fn;
+    this->lock.unlock();
+}
+
+Histogram *MetricsRegistry::histogram(const std::string &name, const std::string &help) {
+    this->lock.lock();
+    Entry *entry = this->find(name, HISTOGRAM);
+    if (!entry) {
+        this->entries.push_back({name, help, HISTOGRAM});
+        entry = &this->entries.back();
+        entry->histogram.reset(new Histogram());
+    }
+    this->lock.unlock();
+    return entry->histogram.get();
+}
+
+/* Histograms are reported in ns, as everywhere else in our messages. */
+void MetricsRegistry::append(bson_t *doc) {
+    bson_t metrics, child;
+    BSON_APPEND_DOCUMENT_BEGIN(doc, "metrics", &metrics);
+    this->lock.lock();
+    for (auto &entry : this->entries) {
+        const char *name = entry.name.c_str();
+        switch (entry.type) {
+        case COUNTER:
+            BSON_APPEND_INT64(&metrics, name, entry.counter->value());
+            break;
+        case GAUGE:
+            BSON_APPEND_INT64(&metrics, name, entry.gauge->value());
+            break;
+        case GAUGE_FN:
+            BSON_APPEND_INT64(&metrics, name, entry.gauge_fn());
+            break;
+        case HISTOGRAM: {
+            Histogram *histogram = entry.histogram.get();
+            BSON_APPEND_DOCUMENT_BEGIN(&metrics, name, &child);
+            BSON_APPEND_INT64(&child, "count", histogram->count());
+            BSON_APPEND_INT64(&child, "sum", histogram->sum());
+            BSON_APPEND_INT64(&child, "p50", histogram->quantile(0.5));
+            BSON_APPEND_INT64(&child, "p90", histogram->quantile(0.9));
+            BSON_APPEND_INT64(&child, "p99", histogram->quantile(0.99));
+            BSON_APPEND_INT64(&child, "max", histogram->quantile(1));
+            bson_append_document_end(&metrics, &child);
+            break;
+        }
+        }
+    }
+    this->lock.unlock();
+    bson_append_document_end(doc, &metrics);
+}
+
+/* Prometheus text exposition format. Histograms become summaries in seconds,
+   per Prometheus convention. */
+std::string MetricsRegistry::prometheus() {
+    static const double quantiles[] = {0.5, 0.9, 0.99};
+    std::ostringstream out;
+    this->lock.lock();
+    for (auto &entry : this->entries) {
+        const std::string &name = entry.name;
+        out << "# HELP " << name << " " << entry.help << "\n";
+        switch (entry.type) {
+        case COUNTER:
+            out << "# TYPE " << name << " counter\n";
+            out << name << " " << entry.counter->value() << "\n";
+            break;
+        case GAUGE:
+            out << "# TYPE " << name << " gauge\n";
+            out << name << " " << entry.gauge->value() << "\n";
+            break;
+        case GAUGE_FN:
+            out << "# TYPE " << name << " gauge\n";
+            out << name << " " << entry.gauge_fn() << "\n";
+            break;
+        case HISTOGRAM: {
+            Histogram *histogram = entry.histogram.get();
+            out << "# TYPE " << name << " summary\n";
+            for (double q : quantiles) {
+                out << name << "{quantile=\"" << q << "\"} " << histogram->quantile(q) / 1e9 << "\n";
+            }
+            out << name << "_sum " << histogram->sum() / 1e9 << "\n";
+            out << name << "_count " << histogram->count() << "\n";
+            break;
+        }
+        }
+    }
+    this->lock.unlock();
+    return out.str();
+}
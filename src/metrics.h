@@ -0,0 +1,91 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <bson.h>
+
+#define METRIC_SHARDS 16
+
+/* Monotonic counter. Increments land in one of several cache-line sized
+   shards picked per thread, so threads bumping the same counter don't fight
+   over a single line. */
+class Counter {
+public:
+    Counter();
+    void inc(uint64_t n = 1);
+    uint64_t value();
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> value;
+    };
+    Shard shards[METRIC_SHARDS];
+};
+
+class Gauge {
+public:
+    Gauge();
+    void set(int64_t value) { this->current.store(value, std::memory_order_relaxed); }
+    void add(int64_t n) { this->current.fetch_add(n, std::memory_order_relaxed); }
+    int64_t value() { return this->current.load(std::memory_order_relaxed); }
+private:
+    std::atomic<int64_t> current;
+};
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+/* HDR-style histogram of ns durations: each power of two is split into
+   HISTOGRAM_SUB_BUCKETS linear buckets, so quantiles are accurate to within
+   12.5% at any scale. Recording is a couple of relaxed atomic adds. */
+class Histogram {
+public:
+    Histogram();
+    void record(int64_t ns);
+    uint64_t count();
+    uint64_t sum();
+    // Estimate of the value at quantile `q` (0-1), in ns.
+    int64_t quantile(double q);
+private:
+    std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> total_ns;
+};
+
+/* Named metrics for the metrics command and the Prometheus listener.
+
+   Metrics are registered once, usually into a function-local static at the
+   point being measured, and live as long as the registry. Registration takes a
+   lock; updating a metric never does. Reading everything out must be done on
+   the Uv thread, since callback gauges may look at Uv-owned state.
+
+ */
+class MetricsRegistry {
+public:
+    Counter *counter(const std::string &name, const std::string &help);
+    Gauge *gauge(const std::string &name, const std::string &help);
+    // A gauge whose value is read from `fn` whenever the metrics are exported.
+    void gauge(const std::string &name, const std::string &help, std::function<int64_t()> fn);
+    Histogram *histogram(const std::string &name, const std::string &help);
+
+    void append(bson_t *doc);
+    std::string prometheus();
+private:
+    enum Type { COUNTER, GAUGE, GAUGE_FN, HISTOGRAM };
+    struct Entry {
+        std::string name;
+        std::string help;
+        Type type;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::function<int64_t()> gauge_fn;
+        std::unique_ptr<Histogram> histogram;
+    };
+    Entry *find(const std::string &name, Type type);
+
+    std::mutex lock;
+    std::list<Entry> entries;
+};
@@ -3,11 +3,23 @@
 #include "draconity.h"
 #include "phrase.h"
 #include "server.h"
+#include "trace.h"
+#include "transport/server.h"
 #include "transport/transport.h"
 
-extern "C" {
+/* Split Dragon's packed phrase into its words. */
+void phrase_words(char *phrase, std::vector<std::string> &words) {
+    uint32_t len = *(uint32_t *)phrase;
+    char *end = phrase + len;
+    char *pos = phrase + 4;
+    while (pos < end) {
+        dsx_id *ent = (dsx_id *)pos;
+        words.push_back(ent->name);
+        pos += ent->size;
+    }
+}
 
-static void phrase_to_bson(bson_t *obj, char *phrase) {
+void phrase_to_bson(bson_t *obj, char *phrase) {
     bson_t array;
     char keystr[16];
     const char *key;
@@ -26,19 +38,16 @@ static void phrase_to_bson(bson_t *obj, char *phrase) {
     bson_append_array_end(obj, &array);
 }
 
-static void result_to_bson(bson_t *obj, dsx_result *result) {
-    bson_t words;
-    BSON_APPEND_ARRAY_BEGIN(obj, "words", &words);
-    char keystr[16];
-    const char *key;
-
+bool result_words(dsx_result *result, int choice, std::vector<PhraseWord> &words) {
+    bool found = false;
     uint32_t paths;
     size_t needed = 0;
-    int rc = _DSXResult_BestPathWord(result, 0, &paths, 1, &needed);
+    int rc = _DSXResult_BestPathWord(result, choice, &paths, 1, &needed);
     if (rc == 33) {
         uint32_t *paths = new uint32_t[needed];
-        rc = _DSXResult_BestPathWord(result, 0, paths, needed, &needed);
+        rc = _DSXResult_BestPathWord(result, choice, paths, needed, &needed);
         if (rc == 0) {
+            found = true;
             int64_t ts_offset_ns = dr_monotonic_offset();
             dsx_word_node node;
             // get the rule number and cfg node information for each word
@@ -53,63 +62,237 @@ static void result_to_bson(bson_t *obj, dsx_result *result) {
                 int64_t end_time_ms   = node.end_time;
                 int64_t start_time_ns = (start_time_ms * 1e6L) + ts_offset_ns;
                 int64_t end_time_ns   = (end_time_ms   * 1e6L) + ts_offset_ns;
-
-                bson_t wdoc;
-                bson_uint32_to_string(i, &key, keystr, sizeof(keystr));
-                BSON_APPEND_DOCUMENT_BEGIN(&words, key, &wdoc);
-                BSON_APPEND_UTF8(&wdoc, "word", word);
-                BSON_APPEND_INT32(&wdoc, "id", id);
-                BSON_APPEND_INT32(&wdoc, "rule", node.rule);
-                BSON_APPEND_INT64(&wdoc, "start", start_time_ns);
-                BSON_APPEND_INT64(&wdoc, "end", end_time_ns);
-                bson_append_document_end(&words, &wdoc);
+                words.push_back({word, id, node.rule, start_time_ns, end_time_ns});
             }
         }
         delete []paths;
     }
-    bson_append_array_end(obj, &words);
+    return found;
 }
 
-void phrase_publish(void *key, char *phrase, dsx_result *result, const char *cmd, bool use_result, bool send_wav) {
-    bson_t obj = BSON_INITIALIZER;
-    std::shared_ptr<Grammar> grammar = draconity->get_grammar((uintptr_t)key);
-    if (grammar == NULL) return;
+void words_to_bson(bson_t *obj, const std::vector<PhraseWord> &words, size_t first) {
+    bson_t array;
+    BSON_APPEND_ARRAY_BEGIN(obj, "words", &array);
+    char keystr[16];
+    const char *key;
+    for (size_t i = first; i < words.size(); i++) {
+        const PhraseWord &word = words[i];
+        bson_t wdoc;
+        bson_uint32_to_string(i - first, &key, keystr, sizeof(keystr));
+        BSON_APPEND_DOCUMENT_BEGIN(&array, key, &wdoc);
+        BSON_APPEND_UTF8(&wdoc, "word", word.word.c_str());
+        BSON_APPEND_INT32(&wdoc, "id", word.id);
+        BSON_APPEND_INT32(&wdoc, "rule", word.rule);
+        BSON_APPEND_INT64(&wdoc, "start", word.start);
+        BSON_APPEND_INT64(&wdoc, "end", word.end);
+        bson_append_document_end(&array, &wdoc);
+    }
+    bson_append_array_end(obj, &array);
+}
+
+bool result_to_bson(bson_t *obj, dsx_result *result, int choice) {
+    std::vector<PhraseWord> words;
+    bool found = result_words(result, choice, words);
+    words_to_bson(obj, words, 0);
+    return found;
+}
+
+/* Copy what a p.end needs out of Dragon's callback.
+
+   This runs on Dragon's thread, so it only copies raw data - all encoding
+   happens later in `phrase_record_publish`.
+
+ */
+static PhraseRecord *phrase_capture(void *key, dsx_end_phrase *endphrase, bool use_result, int64_t entered) {
+    PhraseRecord *record = new PhraseRecord();
+    memset(&record->timeline, 0, sizeof(record->timeline));
+    record->timeline.points[TIMELINE_CALLBACK] = entered;
+    record->key = (uintptr_t)key;
+    record->use_result = use_result;
+    record->result = endphrase->result;
+    record->phrase = NULL;
+    record->words = NULL;
+    record->word_count = 0;
+    record->ts_offset = dr_monotonic_offset();
+    record->mimic = false;
+    if (!use_result) {
+        return record;
+    }
+    uint32_t phrase_len = *(uint32_t *)endphrase->phrase;
+    record->phrase = record->arena.copy(endphrase->phrase, phrase_len);
 
-    BSON_APPEND_UTF8(&obj, "cmd", cmd);
+    uint32_t path;
+    size_t needed = 0;
+    if (_DSXResult_BestPathWord(record->result, 0, &path, 1, &needed) != 33) {
+        return record;
+    }
+    uint32_t *paths = (uint32_t *)record->arena.alloc(needed);
+    if (_DSXResult_BestPathWord(record->result, 0, paths, needed, &needed) != 0) {
+        return record;
+    }
+    uint32_t count = needed / sizeof(uint32_t);
+    record->words = (CapturedWord *)record->arena.alloc(count * sizeof(CapturedWord));
+    for (uint32_t i = 0; i < count; i++) {
+        CapturedWord &captured = record->words[i];
+        char *word = NULL;
+        if (_DSXResult_GetWordNode(record->result, paths[i], &captured.node, &captured.id, &word) || word == NULL) {
+            break;
+        }
+        captured.word = record->arena.copy(word, strlen(word) + 1);
+        record->word_count++;
+    }
+    if (record->word_count > 0) {
+        int64_t end_time_ms = record->words[record->word_count - 1].node.end_time;
+        record->timeline.points[TIMELINE_SPEECH_END] = (int64_t)(end_time_ms * 1e6L) + record->ts_offset;
+    }
+    record->mimic = draconity->matches_mimic(record->words, record->word_count);
+    return record;
+}
+
+/* Encode a captured phrase and send it to the grammar's client.
+
+   Takes ownership of the record and its result. Runs on the Uv thread, unless
+   the phrase queue was unavailable.
+
+ */
+void phrase_record_publish(PhraseRecord *record) {
+    TraceScope trace("publish_phrase", record->key);
+    Timeline &timeline = record->timeline;
+    timeline.points[TIMELINE_DEQUEUED] = dr_monotonic_time();
+    std::shared_ptr<Grammar> grammar = draconity->get_grammar(record->key);
+    timeline.points[TIMELINE_LOOKUP] = dr_monotonic_time();
+    if (grammar == NULL) {
+        if (draconity->bench.running() && server) {
+            server->invoke([] {
+                draconity->bench.published("", false, {});
+            });
+        }
+        _DSXResult_Destroy(record->result);
+        delete record;
+        return;
+    }
+    uint64_t client_id = grammar->state.client_id;
+    bson_t obj = BSON_INITIALIZER;
+    BSON_APPEND_UTF8(&obj, "cmd", "p.end");
     BSON_APPEND_UTF8(&obj, "grammar", grammar->name.c_str());
-    if (use_result) {
-        phrase_to_bson(&obj, phrase);
-        result_to_bson(&obj, result);
-        if (send_wav) {
+    if (record->use_result) {
+        phrase_to_bson(&obj, (char *)record->phrase);
+        std::vector<PhraseWord> words;
+        words.reserve(record->word_count);
+        for (uint32_t i = 0; i < record->word_count; i++) {
+            CapturedWord &captured = record->words[i];
+            int64_t start_time_ms = captured.node.start_time;
+            int64_t end_time_ms   = captured.node.end_time;
+            words.push_back({captured.word, captured.id, captured.node.rule,
+                             (int64_t)(start_time_ms * 1e6L) + record->ts_offset,
+                             (int64_t)(end_time_ms   * 1e6L) + record->ts_offset});
+        }
+        words_to_bson(&obj, words, 0);
+        // Retention is charged from the word timings unless the audio gets
+        // fetched here anyway.
+        size_t wav_size = 0;
+        bool measured = false;
+        if (!record->mimic && record->word_count > 0) {
+            wav_size = ResultStore::estimate(record->words[record->word_count - 1].node.end_time -
+                                             record->words[0].node.start_time);
+        }
+        if (record->mimic) {
+            // Mimics have no audio worth sending.
+            BSON_APPEND_BOOL(&obj, "mimic", true);
+        } else if (draconity->client_options(client_id).send_wav) {
             dsx_dataptr dp = {.data = NULL, .size = 0};
-            if (_DSXResult_GetWAV(result, &dp) == 0 && dp.data != NULL && dp.size > 0) {
+            if (_DSXResult_GetWAV(record->result, &dp) == 0 && dp.data != NULL && dp.size > 0) {
                 BSON_APPEND_BINARY(&obj, "wav", BSON_SUBTYPE_BINARY, (const uint8_t *)dp.data, dp.size);
+                wav_size = dp.size;
+                measured = true;
             }
         }
+        // Anything else the client wants can be fetched later by id.
+        uint64_t utterance = draconity->results.add(record->result, grammar->name, client_id, wav_size, measured);
+        if (utterance) {
+            BSON_APPEND_INT64(&obj, "utterance", utterance);
+        }
     } else {
         bson_t array;
         BSON_APPEND_ARRAY_BEGIN(&obj, "phrase", &array);
         bson_append_array_end(&obj, &array);
+        _DSXResult_Destroy(record->result);
     }
-    draconity_send("phrase", &obj, PUBLISH_TID, grammar->state.client_id);
+    timeline.points[TIMELINE_ENCODED] = dr_monotonic_time();
+    // The client's copy can only cover the points before the send.
+    if (draconity->client_options(client_id).timeline) {
+        timeline_to_bson(&obj, timeline);
+    }
+    bool bench = draconity->bench.running();
+    std::vector<std::string> words;
+    if (bench && record->use_result) {
+        phrase_words((char *)record->phrase, words);
+    }
+    // The timeline and the benchmark are stamped when the write completes,
+    // not when it's queued.
+    timeline.points[TIMELINE_SENT] = dr_monotonic_time();
+    draconity_send("phrase", &obj, PUBLISH_TID, client_id,
+                   [timeline, bench, name{grammar->name}, ours{record->use_result},
+                    words{std::move(words)}](bool written) mutable {
+        if (written) {
+            timeline_written(timeline);
+        }
+        if (bench) {
+            draconity->bench.published(name, ours, std::move(words));
+        }
+    });
+    delete record;
 }
 
+extern "C" {
+
 int phrase_end(void *key, dsx_end_phrase *endphrase) {
+    int64_t entered = dr_monotonic_time();
+    static Counter *ends = draconity->metrics.counter("draconity_phrase_end_total", "Phrase end callbacks");
+    ends->inc();
+    TraceScope trace("phrase_end", (uintptr_t)key);
+    draconity->note_phrase_end();
+    draconity->bench.phrase_end();
+    // Drop any hypothesis still waiting, so it can't arrive after the p.end.
+    draconity->hypotheses.reset((uintptr_t)key);
     bool accept = (endphrase->flags & 1) == 1;
     bool ours = (endphrase->flags & 2) == 2;
 
-    phrase_publish(key, endphrase->phrase, endphrase->result, "p.end", (accept && ours), true);
-    _DSXResult_Destroy(endphrase->result);
+    PhraseRecord *record = phrase_capture(key, endphrase, (accept && ours), entered);
+    record->timeline.points[TIMELINE_QUEUED] = dr_monotonic_time();
+    if (!draconity->phrase_queue.push(record)) {
+        // Nowhere to queue it, so do the work here as we used to.
+        phrase_record_publish(record);
+    }
     return 0;
 }
 
 int phrase_hypothesis(void *key, dsx_hypothesis *hypothesis) {
-    phrase_publish(key, hypothesis->phrase, hypothesis->result, "p.hypothesis", true, false);
+    static Counter *hypotheses = draconity->metrics.counter("draconity_phrase_hypothesis_total", "Phrase hypothesis callbacks");
+    hypotheses->inc();
+    TraceScope trace("phrase_hypothesis", (uintptr_t)key);
+    std::shared_ptr<Grammar> grammar = draconity->get_grammar((uintptr_t)key);
+    if (grammar != NULL) {
+        // Capture what the message needs now; encoding and sending happen on
+        // the Uv thread once the pipeline decides this one is worth sending.
+        Hypothesis captured;
+        captured.grammar = grammar->name;
+        captured.client_id = grammar->state.client_id;
+        phrase_words(hypothesis->phrase, captured.phrase);
+        result_words(hypothesis->result, 0, captured.words);
+        draconity->hypotheses.push((uintptr_t)key, std::move(captured));
+    }
     _DSXResult_Destroy(hypothesis->result);
     return 0;
 }
 
 int phrase_begin(void *key, void *data) {
+    static Counter *begins = draconity->metrics.counter("draconity_phrase_begin_total", "Phrase begin callbacks");
+    begins->inc();
+    trace_instant("phrase_begin", (uintptr_t)key);
+    draconity->note_phrase_begin();
+    draconity->bench.phrase_begin();
+    draconity->hypotheses.reset((uintptr_t)key);
     std::shared_ptr<Grammar> grammar = draconity->get_grammar((uintptr_t)key);
     if (grammar == NULL) return 0;
     draconity_send("phrase",
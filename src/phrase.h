@@ -1,6 +1,7 @@
 #ifndef PHRASE_END_H
 #define PHRASE_END_H
 
+#include <bson.h>
 #include "draconity.h"
 
 extern "C" {
@@ -11,4 +12,15 @@ int phrase_begin(void *key, void *data);
 
 } // extern "C"
 
+void phrase_words(char *phrase, std::vector<std::string> &words);
+// Appends a packed phrase's words as a "phrase" array.
+void phrase_to_bson(bson_t *obj, char *phrase);
+// Collects the words of one of a result's choices (0 is the best path).
+// Returns false if the result has no such choice.
+bool result_words(dsx_result *result, int choice, std::vector<PhraseWord> &words);
+// Appends a "words" array, starting from word `first`.
+void words_to_bson(bson_t *obj, const std::vector<PhraseWord> &words, size_t first);
+bool result_to_bson(bson_t *obj, dsx_result *result, int choice);
+void phrase_record_publish(PhraseRecord *record);
+
 #endif
@@ -0,0 +1,82 @@
+#include <algorithm>
+#include <cstring>
+#include "phrase_queue.h"
+#include "transport/server.h"
+
+Arena::Arena() {
+    this->pos = this->first;
+    this->remaining = sizeof(this->first);
+}
+
+Arena::~Arena() {
+    for (char *block : this->blocks) {
+        delete []block;
+    }
+}
+
+void *Arena::alloc(size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (size > this->remaining) {
+        size_t block_size = std::max(size, (size_t)4096);
+        char *block = new char[block_size];
+        this->blocks.push_back(block);
+        this->pos = block;
+        this->remaining = block_size;
+    }
+    void *ptr = this->pos;
+    this->pos += size;
+    this->remaining -= size;
+    return ptr;
+}
+
+const char *Arena::copy(const void *data, size_t size) {
+    char *ptr = (char *)this->alloc(size);
+    memcpy(ptr, data, size);
+    return ptr;
+}
+
+PhraseQueue::PhraseQueue() {
+    this->head = 0;
+    this->tail = 0;
+    this->running = false;
+    this->consume = nullptr;
+}
+
+void PhraseQueue::init(void (*consume)(PhraseRecord *)) {
+    this->consume = consume;
+    this->running.store(true, std::memory_order_release);
+}
+
+bool PhraseQueue::push(PhraseRecord *record) {
+    if (!this->running.load(std::memory_order_acquire)) {
+        return false;
+    }
+    size_t tail = this->tail.load(std::memory_order_relaxed);
+    if (tail - this->head.load(std::memory_order_acquire) == capacity) {
+        return false;
+    }
+    this->slots[tail % capacity] = record;
+    this->tail.store(tail + 1, std::memory_order_release);
+    // There's one producer, so the calls queued here run in push order and
+    // each one takes the record pushed with it.
+    server->invoke([this] {
+        this->consume_next();
+    });
+    return true;
+}
+
+// Approximate when called from anywhere but the consumer.
+size_t PhraseQueue::depth() {
+    return this->tail.load(std::memory_order_relaxed) - this->head.load(std::memory_order_relaxed);
+}
+
+void PhraseQueue::consume_next() {
+    size_t head = this->head.load(std::memory_order_relaxed);
+    if (head == this->tail.load(std::memory_order_acquire)) {
+        return;
+    }
+    PhraseRecord *record = this->slots[head % capacity];
+    // Free the slot before the (comparatively slow) publish.
+    this->head.store(head + 1, std::memory_order_release);
+    this->consume(record);
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include "timeline.h"
+#include "types.h"
+
+/* Bump allocator for one utterance's captured data. Everything is freed at
+   once when the arena is destroyed. The first block is inline, so a short
+   utterance costs a single allocation. */
+class Arena {
+public:
+    Arena();
+    ~Arena();
+    void *alloc(size_t size);
+    const char *copy(const void *data, size_t size);
+private:
+    Arena(const Arena &);
+    Arena& operator=(const Arena &);
+
+    std::vector<char *> blocks;
+    char *pos;
+    size_t remaining;
+    alignas(8) char first[1024];
+};
+
+/* A word node copied out of a result. */
+struct CapturedWord {
+    const char *word;
+    uint32_t id;
+    dsx_word_node node;
+};
+
+/* Raw data from one end-phrase callback, waiting to be encoded. */
+struct PhraseRecord {
+    Arena arena;
+    uintptr_t key;
+    bool use_result;
+    // Still owned by us - handed to the result store once published.
+    dsx_result *result;
+    const char *phrase;  // Copy of Dragon's packed phrase, or NULL
+    CapturedWord *words;
+    uint32_t word_count;
+    int64_t ts_offset;   // dr_monotonic_offset() at capture time
+    bool mimic;          // Recognised as the words of the mimic in flight
+    Timeline timeline;
+};
+
+/* Lock-free single-producer, single-consumer queue of phrase records.
+
+   The producer is Dragon's end-phrase callback thread; the consumer is the Uv
+   thread. Each push also queues one `consume_next` through UvServer::invoke,
+   so a p.end goes out in order with everything else sent through invoke
+   (the p.begin before it, a mimic reply after it).
+
+ */
+class PhraseQueue {
+public:
+    PhraseQueue();
+    // Must be called from the Uv thread.
+    void init(void (*consume)(PhraseRecord *));
+    // Returns false if the queue is full or not yet running, in which case the
+    // caller still owns `record`.
+    bool push(PhraseRecord *record);
+    size_t depth();
+private:
+    void consume_next();
+
+    static const size_t capacity = 256;
+    PhraseRecord *slots[capacity];
+    std::atomic<size_t> head;  // Next slot to read, owned by the consumer
+    std::atomic<size_t> tail;  // Next slot to write, owned by the producer
+    std::atomic<bool> running;
+    void (*consume)(PhraseRecord *);
+};
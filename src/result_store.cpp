@@ -0,0 +1,107 @@
+#include "result_store.h"
+#include "draconity.h"
+
+RetainedResult::RetainedResult(uint64_t id, dsx_result *result, std::string grammar, uint64_t client_id,
+                               size_t size, bool measured) {
+    this->id = id;
+    this->result = result;
+    this->grammar = grammar;
+    this->client_id = client_id;
+    this->size = size;
+    this->measured = measured;
+}
+
+RetainedResult::~RetainedResult() {
+    _DSXResult_Destroy(this->result);
+}
+
+ResultStore::ResultStore() {
+    this->next_id = 1;
+    this->total_bytes = 0;
+    this->max_count = 0;
+    this->max_bytes = 0;
+}
+
+void ResultStore::configure(size_t max_count, size_t max_bytes) {
+    this->lock.lock();
+    this->max_count = max_count;
+    this->max_bytes = max_bytes;
+    this->lock.unlock();
+}
+
+/* The size is usually an estimate from the word timings: asking Dragon for
+   the WAV just to measure it would produce the audio for every utterance,
+   which is what keeping results around is meant to avoid. */
+uint64_t ResultStore::add(dsx_result *result, const std::string &grammar, uint64_t client_id,
+                          size_t size, bool measured) {
+    // Evicted results are released outside the lock, since destroying them
+    // calls back into Dragon.
+    std::deque<std::shared_ptr<RetainedResult>> evicted;
+    this->lock.lock();
+    if (this->max_count == 0 || size > this->max_bytes) {
+        this->lock.unlock();
+        _DSXResult_Destroy(result);
+        return 0;
+    }
+    uint64_t id = this->next_id++;
+    while (!this->results.empty() &&
+           (this->results.size() >= this->max_count || this->total_bytes + size > this->max_bytes)) {
+        this->total_bytes -= this->results.front()->size;
+        evicted.push_back(std::move(this->results.front()));
+        this->results.pop_front();
+    }
+    this->results.push_back(std::make_shared<RetainedResult>(id, result, grammar, client_id, size, measured));
+    this->total_bytes += size;
+    this->lock.unlock();
+    return id;
+}
+
+std::shared_ptr<RetainedResult> ResultStore::get(uint64_t id) {
+    std::shared_ptr<RetainedResult> found;
+    this->lock.lock();
+    // Ids are handed out in order and evicted from the front, so the position
+    // of an id is just its distance from the oldest one.
+    if (!this->results.empty()) {
+        uint64_t oldest = this->results.front()->id;
+        if (id >= oldest && id - oldest < this->results.size()) {
+            found = this->results[id - oldest];
+        }
+    }
+    this->lock.unlock();
+    return found;
+}
+
+void ResultStore::measured(const std::shared_ptr<RetainedResult> &retained, size_t size) {
+    std::deque<std::shared_ptr<RetainedResult>> evicted;
+    this->lock.lock();
+    if (!retained->measured) {
+        // It may have been evicted since it was fetched.
+        uint64_t oldest = this->results.empty() ? 0 : this->results.front()->id;
+        if (!this->results.empty() && retained->id >= oldest && retained->id - oldest < this->results.size()) {
+            this->total_bytes = this->total_bytes - retained->size + size;
+        }
+        retained->size = size;
+        retained->measured = true;
+        // The estimate may have been short.
+        while (!this->results.empty() && this->total_bytes > this->max_bytes) {
+            this->total_bytes -= this->results.front()->size;
+            evicted.push_back(std::move(this->results.front()));
+            this->results.pop_front();
+        }
+    }
+    this->lock.unlock();
+}
+
+size_t ResultStore::count() {
+    this->lock.lock();
+    size_t count = this->results.size();
+    this->lock.unlock();
+    return count;
+}
+
+size_t ResultStore::bytes() {
+    this->lock.lock();
+    size_t bytes = this->total_bytes;
+    this->lock.unlock();
+    return bytes;
+}
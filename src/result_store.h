@@ -0,0 +1,67 @@
+#pragma once
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include "types.h"
+
+// For estimating a result's audio before Dragon has produced it: roughly
+// 11kHz 16-bit mono, plus the silence around the words.
+#define RESULT_WAV_BYTES_PER_MS 22
+#define RESULT_WAV_PADDING_MS 500
+
+/* A recognition result kept alive after its p.end was sent. Owns the result
+   and destroys it when the last reference goes away. */
+struct RetainedResult {
+    RetainedResult(uint64_t id, dsx_result *result, std::string grammar, uint64_t client_id,
+                   size_t size, bool measured);
+    ~RetainedResult();
+
+    uint64_t id;
+    dsx_result *result;
+    std::string grammar;
+    uint64_t client_id;  // Only this client may query it
+    size_t size;    // Bytes of audio charged for the result
+    bool measured;  // Whether `size` is the real size rather than an estimate
+private:
+    RetainedResult(const RetainedResult &);
+    RetainedResult& operator=(const RetainedResult &);
+};
+
+/* Bounded ring of recent results, so clients can fetch audio and alternative
+   paths on demand rather than with every p.end.
+
+   Results are added from Dragon's threads and queried from the Uv thread.
+
+ */
+class ResultStore {
+public:
+    ResultStore();
+    void configure(size_t max_count, size_t max_bytes);
+
+    // Takes ownership of `result`, charging `size` bytes for it. Returns the
+    // utterance id, or 0 if retention is disabled (in which case the result
+    // has already been destroyed).
+    uint64_t add(dsx_result *result, const std::string &grammar, uint64_t client_id,
+                 size_t size, bool measured);
+    std::shared_ptr<RetainedResult> get(uint64_t id);
+    // Replaces a result's estimated size with its real one, once something
+    // has fetched its audio anyway.
+    void measured(const std::shared_ptr<RetainedResult> &retained, size_t size);
+
+    // Audio bytes to charge for an utterance `audio_ms` long.
+    static size_t estimate(int64_t audio_ms) {
+        return (size_t)(std::max(audio_ms, (int64_t)0) + RESULT_WAV_PADDING_MS) * RESULT_WAV_BYTES_PER_MS;
+    }
+
+    size_t count();
+    size_t bytes();
+private:
+    std::mutex lock;
+    std::deque<std::shared_ptr<RetainedResult>> results;
+    uint64_t next_id;
+    size_t total_bytes;
+    size_t max_count;
+    size_t max_bytes;
+};
@@ -10,11 +10,14 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "transport/server.h"
 #include "transport/transport.h"
 #include "phrase.h"
 #include "server.h"
 #include "draconity.h"
 #include "dr_time.h"
+#include "log.h"
+#include "trace.h"
 
 #ifndef streq
 #define streq(a, b) !strcmp(a, b)
@@ -49,31 +52,20 @@ void draconity_publish(const char *topic, bson_t *obj) {
 }
 
 /* Publish a message to a single client */
-void draconity_send(const char *topic, bson_t *obj, uint32_t tid, uint64_t client_id) {
+void draconity_send(const char *topic, bson_t *obj, uint32_t tid, uint64_t client_id, WrittenFn on_written) {
+    if (tid == NO_REPLY_TID) {
+        bson_destroy(obj);
+        if (on_written) on_written(false);
+        return;
+    }
     auto response = prep_response(topic, obj);
     if (!response.empty()) {
-        draconity_transport_send(std::move(response), tid, client_id);
+        draconity_transport_send(std::move(response), tid, client_id, on_written);
+    } else if (on_written) {
+        on_written(false);
     }
 }
 
-void draconity_logf(const char *fmt, ...) {
-    char *str = NULL;
-    va_list va;
-    va_start(va, fmt);
-    int needed = vsnprintf(NULL, 0, fmt, va);
-    va_end(va);
-
-    va_start(va, fmt);
-    str = new char[needed + 1];
-    vsnprintf(str, needed + 1, fmt, va);
-    va_end(va);
-
-    bson_t obj = BSON_INITIALIZER;
-    BSON_APPEND_UTF8(&obj, "msg", str);
-    draconity_publish("log", &obj);
-    delete str;
-}
-
 static const char *micstates[] = {
     "disabled",
     "off",
@@ -101,23 +93,105 @@ static bson_t *success_msg() {
     return BCON_NEW("success", BCON_BOOL(true));
 }
 
-static bson_t *handle_message(uint64_t client_id, uint32_t tid, const std::vector<uint8_t> &msg) {
+/* Pack a BSON array of words into the buffer _DSXEngine_Mimic expects.
+
+   Returns an error message on failure.
+
+ */
+static std::string encode_mimic_phrase(const uint8_t *buf, uint32_t len,
+                                       std::vector<uint8_t> &phrase, unsigned int *count) {
+    bson_iter_t iter;
+    if (!bson_iter_init_from_data(&iter, buf, len)) {
+        return "mimic phrase iter failed";
+    }
+    // get size of all strings in phrase
+    size_t size = 0;
+    while (bson_iter_next(&iter)) {
+        if (!BSON_ITER_HOLDS_UTF8(&iter)) {
+            return "phrase contains non-string value";
+        }
+        uint32_t length = 0;
+        bson_iter_utf8(&iter, &length);
+        size += length + 1;
+    }
+    phrase.assign(size, 0);
+    uint8_t *pos = phrase.data();
+    bson_iter_init_from_data(&iter, buf, len);
+    *count = 0;
+    while (bson_iter_next(&iter)) {
+        uint32_t length = 0;
+        const char *word = bson_iter_utf8(&iter, &length);
+        memcpy(pos, word, length);
+        pos += length + 1;
+        (*count)++;
+    }
+    return "";
+}
+
+/* Calls fn with each word in a BSON array of words. Returns an error message
+   on failure. */
+template <typename F>
+static std::string read_words(const uint8_t *buf, uint32_t len, F fn) {
+    bson_iter_t iter;
+    if (!bson_iter_init_from_data(&iter, buf, len)) {
+        return "word iter failed";
+    }
+    while (bson_iter_next(&iter)) {
+        if (!BSON_ITER_HOLDS_UTF8(&iter)) {
+            return "words contains non-string value";
+        }
+        fn(bson_iter_utf8(&iter, NULL));
+    }
+    return "";
+}
+
+/* Decode a g.set's active_rules. Returns an error message on failure. */
+static std::string read_rules(const uint8_t *buf, uint32_t len, InternedSet &active_rules) {
+    bson_iter_t iter;
+    // Views into the message, interned once the whole array is read.
+    std::vector<std::string_view> rules;
+    if (!bson_iter_init_from_data(&iter, buf, len)) {
+        return "active_rules iter failed";
+    }
+    while (bson_iter_next(&iter)) {
+        if (!BSON_ITER_HOLDS_UTF8(&iter)) {
+            return "active_rules array contained non-string element";
+        }
+        uint32_t length;
+        const char *rule = bson_iter_utf8(&iter, &length);
+        rules.emplace_back(rule, length);
+    }
+    active_rules = InternedSet(rules);
+    return "";
+}
+
+bson_t *handle_message(uint64_t client_id, uint32_t tid, const uint8_t *msg, size_t msg_len) {
     std::ostringstream errstream;
     std::string errmsg = "";
 
-    char *cmd = NULL, *name = NULL, *state = NULL;
+    char *cmd = NULL, *name = NULL, *state = NULL, *corpus = NULL, *param = NULL;
     bool exclusive = false;
     int priority = 0, counter;
     // Dragon won't supply a pause token of 0, so 0 implies no token.
     uint64_t token = 0;
+    // Utterance ids start at 1, so 0 implies no id.
+    uint64_t utterance = 0;
+    int choice = 0, count = 10;
+    bool wav = false, has_wav = false;
+    int hypothesis_interval = -1;
+    int window = 4;
+    bool hypothesis_suffix = false, has_hypothesis_suffix = false;
+    bool timeline = false, has_timeline = false;
+    bool enabled = false, has_enabled = false;
+    bool to_file = false;
     bool has_exclusive = false, has_priority = false, has_lists = false;
 
-    const uint8_t *data_buf = NULL, *phrase_buf = NULL, *words_buf, *active_rules_buf = NULL, *lists_buf = NULL;
-    uint32_t data_len = 0, phrase_len = 0, words_len, active_rules_len = 0, lists_len = 0;
+    const uint8_t *data_buf = NULL, *phrase_buf = NULL, *words_buf = NULL, *add_buf = NULL, *remove_buf = NULL, *active_rules_buf = NULL, *lists_buf = NULL, *rules_buf = NULL, *phrases_buf = NULL, *values_buf = NULL;
+    uint32_t data_len = 0, phrase_len = 0, words_len = 0, add_len = 0, remove_len = 0, active_rules_len = 0, lists_len = 0, rules_len = 0, phrases_len = 0, values_len = 0;
 
     bson_t *resp = NULL;
     bson_t root;
-    if (!bson_init_static(&root, &msg[0], msg.size())) {
+    if (!bson_init_static(&root, msg, msg_len)) {
         errmsg = "bson init error";
         goto end;
     }
@@ -129,6 +203,10 @@ static bson_t *handle_message(uint64_t client_id, uint32_t tid, const std::vecto
                 cmd = bson_iter_dup_utf8(&iter, NULL);
             } else if (streq(key, "name") && BSON_ITER_HOLDS_UTF8(&iter)) {
                 name = bson_iter_dup_utf8(&iter, NULL);
+            } else if (streq(key, "corpus") && BSON_ITER_HOLDS_UTF8(&iter)) {
+                corpus = bson_iter_dup_utf8(&iter, NULL);
+            } else if (streq(key, "param") && BSON_ITER_HOLDS_UTF8(&iter)) {
+                param = bson_iter_dup_utf8(&iter, NULL);
             } else if (streq(key, "state") && BSON_ITER_HOLDS_UTF8(&iter)) {
                 state = bson_iter_dup_utf8(&iter, NULL);
             } else if (streq(key, "exclusive") && BSON_ITER_HOLDS_BOOL(&iter)) {
@@ -139,15 +217,49 @@ static bson_t *handle_message(uint64_t client_id, uint32_t tid, const std::vecto
                 has_priority = true;
             } else if (streq(key, "token") && BSON_ITER_HOLDS_INT64(&iter)) {
                 token = bson_iter_int64(&iter);
+            } else if (streq(key, "utterance") && BSON_ITER_HOLDS_INT64(&iter)) {
+                utterance = bson_iter_int64(&iter);
+            } else if (streq(key, "choice") && BSON_ITER_HOLDS_INT32(&iter)) {
+                choice = bson_iter_int32(&iter);
+            } else if (streq(key, "count") && BSON_ITER_HOLDS_INT32(&iter)) {
+                count = bson_iter_int32(&iter);
+            } else if (streq(key, "wav") && BSON_ITER_HOLDS_BOOL(&iter)) {
+                wav = bson_iter_bool(&iter);
+                has_wav = true;
+            } else if (streq(key, "hypothesis_interval") && BSON_ITER_HOLDS_INT32(&iter)) {
+                hypothesis_interval = bson_iter_int32(&iter);
+            } else if (streq(key, "hypothesis_suffix") && BSON_ITER_HOLDS_BOOL(&iter)) {
+                hypothesis_suffix = bson_iter_bool(&iter);
+                has_hypothesis_suffix = true;
+            } else if (streq(key, "enabled") && BSON_ITER_HOLDS_BOOL(&iter)) {
+                enabled = bson_iter_bool(&iter);
+                has_enabled = true;
+            } else if (streq(key, "file") && BSON_ITER_HOLDS_BOOL(&iter)) {
+                to_file = bson_iter_bool(&iter);
+            } else if (streq(key, "timeline") && BSON_ITER_HOLDS_BOOL(&iter)) {
+                timeline = bson_iter_bool(&iter);
+                has_timeline = true;
             } else if (streq(key, "active_rules") && BSON_ITER_HOLDS_ARRAY(&iter)) {
                 bson_iter_array(&iter, &active_rules_len, &active_rules_buf);
             } else if (streq(key, "lists") && BSON_ITER_HOLDS_DOCUMENT(&iter)) {
                 bson_iter_document(&iter, &lists_len, &lists_buf);
                 has_lists = true;
+            } else if (streq(key, "rules") && BSON_ITER_HOLDS_DOCUMENT(&iter)) {
+                bson_iter_document(&iter, &rules_len, &rules_buf);
             } else if (streq(key, "phrase") && BSON_ITER_HOLDS_ARRAY(&iter)) {
                 bson_iter_array(&iter, &phrase_len, &phrase_buf);
+            } else if (streq(key, "phrases") && BSON_ITER_HOLDS_ARRAY(&iter)) {
+                bson_iter_array(&iter, &phrases_len, &phrases_buf);
+            } else if (streq(key, "values") && BSON_ITER_HOLDS_ARRAY(&iter)) {
+                bson_iter_array(&iter, &values_len, &values_buf);
+            } else if (streq(key, "window") && BSON_ITER_HOLDS_INT32(&iter)) {
+                window = bson_iter_int32(&iter);
             } else if (streq(key, "words") && BSON_ITER_HOLDS_ARRAY(&iter)) {
                 bson_iter_array(&iter, &words_len, &words_buf);
+            } else if (streq(key, "add") && BSON_ITER_HOLDS_ARRAY(&iter)) {
+                bson_iter_array(&iter, &add_len, &add_buf);
+            } else if (streq(key, "remove") && BSON_ITER_HOLDS_ARRAY(&iter)) {
+                bson_iter_array(&iter, &remove_len, &remove_buf);
             } else if (streq(key, "data") && BSON_ITER_HOLDS_BINARY(&iter)) {
                 bson_iter_binary(&iter, NULL, &data_len, &data_buf);
             }
@@ -213,24 +325,32 @@ static bson_t *handle_message(uint64_t client_id, uint32_t tid, const std::vecto
             goto end;
         } else if (streq(cmd, "w.set")) {
             std::set<std::string> shadow_words = {};
-            if (!words_buf || !words_len) {
-                errmsg = "missing or broken words field";
-                goto end;
-            }
-            if (!bson_iter_init_from_data(&iter, words_buf, words_len)) {
-                errmsg = "word iter failed";
-                goto end;
-            }
-            while (bson_iter_next(&iter)) {
-                if (!BSON_ITER_HOLDS_UTF8(&iter)) {
-                    errmsg = "words contains non-string value";
-                    goto end;
+            if (words_buf) {
+                errmsg = read_words(words_buf, words_len, [&](const char *word) {
+                    shadow_words.insert(word);
+                });
+            } else if (add_buf || remove_buf) {
+                // Changes to the words the client last asked for.
+                shadow_words = draconity->client_words(client_id);
+                if (remove_buf) {
+                    errmsg = read_words(remove_buf, remove_len, [&](const char *word) {
+                        shadow_words.erase(word);
+                    });
                 }
-                const char *word = bson_iter_utf8(&iter, NULL);
-                shadow_words.insert(word);
+                if (add_buf && errmsg.empty()) {
+                    errmsg = read_words(add_buf, add_len, [&](const char *word) {
+                        shadow_words.insert(word);
+                    });
+                }
+            } else {
+                errmsg = "missing or broken words field";
             }
+            if (errmsg.size() > 0) goto end;
 
+            errmsg = draconity->check_words_quota(client_id, shadow_words);
+            if (errmsg.size() > 0) goto end;
             draconity->set_shadow_words(client_id, tid, shadow_words);
+            draconity->schedule_idle_sync();
 
             // Response will be sent when update is synced (or discarded).
             goto no_response;
@@ -255,29 +375,28 @@ static bson_t *handle_message(uint64_t client_id, uint32_t tid, const std::vecto
         }
 
         if (streq(cmd, "g.set")) {
-            if (!data_buf || !data_len) {
+            // Fields left out keep their current values, so clients can send
+            // only what changed since their last g.set.
+            GrammarState current;
+            bool has_current = draconity->current_grammar_state(name, current);
+            if (data_buf && data_len) {
+                shadow_grammar.blob = SharedBlob(data_buf, data_len);
+            } else if (!data_buf && has_current) {
+                shadow_grammar.blob = current.blob;
+            } else {
                 errmsg = "missing or broken data field";
                 goto end;
             }
-            shadow_grammar.blob = std::move(std::vector<uint8_t>(data_buf, data_buf + data_len));
 
             // Decode "rules"
-            if (!active_rules_buf || !active_rules_len) {
+            if (!active_rules_buf && has_current) {
+                shadow_grammar.active_rules = current.active_rules;
+            } else if (!active_rules_buf || !active_rules_len) {
                 errmsg = "missing or broken active_rules field";
                 goto end;
-            }
-            bson_iter_t rules_iter;
-            if (!bson_iter_init_from_data(&rules_iter, active_rules_buf, active_rules_len)) {
-                errmsg = "active_rules iter failed";
-                goto end;
-            }
-            while (bson_iter_next(&rules_iter)) {
-                if (!BSON_ITER_HOLDS_UTF8(&rules_iter)) {
-                    errmsg = "active_rules array contained non-string element";
-                    goto end;
-                }
-                const char *rule = bson_iter_utf8(&rules_iter, NULL);
-                shadow_grammar.active_rules.insert(rule);
+            } else {
+                errmsg = read_rules(active_rules_buf, active_rules_len, shadow_grammar.active_rules);
+                if (errmsg.size() > 0) goto end;
             }
 
             // Decode "lists"
@@ -304,7 +423,7 @@ static bson_t *handle_message(uint64_t client_id, uint32_t tid, const std::vecto
                         errmsg = errstream.str();
                         goto end;
                     }
-                    std::set<std::string> list_contents;
+                    std::vector<std::string_view> list_contents;
                     // Pull each element out of the list, into a vector.
                     while (bson_iter_next(&this_list_iter)) {
                         if (!BSON_ITER_HOLDS_UTF8(&this_list_iter)) {
@@ -312,14 +431,23 @@ static bson_t *handle_message(uint64_t client_id, uint32_t tid, const std::vecto
                             errmsg = errstream.str();
                             goto end;
                         }
-                        std::string element_str = bson_iter_utf8(&this_list_iter, NULL);
-                        list_contents.insert(element_str);
+                        uint32_t length;
+                        const char *element = bson_iter_utf8(&this_list_iter, &length);
+                        list_contents.emplace_back(element, length);
                     }
-                    shadow_grammar.lists[list_name] = std::move(list_contents);
+                    shadow_grammar.lists[list_name] = InternedSet(list_contents);
+                }
+            }
+            if (has_current && shadow_grammar.blob == current.blob) {
+                // Lists a pending update set stay set unless this one replaces them.
+                for (auto &list_pair : current.lists) {
+                    shadow_grammar.lists.emplace(list_pair.first, list_pair.second);
                 }
             }
             shadow_grammar.unload = false;
 
+            errmsg = draconity->check_grammar_quota(client_id, name, shadow_grammar);
+            if (errmsg.size() > 0) goto end;
             draconity->set_shadow_grammar(name, shadow_grammar);
         } else if (streq(cmd, "g.unload")) {
             shadow_grammar.unload = true;
@@ -331,9 +459,139 @@ static bson_t *handle_message(uint64_t client_id, uint32_t tid, const std::vecto
             // When Dragon is paused, we sync immediately (this allows the
             // client to correct errors before unpausing).
             draconity->sync_state();
+        } else {
+            draconity->schedule_idle_sync();
         }
         // Response will be sent when update is synced (or discarded).
         goto no_response;
+    } else if (streq(cmd, "profile.set")) {
+        if (!name) {
+            errmsg = "no name";
+            goto end;
+        }
+        if (!rules_buf || !rules_len) {
+            errmsg = "missing or broken rules field";
+            goto end;
+        }
+        // "rules" maps each grammar name to an array of rule names.
+        ActivationProfile profile;
+        bson_iter_t rules_iter;
+        if (!bson_iter_init_from_data(&rules_iter, rules_buf, rules_len)) {
+            errmsg = "rules iter failed";
+            goto end;
+        }
+        while (bson_iter_next(&rules_iter)) {
+            std::string grammar_name = bson_iter_key(&rules_iter);
+            bson_iter_t grammar_rules_iter;
+            if (!BSON_ITER_HOLDS_ARRAY(&rules_iter) || !bson_iter_recurse(&rules_iter, &grammar_rules_iter)) {
+                errstream << "rules for grammar \"" << grammar_name << "\" are not an array";
+                errmsg = errstream.str();
+                goto end;
+            }
+            InternedSet &grammar_rules = profile[grammar_name];
+            while (bson_iter_next(&grammar_rules_iter)) {
+                if (!BSON_ITER_HOLDS_UTF8(&grammar_rules_iter)) {
+                    errstream << "a rule for grammar \"" << grammar_name << "\" is not a string";
+                    errmsg = errstream.str();
+                    goto end;
+                }
+                grammar_rules.insert(std::string(bson_iter_utf8(&grammar_rules_iter, NULL)));
+            }
+        }
+        // Takes effect on the next profile.use of this name.
+        draconity->set_profile(name, profile);
+        resp = success_msg();
+        goto end;
+    } else if (streq(cmd, "profile.use")) {
+        if (!draconity->ready) goto not_ready;
+        if (!name) {
+            errmsg = "no name";
+            goto end;
+        }
+        errmsg = draconity->use_profile(client_id, tid, name);
+        if (errmsg.size() > 0) {
+            goto end;
+        }
+        if (draconity->pause_token != 0) {
+            draconity->sync_state();
+        } else {
+            draconity->schedule_idle_sync();
+        }
+        // Response will be sent when the switch is synced (or discarded).
+        goto no_response;
+    } else if (cmd[0] == 'r' && cmd[1] == '.') {
+        // Queries against a retained recognition result.
+        std::shared_ptr<RetainedResult> retained = draconity->results.get(utterance);
+        // Another client's utterances look the same as ones that have expired.
+        if (!retained || retained->client_id != client_id) {
+            errmsg = "unknown or expired utterance";
+            goto end;
+        }
+        bson_t *doc = BCON_NEW(
+            "utterance", BCON_INT64(retained->id),
+            "grammar", BCON_UTF8(retained->grammar.c_str()));
+        if (streq(cmd, "r.wav")) {
+            dsx_dataptr dp = {.data = NULL, .size = 0};
+            if (_DSXResult_GetWAV(retained->result, &dp) != 0 || dp.data == NULL) {
+                bson_destroy(doc);
+                errmsg = "no audio for utterance";
+                goto end;
+            }
+            BSON_APPEND_BINARY(doc, "wav", BSON_SUBTYPE_BINARY, (const uint8_t *)dp.data, dp.size);
+            draconity->results.measured(retained, dp.size);
+        } else if (streq(cmd, "r.words")) {
+            if (!result_to_bson(doc, retained->result, choice)) {
+                bson_destroy(doc);
+                errmsg = "no such choice";
+                goto end;
+            }
+        } else if (streq(cmd, "r.choices")) {
+            // Every alternative path Dragon has, best first.
+            bson_t choices;
+            char keystr[16];
+            const char *key;
+            BSON_APPEND_ARRAY_BEGIN(doc, "choices", &choices);
+            for (int i = 0; i < count; i++) {
+                bson_t choice_doc;
+                bson_init(&choice_doc);
+                bool found = result_to_bson(&choice_doc, retained->result, i);
+                if (found) {
+                    bson_uint32_to_string(i, &key, keystr, sizeof(keystr));
+                    BSON_APPEND_DOCUMENT(&choices, key, &choice_doc);
+                }
+                bson_destroy(&choice_doc);
+                if (!found) break;
+            }
+            bson_append_array_end(doc, &choices);
+        } else {
+            bson_destroy(doc);
+            goto unsupported_command;
+        }
+        BSON_APPEND_BOOL(doc, "success", true);
+        resp = doc;
+        goto end;
+    } else if (streq(cmd, "client.options")) {
+        ClientOptions options = draconity->client_options(client_id);
+        if (has_wav) {
+            options.send_wav = wav;
+        }
+        if (hypothesis_interval >= 0) {
+            options.hypothesis_interval = hypothesis_interval;
+        }
+        if (has_hypothesis_suffix) {
+            options.hypothesis_suffix = hypothesis_suffix;
+        }
+        if (has_timeline) {
+            options.timeline = timeline;
+        }
+        draconity->set_client_options(client_id, options);
+        resp = BCON_NEW(
+            "success", BCON_BOOL(true),
+            "wav", BCON_BOOL(options.send_wav),
+            "hypothesis_interval", BCON_INT32(options.hypothesis_interval),
+            "hypothesis_suffix", BCON_BOOL(options.hypothesis_suffix),
+            "timeline", BCON_BOOL(options.timeline));
+        goto end;
     } else if (streq(cmd, "mic.set_state")) {
         if (!state) {
             errmsg = "missing or broken state field";
@@ -376,7 +634,8 @@ static bson_t *handle_message(uint64_t client_id, uint32_t tid, const std::vecto
             "success", BCON_BOOL(true),
             "ready", BCON_BOOL(draconity->ready),
             "runtime", BCON_INT64(dr_monotonic_time() - draconity->start_ts),
-            "language_id", BCON_INT64(language_id));
+            "language_id", BCON_INT64(language_id),
+            "profile", BCON_UTF8(draconity->active_profile_name.c_str()));
 
         BSON_APPEND_ARRAY_BEGIN(doc, "grammars", &grammars);
         // Iterate over an index and the current grammar
@@ -402,6 +661,100 @@ static bson_t *handle_message(uint64_t client_id, uint32_t tid, const std::vecto
 
         bson_append_array_end(doc, &grammars);
 
+        resp = doc;
+    } else if (streq(cmd, "trace.dump")) {
+        // Files only ever go to the configured trace_path.
+        if (!to_file) {
+            std::string json = trace_json();
+            resp = BCON_NEW("success", BCON_BOOL(true),
+                            "trace", BCON_UTF8(json.c_str()));
+            goto end;
+        }
+        int64_t count = trace_dump();
+        if (count < 0) {
+            errmsg = "could not write trace";
+            goto end;
+        }
+        resp = BCON_NEW("success", BCON_BOOL(true),
+                        "count", BCON_INT64(count));
+    } else if (streq(cmd, "metrics")) {
+        bson_t *doc = success_msg();
+        draconity->metrics.append(doc);
+        resp = doc;
+    } else if (streq(cmd, "dragon.set")) {
+        // Turns Dragon's own commands (the "dragon" pseudo-grammar) on or off.
+        if (!draconity->ready) goto not_ready;
+        if (!has_enabled) {
+            errmsg = "missing or broken enabled field";
+            goto end;
+        }
+        errmsg = draconity->set_dragon_enabled(enabled);
+        if (errmsg.size() > 0) goto end;
+        resp = success_msg();
+    } else if (streq(cmd, "status.memory")) {
+        auto usage = draconity->client_usage();
+        for (auto const &client : server->clients) {
+            usage[client->id].queued_bytes = client->queuedBytes();
+        }
+        bson_t *doc = success_msg();
+        bson_t clients, child;
+        ClientUsage total;
+        BSON_APPEND_DOCUMENT_BEGIN(doc, "clients", &clients);
+        for (auto &pair : usage) {
+            ClientUsage &u = pair.second;
+            std::string id = std::to_string(pair.first);
+            BSON_APPEND_DOCUMENT_BEGIN(&clients, id.c_str(), &child);
+            BSON_APPEND_INT64(&child, "grammars", u.grammars);
+            BSON_APPEND_INT64(&child, "blob_bytes", u.blob_bytes);
+            BSON_APPEND_INT64(&child, "list_entries", u.list_entries);
+            BSON_APPEND_INT64(&child, "active_rules", u.active_rules);
+            BSON_APPEND_INT64(&child, "words", u.words);
+            BSON_APPEND_INT64(&child, "queued_bytes", u.queued_bytes);
+            bson_append_document_end(&clients, &child);
+            total.grammars += u.grammars;
+            total.blob_bytes += u.blob_bytes;
+            total.list_entries += u.list_entries;
+            total.active_rules += u.active_rules;
+            total.words += u.words;
+            total.queued_bytes += u.queued_bytes;
+        }
+        bson_append_document_end(doc, &clients);
+        BSON_APPEND_DOCUMENT_BEGIN(doc, "total", &child);
+        BSON_APPEND_INT64(&child, "grammars", total.grammars);
+        BSON_APPEND_INT64(&child, "blob_bytes", total.blob_bytes);
+        BSON_APPEND_INT64(&child, "list_entries", total.list_entries);
+        BSON_APPEND_INT64(&child, "active_rules", total.active_rules);
+        BSON_APPEND_INT64(&child, "words", total.words);
+        BSON_APPEND_INT64(&child, "queued_bytes", total.queued_bytes);
+        BSON_APPEND_INT64(&child, "retained_result_bytes", draconity->results.bytes());
+        BSON_APPEND_INT64(&child, "interned_strings", interned().count());
+        BSON_APPEND_INT64(&child, "interned_bytes", interned().bytes());
+        bson_append_document_end(doc, &child);
+        ClientQuota &q = draconity->quota;
+        BSON_APPEND_DOCUMENT_BEGIN(doc, "quota", &child);
+        BSON_APPEND_INT64(&child, "grammars", q.grammars);
+        BSON_APPEND_INT64(&child, "blob_bytes", q.blob_bytes);
+        BSON_APPEND_INT64(&child, "list_entries", q.list_entries);
+        BSON_APPEND_INT64(&child, "active_rules", q.active_rules);
+        BSON_APPEND_INT64(&child, "words", q.words);
+        BSON_APPEND_INT64(&child, "queued_bytes", q.queued_bytes);
+        bson_append_document_end(doc, &child);
+        resp = doc;
+    } else if (streq(cmd, "api.stats")) {
+        if (!draconity->api_profiler.enabled()) {
+            errmsg = "api profiling is disabled, set api_profile in draconity.toml";
+            goto end;
+        }
+        bson_t *doc = success_msg();
+        draconity->api_profiler.append(doc);
+        resp = doc;
+    } else if (streq(cmd, "timeline.stats")) {
+        bson_t *doc = success_msg();
+        draconity->timelines.append(doc);
+        resp = doc;
+    } else if (streq(cmd, "pause.stats")) {
+        bson_t *doc = success_msg();
+        draconity->append_pause_stats(doc);
         resp = doc;
     } else if (streq(cmd, "mimic")) {
         if (!draconity->ready) goto not_ready;
@@ -409,58 +762,134 @@ static bson_t *handle_message(uint64_t client_id, uint32_t tid, const std::vecto
             errmsg = "missing or broken phrase field";
             goto end;
         }
-        dsx_dataptr dp = {.data = NULL, .size = 0};
-        if (!bson_iter_init_from_data(&iter, phrase_buf, phrase_len)) {
-            errmsg = "mimic phrase iter failed";
+        std::vector<uint8_t> phrase;
+        unsigned int count = 0;
+        errmsg = encode_mimic_phrase(phrase_buf, phrase_len, phrase, &count);
+        if (errmsg.size() > 0) goto end;
+        // Dragon's mimic done callback doesn't say which mimic finished, so
+        // completions are matched to requests in submission order.
+        MimicRequest request = {0, client_id, tid, 0, NULL, 0, false};
+        errmsg = draconity->submit_mimic(request, phrase, count);
+        if (errmsg.size() > 0) goto end;
+        // Response will be sent once mimic completes.
+        goto no_response;
+    } else if (streq(cmd, "mimic.batch")) {
+        if (!draconity->ready) goto not_ready;
+        if (!phrases_buf || !phrases_len) {
+            errmsg = "missing or broken phrases field";
             goto end;
         }
-        // get size of all strings in phrase
-        while (bson_iter_next(&iter)) {
-            if (!BSON_ITER_HOLDS_UTF8(&iter)) {
-                errmsg = "phrase contains non-string value";
+        if (window < 1) {
+            errmsg = "window must be at least 1";
+            goto end;
+        }
+        bson_iter_t phrases_iter;
+        if (!bson_iter_init_from_data(&phrases_iter, phrases_buf, phrases_len)) {
+            errmsg = "mimic phrases iter failed";
+            goto end;
+        }
+        // Encode everything up front so a bad phrase fails the whole batch
+        // before any of it reaches Dragon.
+        auto batch = std::make_shared<MimicBatch>();
+        batch->client_id = client_id;
+        batch->tid = tid;
+        batch->window = window;
+        batch->next = batch->in_flight = batch->completed = batch->failed = 0;
+        batch->cancelled = false;
+        while (bson_iter_next(&phrases_iter)) {
+            const uint8_t *buf = NULL;
+            uint32_t len = 0;
+            if (!BSON_ITER_HOLDS_ARRAY(&phrases_iter)) {
+                errmsg = "phrases contains non-array value";
                 goto end;
             }
-            uint32_t length = 0;
-            bson_iter_utf8(&iter, &length);
-            dp.size += length + 1;
-        }
-        dp.data = calloc(1, dp.size);
-        uint8_t *pos = (uint8_t *)dp.data;
-        if (!bson_iter_init_from_data(&iter, phrase_buf, phrase_len)) {
-            free(dp.data);
-            errmsg = "mimic phrase iter failed";
+            bson_iter_array(&phrases_iter, &len, &buf);
+            std::vector<uint8_t> phrase;
+            unsigned int count = 0;
+            errmsg = encode_mimic_phrase(buf, len, phrase, &count);
+            if (errmsg.size() > 0) goto end;
+            batch->phrases.push_back(std::move(phrase));
+            batch->word_counts.push_back(count);
+        }
+        if (batch->phrases.empty()) {
+            errmsg = "missing or broken phrases field";
             goto end;
         }
-        int count = 0;
-        while (bson_iter_next(&iter)) {
-            uint32_t length = 0;
-            const char *word = bson_iter_utf8(&iter, &length);
-            memcpy(pos, word, length);
-            pos += length + 1;
-            count++;
-        }
-        int rc = _DSXEngine_Mimic(_engine, 0, count, &dp, 0, 2);
-        free(dp.data);
-        if (rc) {
-            errstream << "error during mimic: " << rc;
-            errmsg = errstream.str();
+        // Progress is streamed back as mimic.batch messages on this tid.
+        draconity->start_mimic_batch(batch);
+        goto no_response;
+    } else if (streq(cmd, "bench.mimic")) {
+        if (!draconity->ready) goto not_ready;
+        if (!corpus) {
+            errmsg = "missing or broken corpus field";
             goto end;
         }
-        // We have to synchronize the mimic callback to a specific mimic.
-        // Waiting for the callback will deadlock, so we use a FIFO queue and
-        // rely on mimics being queued in the right order. This could be janky.
-        draconity->mimic_lock.lock();
-        draconity->mimic_queue.push({client_id, tid});
-        draconity->mimic_lock.unlock();
-        // Response will be sent once mimic completes.
+        // Replays the corpus against the loaded grammars; the report is sent
+        // on this tid once every phrase has been mimicked.
+        errmsg = draconity->bench.start(client_id, tid, corpus);
+        if (errmsg.size() > 0) goto end;
+        goto no_response;
+    } else if (streq(cmd, "params")) {
+        bson_t *doc = success_msg();
+        draconity->params.append(doc);
+        resp = doc;
+    } else if (streq(cmd, "params.use")) {
+        if (!draconity->ready) goto not_ready;
+        if (!name) {
+            errmsg = "missing or broken name field";
+            goto end;
+        }
+        errmsg = draconity->params.use(name);
+        if (errmsg.size() > 0) goto end;
+        bson_t *doc = success_msg();
+        draconity->params.append(doc);
+        resp = doc;
+    } else if (streq(cmd, "params.tune")) {
+        if (!draconity->ready) goto not_ready;
+        if (!corpus || !param) {
+            errmsg = "missing or broken corpus or param field";
+            goto end;
+        }
+        bson_iter_t values_iter;
+        if (!values_buf || !bson_iter_init_from_data(&values_iter, values_buf, values_len)) {
+            errmsg = "missing or broken values field";
+            goto end;
+        }
+        std::vector<std::string> values;
+        while (bson_iter_next(&values_iter)) {
+            if (BSON_ITER_HOLDS_UTF8(&values_iter)) {
+                values.push_back(bson_iter_utf8(&values_iter, NULL));
+            } else if (BSON_ITER_HOLDS_INT32(&values_iter)) {
+                values.push_back(std::to_string(bson_iter_int32(&values_iter)));
+            } else if (BSON_ITER_HOLDS_INT64(&values_iter)) {
+                values.push_back(std::to_string(bson_iter_int64(&values_iter)));
+            } else {
+                errmsg = "values contains non-string value";
+                goto end;
+            }
+        }
+        if (values.empty()) {
+            errmsg = "missing or broken values field";
+            goto end;
+        }
+        // Each value gets a full run of the mimic benchmark; progress and the
+        // final comparison are sent as params.tune messages on this tid.
+        errmsg = draconity->tuner.start(client_id, tid, corpus, param, values);
+        if (errmsg.size() > 0) goto end;
         goto no_response;
     } else {
         goto unsupported_command;
     }
 end:
+    static Counter *errors = draconity->metrics.counter("draconity_command_errors_total", "Commands that failed");
+    if (errmsg.size() > 0) {
+        errors->inc();
+    }
     bson_t *pub;
     free(cmd);
     free(name);
+    free(corpus);
+    free(param);
 
     pub = bson_new();
     BSON_APPEND_BOOL(pub, "success", errmsg.size() == 0);
@@ -472,7 +901,7 @@ end:
         resp = BCON_NEW("success", BCON_BOOL(false), "error", BCON_UTF8(errmsg.c_str()));
     }
     // reinit to reset + appease ASAN
-    if (bson_init_static(&root, &msg[0], msg.size())) {
+    if (bson_init_static(&root, msg, msg_len)) {
         BSON_APPEND_DOCUMENT(pub, "cmd", &root);
         draconity_publish("cmd", pub);
     }
@@ -492,7 +921,7 @@ no_response:
 }
 
 void draconity_init() {
-    printf("[+] draconity init\n");
+    draconity_log(LEVEL_INFO, "engine", "draconity init");
     // FIXME: this should just be draconity class init?
     draconity_transport_main(handle_message, draconity->config);
     draconity_publish("status", BCON_NEW("cmd", BCON_UTF8("thread_created")));
@@ -504,7 +933,7 @@ std::mutex readyLock;
 void draconity_ready() {
     readyLock.lock();
     if (!draconity->ready) {
-        printf("[+] status: ready\n");
+        draconity_log(LEVEL_INFO, "engine", "status: ready");
         intptr_t language_id = -1;
         if (_engine) {
             _DSXEngine_GetLanguageID(_engine, &language_id);
@@ -558,26 +987,11 @@ void draconity_attrib_changed(int key, dsx_attrib *attrib) {
 }
 
 void draconity_mimic_done(int key, dsx_mimic *mimic) {
-    draconity->mimic_lock.lock();
-    // If we pop too many items, we have a problem, but we still want to protect
-    // Draconity a crash.
-    if (draconity->mimic_queue.empty()) {
-        // TODO: Maybe log this?
-        draconity->mimic_lock.unlock();
-    } else {
-        auto &mimic_info = draconity->mimic_queue.front();
-        draconity->mimic_queue.pop();
-        draconity->mimic_lock.unlock();
-        uint64_t client_id = mimic_info.first;
-        uint32_t tid = mimic_info.second;
-        draconity_send("mimic",
-                       success_msg(),
-                       tid,
-                       client_id);
-    }
+    draconity->mimic_done();
 }
 
 void draconity_paused(int key, dsx_paused *paused) {
+    trace_instant("paused_callback", paused->token);
     draconity->handle_pause(paused->token);
 }
 
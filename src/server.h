@@ -3,13 +3,22 @@
 
 #include <bson.h>
 #include "draconity.h"
+#include "transport/transport.h"
 
 extern void draconity_init();
 extern void draconity_ready();
 extern void draconity_publish(const char *topic, bson_t *msg);
-extern void draconity_send(const char *topic, bson_t *obj, uint32_t tid, uint64_t client_id);
+// `on_written`, if given, is called once the message reaches the client's
+// socket, or with false if it never does.
+extern void draconity_send(const char *topic, bson_t *obj, uint32_t tid, uint64_t client_id,
+                           WrittenFn on_written = nullptr);
 extern void draconity_logf(const char *fmt, ...);
 
+// Stamps and serializes a message, destroying `obj`.
+std::vector<uint8_t> prep_response(const char *topic, bson_t *obj);
+// Handles one client request. Returns NULL when the reply is sent later.
+bson_t *handle_message(uint64_t client_id, uint32_t tid, const uint8_t *msg, size_t msg_len);
+
 // callbacks
 extern void draconity_attrib_changed(int key, dsx_attrib *attrib);
 extern void draconity_mimic_done(int key, dsx_mimic *mimic);
@@ -6,8 +6,14 @@
 #include "server.h"
 #include "draconity.h"
 #include "abstract_platform.h"
+#include "dr_time.h"
+#include "log.h"
+#include "trace.h"
 
 #include "api.h"
+#ifdef DRACONITY_SIM
+#include "sim/sim_engine.h"
+#endif
 
 int draconity_set_param(const char *key, const char *value) {
     if (!_engine) return -1;
@@ -18,55 +24,30 @@ int draconity_set_param(const char *key, const char *value) {
 }
 
 void draconity_set_default_params() {
-    auto timeout = std::to_string(draconity->timeout);
-    auto timeout_incomplete = std::to_string(draconity->timeout);
-    draconity_set_param("DwTimeOutComplete", timeout.c_str());
-    draconity_set_param("DwTimeOutIncomplete", timeout_incomplete.c_str());
-
-    draconity_set_param("DemonThreadPhraseFinishWait", "0");
-    // draconity_set_param("TwoPassSkipSecondPass", "1");
-    // draconity_set_param("ReturnPhonemes", "1");
-    // draconity_set_param("ReturnNoise", "1");
-    // draconity_set_param("ReturnPauseFillers", "1");
-    // draconity_set_param("Pass2DefaultSpeed", "1");
-    draconity_set_param("NumWordsAvailable", "10000");
-    // draconity_set_param("MinPartialUpdateCFGTime", "1");
-    // draconity_set_param("MinPartialUpdateTime", "1");
-    // draconity_set_param("LiveMicMinStopFrames", "1");
-    // draconity_set_param("SkipLettersVocInVocLookup", "1");
-    draconity_set_param("UseParallelRecognizers", "1");
-    // draconity_set_param("UsePitchTracking", "1");
-    draconity_set_param("Pass1A_DurationThresh_ms", "50");
-    // draconity_set_param("ComputeSpeed", "10");
-    // draconity_set_param("DisableWatchdog", "1");
-    // draconity_set_param("DoBWPlus", "1");
-    draconity_set_param("ExtraDictationWords", "10000");
-    draconity_set_param("MaxCFGWords", "20000");
-    draconity_set_param("MaxPronGuessedWords", "20000");
-    draconity_set_param("PhraseHypothesisCallbackThread", "1");
+    // Dragon has reset everything, so the cached handles go too.
+    draconity->params.reapply();
 }
 
 static void engine_setup(drg_engine *engine) {
     static unsigned int cb_key = 0;
     int ret = _DSXEngine_RegisterAttribChangedCallback(engine, draconity_attrib_changed, NULL, &cb_key);
-    if (ret) draconity_logf("error adding attribute callback: %d", ret);
+    if (ret) draconity_log(LEVEL_ERROR, "engine", "error adding attribute callback: %d", ret);
 
     ret = _DSXEngine_RegisterMimicDoneCallback(engine, draconity_mimic_done, NULL, &cb_key);
-    if (ret) draconity_logf("error adding mimic done callback: %d", ret);
+    if (ret) draconity_log(LEVEL_ERROR, "engine", "error adding mimic done callback: %d", ret);
 
     ret = _DSXEngine_RegisterPausedCallback(engine, draconity_paused, (void*)"paused?", NULL, &cb_key);
-    if (ret) draconity_logf("error adding paused callback: %d", ret);
+    if (ret) draconity_log(LEVEL_ERROR, "engine", "error adding paused callback: %d", ret);
 
     draconity_set_default_params();
 
-    printf("[+] status: start\n");
-    fflush(stdout);
+    draconity_log(LEVEL_INFO, "engine", "status: start");
     draconity_publish("status", BCON_NEW("cmd", BCON_UTF8("start")));
 }
 
 static void engine_acquire(drg_engine *engine, bool early) {
     if (!draconity->engine) {
-        printf("[+] engine acquired\n");
+        draconity_log(LEVEL_INFO, "engine", "engine acquired");
         draconity->engine = engine;
         engine_setup(engine);
     }
@@ -78,12 +59,12 @@ static void engine_acquire(drg_engine *engine, bool early) {
 }
 
 static int DSXEngine_SetBeginPhraseCallback() {
-    draconity_logf("warning: called stubbed SetBeginPhraseCallback()\n");
+    draconity_log(LEVEL_WARN, "engine", "called stubbed SetBeginPhraseCallback()");
     return 0;
 }
 
 static int DSXEngine_SetEndPhraseCallback() {
-    draconity_logf("warning: called stubbed SetEndPhraseCallback()\n");
+    draconity_log(LEVEL_WARN, "engine", "called stubbed SetEndPhraseCallback()");
     return 0;
 }
 
@@ -95,12 +76,20 @@ static int DSXFileSystem_PreferenceSetValue(drg_filesystem *fs, char *a, char *b
 // track which dragon grammars are active, so "dragon" pseudogrammar can activate them
 int (*orig_DSXGrammar_Activate)(drg_grammar *grammar, uintptr_t unk1, uintptr_t unk2, const char *rule_name);
 int DSXGrammar_Activate(drg_grammar *grammar, uintptr_t unk1, uintptr_t unk2, const char *rule_name) {
+    ForeignRuleKey key{grammar, rule_name ? rule_name : ""};
     draconity->dragon_lock.lock();
-    ForeignRule *foreign_rule = new ForeignRule(grammar, unk1, unk2, rule_name);
-    draconity->dragon_rules.push_back(foreign_rule);
+    auto it = draconity->dragon_rules.find(key);
+    if (it == draconity->dragon_rules.end()) {
+        it = draconity->dragon_rules.emplace(key, ForeignRule(grammar, unk1, unk2, rule_name)).first;
+    }
+    ForeignRule &foreign_rule = it->second;
+    foreign_rule.activations++;
     int ret = 0;
     if (draconity->dragon_enabled) {
         ret = orig_DSXGrammar_Activate(grammar, unk1, unk2, rule_name);
+        if (ret == 0) {
+            foreign_rule.applied = true;
+        }
     }
     draconity->dragon_lock.unlock();
     return ret;
@@ -108,21 +97,12 @@ int DSXGrammar_Activate(drg_grammar *grammar, uintptr_t unk1, uintptr_t unk2, co
 
 int (*orig_DSXGrammar_Deactivate)(drg_grammar *grammar, uintptr_t unk1, const char *rule_name);
 int DSXGrammar_Deactivate(drg_grammar *grammar, uintptr_t unk1, const char *rule_name) {
+    ForeignRuleKey key{grammar, rule_name ? rule_name : ""};
     draconity->dragon_lock.lock();
-    // Remove the grammar from the draconity's internal map (if it exists).
-    ForeignRule *rule_to_remove = NULL;
-    for (ForeignRule *foreign_rule : draconity->dragon_rules) {
-        if (foreign_rule->matches(grammar, rule_name)) {
-            // Can't remove within the for loop - store the grammar, then break
-            // and remove it.
-            rule_to_remove = foreign_rule;
-            break;
-        }
-    }
-    if (rule_to_remove) {
-        draconity->dragon_rules.remove(rule_to_remove);
-        delete rule_to_remove;
-    }
+    // Remove the rule from draconity's index (if it's there). Dragon doesn't
+    // nest activations, so one deactivate drops it however many times it was
+    // activated.
+    draconity->dragon_rules.erase(key);
 
     // Now Draconity's record of the grammar has been removed, it can be
     // disabled.
@@ -170,7 +150,7 @@ extern "C" {
 drg_engine *(*orig_DSXEngine_New)();
 static drg_engine *DSXEngine_New() {
     drg_engine *engine = orig_DSXEngine_New();
-    draconity_logf("DSXEngine_New() = %p", engine);
+    draconity_log(LEVEL_DEBUG, "engine", "DSXEngine_New() = %p", engine);
     engine_acquire(engine, true);
     return _engine;
 }
@@ -178,7 +158,7 @@ static drg_engine *DSXEngine_New() {
 int (*orig_DSXEngine_Create)(char *s, uintptr_t val, drg_engine **engine);
 static int DSXEngine_Create(char *s, uintptr_t val, drg_engine **engine) {
     int ret = orig_DSXEngine_Create(s, val, engine);
-    draconity_logf("DSXEngine_Create(%s, %llu, &%p) = %d", s, val, engine, ret);
+    draconity_log(LEVEL_DEBUG, "engine", "DSXEngine_Create(%s, %llu, &%p) = %d", s, (unsigned long long)val, engine, ret);
     engine_acquire(*engine, true);
     return ret;
 }
@@ -279,20 +259,27 @@ extern int talon_draconity_install(std::list<SymbolLoad> server_syms, std::list<
 void draconity_install() {
     printf("[+] draconity starting\n");
     int hooked = 0;
+    int64_t start = dr_monotonic_time();
 #ifdef TALON_BUILD
     hooked |= talon_draconity_install(server_syms, server_hooks);
+#elif defined(DRACONITY_SIM)
+    hooked |= sim_resolve(server_syms, server_hooks);
 #elif defined(__APPLE__)
-    hooked |= Platform::loadSymbols("server.so", server_syms);
-    hooked |= Platform::applyHooks("server.so", server_hooks);
+    hooked |= Platform::resolve("server.so", server_syms, server_hooks);
 #else
-    hooked |= Platform::loadSymbols("server.dll", server_syms);
-    hooked |= Platform::applyHooks("server.dll", server_hooks);
+    hooked |= Platform::resolve("server.dll", server_syms, server_hooks);
 #endif
+    trace_complete("resolve_symbols", start, hooked);
+    draconity_log(LEVEL_INFO, "platform", "resolved symbols in %.2fms", (dr_monotonic_time() - start) / 1e6);
     if (hooked != 0) {
         printf("[!] draconity failed to hook!");
         return;
     }
+    draconity->api_profiler.install();
     draconity_init();
+#ifdef DRACONITY_SIM
+    sim_start(draconity->config);
+#endif
 }
 
 auto _ = Draconity::shared();
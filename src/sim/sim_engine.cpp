@@ -0,0 +1,943 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string.h>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "sim_engine.h"
+#include "sim_grammar.h"
+#include "dr_time.h"
+#include "log.h"
+#include "types.h"
+
+#define align4(len) ((len + 4) & ~3)
+
+// Return codes. 33 is what Dragon returns for a buffer that's too small, and
+// what draconity checks for; the rest are our own.
+enum {
+    SIM_E_INVALID = 1,
+    SIM_E_NOT_FOUND = 2,
+    SIM_E_BAD_GRAMMAR = 3,
+    SIM_E_BAD_TOKEN = 4,
+    SIM_E_BUFFER_TOO_SMALL = 33,
+};
+
+#define SIM_LANGUAGE_ID 0x409  // US English
+#define SIM_MIC_OFF 1
+#define SIM_MIC_ON 2
+// Audio for GetWAV: 16 bit mono at 11025Hz, like Dragon's own.
+#define SIM_WAV_BYTES_PER_MS 22
+
+struct SimWord {
+    std::string text;
+    uint32_t id;
+    uint32_t rule;
+    uint64_t start;  // ms, wall clock
+    uint64_t end;
+};
+
+struct SimResult {
+    std::vector<SimWord> words;
+    std::vector<uint8_t> wav;  // Filled on first GetWAV
+};
+
+struct SimWordIter {
+    std::vector<std::string> words;
+    size_t next;
+};
+
+struct SimParam {
+    std::string key;
+};
+
+struct SimGrammarHandle {
+    SimGrammar grammar;
+    std::set<std::string> active;
+    std::unordered_map<std::string, std::vector<std::string>> lists;
+    std::vector<uint8_t> list_buf;  // Backs the last GetList
+    std::string app_name;
+    int priority;
+    uint64_t order;  // Load order, which breaks priority ties
+
+    int (*begin)(void *, void *);
+    void *begin_user;
+    unsigned int begin_key;
+    int (*hypothesis)(void *, dsx_hypothesis *);
+    void *hypothesis_user;
+    unsigned int hypothesis_key;
+    int (*end)(void *, dsx_end_phrase *);
+    void *end_user;
+    unsigned int end_key;
+};
+
+/* The callbacks one grammar gets for an utterance, copied out so they can be
+   made without the engine lock, even if the grammar goes away meanwhile. */
+struct SimListener {
+    int (*begin)(void *, void *);
+    void *begin_user;
+    int (*hypothesis)(void *, dsx_hypothesis *);
+    void *hypothesis_user;
+    int (*end)(void *, dsx_end_phrase *);
+    void *end_user;
+    bool winner;
+};
+
+struct SimUtterance {
+    std::vector<std::string> words;
+    bool mimic;
+};
+
+class SimEngine {
+public:
+    void configure(std::shared_ptr<cpptoml::table> config);
+    void start();
+    void enqueue(SimUtterance utterance);
+    int resume(uint64_t token);
+    void fire_attrib(const char *name);
+
+    std::mutex lock;
+    std::condition_variable cond;
+    std::set<std::string> vocabulary;
+    std::set<SimGrammarHandle *> grammars;
+    std::unordered_map<std::string, std::string> params;
+    int64_t micstate = SIM_MIC_OFF;
+    bool created = false;
+    bool suspended = false;  // Between DSXEngine_Pause and ResumeRecognition
+    unsigned int next_key = 0;
+    uint64_t next_order = 0;
+
+    void (*attrib_cb)(int, dsx_attrib *) = NULL;
+    void *attrib_user = NULL;
+    unsigned int attrib_key = 0;
+    void (*mimic_cb)(int, dsx_mimic *) = NULL;
+    void *mimic_user = NULL;
+    unsigned int mimic_key = 0;
+    void (*paused_cb)(int, dsx_paused *) = NULL;
+    void *paused_user = NULL;
+    unsigned int paused_key = 0;
+private:
+    void run();
+    void pause();
+    void recognize(const SimUtterance &utterance);
+
+    std::deque<SimUtterance> queue;
+    std::thread thread;
+    bool running = false;
+    // The token being waited on, and the last one resumed.
+    uint64_t pause_token = 0;
+    uint64_t resumed_token = 0;
+    uint64_t next_token = 0;
+
+    int word_ms = 250;
+    int recognize_ms = 0;
+    int pause_interval = 0;
+    int resume_timeout = 10000;
+};
+
+/* Draconity resolves its symbols from a static initializer, so nothing here
+   can rely on static initialization order. Never destroyed, like the engine
+   it stands in for. */
+static SimEngine *sim_engine() {
+    static SimEngine *engine = new SimEngine();
+    return engine;
+}
+#define sim (sim_engine())
+
+#define sim_grammar(g) ((SimGrammarHandle *)(g))
+
+void SimEngine::configure(std::shared_ptr<cpptoml::table> config) {
+    auto table = config ? config->get_table("sim") : nullptr;
+    if (!table) return;
+    this->word_ms = table->get_as<int>("word_ms").value_or(this->word_ms);
+    this->recognize_ms = table->get_as<int>("recognize_ms").value_or(this->recognize_ms);
+    this->pause_interval = table->get_as<int>("pause_interval").value_or(this->pause_interval);
+    this->resume_timeout = table->get_as<int>("resume_timeout").value_or(this->resume_timeout);
+}
+
+void SimEngine::start() {
+    this->lock.lock();
+    if (this->running) {
+        this->lock.unlock();
+        return;
+    }
+    this->running = true;
+    this->lock.unlock();
+    this->thread = std::thread([this] { this->run(); });
+    this->thread.detach();
+}
+
+void SimEngine::enqueue(SimUtterance utterance) {
+    this->lock.lock();
+    this->queue.push_back(std::move(utterance));
+    this->lock.unlock();
+    this->cond.notify_all();
+}
+
+int SimEngine::resume(uint64_t token) {
+    this->lock.lock();
+    if (token == 0 || token != this->pause_token) {
+        this->lock.unlock();
+        return SIM_E_BAD_TOKEN;
+    }
+    this->resumed_token = token;
+    this->pause_token = 0;
+    this->lock.unlock();
+    this->cond.notify_all();
+    return 0;
+}
+
+void SimEngine::fire_attrib(const char *name) {
+    this->lock.lock();
+    auto cb = this->attrib_cb;
+    dsx_attrib attrib = {this->attrib_user, (char *)name};
+    unsigned int key = this->attrib_key;
+    this->lock.unlock();
+    if (cb) {
+        cb(key, &attrib);
+    }
+}
+
+/* The engine thread. Like Dragon, it works through one utterance at a time,
+   pausing before each so grammars can be brought up to date. */
+void SimEngine::run() {
+    std::unique_lock<std::mutex> guard(this->lock);
+    auto ready = [this] {
+        return !this->running || (!this->queue.empty() && !this->suspended);
+    };
+    auto listening = [this] {
+        return this->pause_interval > 0 && this->micstate == SIM_MIC_ON;
+    };
+    while (this->running) {
+        if (!ready()) {
+            if (listening()) {
+                auto timeout = std::chrono::milliseconds(this->pause_interval);
+                if (!this->cond.wait_for(guard, timeout, ready)) {
+                    // Dragon pauses whenever it hears something, recognized
+                    // or not.
+                    guard.unlock();
+                    this->pause();
+                    guard.lock();
+                }
+            } else {
+                this->cond.wait(guard, [&] { return ready() || listening(); });
+            }
+            continue;
+        }
+        SimUtterance utterance = std::move(this->queue.front());
+        this->queue.pop_front();
+        guard.unlock();
+        this->pause();
+        this->recognize(utterance);
+        if (utterance.mimic) {
+            this->lock.lock();
+            auto cb = this->mimic_cb;
+            dsx_mimic mimic = {this->mimic_user, 0};
+            unsigned int key = this->mimic_key;
+            this->lock.unlock();
+            if (cb) {
+                cb(key, &mimic);
+            }
+        }
+        guard.lock();
+    }
+}
+
+void SimEngine::pause() {
+    std::unique_lock<std::mutex> guard(this->lock);
+    auto cb = this->paused_cb;
+    if (!cb) return;
+    uint64_t token = ++this->next_token;
+    // Set before the callback, which may resume straight away.
+    this->pause_token = token;
+    dsx_paused paused = {this->paused_user, token};
+    unsigned int key = this->paused_key;
+    guard.unlock();
+    cb(key, &paused);
+    guard.lock();
+    auto timeout = std::chrono::milliseconds(this->resume_timeout);
+    if (!this->cond.wait_for(guard, timeout, [this, token] { return this->resumed_token >= token; })) {
+        this->pause_token = 0;
+        draconity_log(LEVEL_WARN, "sim", "pause %llu not resumed after %dms, continuing",
+                      (unsigned long long)token, this->resume_timeout);
+    }
+}
+
+/* Pack words into the length-prefixed dsx_id array Dragon hands callbacks. */
+static std::vector<uint8_t> sim_phrase(const std::vector<SimWord> &words, size_t count) {
+    size_t size = 4;
+    for (size_t i = 0; i < count; i++) {
+        size += sizeof(dsx_id) + align4(words[i].text.size());
+    }
+    std::vector<uint8_t> phrase(size, 0);
+    uint32_t len = size;
+    memcpy(phrase.data(), &len, 4);
+    uint8_t *pos = phrase.data() + 4;
+    for (size_t i = 0; i < count; i++) {
+        dsx_id *ent = (dsx_id *)pos;
+        ent->size = sizeof(dsx_id) + align4(words[i].text.size());
+        ent->id = words[i].id;
+        memcpy(ent->name, words[i].text.data(), words[i].text.size());
+        pos += ent->size;
+    }
+    return phrase;
+}
+
+void SimEngine::recognize(const SimUtterance &utterance) {
+    std::vector<SimListener> listeners;
+    std::vector<SimWord> words;
+
+    this->lock.lock();
+    // Highest priority first, then in load order.
+    std::vector<SimGrammarHandle *> ordered;
+    for (SimGrammarHandle *grammar : this->grammars) {
+        if (!grammar->active.empty()) {
+            ordered.push_back(grammar);
+        }
+    }
+    std::sort(ordered.begin(), ordered.end(), [](SimGrammarHandle *a, SimGrammarHandle *b) {
+        return a->priority != b->priority ? a->priority > b->priority : a->order < b->order;
+    });
+    bool found = false;
+    uint64_t base = dr_clock_time() / 1000000;
+    for (SimGrammarHandle *grammar : ordered) {
+        bool winner = false;
+        std::vector<SimMatchWord> matched;
+        for (auto &rule : grammar->active) {
+            if (!found && grammar->grammar.match(rule, utterance.words, grammar->lists, matched)) {
+                winner = found = true;
+                for (size_t i = 0; i < matched.size(); i++) {
+                    uint64_t start = base + i * this->word_ms;
+                    words.push_back({utterance.words[i], matched[i].id, matched[i].rule,
+                                     start, start + this->word_ms});
+                }
+                break;
+            }
+        }
+        listeners.push_back({grammar->begin, grammar->begin_user,
+                             grammar->hypothesis, grammar->hypothesis_user,
+                             grammar->end, grammar->end_user, winner});
+    }
+    this->lock.unlock();
+
+    for (auto &listener : listeners) {
+        if (listener.begin) {
+            listener.begin(listener.begin_user, NULL);
+        }
+    }
+    for (auto &listener : listeners) {
+        if (!listener.winner || !listener.hypothesis) continue;
+        // One hypothesis per word, each a longer prefix of the phrase.
+        for (size_t count = 1; count <= words.size(); count++) {
+            SimResult *result = new SimResult();
+            result->words.assign(words.begin(), words.begin() + count);
+            std::vector<uint8_t> phrase = sim_phrase(words, count);
+            dsx_hypothesis hypothesis = {};
+            hypothesis.phrase = (char *)phrase.data();
+            hypothesis.result = (dsx_result *)result;
+            listener.hypothesis(listener.hypothesis_user, &hypothesis);
+        }
+    }
+    if (this->recognize_ms > 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(this->recognize_ms));
+    }
+    std::vector<uint8_t> phrase = sim_phrase(words, words.size());
+    for (auto &listener : listeners) {
+        if (!listener.end) continue;
+        // Every callback owns its result, and destroys it when done.
+        SimResult *result = new SimResult();
+        dsx_end_phrase end = {};
+        if (found) {
+            // Accepted, and only the winner's to use.
+            end.flags = listener.winner ? 3 : 1;
+            result->words = words;
+        }
+        end.phrase = (char *)phrase.data();
+        end.result = (dsx_result *)result;
+        listener.end(listener.end_user, &end);
+    }
+}
+
+extern "C" {
+
+static drg_engine *sim_DSXEngine_New() {
+    sim->lock.lock();
+    sim->created = true;
+    sim->lock.unlock();
+    return (drg_engine *)sim;
+}
+
+static int sim_DSXEngine_Create(char *s, uintptr_t val, drg_engine **engine) {
+    *engine = sim_DSXEngine_New();
+    return 0;
+}
+
+static int sim_DSXEngine_AddWord(drg_engine *engine, const char *word, int flags, drg_wordinfo **info) {
+    if (!word || !*word) return SIM_E_INVALID;
+    sim->lock.lock();
+    sim->vocabulary.insert(word);
+    sim->lock.unlock();
+    if (info) *info = NULL;
+    return 0;
+}
+
+static int sim_DSXEngine_AddTemporaryWord(drg_engine *engine, const char *word, int flags) {
+    return sim_DSXEngine_AddWord(engine, word, flags, NULL);
+}
+
+static int sim_DSXEngine_DeleteWord(drg_engine *engine, int flags, const char *word) {
+    sim->lock.lock();
+    size_t erased = word ? sim->vocabulary.erase(word) : 0;
+    sim->lock.unlock();
+    return erased ? 0 : SIM_E_NOT_FOUND;
+}
+
+static int sim_DSXEngine_ValidateWord(drg_engine *engine, const char *word, bool *valid) {
+    *valid = false;
+    if (!word) return SIM_E_INVALID;
+    size_t len = strlen(word);
+    if (len == 0 || len > 127) return 0;
+    for (size_t i = 0; i < len; i++) {
+        if ((unsigned char)word[i] < 0x20) return 0;
+    }
+    *valid = true;
+    return 0;
+}
+
+static drg_worditer *sim_DSXEngine_EnumWords(drg_engine *engine, int flags) {
+    SimWordIter *iter = new SimWordIter();
+    sim->lock.lock();
+    iter->words.assign(sim->vocabulary.begin(), sim->vocabulary.end());
+    sim->lock.unlock();
+    iter->next = 0;
+    return (drg_worditer *)iter;
+}
+
+static int sim_DSXWordEnum_GetCount(drg_worditer *iter, uint32_t *count) {
+    *count = ((SimWordIter *)iter)->words.size();
+    return 0;
+}
+
+/* Fills buf with a wordinfo and padded name per word, as far as fits. */
+static int sim_DSXWordEnum_Next(drg_worditer *witer, int max_words, char *buf, uint32_t *word_count,
+                                int buf_size, uint32_t *size_needed) {
+    SimWordIter *iter = (SimWordIter *)witer;
+    uint32_t size = 0, count = 0;
+    while (iter->next < iter->words.size() && (int)count < max_words) {
+        const std::string &word = iter->words[iter->next];
+        uint32_t entry = sizeof(drg_wordinfo) + align4(word.size());
+        if (size + entry > (uint32_t)buf_size) {
+            if (count == 0) {
+                *size_needed = entry;
+                *word_count = 0;
+                return SIM_E_BUFFER_TOO_SMALL;
+            }
+            break;
+        }
+        memset(buf + size, 0, entry);
+        memcpy(buf + size + sizeof(drg_wordinfo), word.data(), word.size());
+        size += entry;
+        count++;
+        iter->next++;
+    }
+    *word_count = count;
+    *size_needed = size;
+    return 0;
+}
+
+static int sim_DSXWordEnum_End(drg_worditer *iter, void *dunno) {
+    delete (SimWordIter *)iter;
+    return 0;
+}
+
+static int sim_DSXEngine_LoadGrammar(drg_engine *engine, int type, dsx_dataptr *data, drg_grammar **grammar_out) {
+    SimGrammarHandle *grammar = new SimGrammarHandle();
+    if (!data || !grammar->grammar.parse((const uint8_t *)data->data, data->size)) {
+        delete grammar;
+        return SIM_E_BAD_GRAMMAR;
+    }
+    grammar->priority = 0;
+    grammar->begin = NULL;
+    grammar->hypothesis = NULL;
+    grammar->end = NULL;
+    sim->lock.lock();
+    grammar->order = ++sim->next_order;
+    sim->grammars.insert(grammar);
+    sim->lock.unlock();
+    *grammar_out = (drg_grammar *)grammar;
+    return 0;
+}
+
+static void *sim_DSXEngine_GetCurrentSpeaker(drg_engine *engine) {
+    static char speaker[] = "sim";
+    std::lock_guard<std::mutex> guard(sim->lock);
+    return sim->created ? speaker : NULL;
+}
+
+static int sim_DSXEngine_GetLanguageID(drg_engine *engine, intptr_t *language_id) {
+    *language_id = SIM_LANGUAGE_ID;
+    return 0;
+}
+
+static int sim_DSXEngine_SetMicState(drg_engine *engine, int state, int unk1, int unk2) {
+    if (state < 0 || state > 5) return SIM_E_INVALID;
+    sim->lock.lock();
+    bool changed = (sim->micstate != state);
+    sim->micstate = state;
+    sim->lock.unlock();
+    sim->cond.notify_all();
+    if (changed) {
+        sim->fire_attrib("MICSTATE");
+    }
+    return 0;
+}
+
+static int sim_DSXEngine_GetMicState(drg_engine *engine, int64_t *state) {
+    std::lock_guard<std::mutex> guard(sim->lock);
+    *state = sim->micstate;
+    return 0;
+}
+
+static int sim_DSXEngine_Mimic(drg_engine *engine, int unk1, unsigned int count, dsx_dataptr *data, unsigned int unk2, int type) {
+    if (!data || !data->data || count == 0) return SIM_E_INVALID;
+    SimUtterance utterance = {{}, true};
+    const char *pos = (const char *)data->data;
+    const char *end = pos + data->size;
+    for (unsigned int i = 0; i < count; i++) {
+        size_t len = strnlen(pos, end - pos);
+        if (pos + len >= end) return SIM_E_INVALID;
+        utterance.words.emplace_back(pos, len);
+        pos += len + 1;
+    }
+    sim->enqueue(std::move(utterance));
+    return 0;
+}
+
+static int sim_DSXEngine_RegisterAttribChangedCallback(drg_engine *engine, void (*cb)(int, dsx_attrib *), void *user, unsigned int *key) {
+    std::lock_guard<std::mutex> guard(sim->lock);
+    sim->attrib_cb = cb;
+    sim->attrib_user = user;
+    sim->attrib_key = *key = ++sim->next_key;
+    return 0;
+}
+
+static int sim_DSXEngine_RegisterMimicDoneCallback(drg_engine *engine, void (*cb)(int, dsx_mimic *), void *user, unsigned int *key) {
+    std::lock_guard<std::mutex> guard(sim->lock);
+    sim->mimic_cb = cb;
+    sim->mimic_user = user;
+    sim->mimic_key = *key = ++sim->next_key;
+    return 0;
+}
+
+static int sim_DSXEngine_RegisterPausedCallback(drg_engine *engine, void (*cb)(int, dsx_paused *), void *user, char *name, unsigned int *key) {
+    std::lock_guard<std::mutex> guard(sim->lock);
+    sim->paused_cb = cb;
+    sim->paused_user = user;
+    sim->paused_key = *key = ++sim->next_key;
+    return 0;
+}
+
+static int sim_DSXEngine_SetStringValue(drg_engine *engine, void *param, const char *value) {
+    if (!param || !value) return SIM_E_INVALID;
+    std::lock_guard<std::mutex> guard(sim->lock);
+    sim->params[((SimParam *)param)->key] = value;
+    return 0;
+}
+
+static void *sim_DSXEngine_GetValue(drg_engine *engine, void *param, void **type, void *value_out, unsigned int size, unsigned int *size_out) {
+    if (!param) return NULL;
+    std::lock_guard<std::mutex> guard(sim->lock);
+    auto it = sim->params.find(((SimParam *)param)->key);
+    if (it == sim->params.end()) return NULL;
+    if (size_out) *size_out = it->second.size() + 1;
+    if (!value_out || size < it->second.size() + 1) return NULL;
+    memcpy(value_out, it->second.c_str(), it->second.size() + 1);
+    return value_out;
+}
+
+static void *sim_DSXEngine_GetParam(drg_engine *engine, const char *key) {
+    return key ? new SimParam{key} : NULL;
+}
+
+static void sim_DSXEngine_DestroyParam(drg_engine *engine, void *param) {
+    delete (SimParam *)param;
+}
+
+// Engine wide phrase callbacks aren't used by draconity.
+static int sim_DSXEngine_SetBeginPhraseCallback(drg_engine *engine, int (*cb)(void *, void *), void *user, unsigned int *key) {
+    std::lock_guard<std::mutex> guard(sim->lock);
+    *key = ++sim->next_key;
+    return 0;
+}
+
+static int sim_DSXEngine_SetEndPhraseCallback(drg_engine *engine, void *cb, void *user, unsigned int *key) {
+    std::lock_guard<std::mutex> guard(sim->lock);
+    *key = ++sim->next_key;
+    return 0;
+}
+
+static int sim_DSXEngine_Pause(drg_engine *engine) {
+    std::lock_guard<std::mutex> guard(sim->lock);
+    sim->suspended = true;
+    return 0;
+}
+
+static int sim_DSXEngine_Resume(drg_engine *engine, uint64_t token) {
+    return sim->resume(token);
+}
+
+static int sim_DSXEngine_ResumeRecognition(drg_engine *engine) {
+    sim->lock.lock();
+    sim->suspended = false;
+    sim->lock.unlock();
+    sim->cond.notify_all();
+    return 0;
+}
+
+// Dragon's file system settings don't affect the simulation.
+static int sim_DSXFileSystem_PreferenceSetValue(drg_filesystem *fs, char *a, char *b, char *c, char *d) {
+    return 0;
+}
+
+static int sim_DSXFileSystem_PreferenceGetValue(drg_filesystem *fs, char *a, char *b, char *c, char *d) {
+    return SIM_E_NOT_FOUND;
+}
+
+static int sim_DSXFileSystem_SetUsersDirectory(drg_filesystem *fs, char *a, bool unk) {
+    return 0;
+}
+
+static int sim_DSXFileSystem_SetVocabsLocation(drg_filesystem *fs, char *a, bool unk) {
+    return 0;
+}
+
+static int sim_DSXFileSystem_SetResultsDirectory(drg_filesystem *fs, char *a, bool unk) {
+    return 0;
+}
+
+static int sim_DSXGrammar_Activate(drg_grammar *grammar, uintptr_t unk1, bool unk2, const char *rule) {
+    SimGrammarHandle *g = sim_grammar(grammar);
+    std::lock_guard<std::mutex> guard(sim->lock);
+    if (!rule || !g->grammar.is_exported(rule)) return SIM_E_NOT_FOUND;
+    g->active.insert(rule);
+    return 0;
+}
+
+static int sim_DSXGrammar_Deactivate(drg_grammar *grammar, uintptr_t unk1, const char *rule) {
+    SimGrammarHandle *g = sim_grammar(grammar);
+    std::lock_guard<std::mutex> guard(sim->lock);
+    if (!rule || !g->active.erase(rule)) return SIM_E_NOT_FOUND;
+    return 0;
+}
+
+static int sim_DSXGrammar_Destroy(drg_grammar *grammar) {
+    SimGrammarHandle *g = sim_grammar(grammar);
+    sim->lock.lock();
+    size_t erased = sim->grammars.erase(g);
+    sim->lock.unlock();
+    if (!erased) return SIM_E_NOT_FOUND;
+    delete g;
+    return 0;
+}
+
+static int sim_DSXGrammar_GetList(drg_grammar *grammar, const char *name, dsx_dataptr *data) {
+    SimGrammarHandle *g = sim_grammar(grammar);
+    std::lock_guard<std::mutex> guard(sim->lock);
+    auto it = name ? g->lists.find(name) : g->lists.end();
+    if (it == g->lists.end()) return SIM_E_NOT_FOUND;
+    std::vector<uint8_t> &buf = g->list_buf;
+    buf.clear();
+    for (auto &entry : it->second) {
+        size_t at = buf.size();
+        buf.resize(at + sizeof(dsx_id) + align4(entry.size()), 0);
+        dsx_id *ent = (dsx_id *)&buf[at];
+        ent->size = sizeof(dsx_id) + align4(entry.size());
+        memcpy(ent->name, entry.data(), entry.size());
+    }
+    data->data = buf.data();
+    data->size = buf.size();
+    return 0;
+}
+
+static int sim_DSXGrammar_RegisterBeginPhraseCallback(drg_grammar *grammar, int (*cb)(void *, void *), void *user, unsigned int *key) {
+    SimGrammarHandle *g = sim_grammar(grammar);
+    std::lock_guard<std::mutex> guard(sim->lock);
+    g->begin = cb;
+    g->begin_user = user;
+    g->begin_key = *key = ++sim->next_key;
+    return 0;
+}
+
+static int sim_DSXGrammar_RegisterEndPhraseCallback(drg_grammar *grammar, int (*cb)(void *, dsx_end_phrase *), void *user, unsigned int *key) {
+    SimGrammarHandle *g = sim_grammar(grammar);
+    std::lock_guard<std::mutex> guard(sim->lock);
+    g->end = cb;
+    g->end_user = user;
+    g->end_key = *key = ++sim->next_key;
+    return 0;
+}
+
+static int sim_DSXGrammar_RegisterPhraseHypothesisCallback(drg_grammar *grammar, int (*cb)(void *, dsx_hypothesis *), void *user, unsigned int *key) {
+    SimGrammarHandle *g = sim_grammar(grammar);
+    std::lock_guard<std::mutex> guard(sim->lock);
+    g->hypothesis = cb;
+    g->hypothesis_user = user;
+    g->hypothesis_key = *key = ++sim->next_key;
+    return 0;
+}
+
+static int sim_DSXGrammar_SetApplicationName(drg_grammar *grammar, const char *name) {
+    std::lock_guard<std::mutex> guard(sim->lock);
+    sim_grammar(grammar)->app_name = name ? name : "";
+    return 0;
+}
+
+static int sim_DSXGrammar_SetList(drg_grammar *grammar, const char *name, dsx_dataptr *data) {
+    SimGrammarHandle *g = sim_grammar(grammar);
+    if (!name || !data || (data->size > 0 && !data->data)) return SIM_E_INVALID;
+    std::vector<std::string> entries;
+    const uint8_t *pos = (const uint8_t *)data->data;
+    const uint8_t *end = pos + data->size;
+    while (pos < end) {
+        const dsx_id *ent = (const dsx_id *)pos;
+        if ((size_t)(end - pos) < sizeof(dsx_id) || ent->size < sizeof(dsx_id) || ent->size > (size_t)(end - pos)) {
+            return SIM_E_INVALID;
+        }
+        entries.emplace_back(ent->name, strnlen(ent->name, ent->size - sizeof(dsx_id)));
+        pos += ent->size;
+    }
+    std::lock_guard<std::mutex> guard(sim->lock);
+    if (!g->grammar.has_list(name)) return SIM_E_NOT_FOUND;
+    g->lists[name] = std::move(entries);
+    return 0;
+}
+
+static int sim_DSXGrammar_GetApplicationName(drg_grammar *grammar, char *buf, int buf_size, int *size_out) {
+    std::lock_guard<std::mutex> guard(sim->lock);
+    const std::string &name = sim_grammar(grammar)->app_name;
+    if (size_out) *size_out = name.size() + 1;
+    if (!buf || buf_size < (int)name.size() + 1) return SIM_E_BUFFER_TOO_SMALL;
+    memcpy(buf, name.c_str(), name.size() + 1);
+    return 0;
+}
+
+static int sim_DSXGrammar_SetPriority(drg_grammar *grammar, int priority) {
+    std::lock_guard<std::mutex> guard(sim->lock);
+    sim_grammar(grammar)->priority = priority;
+    return 0;
+}
+
+static int sim_DSXGrammar_SetSpecialGrammar(drg_grammar *grammar, int special) {
+    return 0;
+}
+
+static int sim_DSXGrammar_Unregister(drg_grammar *grammar, unsigned int key) {
+    SimGrammarHandle *g = sim_grammar(grammar);
+    std::lock_guard<std::mutex> guard(sim->lock);
+    if (key == 0) return SIM_E_NOT_FOUND;
+    if (g->begin_key == key) {
+        g->begin = NULL;
+        g->begin_key = 0;
+    } else if (g->hypothesis_key == key) {
+        g->hypothesis = NULL;
+        g->hypothesis_key = 0;
+    } else if (g->end_key == key) {
+        g->end = NULL;
+        g->end_key = 0;
+    } else {
+        return SIM_E_NOT_FOUND;
+    }
+    return 0;
+}
+
+static int sim_DSXResult_GetWAV(dsx_result *result, dsx_dataptr *data) {
+    SimResult *r = (SimResult *)result;
+    if (r->words.empty()) return SIM_E_NOT_FOUND;
+    if (r->wav.empty()) {
+        // Silence, as long as the words.
+        uint64_t ms = r->words.back().end - r->words.front().start;
+        r->wav.assign(ms * SIM_WAV_BYTES_PER_MS, 0);
+    }
+    data->data = r->wav.data();
+    data->size = r->wav.size();
+    return 0;
+}
+
+/* The best path is just the word indexes; `path_size` is in bytes. */
+static int sim_DSXResult_BestPathWord(dsx_result *result, int choice, uint32_t *path, size_t path_size, size_t *needed) {
+    SimResult *r = (SimResult *)result;
+    if (choice != 0 || r->words.empty()) return SIM_E_NOT_FOUND;
+    *needed = r->words.size() * sizeof(uint32_t);
+    if (path_size < *needed) return SIM_E_BUFFER_TOO_SMALL;
+    for (uint32_t i = 0; i < r->words.size(); i++) {
+        path[i] = i;
+    }
+    return 0;
+}
+
+static int sim_DSXResult_GetWordNode(dsx_result *result, uint32_t path, void *node, uint32_t *num, char **name) {
+    SimResult *r = (SimResult *)result;
+    if (path >= r->words.size()) return SIM_E_NOT_FOUND;
+    SimWord &word = r->words[path];
+    dsx_word_node *out = (dsx_word_node *)node;
+    memset(out, 0, sizeof(*out));
+    out->start_time = word.start;
+    out->end_time = word.end;
+    out->rule = word.rule;
+    *num = word.id;
+    *name = (char *)word.text.c_str();
+    return 0;
+}
+
+static int sim_DSXResult_Destroy(dsx_result *result) {
+    delete (SimResult *)result;
+    return 0;
+}
+
+static void sim_SDApi_SetShowCalls(bool show) {}
+static void sim_SDApi_SetShowCallsWithFileSpecArgs(bool show) {}
+static void sim_SDApi_SetShowCallPointerArguments(bool show) {}
+static void sim_SDApi_SetShowCallMemDeltas(bool show) {}
+static void sim_SDApi_SetShowAllocation(bool show) {}
+static void sim_SDApi_SetShowAllocationHistogram(bool show) {}
+
+static void *sim_SDRule_New(void *sdapi, void *rule) {
+    return NULL;
+}
+
+static void *sim_SDRule_Delete(void *sdapi, void *rule) {
+    return NULL;
+}
+
+} // extern "C"
+
+/* Each function is reached through an entry point that calls via a slot, so a
+   hook can be installed by pointing the slot elsewhere - the loaded symbol
+   then goes through the hook, just as it would with Dragon's patched code. */
+template <auto Impl, typename F> struct SimEntry;
+
+template <auto Impl, typename R, typename... Args>
+struct SimEntry<Impl, R (*)(Args...)> {
+    static R (*slot)(Args...);
+    static R call(Args... args) {
+        return slot(args...);
+    }
+};
+
+template <auto Impl, typename R, typename... Args>
+R (*SimEntry<Impl, R (*)(Args...)>::slot)(Args...) = Impl;
+
+#define sim_entry(name) SimEntry<&sim_##name, decltype(&sim_##name)>
+
+struct SimSymbol {
+    void *entry;
+    void **slot;
+};
+
+#define e(name) {#name, {(void *)sim_entry(name)::call, (void **)&sim_entry(name)::slot}}
+static const std::unordered_map<std::string, SimSymbol> &sim_symbols() {
+    static std::unordered_map<std::string, SimSymbol> symbols {
+        e(DSXEngine_New),
+        e(DSXEngine_Create),
+
+        e(DSXEngine_AddWord),
+        e(DSXEngine_AddTemporaryWord),
+        e(DSXEngine_DeleteWord),
+        e(DSXEngine_ValidateWord),
+        e(DSXEngine_EnumWords),
+
+        e(DSXWordEnum_GetCount),
+        e(DSXWordEnum_Next),
+        e(DSXWordEnum_End),
+
+        e(DSXEngine_LoadGrammar),
+        e(DSXEngine_GetCurrentSpeaker),
+        e(DSXEngine_GetLanguageID),
+        e(DSXEngine_SetMicState),
+        e(DSXEngine_GetMicState),
+        e(DSXEngine_Mimic),
+        e(DSXEngine_RegisterAttribChangedCallback),
+        e(DSXEngine_RegisterMimicDoneCallback),
+        e(DSXEngine_RegisterPausedCallback),
+
+        e(DSXEngine_SetStringValue),
+        e(DSXEngine_GetValue),
+        e(DSXEngine_GetParam),
+        e(DSXEngine_DestroyParam),
+
+        e(DSXEngine_SetBeginPhraseCallback),
+        e(DSXEngine_SetEndPhraseCallback),
+
+        e(DSXEngine_Pause),
+        e(DSXEngine_Resume),
+        e(DSXEngine_ResumeRecognition),
+
+        e(DSXFileSystem_PreferenceSetValue),
+        e(DSXFileSystem_PreferenceGetValue),
+        e(DSXFileSystem_SetUsersDirectory),
+        e(DSXFileSystem_SetVocabsLocation),
+        e(DSXFileSystem_SetResultsDirectory),
+
+        e(DSXGrammar_Activate),
+        e(DSXGrammar_Deactivate),
+        e(DSXGrammar_Destroy),
+        e(DSXGrammar_GetList),
+        e(DSXGrammar_RegisterBeginPhraseCallback),
+        e(DSXGrammar_RegisterEndPhraseCallback),
+        e(DSXGrammar_RegisterPhraseHypothesisCallback),
+        e(DSXGrammar_SetApplicationName),
+        e(DSXGrammar_SetList),
+        e(DSXGrammar_GetApplicationName),
+        e(DSXGrammar_SetPriority),
+        e(DSXGrammar_SetSpecialGrammar),
+        e(DSXGrammar_Unregister),
+
+        e(DSXResult_GetWAV),
+        e(DSXResult_BestPathWord),
+        e(DSXResult_GetWordNode),
+        e(DSXResult_Destroy),
+
+        e(SDApi_SetShowCalls),
+        e(SDApi_SetShowCallsWithFileSpecArgs),
+        e(SDApi_SetShowCallPointerArguments),
+        e(SDApi_SetShowCallMemDeltas),
+        e(SDApi_SetShowAllocation),
+        e(SDApi_SetShowAllocationHistogram),
+
+        e(SDRule_New),
+        e(SDRule_Delete),
+    };
+    return symbols;
+}
+#undef e
+
+int sim_resolve(std::list<SymbolLoad> &loads, std::list<CodeHook> &hooks) {
+    auto &sim_symbols = ::sim_symbols();
+    for (auto &symbol_load : loads) {
+        auto it = sim_symbols.find(symbol_load.name);
+        if (it != sim_symbols.end()) {
+            symbol_load.setAddr(it->second.entry);
+        }
+    }
+    for (auto &hook : hooks) {
+        auto it = sim_symbols.find(hook.name);
+        if (it != sim_symbols.end()) {
+            hook.redirect(it->second.slot);
+        }
+    }
+    return 0;
+}
+
+void sim_start(std::shared_ptr<cpptoml::table> config) {
+    sim->configure(config);
+    sim->start();
+    draconity_log(LEVEL_INFO, "sim", "simulated engine starting");
+    // What Dragon's UI does at startup, through the (hooked) entry points.
+    drg_engine *engine = NULL;
+    sim_entry(DSXEngine_Create)::call((char *)"sim", 0, &engine);
+    sim_entry(DSXEngine_SetMicState)::call(engine, SIM_MIC_ON, 0, 0);
+}
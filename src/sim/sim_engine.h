@@ -0,0 +1,34 @@
+#pragma once
+#include <list>
+#include <memory>
+
+#include "cpptoml.h"
+#include "symbol_load.h"
+#include "code_hook.h"
+
+/* A simulated Dragon engine, for running draconity on Linux.
+
+   Every function in api.h has an in-process implementation here: grammars are
+   parsed (see SimGrammar) and their active rules matched against mimics, which
+   are "recognized" on the engine's own thread with the begin, hypothesis and
+   end callbacks Dragon would make, and each utterance starts with a pause that
+   waits for DSXEngine_Resume. Words, lists, parameters and mic state are kept
+   as plain state. It's deterministic: the same calls always produce the same
+   callbacks, tokens and word ids, with word timings derived from `word_ms`.
+
+   Configured from the [sim] table:
+
+       [sim]
+       word_ms = 250           # synthetic duration of each recognized word
+       recognize_ms = 0        # delay between a phrase's begin and end
+       pause_interval = 0      # ms between idle pauses, 0 to pause only for mimics
+       resume_timeout = 10000  # ms to wait for a resume before recognizing anyway
+
+ */
+
+// Points the loads at the simulated engine and redirects the hooks through its
+// entry points. Always succeeds.
+int sim_resolve(std::list<SymbolLoad> &loads, std::list<CodeHook> &hooks);
+// Plays the part of Dragon's own UI: creates the engine and turns the mic on,
+// through the hooked entry points. Call once the server is running.
+void sim_start(std::shared_ptr<cpptoml::table> config);
@@ -0,0 +1,370 @@
+#include <functional>
+#include <string.h>
+#include "sim_grammar.h"
+
+#define align4(len) ((len + 4) & ~3)
+
+// Dragon reports words from its built in dictation rules under this rule id.
+#define SIM_DICTATION_RULE 1000000
+// Deepest rule reference chain followed before a match gives up.
+#define SIM_MAX_DEPTH 64
+
+enum {
+    SIM_CHUNK_WORDS = 2,
+    SIM_CHUNK_RULES = 3,
+    SIM_CHUNK_EXPORTS = 4,
+    SIM_CHUNK_IMPORTS = 5,
+    SIM_CHUNK_LISTS = 6,
+};
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint16_t read16(const uint8_t *p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+template <typename F>
+static bool parse_ids(const uint8_t *pos, const uint8_t *end, F fn) {
+    while (pos < end) {
+        if (end - pos < 8) return false;
+        uint32_t size = read32(pos);
+        uint32_t id = read32(pos + 4);
+        if (size < 8 || size > (size_t)(end - pos)) return false;
+        const char *name = (const char *)pos + 8;
+        fn(id, std::string(name, strnlen(name, size - 8)));
+        pos += size;
+    }
+    return true;
+}
+
+static bool parse_rule(const uint8_t *pos, const uint8_t *end, SimGrammar::Node &root) {
+    root.type = SIM_ELEM_START;
+    root.value = SIM_GROUP_SEQ;
+    std::vector<SimGrammar::Node *> stack = {&root};
+    while (pos < end) {
+        if (end - pos < 8) return false;
+        uint16_t type = read16(pos);
+        uint16_t size = read16(pos + 2);
+        uint32_t value = read32(pos + 4);
+        pos += 4 + size;
+        SimGrammar::Node *top = stack.back();
+        if (type == SIM_ELEM_END) {
+            if (stack.size() < 2 || top->value != value) return false;
+            stack.pop_back();
+            continue;
+        }
+        top->children.push_back({type, value, {}});
+        if (type == SIM_ELEM_START) {
+            stack.push_back(&top->children.back());
+        }
+    }
+    return stack.size() == 1;
+}
+
+bool SimGrammar::parse(const uint8_t *data, size_t size) {
+    if (!data || size < 8) return false;
+    const uint8_t *pos = data + 8;
+    const uint8_t *end = data + size;
+    while (pos < end) {
+        if (end - pos < 8) return false;
+        uint32_t chunk = read32(pos);
+        uint32_t chunk_size = read32(pos + 4);
+        pos += 8;
+        if (chunk_size > (size_t)(end - pos)) return false;
+        const uint8_t *chunk_end = pos + chunk_size;
+        bool ok = true;
+        switch (chunk) {
+        case SIM_CHUNK_EXPORTS:
+            ok = parse_ids(pos, chunk_end, [this](uint32_t id, std::string name) { this->exported[name] = id; });
+            break;
+        case SIM_CHUNK_IMPORTS:
+            ok = parse_ids(pos, chunk_end, [this](uint32_t id, std::string name) { this->imported[id] = name; });
+            break;
+        case SIM_CHUNK_LISTS:
+            ok = parse_ids(pos, chunk_end, [this](uint32_t id, std::string name) { this->list_names[id] = name; });
+            break;
+        case SIM_CHUNK_WORDS:
+            ok = parse_ids(pos, chunk_end, [this](uint32_t id, std::string name) { this->words[id] = name; });
+            break;
+        case SIM_CHUNK_RULES:
+            while (ok && pos < chunk_end) {
+                if (chunk_end - pos < 8) return false;
+                uint32_t rule_size = read32(pos);
+                uint32_t id = read32(pos + 4);
+                if (rule_size < 8 || rule_size > (size_t)(chunk_end - pos)) return false;
+                ok = parse_rule(pos + 8, pos + rule_size, this->rules[id]);
+                pos += rule_size;
+            }
+            break;
+        default:
+            // Chunks we don't simulate, like dictation settings.
+            break;
+        }
+        if (!ok) return false;
+        pos = chunk_end;
+    }
+    for (auto &pair : this->exported) {
+        if (this->rules.find(pair.second) == this->rules.end()) return false;
+    }
+    return this->exported.size() > 0;
+}
+
+bool SimGrammar::is_exported(const std::string &rule) const {
+    return this->exported.find(rule) != this->exported.end();
+}
+
+bool SimGrammar::has_list(const std::string &list) const {
+    for (auto &pair : this->list_names) {
+        if (pair.second == list) return true;
+    }
+    return false;
+}
+
+typedef std::function<bool(size_t)> SimNext;
+
+/* Backtracking matcher over a rule's element tree. Each step is handed the
+   rest of the match as a continuation, so alternatives, optionals and repeats
+   can retry with a different split of the words. */
+class SimMatcher {
+public:
+    SimMatcher(const SimGrammar &grammar, const std::vector<std::string> &words,
+               const std::unordered_map<std::string, std::vector<std::string>> &lists)
+        : grammar(grammar), words(words), lists(lists) {}
+
+    bool rule(uint32_t id, size_t pos, const SimNext &next) {
+        auto import = this->grammar.imported.find(id);
+        if (import != this->grammar.imported.end()) {
+            return this->dictation(import->second, pos, next);
+        }
+        auto it = this->grammar.rules.find(id);
+        if (it == this->grammar.rules.end() || this->depth >= SIM_MAX_DEPTH) {
+            return false;
+        }
+        this->depth++;
+        bool matched = this->node(it->second, pos, id, next);
+        this->depth--;
+        return matched;
+    }
+
+    std::vector<SimMatchWord> path;
+private:
+    bool node(const SimGrammar::Node &n, size_t pos, uint32_t rule, const SimNext &next) {
+        switch (n.type) {
+        case SIM_ELEM_WORD: {
+            auto word = this->grammar.words.find(n.value);
+            if (pos >= this->words.size() || word == this->grammar.words.end() || word->second != this->words[pos]) {
+                return false;
+            }
+            return this->consume(pos, 1, n.value, rule, next);
+        }
+        case SIM_ELEM_LIST:
+            return this->list(n.value, pos, rule, next);
+        case SIM_ELEM_RULE:
+            return this->rule(n.value, pos, next);
+        case SIM_ELEM_START:
+            switch (n.value) {
+            case SIM_GROUP_ALT:
+                for (auto &child : n.children) {
+                    if (this->node(child, pos, rule, next)) return true;
+                }
+                return false;
+            case SIM_GROUP_OPT:
+                return this->seq(n.children, 0, pos, rule, next) || next(pos);
+            case SIM_GROUP_REP:
+                return this->seq(n.children, 0, pos, rule, [&](size_t end) {
+                    // Only go round again if the last pass consumed something.
+                    return (end > pos && this->node(n, end, rule, next)) || next(end);
+                });
+            default:
+                return this->seq(n.children, 0, pos, rule, next);
+            }
+        default:
+            return false;
+        }
+    }
+
+    bool seq(const std::vector<SimGrammar::Node> &children, size_t i, size_t pos, uint32_t rule, const SimNext &next) {
+        if (i == children.size()) {
+            return next(pos);
+        }
+        return this->node(children[i], pos, rule, [&](size_t end) {
+            return this->seq(children, i + 1, end, rule, next);
+        });
+    }
+
+    // List entries can hold several words, which are matched one by one.
+    bool list(uint32_t id, size_t pos, uint32_t rule, const SimNext &next) {
+        auto name = this->grammar.list_names.find(id);
+        if (name == this->grammar.list_names.end()) return false;
+        auto entries = this->lists.find(name->second);
+        if (entries == this->lists.end()) return false;
+        for (auto &entry : entries->second) {
+            size_t count = 0, start = 0;
+            bool matched = true;
+            while (matched && start <= entry.size()) {
+                size_t space = entry.find(' ', start);
+                if (space == std::string::npos) space = entry.size();
+                matched = pos + count < this->words.size() &&
+                          entry.compare(start, space - start, this->words[pos + count]) == 0;
+                count++;
+                start = space + 1;
+            }
+            if (!matched && pos < this->words.size() && entry == this->words[pos]) {
+                matched = true;
+                count = 1;
+            }
+            if (matched && this->consume(pos, count, 0, rule, next)) return true;
+        }
+        return false;
+    }
+
+    // Dictation takes any words, greedily; letters take single characters.
+    bool dictation(const std::string &name, size_t pos, const SimNext &next) {
+        bool letters = (name == "dgnletters");
+        if (!letters && name != "dgndictation" && name != "dgnwords") {
+            return false;
+        }
+        size_t count = 0;
+        while (pos + count < this->words.size() &&
+               (!letters || this->words[pos + count].size() == 1)) {
+            count++;
+        }
+        for (; count > 0; count--) {
+            if (this->consume(pos, count, 0, SIM_DICTATION_RULE, next)) return true;
+        }
+        return false;
+    }
+
+    bool consume(size_t pos, size_t count, uint32_t id, uint32_t rule, const SimNext &next) {
+        for (size_t i = 0; i < count; i++) {
+            this->path.push_back({id, rule});
+        }
+        if (next(pos + count)) return true;
+        this->path.resize(this->path.size() - count);
+        return false;
+    }
+
+    const SimGrammar &grammar;
+    const std::vector<std::string> &words;
+    const std::unordered_map<std::string, std::vector<std::string>> &lists;
+    int depth = 0;
+};
+
+bool SimGrammar::match(const std::string &rule, const std::vector<std::string> &words,
+                       const std::unordered_map<std::string, std::vector<std::string>> &lists,
+                       std::vector<SimMatchWord> &out) const {
+    auto it = this->exported.find(rule);
+    if (it == this->exported.end() || words.empty()) {
+        return false;
+    }
+    SimMatcher matcher(*this, words, lists);
+    if (!matcher.rule(it->second, 0, [&](size_t end) { return end == words.size(); })) {
+        return false;
+    }
+    out = std::move(matcher.path);
+    return true;
+}
+
+uint32_t SimGrammarBuilder::rule(const std::string &name, bool exported) {
+    uint32_t id = this->next_rule++;
+    if (exported) {
+        this->exports.push_back({name, id});
+    }
+    return id;
+}
+
+uint32_t SimGrammarBuilder::import(const std::string &name) {
+    uint32_t id = this->next_rule++;
+    this->imports.push_back({name, id});
+    return id;
+}
+
+uint32_t SimGrammarBuilder::list(const std::string &name) {
+    uint32_t id = this->lists.size() + 1;
+    this->lists.push_back({name, id});
+    return id;
+}
+
+uint32_t SimGrammarBuilder::word(const std::string &word) {
+    auto it = this->word_ids.find(word);
+    if (it != this->word_ids.end()) {
+        return it->second;
+    }
+    uint32_t id = this->words.size() + 1;
+    this->words.push_back({word, id});
+    this->word_ids[word] = id;
+    return id;
+}
+
+void SimGrammarBuilder::begin_rule(uint32_t rule) {
+    this->definitions.push_back({rule, {}});
+}
+
+void SimGrammarBuilder::start(uint32_t group) {
+    this->element(SIM_ELEM_START, group);
+}
+
+void SimGrammarBuilder::end(uint32_t group) {
+    this->element(SIM_ELEM_END, group);
+}
+
+void SimGrammarBuilder::element(uint16_t type, uint32_t value) {
+    std::vector<uint8_t> &def = this->definitions.back().second;
+    uint16_t size = sizeof(value);
+    size_t at = def.size();
+    def.resize(at + 8);
+    memcpy(&def[at], &type, 2);
+    memcpy(&def[at + 2], &size, 2);
+    memcpy(&def[at + 4], &value, 4);
+}
+
+static void append32(std::vector<uint8_t> &out, uint32_t v) {
+    size_t at = out.size();
+    out.resize(at + 4);
+    memcpy(&out[at], &v, 4);
+}
+
+template <typename T>
+static void append_ids(std::vector<uint8_t> &out, uint32_t chunk, const T &ids) {
+    if (ids.empty()) return;
+    append32(out, chunk);
+    size_t size_at = out.size();
+    append32(out, 0);
+    for (auto &named : ids) {
+        uint32_t padded = align4(named.name.size());
+        append32(out, 8 + padded);
+        append32(out, named.id);
+        size_t at = out.size();
+        out.resize(at + padded, 0);
+        memcpy(&out[at], named.name.data(), named.name.size());
+    }
+    uint32_t size = out.size() - size_at - 4;
+    memcpy(&out[size_at], &size, 4);
+}
+
+std::vector<uint8_t> SimGrammarBuilder::build() const {
+    std::vector<uint8_t> out;
+    append32(out, 0);
+    append32(out, 0);
+    append_ids(out, SIM_CHUNK_EXPORTS, this->exports);
+    append_ids(out, SIM_CHUNK_IMPORTS, this->imports);
+    append_ids(out, SIM_CHUNK_LISTS, this->lists);
+    append_ids(out, SIM_CHUNK_WORDS, this->words);
+    append32(out, SIM_CHUNK_RULES);
+    size_t size_at = out.size();
+    append32(out, 0);
+    for (auto &def : this->definitions) {
+        append32(out, 8 + def.second.size());
+        append32(out, def.first);
+        out.insert(out.end(), def.second.begin(), def.second.end());
+    }
+    uint32_t size = out.size() - size_at - 4;
+    memcpy(&out[size_at], &size, 4);
+    return out;
+}
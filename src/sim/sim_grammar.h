@@ -0,0 +1,95 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* Element types and values in a compiled grammar's rule definitions. */
+enum {
+    SIM_ELEM_START = 1,
+    SIM_ELEM_END = 2,
+    SIM_ELEM_WORD = 3,
+    SIM_ELEM_RULE = 4,
+    SIM_ELEM_LIST = 6,
+};
+
+enum {
+    SIM_GROUP_SEQ = 1,
+    SIM_GROUP_ALT = 2,
+    SIM_GROUP_REP = 3,
+    SIM_GROUP_OPT = 4,
+};
+
+/* One recognized word: its grammar word id (0 for list and dictation words)
+   and the id of the innermost rule it matched in. */
+struct SimMatchWord {
+    uint32_t id;
+    uint32_t rule;
+};
+
+/* A grammar blob as the simulated engine understands it.
+
+   Blobs use the same layout natlink and dragonfly compile to: an 8 byte
+   header, then chunks of `uint32 id, uint32 size` followed by the chunk data.
+   The exported rule (4), imported rule (5), list (6) and word (2) chunks are
+   arrays of dsx_id entries; the rule chunk (3) holds each rule's definition as
+   `uint16 type, uint16 size, uint32 value` elements, with START and END
+   bracketing sequences, alternatives, repeats and optionals.
+
+ */
+class SimGrammar {
+public:
+    // Returns false if the blob is truncated or has no rules.
+    bool parse(const uint8_t *data, size_t size);
+
+    bool is_exported(const std::string &rule) const;
+    bool has_list(const std::string &list) const;
+    // Matches the whole phrase against `rule`, filling one entry per word.
+    bool match(const std::string &rule, const std::vector<std::string> &words,
+               const std::unordered_map<std::string, std::vector<std::string>> &lists,
+               std::vector<SimMatchWord> &out) const;
+
+    struct Node {
+        uint16_t type;   // SIM_ELEM_*, with START meaning a group
+        uint32_t value;  // SIM_GROUP_* for groups, otherwise the id
+        std::vector<Node> children;
+    };
+private:
+    friend class SimMatcher;
+    std::unordered_map<std::string, uint32_t> exported;
+    std::unordered_map<uint32_t, std::string> imported;
+    std::unordered_map<uint32_t, std::string> list_names;
+    std::unordered_map<uint32_t, std::string> words;
+    std::unordered_map<uint32_t, Node> rules;
+};
+
+/* Builds grammar blobs in the layout SimGrammar parses, for generating
+   synthetic grammars. Each begin_rule() starts a definition, which the element
+   methods after it add to. */
+class SimGrammarBuilder {
+public:
+    uint32_t rule(const std::string &name, bool exported = true);
+    uint32_t import(const std::string &name);
+    uint32_t list(const std::string &name);
+    uint32_t word(const std::string &word);
+
+    void begin_rule(uint32_t rule);
+    void start(uint32_t group);
+    void end(uint32_t group);
+    void add_word(const std::string &word) { this->element(SIM_ELEM_WORD, this->word(word)); }
+    void add_rule(uint32_t rule) { this->element(SIM_ELEM_RULE, rule); }
+    void add_list(uint32_t list) { this->element(SIM_ELEM_LIST, list); }
+
+    std::vector<uint8_t> build() const;
+private:
+    void element(uint16_t type, uint32_t value);
+
+    struct Named {
+        std::string name;
+        uint32_t id;
+    };
+    std::vector<Named> exports, imports, lists, words;
+    std::unordered_map<std::string, uint32_t> word_ids;
+    uint32_t next_rule = 1;
+    std::vector<std::pair<uint32_t, std::vector<uint8_t>>> definitions;
+};
@@ -0,0 +1,85 @@
+#include "timeline.h"
+#include "draconity.h"
+#include "dr_time.h"
+
+static const char *point_names[TIMELINE_POINTS] = {
+    "speech_end",
+    "callback",
+    "queued",
+    "dequeued",
+    "lookup",
+    "encoded",
+    "sent",
+    "written",
+};
+
+TimelineStats::TimelineStats() {
+    this->count = 0;
+    memset(this->histograms, 0, sizeof(this->histograms));
+    memset(this->totals, 0, sizeof(this->totals));
+}
+
+void TimelineStats::add(const Timeline &timeline) {
+    this->count++;
+    int64_t last = 0;
+    for (int i = 0; i < TIMELINE_POINTS; i++) {
+        int64_t point = timeline.points[i];
+        if (point == 0) {
+            continue;
+        }
+        if (last != 0) {
+            // Dragon's word times are coarse, so speech can appear to end
+            // after the callback.
+            int64_t us = (point > last) ? (point - last) / 1000 : 0;
+            int bucket = 0;
+            while (bucket < TIMELINE_HISTOGRAM_BUCKETS - 1 && us >= ((int64_t)1 << bucket)) {
+                bucket++;
+            }
+            this->histograms[i][bucket]++;
+            this->totals[i] += us;
+        }
+        last = point;
+    }
+}
+
+void TimelineStats::append(bson_t *doc) {
+    bson_t stages, stage, array, child;
+    char keystr[16];
+    const char *key;
+
+    BSON_APPEND_INT64(doc, "count", this->count);
+    BSON_APPEND_DOCUMENT_BEGIN(doc, "stages", &stages);
+    // Stages are named for the point they end at.
+    for (int i = 1; i < TIMELINE_POINTS; i++) {
+        BSON_APPEND_DOCUMENT_BEGIN(&stages, point_names[i], &stage);
+        BSON_APPEND_INT64(&stage, "total_us", this->totals[i]);
+        BSON_APPEND_ARRAY_BEGIN(&stage, "histogram", &array);
+        for (int j = 0; j < TIMELINE_HISTOGRAM_BUCKETS; j++) {
+            bson_uint32_to_string(j, &key, keystr, sizeof(keystr));
+            BSON_APPEND_DOCUMENT_BEGIN(&array, key, &child);
+            // Upper bound of the bucket in us - the last bucket is unbounded.
+            BSON_APPEND_INT64(&child, "lt_us", (j == TIMELINE_HISTOGRAM_BUCKETS - 1) ? -1 : (int64_t)1 << j);
+            BSON_APPEND_INT64(&child, "count", this->histograms[i][j]);
+            bson_append_document_end(&array, &child);
+        }
+        bson_append_array_end(&stage, &array);
+        bson_append_document_end(&stages, &stage);
+    }
+    bson_append_document_end(doc, &stages);
+}
+
+void timeline_to_bson(bson_t *obj, const Timeline &timeline) {
+    bson_t child;
+    BSON_APPEND_DOCUMENT_BEGIN(obj, "timeline", &child);
+    for (int i = 0; i < TIMELINE_POINTS; i++) {
+        if (timeline.points[i] != 0) {
+            BSON_APPEND_INT64(&child, point_names[i], timeline.points[i]);
+        }
+    }
+    bson_append_document_end(obj, &child);
+}
+
+void timeline_written(Timeline &timeline) {
+    timeline.points[TIMELINE_WRITTEN] = dr_monotonic_time();
+    draconity->timelines.add(timeline);
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <stdint.h>
+#include <bson.h>
+
+/* Points an utterance passes on its way from the end of speech to the client.
+   Each is a dr_monotonic_time() timestamp, or 0 if the point was skipped. */
+enum TimelinePoint {
+    TIMELINE_SPEECH_END,  // Dragon's end time for the last word
+    TIMELINE_CALLBACK,    // phrase_end entered
+    TIMELINE_QUEUED,      // Captured and handed to the phrase queue
+    TIMELINE_DEQUEUED,    // Picked up on the Uv thread
+    TIMELINE_LOOKUP,      // Grammar looked up
+    TIMELINE_ENCODED,     // p.end encoded
+    TIMELINE_SENT,        // Handed to the transport
+    TIMELINE_WRITTEN,     // Written to the client's socket
+    TIMELINE_POINTS,
+};
+
+struct Timeline {
+    int64_t points[TIMELINE_POINTS];
+};
+
+#define TIMELINE_HISTOGRAM_BUCKETS 24
+
+/* Histograms of the time spent in each stage, where a stage runs from one
+   recorded point to the next.
+
+   Must only be used from the Uv thread.
+
+ */
+class TimelineStats {
+public:
+    TimelineStats();
+    void add(const Timeline &timeline);
+    void append(bson_t *doc);
+private:
+    uint64_t count;
+    // Stage durations, bucketed by powers of two us. Indexed by the point the
+    // stage ends at.
+    uint64_t histograms[TIMELINE_POINTS][TIMELINE_HISTOGRAM_BUCKETS];
+    int64_t totals[TIMELINE_POINTS];
+};
+
+void timeline_to_bson(bson_t *obj, const Timeline &timeline);
+// Marks the timeline written and adds it to the stats. Called on the Uv thread
+// once the p.end's write has completed.
+void timeline_written(Timeline &timeline);
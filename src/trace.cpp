@@ -0,0 +1,250 @@
+#include <atomic>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include "trace.h"
+
+#define TRACE_CAPACITY (1 << 15)
+
+struct TraceSlot {
+    // Index + 1 of the event in the slot, or 0 while it's being written.
+    std::atomic<uint64_t> seq;
+    int64_t ts;
+    int64_t dur;
+    const char *name;
+    int64_t arg;
+    uint32_t tid;
+    char phase;
+};
+
+static TraceSlot ring[TRACE_CAPACITY];
+static std::atomic<uint64_t> head(0);
+static std::atomic<uint32_t> next_tid(1);
+static bool enabled = true;
+// Kept in a fixed buffer so the crash hook doesn't have to allocate.
+static char dump_path[1024];
+
+static uint32_t trace_tid() {
+    static thread_local uint32_t tid = next_tid.fetch_add(1);
+    return tid;
+}
+
+static void trace_record(char phase, const char *name, int64_t ts, int64_t dur, int64_t arg) {
+    if (!enabled) return;
+    uint64_t index = head.fetch_add(1, std::memory_order_relaxed);
+    TraceSlot &slot = ring[index & (TRACE_CAPACITY - 1)];
+    slot.seq.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.ts = ts;
+    slot.dur = dur;
+    slot.name = name;
+    slot.arg = arg;
+    slot.tid = trace_tid();
+    slot.phase = phase;
+    slot.seq.store(index + 1, std::memory_order_release);
+}
+
+void trace_init(bool trace_enabled, const std::string &path) {
+    enabled = trace_enabled;
+    snprintf(dump_path, sizeof(dump_path), "%s", path.c_str());
+}
+
+void trace_instant(const char *name, int64_t arg) {
+    trace_record('i', name, dr_monotonic_time(), 0, arg);
+}
+
+void trace_complete(const char *name, int64_t start, int64_t arg) {
+    trace_record('X', name, start, dr_monotonic_time() - start, arg);
+}
+
+/* Buffered JSON writer. With an fd it only uses write(2) and a stack buffer,
+   so it's safe to use from a signal handler. */
+struct TraceWriter {
+    int fd;
+    std::string *out;
+    char buf[4096];
+    size_t len;
+
+    void flush() {
+        if (this->out) {
+            this->out->append(this->buf, this->len);
+        } else {
+            size_t pos = 0;
+            while (pos < this->len) {
+                ssize_t n = write(this->fd, this->buf + pos, this->len - pos);
+                if (n <= 0) break;
+                pos += n;
+            }
+        }
+        this->len = 0;
+    }
+
+    void put(const char *s, size_t n) {
+        if (this->len + n > sizeof(this->buf)) {
+            this->flush();
+        }
+        if (n > sizeof(this->buf)) n = sizeof(this->buf);
+        memcpy(this->buf + this->len, s, n);
+        this->len += n;
+    }
+
+    void str(const char *s) {
+        this->put(s, strlen(s));
+    }
+
+    void num(int64_t value) {
+        char digits[24];
+        int i = sizeof(digits);
+        bool negative = value < 0;
+        uint64_t v = negative ? -(uint64_t)value : value;
+        do {
+            digits[--i] = '0' + v % 10;
+            v /= 10;
+        } while (v);
+        if (negative) digits[--i] = '-';
+        this->put(digits + i, sizeof(digits) - i);
+    }
+
+    // Chrome wants microseconds; keep the ns as the fraction.
+    void us(int64_t ns) {
+        this->num(ns / 1000);
+        char frac[4] = {'.', (char)('0' + ns / 100 % 10), (char)('0' + ns / 10 % 10), (char)('0' + ns % 10)};
+        if (ns >= 0) this->put(frac, sizeof(frac));
+    }
+};
+
+static int64_t trace_write(TraceWriter &w) {
+    uint64_t end = head.load(std::memory_order_acquire);
+    uint64_t start = (end > TRACE_CAPACITY) ? end - TRACE_CAPACITY : 0;
+    int64_t count = 0;
+    w.str("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (uint64_t i = start; i < end; i++) {
+        TraceSlot &slot = ring[i & (TRACE_CAPACITY - 1)];
+        uint64_t seq = slot.seq.load(std::memory_order_acquire);
+        if (seq != i + 1) continue;
+        TraceSlot copy;
+        copy.ts = slot.ts;
+        copy.dur = slot.dur;
+        copy.name = slot.name;
+        copy.arg = slot.arg;
+        copy.tid = slot.tid;
+        copy.phase = slot.phase;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        // Overwritten while we were copying it.
+        if (slot.seq.load(std::memory_order_relaxed) != seq) continue;
+
+        w.str(count ? ",\n{\"name\":\"" : "\n{\"name\":\"");
+        w.str(copy.name);
+        w.str("\",\"ph\":\"");
+        w.put(&copy.phase, 1);
+        w.str("\",\"pid\":1,\"tid\":");
+        w.num(copy.tid);
+        w.str(",\"ts\":");
+        w.us(copy.ts);
+        if (copy.phase == 'X') {
+            w.str(",\"dur\":");
+            w.us(copy.dur);
+        } else {
+            w.str(",\"s\":\"t\"");
+        }
+        w.str(",\"args\":{\"arg\":");
+        w.num(copy.arg);
+        w.str("}}");
+        count++;
+    }
+    w.str("\n]}\n");
+    w.flush();
+    return count;
+}
+
+int64_t trace_dump() {
+    if (!dump_path[0]) {
+        return -1;
+    }
+    int fd = open(dump_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    TraceWriter w;
+    w.fd = fd;
+    w.out = NULL;
+    w.len = 0;
+    int64_t count = trace_write(w);
+    close(fd);
+    return count;
+}
+
+std::string trace_json() {
+    std::string out;
+    TraceWriter w;
+    w.fd = -1;
+    w.out = &out;
+    w.len = 0;
+    trace_write(w);
+    return out;
+}
+
+#ifdef _WIN32
+static LPTOP_LEVEL_EXCEPTION_FILTER previous_filter;
+
+static LONG WINAPI trace_crash_filter(EXCEPTION_POINTERS *info) {
+    trace_dump();
+    return previous_filter ? previous_filter(info) : EXCEPTION_CONTINUE_SEARCH;
+}
+
+void trace_install_hooks() {
+    if (!enabled || !dump_path[0]) return;
+    previous_filter = SetUnhandledExceptionFilter(trace_crash_filter);
+}
+#else
+static const int crash_signals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+static struct sigaction previous_actions[sizeof(crash_signals) / sizeof(crash_signals[0])];
+
+static void trace_crash_handler(int sig, siginfo_t *info, void *context) {
+    struct sigaction *previous = NULL;
+    for (size_t i = 0; i < sizeof(crash_signals) / sizeof(crash_signals[0]); i++) {
+        if (crash_signals[i] == sig) {
+            previous = &previous_actions[i];
+        }
+    }
+    if (!previous) return;
+    // If something else handles the signal it owns the fault (Dragon may
+    // recover from it), so pass it on untouched and don't dump.
+    if (previous->sa_flags & SA_SIGINFO) {
+        previous->sa_sigaction(sig, info, context);
+        return;
+    }
+    if (previous->sa_handler == SIG_IGN) {
+        return;
+    }
+    if (previous->sa_handler != SIG_DFL) {
+        previous->sa_handler(sig);
+        return;
+    }
+    // Nothing else wants it, so the process is about to die.
+    trace_dump();
+    sigaction(sig, previous, NULL);
+    // A fault is raised again, with its own siginfo, when the instruction is
+    // retried on return. A sent signal (raise, abort, kill) has to be resent.
+    if (!info || info->si_code <= 0) {
+        raise(sig);
+    }
+}
+
+void trace_install_hooks() {
+    if (!enabled || !dump_path[0]) return;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = trace_crash_handler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_SIGINFO;
+    for (size_t i = 0; i < sizeof(crash_signals) / sizeof(crash_signals[0]); i++) {
+        sigaction(crash_signals[i], &action, &previous_actions[i]);
+    }
+}
+#endif
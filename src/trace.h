@@ -0,0 +1,39 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include "dr_time.h"
+
+/* Always-on flight recorder.
+
+   Events go into a fixed-size lock-free ring, overwriting the oldest, so the
+   last few seconds before a stall or crash can be exported as Chrome
+   trace-event JSON and opened in chrome://tracing or Perfetto.
+
+   Event names must be string literals - only the pointer is recorded.
+
+ */
+
+// Reads the trace config. Called once, before any events are recorded.
+void trace_init(bool enabled, const std::string &dump_path);
+// Dumps the trace when the process is about to die of a fault or abort. Only
+// installed when trace_crash is set, as it puts handlers in front of Dragon's.
+void trace_install_hooks();
+
+void trace_instant(const char *name, int64_t arg = 0);
+void trace_complete(const char *name, int64_t start, int64_t arg = 0);
+
+// Writes the ring as Chrome trace JSON to the configured dump path. Returns the
+// number of events written, or -1 if the file couldn't be opened.
+int64_t trace_dump();
+std::string trace_json();
+
+/* Records the enclosing scope as a complete event. */
+class TraceScope {
+public:
+    TraceScope(const char *name, int64_t arg = 0) : name(name), arg(arg), start(dr_monotonic_time()) {}
+    ~TraceScope() { trace_complete(this->name, this->start, this->arg); }
+private:
+    const char *name;
+    int64_t arg;
+    int64_t start;
+};
@@ -1,13 +1,58 @@
+#include <deque>
 #include <bson.h>
+#include "draconity.h"
+#include "dr_time.h"
+#include "log.h"
+#include "trace.h"
+#include "transport/framing.h"
 #include "transport/transport.h"
 
 class UvClientBase {
 public:
     virtual void publish(const std::vector<uint8_t> &msg) {}
     virtual void writeMessage(const uint32_t tid, const std::vector<uint8_t> &msg) {}
+    // Bytes written but not yet flushed to the socket.
+    virtual size_t queuedBytes() { return 0; }
+    virtual void disconnect() {}
     virtual ~UvClientBase() {};
+
+    // Calls `fn` once everything written so far has reached the socket.
+    void afterWrites(WrittenFn fn) {
+        if (this->writes_done == this->writes_issued) {
+            fn(true);
+            return;
+        }
+        this->write_waiters.emplace_back(this->writes_issued, std::move(fn));
+    }
+
+    // A write finished. libuv completes a stream's writes in order.
+    void onWrite() {
+        this->writes_done++;
+        while (!this->write_waiters.empty() && this->write_waiters.front().first <= this->writes_done) {
+            WrittenFn fn = std::move(this->write_waiters.front().second);
+            this->write_waiters.pop_front();
+            fn(true);
+        }
+    }
+
+    // The connection closed with writes still outstanding.
+    void onClose() {
+        auto waiters = std::move(this->write_waiters);
+        this->write_waiters.clear();
+        for (auto &waiter : waiters) {
+            waiter.second(false);
+        }
+    }
+protected:
+    uint64_t writes_issued = 0;
+    uint64_t writes_done = 0;
+    std::deque<std::pair<uint64_t, WrittenFn>> write_waiters;
 public:
     uint64_t id;
+    bool authed = false;
+    // Whether Dragon should wait for this client to unpause. Clients can opt
+    // out when they authenticate.
+    bool pauses = true;
 };
 
 template <typename T>
@@ -16,7 +61,6 @@ public:
     UvClient(std::shared_ptr<T> stream, transport_msg_fn callback, std::string secret, uint64_t client_id) {
         this->stream = stream;
         this->handle_message_callback = callback;
-        this->authed = false;
         this->secret = secret;
         this->id = client_id;
     }
@@ -27,29 +71,15 @@ public:
     }
 
     void onData(const uvw::DataEvent &event, T &stream) {
-        auto data = &event.data[0];
-        recv_buffer.insert(recv_buffer.end(), data, data + event.length);
-        while (true) {
-            if (!received_header) {
-                if (recv_buffer.size() >= sizeof(MessageHeader)) {
-                    uint32_t *recv_buffer_start = reinterpret_cast<uint32_t *>(recv_buffer.data());
-                    received_header = std::optional(MessageHeader{
-                            .tid = htonl(recv_buffer_start[0]),
-                            .length = htonl(recv_buffer_start[1])});
-                    recv_buffer.erase(recv_buffer.begin(), recv_buffer.begin() + sizeof(MessageHeader));
-                } else {
-                    break;
-                }
-            }
-            if (received_header && recv_buffer.size() >= received_header->length) {
-                std::vector<uint8_t> msg(recv_buffer.begin(), recv_buffer.begin() + received_header->length);
-                handleMessage(msg);
-                recv_buffer.erase(recv_buffer.begin(), recv_buffer.begin() + received_header->length);
-                received_header = {};
-            } else if (received_header) {
-                // we haven't got enough data to parse the body yet
-                break;
-            }
+        bool ok = this->decoder.feed((const uint8_t *)event.data.get(), event.length,
+                                     [this](uint32_t tid, const uint8_t *data, uint32_t length) {
+            this->handleMessage(tid, data, length);
+            return true;
+        });
+        if (!ok) {
+            draconity_log(LEVEL_WARN, "transport", "client %llu sent a message over %d bytes, disconnecting",
+                          (unsigned long long)this->id, MAX_MESSAGE_LENGTH);
+            stream.close();
         }
     }
 
@@ -63,28 +93,46 @@ public:
         writeMessage(tid, &msg[0], msg.size());
     }
 
+    size_t queuedBytes() override {
+        return stream->writeQueueSize();
+    }
+
+    void disconnect() override {
+        stream->close();
+    }
+
 private:
-    void handleMessage(std::vector<uint8_t> &msg) {
+    // `msg` points into the read buffer, and is only valid during the call.
+    void handleMessage(uint32_t tid, const uint8_t *msg, size_t msg_len) {
+        static Counter *received = draconity->metrics.counter("draconity_messages_received_total", "Messages received from clients");
+        static Counter *received_bytes = draconity->metrics.counter("draconity_received_bytes_total", "Message bytes received from clients");
+        static Histogram *handle_time = draconity->metrics.histogram("draconity_message_seconds", "Time spent handling a client message");
+        received->inc();
+        received_bytes->inc(msg_len);
         bson_t *reply = nullptr;
         if (!authed) {
-            reply = handleAuth(msg);
+            reply = handleAuth(msg, msg_len);
         } else {
-            reply = handle_message_callback(this->id, received_header->tid, msg);
+            int64_t start = dr_monotonic_time();
+            reply = handle_message_callback(this->id, tid, msg, msg_len);
+            handle_time->record(dr_monotonic_time() - start);
+            trace_complete("handle_message", start, this->id);
         }
         // HACK: Some messages won't return a reply immediately. If a message
         //   returns null, it's making a pinky promise to reply later.
         if (reply) {
             uint32_t reply_length;
             uint8_t *reply_data = bson_destroy_with_steal(reply, true, &reply_length);
-            writeMessage(received_header->tid, reply_data, reply_length);
+            writeMessage(tid, reply_data, reply_length);
             bson_free(reply_data);
         }
     }
 
-    bson_t *handleAuth(std::vector<uint8_t> &msg) {
-        std::string cmd, secret;
+    bson_t *handleAuth(const uint8_t *msg, size_t msg_len) {
+        std::string cmd, secret, resume;
+        bool pauses = true;
         bson_t root;
-        if (!bson_init_static(&root, &msg[0], msg.size())) {
+        if (!bson_init_static(&root, msg, msg_len)) {
             return BCON_NEW(
                 "success", BCON_BOOL(false),
                 "error",   BCON_UTF8("failed to parse BSON"));
@@ -97,6 +145,10 @@ private:
                     cmd = bson_iter_utf8(&iter, NULL);
                 } else if (key == "secret" && BSON_ITER_HOLDS_UTF8(&iter)) {
                     secret = bson_iter_utf8(&iter, NULL);
+                } else if (key == "pause" && BSON_ITER_HOLDS_BOOL(&iter)) {
+                    pauses = bson_iter_bool(&iter);
+                } else if (key == "resume" && BSON_ITER_HOLDS_UTF8(&iter)) {
+                    resume = bson_iter_utf8(&iter, NULL);
                 }
             }
         }
@@ -109,7 +161,14 @@ private:
                 }
                 if (diff == 0) {
                     this->authed = true;
-                    return BCON_NEW("success", BCON_BOOL(true));
+                    this->pauses = pauses;
+                    // Only now can the client make us reserve room for a
+                    // large message before it has sent it.
+                    this->decoder.reserve_limit = this->decoder.max_length;
+                    bson_t *reply = BCON_NEW("success", BCON_BOOL(true));
+                    // A client resuming a session takes over its old id.
+                    this->id = draconity->open_session(this->id, resume, reply);
+                    return reply;
                 }
             }
             return BCON_NEW(
@@ -124,25 +183,23 @@ private:
     // Write `msg_len` bytes of `msg` to the client using the given transaction id of `tid`.
     // Callers are responsible for freeing any data pointed at by `msg` afterwards.
     void writeMessage(const uint32_t tid, const uint8_t *msg, size_t msg_len) {
-        // We jump through some hoops to allocate a new chunk of memory pointed to by a
-        // `unique_ptr` and copy our data to write into that, so that we can pass that into
-        // uvw. That way we don't have to worry about `msg`'s lifetime lasting long enough:
-        // uvw will take care of freeing the memory passed to it once the data is sent.
-        size_t frame_size = sizeof(MessageHeader) + msg_len;
-        auto data_to_write = std::make_unique<char[]>(frame_size);
-        auto header = reinterpret_cast<MessageHeader *>(&data_to_write.get()[0]);
-        header->tid = ntohl(tid);
-        header->length = ntohl(msg_len);
-        std::memcpy(&data_to_write.get()[sizeof(MessageHeader)], msg, msg_len);
+        static Counter *sent = draconity->metrics.counter("draconity_messages_sent_total", "Messages written to clients");
+        static Counter *sent_bytes = draconity->metrics.counter("draconity_sent_bytes_total", "Message bytes written to clients");
+        sent->inc();
+        sent_bytes->inc(msg_len);
+        TraceScope trace("write", msg_len);
+        // We copy the message into a new chunk of memory pointed to by a
+        // `unique_ptr`, so that we don't have to worry about `msg`'s lifetime
+        // lasting long enough: uvw frees the copy once the data is sent.
+        size_t frame_size;
+        auto data_to_write = frame_message(tid, msg, msg_len, &frame_size);
         stream->write(std::move(data_to_write), frame_size);
+        this->writes_issued++;
     }
 
 private:
     std::string secret;
-    bool authed;
     transport_msg_fn handle_message_callback;
     std::shared_ptr<T> stream;
-    std::vector<uint8_t> recv_buffer;
-
-    std::optional<MessageHeader> received_header = {};
+    FrameDecoder decoder;
 };
@@ -0,0 +1,170 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+/* The wire framing, shared by the server's transport and the client library
+   in client/. Each message is a MessageHeader, both fields in network byte
+   order, followed by `length` bytes of BSON. Replies carry the tid of the
+   request they answer; publishes carry PUBLISH_TID.
+
+   Nothing here depends on libuv or libbson, so clients on other event loops
+   can use it as is.
+
+ */
+
+#define PUBLISH_TID 0
+// Never sent; the server gives it to requests whose replies have nowhere to
+// go. Clients shouldn't use it.
+#define NO_REPLY_TID 0xFFFFFFFF
+
+typedef struct __attribute__((packed)) {
+    uint32_t tid, length;
+} MessageHeader;
+
+// Writes a header for `msg_len` bytes of message to `out`.
+static inline void write_header(uint8_t *out, uint32_t tid, size_t msg_len) {
+    MessageHeader header = {.tid = htonl(tid), .length = htonl((uint32_t)msg_len)};
+    memcpy(out, &header, sizeof(header));
+}
+
+// A framed copy of `msg`, allocated the way uvw's write wants it.
+static inline std::unique_ptr<char[]> frame_message(uint32_t tid, const uint8_t *msg, size_t msg_len,
+                                                    size_t *frame_size) {
+    *frame_size = sizeof(MessageHeader) + msg_len;
+    auto data = std::make_unique<char[]>(*frame_size);
+    write_header((uint8_t *)data.get(), tid, msg_len);
+    if (msg_len > 0) {
+        memcpy(data.get() + sizeof(MessageHeader), msg, msg_len);
+    }
+    return data;
+}
+
+// Appends a framed copy of `msg` to `out`, so several can go in one write.
+static inline void append_frame(std::vector<uint8_t> &out, uint32_t tid, const uint8_t *msg, size_t msg_len) {
+    size_t offset = out.size();
+    out.resize(offset + sizeof(MessageHeader) + msg_len);
+    write_header(&out[offset], tid, msg_len);
+    if (msg_len > 0) {
+        memcpy(&out[offset + sizeof(MessageHeader)], msg, msg_len);
+    }
+}
+
+// Longest message a FrameDecoder accepts by default.
+#define MAX_MESSAGE_LENGTH (64 * 1024 * 1024)
+// Most a FrameDecoder reserves for a split message by default, before any of
+// it has arrived, and most it keeps allocated between messages.
+#define FRAME_RESERVE_LIMIT (64 * 1024)
+
+/* Splits a byte stream back into messages. */
+class FrameDecoder {
+public:
+    /* Calls fn(tid, data, length) for each message `data` completes, where fn
+       returns false to drop the rest of the read. Messages that arrive whole
+       are passed straight out of `data`; only a message split across reads is
+       copied. `data` is only valid during the call.
+
+       Returns false if a header claims more than max_length bytes, after which
+       the stream can't be trusted and should be closed. */
+    template <typename F>
+    bool feed(const uint8_t *data, size_t length, F fn) {
+        // Finish the message the last read split first.
+        while (!this->partial.empty() && length > 0) {
+            size_t take = std::min(length, this->wanted());
+            this->partial.insert(this->partial.end(), data, data + take);
+            data += take;
+            length -= take;
+            if (!this->check_partial()) {
+                return false;
+            }
+            if (this->wanted() == 0) {
+                MessageHeader header = read_header(this->partial.data());
+                bool more = fn(header.tid, this->partial.data() + sizeof(MessageHeader), header.length);
+                this->clear();
+                if (!more) return true;
+            }
+        }
+        while (length >= sizeof(MessageHeader)) {
+            MessageHeader header = read_header(data);
+            if (header.length > this->max_length) {
+                return false;
+            }
+            if (length - sizeof(MessageHeader) < header.length) {
+                break;
+            }
+            if (!fn(header.tid, data + sizeof(MessageHeader), header.length)) {
+                return true;
+            }
+            data += sizeof(MessageHeader) + header.length;
+            length -= sizeof(MessageHeader) + header.length;
+        }
+        if (length > 0) {
+            this->partial.assign(data, data + length);
+            return this->check_partial();
+        }
+        return true;
+    }
+
+    // Bytes held back waiting for the rest of a message.
+    size_t buffered() const {
+        return this->partial.size();
+    }
+
+    // Drops any partial message, and frees the buffer if a large one grew it.
+    void clear() {
+        if (this->partial.capacity() > FRAME_RESERVE_LIMIT) {
+            std::vector<uint8_t>().swap(this->partial);
+        } else {
+            this->partial.clear();
+        }
+    }
+
+    // Longest message accepted.
+    size_t max_length = MAX_MESSAGE_LENGTH;
+    // Most reserved for a split message ahead of its bytes arriving; past
+    // this the buffer grows as they come. Only raise it for trusted peers.
+    size_t reserve_limit = FRAME_RESERVE_LIMIT;
+
+private:
+    static MessageHeader read_header(const uint8_t *data) {
+        MessageHeader header;
+        memcpy(&header, data, sizeof(header));
+        header.tid = ntohl(header.tid);
+        header.length = ntohl(header.length);
+        return header;
+    }
+
+    // Bytes still missing from the partial message.
+    size_t wanted() const {
+        if (this->partial.size() < sizeof(MessageHeader)) {
+            return sizeof(MessageHeader) - this->partial.size();
+        }
+        size_t total = sizeof(MessageHeader) + read_header(this->partial.data()).length;
+        return total - this->partial.size();
+    }
+
+    // Once the partial message's header is in, checks its length and reserves
+    // room for the rest, up to reserve_limit, so most messages are copied only
+    // once. Returns false if the message is too long.
+    bool check_partial() {
+        if (this->partial.size() < sizeof(MessageHeader)) {
+            return true;
+        }
+        size_t length = read_header(this->partial.data()).length;
+        if (length > this->max_length) {
+            this->clear();
+            return false;
+        }
+        this->partial.reserve(std::min(sizeof(MessageHeader) + length, this->reserve_limit));
+        return true;
+    }
+
+    std::vector<uint8_t> partial;
+};
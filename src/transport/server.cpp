@@ -8,15 +8,21 @@
 #include <optional>
 #include <sstream>
 #include <thread>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 #include <uvw.hpp>
 
 #include "abstract_platform.h"
 #include "transport/transport.h"
 #include "server.h"
 #include "draconity.h"
+#include "log.h"
 
 UvServer::UvServer(transport_msg_fn callback, std::shared_ptr<cpptoml::table> config) {
     this->config = config;
+    // Constructed on the thread that goes on to run the loop.
+    this->loop_thread = std::this_thread::get_id();
     handle_message_callback = callback;
     loop = uvw::Loop::create();
 
@@ -25,7 +31,7 @@ UvServer::UvServer(transport_msg_fn callback, std::shared_ptr<cpptoml::table> co
         this->drain_invoke_queue();
     });
     async_invoke_handle->on<uvw::ErrorEvent>([](auto &, auto &) {
-        printf("[!] draconity transport: received error event for checking invoke queue!");
+        draconity_log(LEVEL_ERROR, "transport", "received error event for checking invoke queue!");
     });
 
     this->client_nonce = 0;
@@ -39,7 +45,7 @@ UvServer::UvServer(transport_msg_fn callback, std::shared_ptr<cpptoml::table> co
                 auto host = socket->get_as<std::string>("host").value_or("");
                 auto port = socket->get_as<int>("port").value_or(0);
                 if (host != "" && port > 0) {
-                    printf("[+] draconity transport: binding TCP at %s:%i\n", host.c_str(), port);
+                    draconity_log(LEVEL_INFO, "transport", "binding TCP at %s:%i", host.c_str(), port);
                     this->listenTCP(host, port);
                     listening = true;
                 }
@@ -50,10 +56,10 @@ UvServer::UvServer(transport_msg_fn callback, std::shared_ptr<cpptoml::table> co
             for (auto pipe : *pipes) {
                 auto path = pipe->get_as<std::string>("path").value_or("");
                 if (path != "") {
-                    printf("[+] draconity transport: binding pipe at %s\n", path.c_str());
-                    // if we're on mac, this is a file and we need to expand ~/ to HOME and unlink the old socket
+                    draconity_log(LEVEL_INFO, "transport", "binding pipe at %s", path.c_str());
+                    // if we're on mac or linux, this is a file and we need to expand ~/ to HOME and unlink the old socket
                     // (on windows it's a global named pipe)
-#ifdef __APPLE__
+#ifndef _WIN32
                     path = Platform::expanduser(path);
                     unlink(path.c_str());
 #endif
@@ -63,11 +69,31 @@ UvServer::UvServer(transport_msg_fn callback, std::shared_ptr<cpptoml::table> co
             }
         }
     }
+    auto metrics = config ? config->get_table("metrics") : nullptr;
+    if (metrics) {
+        // The metrics listener is unauthenticated, so only bind it somewhere
+        // local.
+        auto host = metrics->get_as<std::string>("host").value_or("");
+        auto port = metrics->get_as<int>("port").value_or(0);
+        auto path = metrics->get_as<std::string>("path").value_or("");
+        if (host != "" && port > 0) {
+            draconity_log(LEVEL_INFO, "metrics", "binding TCP at %s:%i", host.c_str(), port);
+            this->listenMetricsTCP(host, port);
+        }
+        if (path != "") {
+            draconity_log(LEVEL_INFO, "metrics", "binding pipe at %s", path.c_str());
+#ifndef _WIN32
+            path = Platform::expanduser(path);
+            unlink(path.c_str());
+#endif
+            this->listenMetricsPipe(path);
+        }
+    }
     if (!listening) {
-        printf("[!] error: no socket/pipe configured in draconity.yml, not listening for connections\n");
+        draconity_log(LEVEL_ERROR, "transport", "no socket/pipe configured in draconity.yml, not listening for connections");
     }
     if (secret == "") {
-        printf("[+] error: no secret configured in draconity.yml, not accepting connections\n");
+        draconity_log(LEVEL_ERROR, "transport", "no secret configured in draconity.yml, not accepting connections");
     }
 }
 
@@ -92,17 +118,18 @@ void UvServer::listenTCP(std::string host, int port) {
     auto resource = loop->resource<uvw::TCPHandle>();
     resource->on<uvw::ListenEvent>([this](const uvw::ListenEvent &, uvw::TCPHandle &srv) {
         auto stream = srv.loop().resource<uvw::TCPHandle>();
-        printf("[+] draconity transport: accepted TCP connection from peer %s\n", peername(stream->peer()).c_str());
+        draconity_log(LEVEL_INFO, "transport", "accepted TCP connection from peer %s", peername(stream->peer()).c_str());
 
         auto client = std::make_shared<UvClient<uvw::TCPHandle>>(stream, handle_message_callback, this->secret, this->client_nonce++);
         auto baseClient = std::static_pointer_cast<UvClientBase>(client);
         stream->once<uvw::CloseEvent>([this, baseClient](auto &, auto &stream) {
-            printf("[+] draconity transport: closing TCP connection to peer %s\n", peername(stream.peer()).c_str());
+            draconity_log(LEVEL_INFO, "transport", "closing TCP connection to peer %s", peername(stream.peer()).c_str());
             clients.remove(baseClient);
+            baseClient->onClose();
             draconity->handle_disconnect(baseClient->id);
         });
         stream->once<uvw::ErrorEvent>([client](auto &event, auto &stream) {
-            printf("[+] draconity transport: TCP error for peer %s: [%d] %s\n",
+            draconity_log(LEVEL_WARN, "transport", "TCP error for peer %s: [%d] %s",
                    peername(stream.peer()).c_str(), event.code(), event.name());
             client->onDisconnect(event, stream);
         });
@@ -112,13 +139,16 @@ void UvServer::listenTCP(std::string host, int port) {
         stream->on<uvw::DataEvent>([client](auto &event, auto &stream) {
             client->onData(event, stream);
         });
+        stream->on<uvw::WriteEvent>([client](auto &, auto &) {
+            client->onWrite();
+        });
 
         clients.push_back(baseClient);
         srv.accept(*stream);
         stream->read();
     });
     resource->on<uvw::ErrorEvent>([](auto &event, auto &resource) {
-        printf("[+] draconity TCP transport error[%d]: %s\n", event.code(), event.name());
+        draconity_log(LEVEL_WARN, "transport", "TCP transport error[%d]: %s", event.code(), event.name());
     });
     resource->bind(host, port);
     resource->listen();
@@ -129,17 +159,18 @@ void UvServer::listenPipe(std::string path) {
     auto resource = loop->resource<uvw::PipeHandle>();
     resource->on<uvw::ListenEvent>([this](const uvw::ListenEvent &, uvw::PipeHandle &srv) {
         auto stream = srv.loop().resource<uvw::PipeHandle>();
-        printf("[+] draconity transport: accepted pipe connection from peer %s\n", peername(stream->peer()).c_str());
+        draconity_log(LEVEL_INFO, "transport", "accepted pipe connection from peer %s", peername(stream->peer()).c_str());
 
         auto client = std::make_shared<UvClient<uvw::PipeHandle>>(stream, handle_message_callback, this->secret, this->client_nonce++);
         auto baseClient = std::static_pointer_cast<UvClientBase>(client);
         stream->once<uvw::CloseEvent>([this, baseClient](auto &, auto &stream) {
-            printf("[+] draconity transport: closing pipe connection to peer %s\n", peername(stream.peer()).c_str());
+            draconity_log(LEVEL_INFO, "transport", "closing pipe connection to peer %s", peername(stream.peer()).c_str());
             clients.remove(baseClient);
+            baseClient->onClose();
             draconity->handle_disconnect(baseClient->id);
         });
         stream->once<uvw::ErrorEvent>([client](auto &event, auto &stream) {
-            printf("[+] draconity transport: pipe error for peer %s: [%d] %s\n",
+            draconity_log(LEVEL_WARN, "transport", "pipe error for peer %s: [%d] %s",
                    peername(stream.peer()).c_str(), event.code(), event.name());
             client->onDisconnect(event, stream);
         });
@@ -149,13 +180,81 @@ void UvServer::listenPipe(std::string path) {
         stream->on<uvw::DataEvent>([client](auto &event, auto &stream) {
             client->onData(event, stream);
         });
+        stream->on<uvw::WriteEvent>([client](auto &, auto &) {
+            client->onWrite();
+        });
 
         clients.push_back(baseClient);
         srv.accept(*stream);
         stream->read();
     });
     resource->on<uvw::ErrorEvent>([](auto &event, auto &resource) {
-        printf("[+] draconity pipe transport error[%d]: %s\n", event.code(), event.name());
+        draconity_log(LEVEL_WARN, "transport", "pipe transport error[%d]: %s", event.code(), event.name());
+    });
+    resource->bind(path);
+    resource->listen();
+}
+
+/* Answer each connection with the metrics in Prometheus text format as a
+   minimal HTTP response, whatever was asked for, then hang up. */
+template <typename T>
+void UvServer::serveMetrics(T &srv) {
+    auto stream = srv.loop().template resource<T>();
+    auto request = std::make_shared<std::string>();
+    stream->template on<uvw::DataEvent>([request](auto &event, auto &stream) {
+        request->append(&event.data[0], event.length);
+        // Wait for the end of the request headers.
+        if (request->find("\r\n\r\n") == std::string::npos) {
+            if (request->size() > 8192) {
+                stream.close();
+            }
+            return;
+        }
+        std::string body = draconity->metrics.prometheus();
+        std::ostringstream response;
+        response << "HTTP/1.0 200 OK\r\n"
+                 << "Content-Type: text/plain; version=0.0.4\r\n"
+                 << "Content-Length: " << body.size() << "\r\n"
+                 << "Connection: close\r\n\r\n"
+                 << body;
+        std::string data = response.str();
+        auto buf = std::make_unique<char[]>(data.size());
+        std::memcpy(buf.get(), data.data(), data.size());
+        stream.template once<uvw::WriteEvent>([](auto &, auto &stream) {
+            stream.close();
+        });
+        stream.write(std::move(buf), data.size());
+        stream.stop();
+    });
+    stream->template once<uvw::EndEvent>([](auto &, auto &stream) {
+        stream.close();
+    });
+    stream->template once<uvw::ErrorEvent>([](auto &, auto &stream) {
+        stream.close();
+    });
+    srv.accept(*stream);
+    stream->read();
+}
+
+void UvServer::listenMetricsTCP(std::string host, int port) {
+    auto resource = loop->resource<uvw::TCPHandle>();
+    resource->on<uvw::ListenEvent>([this](const uvw::ListenEvent &, uvw::TCPHandle &srv) {
+        this->serveMetrics(srv);
+    });
+    resource->on<uvw::ErrorEvent>([](auto &event, auto &resource) {
+        draconity_log(LEVEL_WARN, "metrics", "TCP error[%d]: %s", event.code(), event.name());
+    });
+    resource->bind(host, port);
+    resource->listen();
+}
+
+void UvServer::listenMetricsPipe(std::string path) {
+    auto resource = loop->resource<uvw::PipeHandle>();
+    resource->on<uvw::ListenEvent>([this](const uvw::ListenEvent &, uvw::PipeHandle &srv) {
+        this->serveMetrics(srv);
+    });
+    resource->on<uvw::ErrorEvent>([](auto &event, auto &resource) {
+        draconity_log(LEVEL_WARN, "metrics", "pipe error[%d]: %s", event.code(), event.name());
     });
     resource->bind(path);
     resource->listen();
@@ -179,7 +278,14 @@ void UvServer::invoke(std::function<void()> fn) {
 // Publish (TID 0) the `msg` to all connected clients.
 void UvServer::publish(std::vector<uint8_t> msg) {
     invoke([this, msg{std::move(msg)}] {
+        static Counter *dropped = draconity->metrics.counter("draconity_publish_dropped_total", "Publishes dropped for clients over their queued_bytes quota");
+        uint64_t limit = draconity->quota.queued_bytes;
         for (auto const &client : clients) {
+            // A client that isn't reading doesn't get to grow our heap.
+            if (limit && client->queuedBytes() > limit) {
+                dropped->inc();
+                continue;
+            }
             client->publish(msg);
         }
     });
@@ -187,17 +293,36 @@ void UvServer::publish(std::vector<uint8_t> msg) {
 
 /* Publish the `msg` to a single client.
 
-   If the client no longer exists, does nothing.
+   If the client no longer exists, does nothing. A client over its
+   queued_bytes quota has publishes dropped, as in `publish`, but replies
+   can't be dropped without breaking the client, so it's disconnected.
  */
-void UvServer::send(std::vector<uint8_t> msg, uint32_t tid, uint64_t client_id) {
+void UvServer::send(std::vector<uint8_t> msg, uint32_t tid, uint64_t client_id, WrittenFn on_written) {
     // TODO: Store clients in a map for quicker id lookup?
-    invoke([this, tid, client_id, msg{std::move(msg)}] {
+    invoke([this, tid, client_id, msg{std::move(msg)}, on_written] {
+        static Counter *dropped = draconity->metrics.counter("draconity_publish_dropped_total", "Publishes dropped for clients over their queued_bytes quota");
+        static Counter *disconnected = draconity->metrics.counter("draconity_quota_disconnects_total", "Clients disconnected for going over their queued_bytes quota");
+        uint64_t limit = draconity->quota.queued_bytes;
         for (auto const &client : clients) {
             if (client->id == client_id) {
+                if (limit && client->queuedBytes() > limit) {
+                    if (tid == PUBLISH_TID) {
+                        dropped->inc();
+                    } else {
+                        draconity_log(LEVEL_WARN, "transport", "client %llu has over %llu bytes queued, disconnecting",
+                                      (unsigned long long)client_id, (unsigned long long)limit);
+                        disconnected->inc();
+                        client->disconnect();
+                    }
+                    if (on_written) on_written(false);
+                    return;
+                }
                 client->writeMessage(tid, std::move(msg));
+                if (on_written) client->afterWrites(on_written);
                 return;
             }
         }
+        if (on_written) on_written(false);
     });
 }
 
@@ -218,7 +343,7 @@ UvServer *server = nullptr;
 void draconity_transport_main(transport_msg_fn callback, std::shared_ptr<cpptoml::table> config) {
     std::thread networkThread([config, callback] {
         server = new UvServer(callback, config);
-        draconity->init_pause_timer();
+        draconity->init_handles();
         server->run();
     });
     networkThread.detach();
@@ -229,7 +354,7 @@ void draconity_transport_publish(std::vector<uint8_t> data) {
     server->publish(std::move(data));
 }
 
-void draconity_transport_send(std::vector<uint8_t> data, uint32_t tid, uint64_t client_id) {
+void draconity_transport_send(std::vector<uint8_t> data, uint32_t tid, uint64_t client_id, WrittenFn on_written) {
     if (!server) return;
-    server->send(std::move(data), tid, client_id);
+    server->send(std::move(data), tid, client_id, on_written);
 }
@@ -2,6 +2,7 @@
 #include <set>
 #include <functional>
 #include <memory>
+#include <thread>
 #include <uvw.hpp>
 
 #include "transport.h"
@@ -14,23 +15,29 @@ public:
     ~UvServer();
     void listenTCP(std::string host, int port);
     void listenPipe(std::string path);
+    void listenMetricsTCP(std::string host, int port);
+    void listenMetricsPipe(std::string path);
     void run();
 
     void publish(std::vector<uint8_t> msg);
-    void send(std::vector<uint8_t> msg, uint32_t tid, uint64_t client_id);
+    void send(std::vector<uint8_t> msg, uint32_t tid, uint64_t client_id, WrittenFn on_written = nullptr);
     void invoke(std::function<void()> fn);
+    bool on_loop_thread() { return std::this_thread::get_id() == this->loop_thread; }
 public:
     std::shared_ptr<uvw::Loop> loop;
     std::list<std::shared_ptr<UvClientBase>> clients;
 private:
     std::string secret;
     void drain_invoke_queue();
+    template <typename T>
+    void serveMetrics(T &srv);
 
     transport_msg_fn handle_message_callback;
     std::shared_ptr<cpptoml::table> config;
     std::list<std::function<void()>> invoke_queue;
     std::shared_ptr<uvw::AsyncHandle> async_invoke_handle;
     std::mutex lock; // protects access to `invoke_queue`
+    std::thread::id loop_thread;
     int64_t client_nonce;
 };
 
@@ -1,20 +1,22 @@
 #pragma once
+#include <functional>
 #include "cpptoml.h"
+#include "transport/framing.h"
+
+// Called on the Uv thread once a sent message has reached the client's socket
+// (true), or was dropped or cut off by the connection closing (false).
+typedef std::function<void(bool written)> WrittenFn;
 
 extern "C" {
 
 #include <bson.h>
 #include <stdint.h>
 
-#define PUBLISH_TID 0
-
-typedef struct __attribute__((packed)) {
-    uint32_t tid, length;
-} MessageHeader;
-
-typedef bson_t *(*transport_msg_fn)(const uint64_t client_id, const uint32_t tid, const std::vector<uint8_t> &msg);
+// `msg` is only valid during the call.
+typedef bson_t *(*transport_msg_fn)(const uint64_t client_id, const uint32_t tid, const uint8_t *msg, size_t msg_len);
 extern void draconity_transport_main(transport_msg_fn callback, std::shared_ptr<cpptoml::table> config);
 extern void draconity_transport_publish(const std::vector<uint8_t> msg);
-extern void draconity_transport_send(const std::vector<uint8_t> msg, uint32_t tid, uint64_t client_id);
+extern void draconity_transport_send(const std::vector<uint8_t> msg, uint32_t tid, uint64_t client_id,
+                                     WrittenFn on_written = nullptr);
 
 } // extern "C"
@@ -0,0 +1,460 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <set>
+#include <thread>
+
+#include <bson.h>
+#include "draconity.h"
+#include "dr_time.h"
+#include "phrase.h"
+#include "server.h"
+#include "sim/sim_grammar.h"
+#include "transport/server.h"
+#include "synthetic.h"
+
+/* Microbenchmarks for draconity's serialization and sync paths.
+
+   Links libdraconity, which starts up against the simulated engine as it
+   would under Dragon, so the sync benchmarks include the engine calls they
+   make. Each benchmark is timed per iteration and reported as JSON:
+
+       draconity_bench [--filter substring] [--out report.json]
+                       [--words 100000] [--rules 200] [--lists 4] [--list-size 10000]
+                       [--phrase-words 12] [--min-time 0.5] [--max-iterations 100000]
+
+ */
+
+struct BenchOptions {
+    size_t words = 100000;
+    size_t rules = 200;
+    size_t lists = 4;
+    size_t list_size = 10000;
+    size_t phrase_words = 12;
+    double min_time = 0.5;  // seconds per benchmark
+    size_t max_iterations = 100000;
+    std::string filter;
+    std::string out;
+};
+
+struct BenchResult {
+    std::string name;
+    size_t items;  // What one iteration processes: words, list entries, rules or messages
+    std::vector<int64_t> samples;
+};
+
+static BenchOptions options;
+static std::vector<BenchResult> results;
+
+/* Runs `fn` until it has run for min_time or max_iterations times, timing each
+   call. `setup` runs untimed before every call. */
+static void bench(const std::string &name, size_t items, std::function<void()> fn,
+                  std::function<void()> setup = nullptr) {
+    if (name.find(options.filter) == std::string::npos) {
+        return;
+    }
+    BenchResult result;
+    result.name = name;
+    result.items = items;
+    // One untimed run to warm caches and the string table.
+    if (setup) setup();
+    fn();
+    int64_t budget = options.min_time * 1e9;
+    int64_t total = 0;
+    while (total < budget && result.samples.size() < options.max_iterations) {
+        if (setup) setup();
+        int64_t start = dr_monotonic_time();
+        fn();
+        int64_t elapsed = dr_monotonic_time() - start;
+        result.samples.push_back(elapsed);
+        total += elapsed;
+    }
+    std::sort(result.samples.begin(), result.samples.end());
+    auto &s = result.samples;
+    fprintf(stderr, "%-40s %8zu iters  p50 %10.3fus  p90 %10.3fus\n", name.c_str(), s.size(),
+            s[s.size() / 2] / 1e3, s[s.size() * 9 / 10] / 1e3);
+    results.push_back(std::move(result));
+}
+
+/* Grammar and word state belong to the Uv thread, so benchmarks touching it
+   run there. */
+static void on_uv(std::function<void()> fn) {
+    std::promise<void> done;
+    server->invoke([&] {
+        fn();
+        done.set_value();
+    });
+    done.get_future().wait();
+}
+
+/* A result to serialize, from recognizing a mimic against a grammar of our
+   own. Kept rather than destroyed by the callback. */
+static std::promise<dsx_result *> result_promise;
+
+static int bench_end(void *key, dsx_end_phrase *endphrase) {
+    if ((endphrase->flags & 2) != 0) {
+        result_promise.set_value(endphrase->result);
+    } else {
+        _DSXResult_Destroy(endphrase->result);
+    }
+    return 0;
+}
+
+static dsx_result *recognize_phrase(const std::vector<std::string> &words) {
+    SimGrammarBuilder builder;
+    builder.begin_rule(builder.rule("phrase"));
+    builder.start(SIM_GROUP_SEQ);
+    for (auto &word : words) {
+        builder.add_word(word);
+    }
+    builder.end(SIM_GROUP_SEQ);
+    std::vector<uint8_t> blob = builder.build();
+    dsx_dataptr blob_dp = {.data = blob.data(), .size = (uint32_t)blob.size()};
+    drg_grammar *grammar = NULL;
+    unsigned int key = 0;
+    if (_DSXEngine_LoadGrammar(_engine, 1, &blob_dp, &grammar) ||
+            _DSXGrammar_RegisterEndPhraseCallback(grammar, bench_end, NULL, &key) ||
+            _DSXGrammar_Activate(grammar, 0, false, "phrase")) {
+        return NULL;
+    }
+    std::vector<uint8_t> phrase;
+    for (auto &word : words) {
+        phrase.insert(phrase.end(), word.begin(), word.end());
+        phrase.push_back(0);
+    }
+    dsx_dataptr phrase_dp = {.data = phrase.data(), .size = (uint32_t)phrase.size()};
+    auto future = result_promise.get_future();
+    if (_DSXEngine_Mimic(_engine, 0, words.size(), &phrase_dp, 0, 2)) {
+        return NULL;
+    }
+    if (future.wait_for(std::chrono::seconds(10)) != std::future_status::ready) {
+        return NULL;
+    }
+    dsx_result *result = future.get();
+    _DSXGrammar_Unregister(grammar, key);
+    _DSXGrammar_Destroy(grammar);
+    return result;
+}
+
+/* Stands in for a socket, so onData can be driven without a loop. */
+struct BenchStream {
+    void write(std::unique_ptr<char[]> data, unsigned int length) {}
+    size_t writeQueueSize() { return 0; }
+    void close() {}
+};
+
+static bson_t *ignore_message(const uint64_t client_id, const uint32_t tid, const uint8_t *msg, size_t msg_len) {
+    return NULL;
+}
+
+static std::vector<uint8_t> frame(uint32_t tid, const uint8_t *data, uint32_t length) {
+    std::vector<uint8_t> framed;
+    append_frame(framed, tid, data, length);
+    return framed;
+}
+
+/* Feeds `stream` to a client in reads of up to `chunk` bytes, as libuv would. */
+static void feed(UvClient<BenchStream> &client, BenchStream &stream,
+                 const std::vector<uint8_t> &data, size_t chunk) {
+    for (size_t offset = 0; offset < data.size(); offset += chunk) {
+        size_t length = std::min(chunk, data.size() - offset);
+        auto buf = std::make_unique<char[]>(length);
+        memcpy(buf.get(), data.data() + offset, length);
+        uvw::DataEvent event{std::move(buf), length};
+        client.onData(event, stream);
+    }
+}
+
+static void bench_serialization() {
+    std::vector<std::string> words = synthetic_words(options.phrase_words);
+    std::vector<uint8_t> phrase = synthetic_phrase(words);
+    std::string suffix = "/" + std::to_string(words.size());
+
+    bson_t *obj = NULL;
+    bench("prep_response/status", 1, [&] {
+        std::vector<uint8_t> response = prep_response("status", obj);
+    }, [&] {
+        obj = BCON_NEW("cmd", BCON_UTF8("thread_created"));
+    });
+    bench("prep_response/p.end" + suffix, words.size(), [&] {
+        std::vector<uint8_t> response = prep_response("p.end", obj);
+    }, [&] {
+        obj = BCON_NEW("cmd", BCON_UTF8("p.end"), "grammar", BCON_UTF8("bench"));
+        phrase_to_bson(obj, (char *)phrase.data());
+    });
+    bench("phrase_to_bson" + suffix, words.size(), [&] {
+        bson_t obj = BSON_INITIALIZER;
+        phrase_to_bson(&obj, (char *)phrase.data());
+        bson_destroy(&obj);
+    });
+
+    dsx_result *result = recognize_phrase(words);
+    if (!result) {
+        fprintf(stderr, "could not get a result from the engine, skipping result_to_bson\n");
+        return;
+    }
+    bench("result_to_bson" + suffix, words.size(), [&] {
+        bson_t obj = BSON_INITIALIZER;
+        result_to_bson(&obj, result, 0);
+        bson_destroy(&obj);
+    });
+    _DSXResult_Destroy(result);
+}
+
+static void bench_gset() {
+    SyntheticGrammar grammar = synthetic_grammar("bench_gset", options.rules, options.lists, options.list_size);
+    bson_t *gset = synthetic_gset(grammar);
+    std::vector<uint8_t> msg(bson_get_data(gset), bson_get_data(gset) + gset->len);
+    bson_destroy(gset);
+    std::string name = "handle_message/g.set/" + std::to_string(options.lists) + "x" + std::to_string(options.list_size);
+    size_t items = options.rules + options.lists * options.list_size;
+    on_uv([&] {
+        bench(name, items, [&] {
+            bson_t *reply = handle_message(1, 1, msg.data(), msg.size());
+            if (reply) {
+                // Only errors are replied to straight away.
+                bson_destroy(reply);
+            }
+        }, [&] {
+            // Drop the last update, so it isn't reported as skipped.
+            draconity->shadow_lock.lock();
+            draconity->shadow_grammars.erase(grammar.name);
+            draconity->shadow_lock.unlock();
+        });
+        draconity->shadow_lock.lock();
+        draconity->shadow_grammars.erase(grammar.name);
+        draconity->shadow_lock.unlock();
+    });
+}
+
+static void bench_grammar_sync() {
+    SyntheticGrammar synthetic = synthetic_grammar("bench_sync", options.rules, options.lists, options.list_size, 1);
+    on_uv([&] {
+        auto grammar = std::make_shared<Grammar>(synthetic.name);
+        grammar->key = draconity->grammar_registry.add(grammar);
+        SharedBlob blob(synthetic.blob.data(), synthetic.blob.size());
+        if (load_grammar(grammar, blob)) {
+            fprintf(stderr, "could not load the sync grammar, skipping grammar sync\n");
+            draconity->grammar_registry.remove(grammar->key);
+            return;
+        }
+
+        std::vector<std::string_view> entries(synthetic.lists["list0"].begin(), synthetic.lists["list0"].end());
+        InternedSet list(entries);
+        std::string list_suffix = "/" + std::to_string(list.size());
+        bench("list_dataptr" + list_suffix, list.size(), [&] {
+            dsx_dataptr dataptr = list_dataptr(list);
+            free(dataptr.data);
+        });
+        bench("set_list" + list_suffix, list.size(), [&] {
+            set_list(grammar, "list0", list);
+        });
+
+        // All the rules, and the same less every tenth.
+        std::vector<std::string_view> rules(synthetic.rules.begin(), synthetic.rules.end());
+        InternedSet all_rules(rules);
+        std::vector<std::string_view> fewer;
+        for (size_t i = 0; i < rules.size(); i++) {
+            if (i % 10 != 0) fewer.push_back(rules[i]);
+        }
+        InternedSet some_rules(fewer);
+        std::string rules_suffix = "/" + std::to_string(all_rules.size());
+        sync_rules(grammar, all_rules);
+        bench("sync_rules/unchanged" + rules_suffix, all_rules.size(), [&] {
+            sync_rules(grammar, all_rules);
+        });
+        bool toggle = false;
+        bench("sync_rules/churn" + rules_suffix, all_rules.size(), [&] {
+            sync_rules(grammar, toggle ? all_rules : some_rules);
+        }, [&] {
+            toggle = !toggle;
+        });
+
+        unload_grammar(grammar);
+        draconity->grammar_registry.remove(grammar->key);
+    });
+}
+
+static void bench_sync_words() {
+    std::vector<std::string> vocab = synthetic_words(options.words, 2);
+    std::set<std::string> words(vocab.begin(), vocab.end());
+    // The same vocabulary with one word in a hundred swapped out.
+    std::set<std::string> churned = words;
+    std::vector<std::string> replacements = synthetic_words(options.words / 100, 3);
+    for (size_t i = 0; i < replacements.size(); i++) {
+        churned.erase(vocab[i * 100]);
+        churned.insert(replacements[i]);
+    }
+    std::string suffix = "/" + std::to_string(words.size());
+    const uint64_t client_id = -1;
+    on_uv([&] {
+        std::set<std::string> next;
+        bench("sync_words/unchanged" + suffix, words.size(), [&] {
+            draconity->sync_state();
+        }, [&] {
+            next = words;
+            draconity->set_shadow_words(client_id, 0, next);
+        });
+        bool toggle = false;
+        bench("sync_words/churn" + suffix, words.size(), [&] {
+            draconity->sync_state();
+        }, [&] {
+            toggle = !toggle;
+            next = toggle ? churned : words;
+            draconity->set_shadow_words(client_id, 0, next);
+        });
+        draconity->clear_client_state(client_id);
+        draconity->sync_state();
+    });
+}
+
+static void bench_framing() {
+    auto stream = std::make_shared<BenchStream>();
+    UvClient<BenchStream> client(stream, ignore_message, "", -1);
+    client.authed = true;
+
+    // Many small requests, as a client toggling rules would send.
+    bson_t *small = BCON_NEW("cmd", BCON_UTF8("g.rules"), "name", BCON_UTF8("bench"));
+    std::vector<uint8_t> smalls;
+    const size_t count = 1000;
+    for (size_t i = 0; i < count; i++) {
+        auto framed = frame(i + 1, bson_get_data(small), small->len);
+        smalls.insert(smalls.end(), framed.begin(), framed.end());
+    }
+    bson_destroy(small);
+
+    // One large g.set, arriving over many reads.
+    SyntheticGrammar grammar = synthetic_grammar("bench_frame", options.rules, options.lists, options.list_size);
+    bson_t *gset = synthetic_gset(grammar);
+    std::vector<uint8_t> large = frame(1, bson_get_data(gset), gset->len);
+    bson_destroy(gset);
+
+    on_uv([&] {
+        bench("onData/small/" + std::to_string(count), count, [&] {
+            feed(client, *stream, smalls, 65536);
+        });
+        bench("onData/g.set/" + std::to_string(large.size()), 1, [&] {
+            feed(client, *stream, large, 65536);
+        });
+    });
+}
+
+static bson_t *report() {
+    bson_t *doc = bson_new();
+    bson_t opts, array, child;
+    char keystr[16];
+    const char *key;
+
+    BSON_APPEND_DOCUMENT_BEGIN(doc, "options", &opts);
+    BSON_APPEND_INT64(&opts, "words", options.words);
+    BSON_APPEND_INT64(&opts, "rules", options.rules);
+    BSON_APPEND_INT64(&opts, "lists", options.lists);
+    BSON_APPEND_INT64(&opts, "list_size", options.list_size);
+    BSON_APPEND_INT64(&opts, "phrase_words", options.phrase_words);
+    BSON_APPEND_DOUBLE(&opts, "min_time", options.min_time);
+    bson_append_document_end(doc, &opts);
+
+    BSON_APPEND_ARRAY_BEGIN(doc, "results", &array);
+    for (size_t i = 0; i < results.size(); i++) {
+        auto &s = results[i].samples;
+        int64_t sum = 0;
+        for (int64_t sample : s) {
+            sum += sample;
+        }
+        bson_uint32_to_string(i, &key, keystr, sizeof(keystr));
+        BSON_APPEND_DOCUMENT_BEGIN(&array, key, &child);
+        BSON_APPEND_UTF8(&child, "name", results[i].name.c_str());
+        BSON_APPEND_INT64(&child, "items", results[i].items);
+        BSON_APPEND_INT64(&child, "iterations", s.size());
+        BSON_APPEND_INT64(&child, "min_ns", s.front());
+        BSON_APPEND_INT64(&child, "p50_ns", s[s.size() / 2]);
+        BSON_APPEND_INT64(&child, "p90_ns", s[s.size() * 9 / 10]);
+        BSON_APPEND_INT64(&child, "p99_ns", s[s.size() * 99 / 100]);
+        BSON_APPEND_INT64(&child, "max_ns", s.back());
+        BSON_APPEND_INT64(&child, "mean_ns", sum / (int64_t)s.size());
+        bson_append_document_end(&array, &child);
+    }
+    bson_append_array_end(doc, &array);
+    return doc;
+}
+
+static bool parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        const char *value = argv[++i];
+        if (arg == "--filter") {
+            options.filter = value;
+        } else if (arg == "--out") {
+            options.out = value;
+        } else if (arg == "--words") {
+            options.words = strtoull(value, NULL, 10);
+        } else if (arg == "--rules") {
+            options.rules = strtoull(value, NULL, 10);
+        } else if (arg == "--lists") {
+            options.lists = strtoull(value, NULL, 10);
+        } else if (arg == "--list-size") {
+            options.list_size = strtoull(value, NULL, 10);
+        } else if (arg == "--phrase-words") {
+            options.phrase_words = strtoull(value, NULL, 10);
+        } else if (arg == "--min-time") {
+            options.min_time = strtod(value, NULL);
+        } else if (arg == "--max-iterations") {
+            options.max_iterations = strtoull(value, NULL, 10);
+        } else {
+            return false;
+        }
+    }
+    // The grammar benchmarks need at least one rule and a list to work on.
+    return options.rules > 0 && options.lists > 0 && options.list_size > 0 && options.max_iterations > 0;
+}
+
+int main(int argc, char **argv) {
+    if (!parse_args(argc, argv)) {
+        fprintf(stderr, "usage: %s [--filter substring] [--out report.json] [--words n] [--rules n]\n"
+                        "       [--lists n] [--list-size n] [--phrase-words n] [--min-time seconds]\n"
+                        "       [--max-iterations n]\n", argv[0]);
+        return 2;
+    }
+    // libdraconity starts its server and the engine as it loads.
+    for (int i = 0; !server || !draconity->ready; i++) {
+        if (i == 1000) {
+            fprintf(stderr, "draconity did not become ready\n");
+            return 1;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    bench_serialization();
+    bench_gset();
+    bench_grammar_sync();
+    bench_sync_words();
+    bench_framing();
+
+    bson_t *doc = report();
+    size_t length = 0;
+    char *json = bson_as_json(doc, &length);
+    bool written = true;
+    if (options.out.size() > 0) {
+        std::ofstream file(options.out);
+        file.write(json, length);
+        file << "\n";
+        written = (bool)file;
+    } else {
+        std::cout.write(json, length);
+        std::cout << std::endl;
+    }
+    bson_free(json);
+    bson_destroy(doc);
+    if (!written) {
+        fprintf(stderr, "could not write report to %s\n", options.out.c_str());
+        return 1;
+    }
+    return 0;
+}
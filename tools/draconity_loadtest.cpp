@@ -0,0 +1,844 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits.h>
+#include <list>
+#include <map>
+#include <memory>
+#include <netinet/in.h>
+#include <random>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+#include <bson.h>
+#include <uvw.hpp>
+#include "dr_time.h"
+#include "draconity_client.h"
+#include "synthetic.h"
+
+/* Load test for the pause path: handle_pause, sync_state, every client's
+   unpause and do_unpause.
+
+   Starts draconity on the simulated engine in a `sleep` process (or connects
+   to a running server with --connect), then runs many clients against it. A
+   driver connection mimics at --pause-rate, and the engine pauses before each
+   mimic. Each client answers each pause by sometimes sending a g.set with
+   part of a list replaced and a w.set with part of its vocabulary replaced,
+   then unpausing. Some clients disconnect mid-pause instead, and reconnect and
+   upload everything again. Some of those first send a g.set, which is left
+   pending when they drop, and reconnect with their resume token, so the new
+   connection must get no reply meant for the old one.
+
+   Reports the server's pause durations (polled from pause.stats), client side
+   latencies and every transaction's outcome as JSON, and fails unless every
+   transaction on a connection that stayed open got exactly one response.
+
+ */
+
+extern char **environ;
+
+struct LoadOptions {
+    size_t clients = 16;
+    double duration = 10;       // seconds of measured load
+    double pause_rate = 20;     // mimics, and so pauses, per second
+    size_t rules = 20;
+    size_t lists = 2;
+    size_t list_size = 1000;
+    size_t words = 2000;
+    double churn = 0.05;        // fraction of a list or vocabulary replaced by an update
+    double update = 0.5;        // chance a client sends a g.set during a pause
+    double word_update = 0.1;   // chance a client sends a w.set during a pause
+    double disconnect = 0.01;   // chance a client disconnects instead of unpausing
+    double resume = 0.5;        // chance a disconnecting client resumes its session
+    int unpause_delay = 0;      // ms a client waits before unpausing
+    int pause_timeout = 10000;
+    int idle_sync_delay = 0;
+    uint64_t seed = 1;
+    std::string server;         // libdraconity to start
+    std::string host = "127.0.0.1";
+    int port = 0;
+    std::string secret;
+    std::string out;
+};
+
+struct LoadStats {
+    // Client side latencies, in ns.
+    // From the server sending "paused" to a client reading it. Only meaningful
+    // with the server on the same machine, as it compares monotonic clocks.
+    std::vector<int64_t> publish_lag;
+    std::vector<int64_t> unpause_rtt;  // From reading "paused" to the unpause reply
+    std::vector<int64_t> gset_rtt;     // From sending a g.set to its final status
+    std::vector<int64_t> wset_rtt;
+    std::vector<int64_t> mimic_rtt;
+    // Server side pause durations by token.
+    std::map<uint64_t, int64_t> pauses;
+    uint64_t pause_timeouts = 0;
+    uint64_t first_token = 0;  // Pauses up to this one were before measuring started
+    uint64_t last_token = 0;
+
+    uint64_t answered = 0;
+    uint64_t abandoned = 0;   // Pending when their connection closed
+    uint64_t unexpected = 0;  // Replies to transactions that weren't pending
+    std::map<std::string, uint64_t> outcomes;
+
+    uint64_t disconnects = 0;
+    uint64_t reconnects = 0;
+    uint64_t resumes = 0;     // Reconnects the server resumed the session of
+    uint64_t lost = 0;        // Connections closed by the server or an error
+    bool measuring = false;
+
+    void reset_samples() {
+        publish_lag.clear();
+        unpause_rtt.clear();
+        gset_rtt.clear();
+        wset_rtt.clear();
+        mimic_rtt.clear();
+        pauses.clear();
+        pause_timeouts = 0;
+    }
+};
+
+static LoadOptions options;
+static LoadStats stats;
+
+static std::string doc_utf8(const bson_t *doc, const char *key) {
+    bson_iter_t iter;
+    if (bson_iter_init_find(&iter, doc, key) && BSON_ITER_HOLDS_UTF8(&iter)) {
+        return bson_iter_utf8(&iter, NULL);
+    }
+    return "";
+}
+
+static bool doc_bool(const bson_t *doc, const char *key) {
+    bson_iter_t iter;
+    return bson_iter_init_find(&iter, doc, key) && BSON_ITER_HOLDS_BOOL(&iter) && bson_iter_bool(&iter);
+}
+
+static int64_t doc_int64(const bson_t *doc, const char *key) {
+    bson_iter_t iter;
+    if (bson_iter_init_find(&iter, doc, key) && BSON_ITER_HOLDS_INT64(&iter)) {
+        return bson_iter_int64(&iter);
+    }
+    return 0;
+}
+
+/* A client connection that counts every transaction and its outcome in
+   `stats`. */
+static std::shared_ptr<DraconityClient> load_connection(std::shared_ptr<uvw::Loop> loop) {
+    auto conn = std::make_shared<DraconityClient>(loop);
+    conn->on_complete = [](const std::string &cmd, std::chrono::nanoseconds rtt, const bson_t *reply) {
+        if (!reply) {
+            stats.abandoned++;
+            return;
+        }
+        stats.answered++;
+        std::string status = doc_utf8(reply, "status");
+        if (status.empty()) {
+            status = doc_bool(reply, "success") ? "success" : doc_utf8(reply, "error");
+        }
+        stats.outcomes[cmd + "/" + status]++;
+        if (cmd == "g.set" && stats.measuring) {
+            stats.gset_rtt.push_back(rtt.count());
+        } else if (cmd == "w.set" && stats.measuring) {
+            stats.wset_rtt.push_back(rtt.count());
+        } else if (cmd == "mimic" && stats.measuring) {
+            stats.mimic_rtt.push_back(rtt.count());
+        }
+    };
+    conn->on_unexpected = [](uint32_t tid) {
+        stats.unexpected++;
+    };
+    conn->on_lost = [](const char *error) {
+        if (error) {
+            fprintf(stderr, "connection error: %s\n", error);
+        }
+        stats.lost++;
+    };
+    return conn;
+}
+
+static void open_connection(std::shared_ptr<DraconityClient> &conn, bool pauses,
+                            std::function<void(const bson_t *reply)> on_ready) {
+    conn->connect_tcp(options.host, options.port, options.secret, pauses, [on_ready](const bson_t *reply) {
+        if (reply && doc_bool(reply, "success")) {
+            on_ready(reply);
+        } else if (reply) {
+            fprintf(stderr, "authentication failed: %s\n", doc_utf8(reply, "error").c_str());
+        }
+    });
+}
+
+/* Whether clients churn their state and disconnect, rather than just
+   unpausing. Off while connecting and draining. */
+static bool churning = false;
+
+/* A client with one grammar and a vocabulary, answering pauses. */
+class LoadClient {
+public:
+    LoadClient(std::shared_ptr<uvw::Loop> loop, size_t index) : rng(options.seed * 1000003 + index) {
+        this->loop = loop;
+        this->index = index;
+        this->grammar = synthetic_grammar("load" + std::to_string(index), options.rules,
+                                          options.lists, options.list_size, index + 1);
+        this->state = {this->grammar.blob, this->grammar.rules, this->grammar.lists};
+        // The first list and the vocabulary are windows onto larger pools,
+        // which updates slide along.
+        uint64_t seed = (options.seed << 20) + index * 2;
+        this->list_pool = synthetic_words(options.list_size * 4, seed);
+        this->word_pool = synthetic_words(options.words * 4, seed + 1);
+        this->reconnect_timer = loop->resource<uvw::TimerHandle>();
+        this->reconnect_timer->on<uvw::TimerEvent>([this](const uvw::TimerEvent &, uvw::TimerHandle &) {
+            stats.reconnects++;
+            this->connect(this->resuming);
+        });
+        // Drops the connection a moment after leaving a g.set pending on it,
+        // so the g.set is written first.
+        this->drop_timer = loop->resource<uvw::TimerHandle>();
+        this->drop_timer->on<uvw::TimerEvent>([this](const uvw::TimerEvent &, uvw::TimerHandle &) {
+            this->conn->close();
+            this->reconnect_timer->start(uvw::TimerHandle::Time{100}, uvw::TimerHandle::Time{0});
+        });
+    }
+
+    void connect(bool resume = false) {
+        std::string resume_token;
+        if (this->conn) {
+            resume_token = this->conn->resume_token;
+            // Handles may still call back into the old connection.
+            this->retired.push_back(this->conn);
+        }
+        this->conn = load_connection(this->loop);
+        if (resume) {
+            this->conn->resume_token = resume_token;
+        }
+        this->conn->on_publish = [this](std::string_view topic, const bson_t *msg) {
+            if (topic == "paused") {
+                this->on_paused(msg);
+            }
+        };
+        open_connection(this->conn, true, [this](const bson_t *reply) {
+            if (doc_bool(reply, "resumed")) {
+                stats.resumes++;
+            }
+            // Like a restarted client, upload everything; the server only
+            // applies what differs from the state it kept.
+            this->send_grammar([this] { this->ready = true; });
+            this->send_words();
+        });
+    }
+
+    void close() {
+        this->reconnect_timer->close();
+        this->drop_timer->close();
+        if (this->conn) {
+            this->conn->close();
+        }
+    }
+
+    size_t pending_count() {
+        return this->conn ? this->conn->pending_count() : 0;
+    }
+
+    const std::vector<std::string> &phrase() {
+        return this->grammar.phrases[0];
+    }
+
+    bool ready = false;
+private:
+    void on_paused(const bson_t *msg) {
+        int64_t received = dr_monotonic_time();
+        uint64_t token = doc_int64(msg, "token");
+        if (stats.measuring) {
+            stats.publish_lag.push_back(received - doc_int64(msg, "ts"));
+        }
+        std::uniform_real_distribution<double> chance(0, 1);
+        if (churning && chance(this->rng) < options.disconnect) {
+            stats.disconnects++;
+            this->ready = false;
+            this->resuming = chance(this->rng) < options.resume;
+            if (!this->resuming) {
+                this->conn->close();
+                this->reconnect_timer->start(uvw::TimerHandle::Time{100}, uvw::TimerHandle::Time{0});
+                return;
+            }
+            // Leave a g.set pending on the old connection: the engine is
+            // paused, so it can't sync before we drop. Its reply must not
+            // reach the resumed connection, whose tids start again at 1.
+            this->list_offset += std::max<size_t>(1, options.list_size * options.churn);
+            this->send_grammar(nullptr);
+            this->drop_timer->start(uvw::TimerHandle::Time{10}, uvw::TimerHandle::Time{0});
+            return;
+        }
+        if (churning && chance(this->rng) < options.update) {
+            this->list_offset += std::max<size_t>(1, options.list_size * options.churn);
+            this->send_grammar(nullptr);
+        }
+        if (churning && chance(this->rng) < options.word_update) {
+            this->word_offset += std::max<size_t>(1, options.words * options.churn);
+            this->send_words();
+        }
+        auto conn = this->conn;
+        auto unpause = [conn, token, received] {
+            conn->unpause(token, [received](const bson_t *reply) {
+                if (reply && stats.measuring) {
+                    stats.unpause_rtt.push_back(dr_monotonic_time() - received);
+                }
+            });
+        };
+        if (options.unpause_delay > 0) {
+            auto timer = this->loop->resource<uvw::TimerHandle>();
+            timer->once<uvw::TimerEvent>([unpause](const uvw::TimerEvent &, uvw::TimerHandle &timer) {
+                unpause();
+                timer.close();
+            });
+            timer->start(uvw::TimerHandle::Time{(uint64_t)options.unpause_delay}, uvw::TimerHandle::Time{0});
+        } else {
+            unpause();
+        }
+    }
+
+    // The client library sends only the part of the list that changed.
+    void send_grammar(std::function<void()> on_synced) {
+        auto &list = this->state.lists["list0"];
+        for (size_t i = 0; i < list.size(); i++) {
+            list[i] = this->list_pool[(this->list_offset + i) % this->list_pool.size()];
+        }
+        this->conn->set_grammar(this->grammar.name, this->state, [on_synced](const bson_t *reply) {
+            if (reply && on_synced) on_synced();
+        });
+    }
+
+    void send_words() {
+        std::set<std::string> words;
+        for (size_t i = 0; i < options.words; i++) {
+            words.insert(this->word_pool[(this->word_offset + i) % this->word_pool.size()]);
+        }
+        this->conn->set_words(words);
+    }
+
+    std::shared_ptr<uvw::Loop> loop;
+    size_t index;
+    std::mt19937_64 rng;
+    SyntheticGrammar grammar;
+    // The grammar as last sent, with the first list's window applied.
+    ClientGrammar state;
+    std::vector<std::string> list_pool, word_pool;
+    size_t list_offset = 0, word_offset = 0;
+    std::shared_ptr<DraconityClient> conn;
+    std::list<std::shared_ptr<DraconityClient>> retired;
+    std::shared_ptr<uvw::TimerHandle> reconnect_timer, drop_timer;
+    bool resuming = false;
+};
+
+/* Mimics to make the engine pause, and polls the server's pause history. Takes
+   no part in pauses itself. */
+class PauseDriver {
+public:
+    PauseDriver(std::shared_ptr<uvw::Loop> loop) : conn(load_connection(loop)) {
+        this->mimic_timer = loop->resource<uvw::TimerHandle>();
+        this->mimic_timer->on<uvw::TimerEvent>([this](const uvw::TimerEvent &, uvw::TimerHandle &) {
+            this->mimic();
+        });
+        this->poll_timer = loop->resource<uvw::TimerHandle>();
+        this->poll_timer->on<uvw::TimerEvent>([this](const uvw::TimerEvent &, uvw::TimerHandle &) {
+            this->poll();
+        });
+    }
+
+    // Waits for the engine to be ready.
+    void open(std::function<void()> on_ready) {
+        open_connection(this->conn, false, [this, on_ready](const bson_t *) {
+            this->wait_ready(on_ready);
+        });
+    }
+
+    void start(const std::vector<std::string> &phrase) {
+        this->phrase = phrase;
+        uint64_t interval = std::max(1.0, 1000 / options.pause_rate);
+        this->mimic_timer->start(uvw::TimerHandle::Time{interval}, uvw::TimerHandle::Time{interval});
+        this->poll_timer->start(uvw::TimerHandle::Time{50}, uvw::TimerHandle::Time{50});
+    }
+
+    void poll(std::function<void()> on_done = nullptr) {
+        if (this->polling && !on_done) return;
+        this->polling = true;
+        this->conn->request(BCON_NEW("cmd", BCON_UTF8("pause.stats")), [this, on_done](const bson_t *reply) {
+            this->polling = false;
+            if (reply) {
+                this->record_pauses(reply);
+            }
+            if (on_done) on_done();
+        });
+    }
+
+    void stop() {
+        this->mimic_timer->stop();
+        this->poll_timer->stop();
+    }
+
+    void close() {
+        this->mimic_timer->close();
+        this->poll_timer->close();
+        this->conn->close();
+    }
+
+    size_t pending_count() {
+        return this->conn->pending_count();
+    }
+private:
+    void wait_ready(std::function<void()> on_ready) {
+        this->conn->request(BCON_NEW("cmd", BCON_UTF8("status")), [this, on_ready](const bson_t *reply) {
+            if (!reply) {
+                return;
+            }
+            if (doc_bool(reply, "ready")) {
+                on_ready();
+                return;
+            }
+            this->poll_timer->once<uvw::TimerEvent>([this, on_ready](const uvw::TimerEvent &, uvw::TimerHandle &) {
+                this->wait_ready(on_ready);
+            });
+            this->poll_timer->start(uvw::TimerHandle::Time{100}, uvw::TimerHandle::Time{0});
+        });
+    }
+
+    void mimic() {
+        // Like Dragon, the engine runs one mimic at a time. Don't let a slow
+        // server build a backlog.
+        if (this->in_flight >= 2) {
+            return;
+        }
+        bson_t *msg = BCON_NEW("cmd", BCON_UTF8("mimic"));
+        bson_t array;
+        char keystr[16];
+        const char *key;
+        BSON_APPEND_ARRAY_BEGIN(msg, "phrase", &array);
+        for (size_t i = 0; i < this->phrase.size(); i++) {
+            bson_uint32_to_string(i, &key, keystr, sizeof(keystr));
+            BSON_APPEND_UTF8(&array, key, this->phrase[i].c_str());
+        }
+        bson_append_array_end(msg, &array);
+        this->in_flight++;
+        this->conn->request(msg, [this](const bson_t *reply) {
+            this->in_flight--;
+        });
+    }
+
+    void record_pauses(const bson_t *reply) {
+        bson_iter_t iter, recent, record;
+        if (!bson_iter_init_find(&iter, reply, "recent") || !bson_iter_recurse(&iter, &recent)) {
+            return;
+        }
+        while (bson_iter_next(&recent)) {
+            if (!bson_iter_recurse(&recent, &record)) continue;
+            uint64_t token = 0;
+            int64_t duration = 0;
+            uint32_t timed_out = 0;
+            while (bson_iter_next(&record)) {
+                std::string key = bson_iter_key(&record);
+                if (key == "token") {
+                    token = bson_iter_int64(&record);
+                } else if (key == "duration") {
+                    duration = bson_iter_int64(&record);
+                } else if (key == "timed_out") {
+                    bson_iter_t clients;
+                    if (bson_iter_recurse(&record, &clients)) {
+                        while (bson_iter_next(&clients)) {
+                            timed_out++;
+                        }
+                    }
+                }
+            }
+            stats.last_token = std::max(stats.last_token, token);
+            if (!stats.measuring || token <= stats.first_token || stats.pauses.count(token)) {
+                continue;
+            }
+            stats.pauses[token] = duration;
+            stats.pause_timeouts += timed_out;
+        }
+    }
+
+    std::shared_ptr<DraconityClient> conn;
+    std::vector<std::string> phrase;
+    std::shared_ptr<uvw::TimerHandle> mimic_timer, poll_timer;
+    int in_flight = 0;
+    bool polling = false;
+};
+
+static void append_summary(bson_t *doc, const char *key, std::vector<int64_t> samples) {
+    bson_t child;
+    BSON_APPEND_DOCUMENT_BEGIN(doc, key, &child);
+    BSON_APPEND_INT64(&child, "count", samples.size());
+    if (!samples.empty()) {
+        std::sort(samples.begin(), samples.end());
+        int64_t sum = 0;
+        for (int64_t sample : samples) {
+            sum += sample;
+        }
+        BSON_APPEND_INT64(&child, "p50_ns", samples[samples.size() / 2]);
+        BSON_APPEND_INT64(&child, "p90_ns", samples[samples.size() * 9 / 10]);
+        BSON_APPEND_INT64(&child, "p99_ns", samples[samples.size() * 99 / 100]);
+        BSON_APPEND_INT64(&child, "max_ns", samples.back());
+        BSON_APPEND_INT64(&child, "mean_ns", sum / (int64_t)samples.size());
+    }
+    bson_append_document_end(doc, &child);
+}
+
+static bson_t *report(uint64_t missing, bool passed) {
+    bson_t *doc = bson_new();
+    bson_t child;
+
+    BSON_APPEND_DOCUMENT_BEGIN(doc, "options", &child);
+    BSON_APPEND_INT64(&child, "clients", options.clients);
+    BSON_APPEND_DOUBLE(&child, "duration", options.duration);
+    BSON_APPEND_DOUBLE(&child, "pause_rate", options.pause_rate);
+    BSON_APPEND_INT64(&child, "rules", options.rules);
+    BSON_APPEND_INT64(&child, "lists", options.lists);
+    BSON_APPEND_INT64(&child, "list_size", options.list_size);
+    BSON_APPEND_INT64(&child, "words", options.words);
+    BSON_APPEND_DOUBLE(&child, "churn", options.churn);
+    BSON_APPEND_DOUBLE(&child, "update", options.update);
+    BSON_APPEND_DOUBLE(&child, "word_update", options.word_update);
+    BSON_APPEND_DOUBLE(&child, "disconnect", options.disconnect);
+    BSON_APPEND_DOUBLE(&child, "resume", options.resume);
+    BSON_APPEND_INT32(&child, "unpause_delay", options.unpause_delay);
+    bson_append_document_end(doc, &child);
+
+    std::vector<int64_t> durations;
+    for (auto &pair : stats.pauses) {
+        durations.push_back(pair.second);
+    }
+    BSON_APPEND_DOCUMENT_BEGIN(doc, "pauses", &child);
+    append_summary(&child, "duration", durations);
+    // Pauses that fell out of the server's history between polls.
+    int64_t expected = stats.last_token > stats.first_token ? stats.last_token - stats.first_token : 0;
+    BSON_APPEND_INT64(&child, "unrecorded", expected - (int64_t)stats.pauses.size());
+    BSON_APPEND_INT64(&child, "client_timeouts", stats.pause_timeouts);
+    bson_append_document_end(doc, &child);
+
+    BSON_APPEND_DOCUMENT_BEGIN(doc, "latency", &child);
+    append_summary(&child, "publish_lag", stats.publish_lag);
+    append_summary(&child, "unpause", stats.unpause_rtt);
+    append_summary(&child, "g.set", stats.gset_rtt);
+    append_summary(&child, "w.set", stats.wset_rtt);
+    append_summary(&child, "mimic", stats.mimic_rtt);
+    bson_append_document_end(doc, &child);
+
+    BSON_APPEND_DOCUMENT_BEGIN(doc, "transactions", &child);
+    BSON_APPEND_INT64(&child, "sent", stats.answered + stats.abandoned + missing);
+    BSON_APPEND_INT64(&child, "answered", stats.answered);
+    BSON_APPEND_INT64(&child, "abandoned", stats.abandoned);
+    BSON_APPEND_INT64(&child, "unexpected", stats.unexpected);
+    BSON_APPEND_INT64(&child, "missing", missing);
+    bson_append_document_end(doc, &child);
+
+    BSON_APPEND_DOCUMENT_BEGIN(doc, "outcomes", &child);
+    for (auto &pair : stats.outcomes) {
+        BSON_APPEND_INT64(&child, pair.first.c_str(), pair.second);
+    }
+    bson_append_document_end(doc, &child);
+
+    BSON_APPEND_DOCUMENT_BEGIN(doc, "connections", &child);
+    BSON_APPEND_INT64(&child, "disconnects", stats.disconnects);
+    BSON_APPEND_INT64(&child, "reconnects", stats.reconnects);
+    BSON_APPEND_INT64(&child, "resumes", stats.resumes);
+    BSON_APPEND_INT64(&child, "lost", stats.lost);
+    bson_append_document_end(doc, &child);
+
+    BSON_APPEND_BOOL(doc, "passed", passed);
+    return doc;
+}
+
+/* Runs libdraconity against the simulated engine in a `sleep` process, with a
+   config of our own in a scratch HOME. Returns the pid, or -1. */
+static pid_t spawn_server(std::string &home) {
+    char home_template[] = "/tmp/draconity-loadtest.XXXXXX";
+    if (!mkdtemp(home_template)) {
+        return -1;
+    }
+    home = home_template;
+    mkdir((home + "/.talon").c_str(), 0700);
+    std::ofstream config(home + "/.talon/draconity.toml");
+    config << "secret = \"" << options.secret << "\"\n"
+           << "pause_timeout = " << options.pause_timeout << "\n"
+           << "idle_sync_delay = " << options.idle_sync_delay << "\n"
+           << "resume_grace = " << (options.resume > 0 ? 5000 : 0) << "\n"
+           << "trace = false\n"
+           << "\n[[socket]]\n"
+           << "host = \"" << options.host << "\"\n"
+           << "port = " << options.port << "\n"
+           << "\n[sim]\n"
+           << "word_ms = 1\n";
+    config.close();
+    if (!config) {
+        return -1;
+    }
+
+    std::vector<std::string> env;
+    for (char **var = environ; *var; var++) {
+        if (strncmp(*var, "HOME=", 5) && strncmp(*var, "LD_PRELOAD=", 11)) {
+            env.push_back(*var);
+        }
+    }
+    env.push_back("HOME=" + home);
+    env.push_back("LD_PRELOAD=" + options.server);
+    std::vector<char *> envp;
+    for (auto &var : env) {
+        envp.push_back((char *)var.c_str());
+    }
+    envp.push_back(NULL);
+    char *argv[] = {(char *)"sleep", (char *)"infinity", NULL};
+    pid_t pid;
+    if (posix_spawnp(&pid, "sleep", NULL, NULL, argv, envp.data())) {
+        return -1;
+    }
+    return pid;
+}
+
+static bool wait_listening(int timeout_ms) {
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(options.port);
+    inet_pton(AF_INET, options.host.c_str(), &addr.sin_addr);
+    for (int waited = 0; waited < timeout_ms; waited += 50) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        bool connected = (connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0);
+        ::close(fd);
+        if (connected) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    return false;
+}
+
+static int free_port() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    int port = 0;
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) == 0 && getsockname(fd, (sockaddr *)&addr, &len) == 0) {
+        port = ntohs(addr.sin_port);
+    }
+    ::close(fd);
+    return port;
+}
+
+/* The libdraconity built alongside us. */
+static std::string default_server() {
+    char path[PATH_MAX];
+    ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len <= 0) {
+        return "";
+    }
+    std::string exe(path, len);
+    return exe.substr(0, exe.rfind('/')) + "/../lib/libdraconity.so";
+}
+
+static bool parse_args(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            return false;
+        }
+        const char *value = argv[++i];
+        if (arg == "--clients") {
+            options.clients = strtoull(value, NULL, 10);
+        } else if (arg == "--duration") {
+            options.duration = strtod(value, NULL);
+        } else if (arg == "--pause-rate") {
+            options.pause_rate = strtod(value, NULL);
+        } else if (arg == "--rules") {
+            options.rules = strtoull(value, NULL, 10);
+        } else if (arg == "--lists") {
+            options.lists = strtoull(value, NULL, 10);
+        } else if (arg == "--list-size") {
+            options.list_size = strtoull(value, NULL, 10);
+        } else if (arg == "--words") {
+            options.words = strtoull(value, NULL, 10);
+        } else if (arg == "--churn") {
+            options.churn = strtod(value, NULL);
+        } else if (arg == "--update") {
+            options.update = strtod(value, NULL);
+        } else if (arg == "--word-update") {
+            options.word_update = strtod(value, NULL);
+        } else if (arg == "--disconnect") {
+            options.disconnect = strtod(value, NULL);
+        } else if (arg == "--resume") {
+            options.resume = strtod(value, NULL);
+        } else if (arg == "--unpause-delay") {
+            options.unpause_delay = atoi(value);
+        } else if (arg == "--pause-timeout") {
+            options.pause_timeout = atoi(value);
+        } else if (arg == "--idle-sync-delay") {
+            options.idle_sync_delay = atoi(value);
+        } else if (arg == "--seed") {
+            options.seed = strtoull(value, NULL, 10);
+        } else if (arg == "--server") {
+            options.server = value;
+        } else if (arg == "--connect") {
+            std::string target = value;
+            size_t colon = target.rfind(':');
+            if (colon == std::string::npos) return false;
+            options.host = target.substr(0, colon);
+            options.port = atoi(target.c_str() + colon + 1);
+        } else if (arg == "--secret") {
+            options.secret = value;
+        } else if (arg == "--out") {
+            options.out = value;
+        } else {
+            return false;
+        }
+    }
+    // Every client's grammar needs a rule and a list for its updates.
+    return options.clients > 0 && options.rules > 0 && options.lists > 0 &&
+        options.list_size > 0 && options.pause_rate > 0;
+}
+
+int main(int argc, char **argv) {
+    if (!parse_args(argc, argv)) {
+        fprintf(stderr, "usage: %s [--clients n] [--duration seconds] [--pause-rate per_second]\n"
+                        "       [--rules n] [--lists n] [--list-size n] [--words n] [--churn fraction]\n"
+                        "       [--update chance] [--word-update chance] [--disconnect chance] [--resume chance]\n"
+                        "       [--unpause-delay ms] [--pause-timeout ms] [--idle-sync-delay ms] [--seed n]\n"
+                        "       [--server libdraconity.so | --connect host:port --secret secret] [--out report.json]\n",
+                argv[0]);
+        return 2;
+    }
+
+    pid_t server = -1;
+    std::string home;
+    if (options.port == 0) {
+        if (options.server.empty()) {
+            options.server = default_server();
+        }
+        std::mt19937_64 rng(dr_clock_time());
+        options.secret = std::to_string(rng()) + std::to_string(rng());
+        options.port = free_port();
+        if (options.port == 0) {
+            fprintf(stderr, "could not find a free port\n");
+            return 1;
+        }
+        server = spawn_server(home);
+        if (server < 0) {
+            fprintf(stderr, "could not start a server with %s\n", options.server.c_str());
+            return 1;
+        }
+        fprintf(stderr, "started server %d with HOME=%s\n", server, home.c_str());
+    }
+    if (!wait_listening(10000)) {
+        fprintf(stderr, "server is not listening on %s:%d\n", options.host.c_str(), options.port);
+        if (server > 0) kill(server, SIGTERM);
+        return 1;
+    }
+
+    auto loop = uvw::Loop::create();
+    PauseDriver driver(loop);
+    std::vector<std::unique_ptr<LoadClient>> clients;
+    for (size_t i = 0; i < options.clients; i++) {
+        clients.push_back(std::make_unique<LoadClient>(loop, i));
+    }
+
+    // Connecting: mimic until every client's first g.set is synced. Running:
+    // churn for the duration. Draining: keep pausing until every client's
+    // pending transactions are answered. Finishing: wait for the driver's own.
+    // Either of the last two gives up after 10s.
+    enum { CONNECTING, RUNNING, DRAINING, FINISHING, DONE } phase = CONNECTING;
+    int64_t phase_start = dr_monotonic_time();
+    uint64_t missing = 0;
+    auto phase_timer = loop->resource<uvw::TimerHandle>();
+    phase_timer->on<uvw::TimerEvent>([&](const uvw::TimerEvent &, uvw::TimerHandle &timer) {
+        int64_t elapsed = dr_monotonic_time() - phase_start;
+        size_t pending = 0;
+        for (auto &client : clients) {
+            pending += client->pending_count();
+        }
+        if (phase == CONNECTING) {
+            bool ready = std::all_of(clients.begin(), clients.end(), [](auto &client) { return client->ready; });
+            if (!ready) return;
+            fprintf(stderr, "%zu clients ready, running for %.1fs\n", clients.size(), options.duration);
+            stats.reset_samples();
+            stats.first_token = stats.last_token;
+            stats.measuring = true;
+            churning = true;
+            phase = RUNNING;
+            phase_start = dr_monotonic_time();
+        } else if (phase == RUNNING && elapsed >= options.duration * 1e9) {
+            churning = false;
+            phase = DRAINING;
+            phase_start = dr_monotonic_time();
+        } else if (phase == DRAINING && (pending == 0 || elapsed >= 10e9)) {
+            missing = pending;
+            driver.stop();
+            phase = FINISHING;
+            phase_start = dr_monotonic_time();
+        } else if (phase == FINISHING && (driver.pending_count() == 0 || elapsed >= 10e9)) {
+            missing += driver.pending_count();
+            phase = DONE;
+            timer.close();
+            // One last look at the pause history, then close everything so
+            // the loop exits.
+            driver.poll([&] {
+                stats.measuring = false;
+                driver.close();
+                for (auto &client : clients) {
+                    client->close();
+                }
+            });
+        }
+    });
+
+    driver.open([&] {
+        for (auto &client : clients) {
+            client->connect();
+        }
+        driver.start(clients[0]->phrase());
+        phase_timer->start(uvw::TimerHandle::Time{50}, uvw::TimerHandle::Time{50});
+    });
+    loop->run();
+
+    bool passed = (stats.unexpected == 0 && missing == 0 && stats.lost == 0);
+    bson_t *doc = report(missing, passed);
+    size_t length = 0;
+    char *json = bson_as_json(doc, &length);
+    bool written = true;
+    if (options.out.size() > 0) {
+        std::ofstream file(options.out);
+        file.write(json, length);
+        file << "\n";
+        written = (bool)file;
+    } else {
+        std::cout.write(json, length);
+        std::cout << std::endl;
+    }
+    bson_free(json);
+    bson_destroy(doc);
+
+    if (server > 0) {
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+    }
+    if (!written) {
+        fprintf(stderr, "could not write report to %s\n", options.out.c_str());
+        return 1;
+    }
+    if (!passed) {
+        fprintf(stderr, "FAILED: %llu unexpected responses, %llu missing, %llu connections lost\n",
+                (unsigned long long)stats.unexpected, (unsigned long long)missing,
+                (unsigned long long)stats.lost);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include <string.h>
+#include "synthetic.h"
+#include "sim/sim_grammar.h"
+#include "types.h"
+
+#define align4(len) ((len + 4) & ~3)
+
+static const char *consonants = "bdfgklmnprstvz";
+static const char *vowels = "aeiou";
+
+/* Words are their index spelled in syllables, with the seed in the high bits
+   so each seed gets its own range of up to 16M words. */
+std::vector<std::string> synthetic_words(size_t count, uint64_t seed) {
+    const size_t syllables = strlen(consonants) * strlen(vowels);
+    std::vector<std::string> words;
+    words.reserve(count);
+    for (size_t i = 0; i < count; i++) {
+        uint64_t n = (seed << 24) + i;
+        std::string word;
+        // At least two syllables, so no word is a single letter pair.
+        for (int digits = 0; n > 0 || digits < 2; digits++) {
+            size_t syllable = n % syllables;
+            word += consonants[syllable / strlen(vowels)];
+            word += vowels[syllable % strlen(vowels)];
+            n /= syllables;
+        }
+        words.push_back(std::move(word));
+    }
+    return words;
+}
+
+SyntheticGrammar synthetic_grammar(const std::string &name, size_t rules, size_t lists,
+                                   size_t list_size, uint64_t seed) {
+    SyntheticGrammar grammar;
+    grammar.name = name;
+    SimGrammarBuilder builder;
+
+    std::vector<uint32_t> list_ids;
+    std::vector<std::string> list_names;
+    for (size_t i = 0; i < lists; i++) {
+        std::string list_name = "list" + std::to_string(i);
+        list_ids.push_back(builder.list(list_name));
+        list_names.push_back(list_name);
+        // Seeds past the keywords', so lists never overlap them.
+        grammar.lists[list_name] = synthetic_words(list_size, seed * (lists + 1) + i + 1);
+    }
+
+    std::vector<std::string> keywords = synthetic_words(rules * 2, seed * (lists + 1));
+    for (size_t i = 0; i < rules; i++) {
+        std::string rule_name = "rule" + std::to_string(i);
+        builder.begin_rule(builder.rule(rule_name));
+        builder.start(SIM_GROUP_SEQ);
+        builder.add_word(keywords[i * 2]);
+        builder.add_word(keywords[i * 2 + 1]);
+        std::vector<std::string> phrase = {keywords[i * 2], keywords[i * 2 + 1]};
+        if (lists > 0 && list_size > 0) {
+            builder.add_list(list_ids[i % lists]);
+            phrase.push_back(grammar.lists[list_names[i % lists]][i % list_size]);
+        }
+        builder.end(SIM_GROUP_SEQ);
+        grammar.rules.push_back(rule_name);
+        grammar.phrases.push_back(std::move(phrase));
+    }
+    grammar.blob = builder.build();
+    return grammar;
+}
+
+static void append_strings(bson_t *array, const std::vector<std::string> &strings) {
+    char keystr[16];
+    const char *key;
+    for (size_t i = 0; i < strings.size(); i++) {
+        bson_uint32_to_string(i, &key, keystr, sizeof(keystr));
+        bson_append_utf8(array, key, -1, strings[i].data(), strings[i].size());
+    }
+}
+
+bson_t *synthetic_gset(const SyntheticGrammar &grammar) {
+    bson_t *msg = bson_new();
+    BSON_APPEND_UTF8(msg, "cmd", "g.set");
+    BSON_APPEND_UTF8(msg, "name", grammar.name.c_str());
+    BSON_APPEND_BINARY(msg, "data", BSON_SUBTYPE_BINARY, grammar.blob.data(), grammar.blob.size());
+
+    bson_t rules;
+    BSON_APPEND_ARRAY_BEGIN(msg, "active_rules", &rules);
+    append_strings(&rules, grammar.rules);
+    bson_append_array_end(msg, &rules);
+
+    bson_t lists, list;
+    BSON_APPEND_DOCUMENT_BEGIN(msg, "lists", &lists);
+    for (auto &pair : grammar.lists) {
+        BSON_APPEND_ARRAY_BEGIN(&lists, pair.first.c_str(), &list);
+        append_strings(&list, pair.second);
+        bson_append_array_end(&lists, &list);
+    }
+    bson_append_document_end(msg, &lists);
+    return msg;
+}
+
+std::vector<uint8_t> synthetic_phrase(const std::vector<std::string> &words) {
+    size_t size = 4;
+    for (auto &word : words) {
+        size += sizeof(dsx_id) + align4(word.size());
+    }
+    std::vector<uint8_t> phrase(size, 0);
+    uint32_t len = size;
+    memcpy(phrase.data(), &len, 4);
+    uint8_t *pos = phrase.data() + 4;
+    for (auto &word : words) {
+        dsx_id *ent = (dsx_id *)pos;
+        ent->size = sizeof(dsx_id) + align4(word.size());
+        memcpy(ent->name, word.data(), word.size());
+        pos += ent->size;
+    }
+    return phrase;
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <bson.h>
+
+/* Generators for synthetic vocabularies, lists and grammars, for the tools
+   that drive draconity against the simulated engine.
+
+   Everything is deterministic: the same sizes and seed always produce the same
+   words, so numbers from different runs are comparable.
+
+ */
+
+// `count` distinct pronounceable words. Different seeds give disjoint sets.
+std::vector<std::string> synthetic_words(size_t count, uint64_t seed = 0);
+
+struct SyntheticGrammar {
+    std::string name;
+    std::vector<uint8_t> blob;
+    // Exported rules, each two keywords followed by one of the lists if there
+    // are any.
+    std::vector<std::string> rules;
+    std::unordered_map<std::string, std::vector<std::string>> lists;
+    // A phrase each rule matches, in the same order as `rules`.
+    std::vector<std::vector<std::string>> phrases;
+};
+
+SyntheticGrammar synthetic_grammar(const std::string &name, size_t rules, size_t lists,
+                                   size_t list_size, uint64_t seed = 0);
+
+// A g.set for the grammar, with every rule active and all its lists.
+bson_t *synthetic_gset(const SyntheticGrammar &grammar);
+
+// Packs words into the length-prefixed dsx_id array Dragon's phrase callbacks
+// receive.
+std::vector<uint8_t> synthetic_phrase(const std::vector<std::string> &words);